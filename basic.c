@@ -0,0 +1,547 @@
+//
+//  What the emulator knows about the Altair BASIC it is running
+//
+//  We do not ship BASIC, so nothing here is tied to one release of it.
+//  When an image is loaded it is fingerprinted: it is hashed, and its
+//  reserved word list is found by pattern (every Microsoft BASIC starts
+//  that list with END, FOR, ... and numbers its tokens from 0x80 in list
+//  order).  Where BASIC keeps its program is learned at the first OK
+//  prompt, while the program is still empty: BASIC's VARTAB, ARYTAB and
+//  STREND pointers then all point just past the two zero bytes that end
+//  an empty program text.
+//
+//  With that we can tokenize and list lines ourselves, and put whole
+//  listings straight into the program text the way BASIC's own line
+//  entry does.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "basic.h"
+#include "drivers/crc.h"
+
+static uint8_t* memory = NULL;
+static basic_layout_t layout;
+
+// The reserved words, NUL separated, token 0x80 + i starts at keyword_start[i]
+static char keyword_text[1024];
+static uint16_t keyword_start[128];
+static int rem_token = -1;
+static int data_token = -1;
+
+static uint32_t recent_output = 0; // last few characters BASIC printed
+static bool at_prompt = false;
+
+// What was typed before the first OK, the answers to MEMORY SIZE? and the
+// rest, a comma after each
+static char answers[BASIC_ANSWERS_LEN];
+static size_t answers_len = 0;
+
+// Typed to BASIC ahead of the keyboard, see basic_typed
+static const char* typing = NULL;
+
+// Program text as we add lines to it, see basic_load_begin
+static uint16_t load_limit;
+static uint16_t load_end;
+static uint16_t load_cursor;
+static uint16_t load_cursor_number;
+
+static inline uint16_t peek16(uint16_t addr)
+{
+  return memory[addr] | (memory[(uint16_t) (addr + 1)] << 8);
+}
+
+static inline void poke16(uint16_t addr, uint16_t value)
+{
+  memory[addr] = value & 0xff;
+  memory[(uint16_t) (addr + 1)] = value >> 8;
+}
+
+static void find_keywords(void)
+{
+  static const uint8_t first_marked[] = {'E' | 0x80, 'N', 'D', 'F' | 0x80, 'O', 'R'};
+  static const uint8_t last_marked[] = {'E', 'N', 'D' | 0x80, 'F', 'O', 'R' | 0x80};
+
+  for (uint32_t addr = 0; addr + sizeof(first_marked) <= layout.rom_size; addr++)
+  {
+    if (memcmp(&memory[addr], first_marked, sizeof(first_marked)) == 0)
+    {
+      layout.marks_last_char = false;
+    }
+    else if (memcmp(&memory[addr], last_marked, sizeof(last_marked)) == 0)
+    {
+      layout.marks_last_char = true;
+    }
+    else
+    {
+      continue;
+    }
+    layout.keyword_table = addr;
+    break;
+  }
+  if (layout.keyword_table == 0)
+  {
+    return;
+  }
+
+  // copy the words out, the list ends at the first byte that cannot
+  // start (or continue) a word
+  uint32_t addr = layout.keyword_table;
+  size_t used = 0;
+  int count = 0;
+  while (count < 128 && addr < layout.rom_size &&
+         used + 16 < sizeof(keyword_text) &&
+         isgraph(memory[addr] & 0x7f) &&
+         (layout.marks_last_char || (memory[addr] & 0x80)))
+  {
+    keyword_start[count] = used;
+    keyword_text[used++] = memory[addr++] & 0x7f;
+    if (!layout.marks_last_char || !(memory[addr - 1] & 0x80))
+    {
+      while (addr < layout.rom_size && used + 2 < sizeof(keyword_text))
+      {
+        uint8_t b = memory[addr];
+        if (!layout.marks_last_char && (b & 0x80))
+        {
+          break;
+        }
+        if (!isgraph(b & 0x7f))
+        {
+          break;
+        }
+        keyword_text[used++] = b & 0x7f;
+        addr++;
+        if (b & 0x80)
+        {
+          break;
+        }
+      }
+    }
+    keyword_text[used++] = '\0';
+
+    if (strcmp(&keyword_text[keyword_start[count]], "REM") == 0)
+    {
+      rem_token = count;
+    }
+    else if (strcmp(&keyword_text[keyword_start[count]], "DATA") == 0)
+    {
+      data_token = count;
+    }
+    count++;
+  }
+  layout.keyword_count = count;
+}
+
+// Called at an OK prompt, see if the empty program can be found
+static void find_program(void)
+{
+  for (uint32_t addr = 0; addr + 6 <= 0xffff; addr++)
+  {
+    uint16_t v = peek16(addr);
+    if (v < addr + 8 || peek16(addr + 2) != v || peek16(addr + 4) != v)
+    {
+      continue;
+    }
+    if (memory[v - 2] == 0 && memory[v - 1] == 0)
+    {
+      layout.vartab = addr;
+      layout.txttab = v - 2;
+      return;
+    }
+  }
+}
+
+void basic_init(uint8_t* mem, uint32_t rom_size)
+{
+  memory = mem;
+  memset(&layout, 0, sizeof(layout));
+  layout.rom_size = rom_size;
+  layout.rom_hash = fnv1a(FNV1A_INIT, memory, rom_size);
+  rem_token = data_token = -1;
+  recent_output = 0;
+  at_prompt = false;
+  answers_len = 0;
+  answers[0] = '\0';
+  typing = NULL;
+
+  find_keywords();
+}
+
+const basic_layout_t* basic_layout(void)
+{
+  return &layout;
+}
+
+// Everything BASIC prints to the terminal passes through here
+void basic_output(uint8_t chr)
+{
+  chr &= 0x7f;
+  if (chr == 0)
+  {
+    return; // padding nulls
+  }
+
+  recent_output = (recent_output << 8) | chr;
+  if (recent_output == (('O' << 24) | ('K' << 16) | ('\r' << 8) | '\n'))
+  {
+    at_prompt = true;
+    if (layout.vartab == 0)
+    {
+      find_program();
+      if (answers_len > 0 && answers[answers_len - 1] == ',')
+      {
+        answers[--answers_len] = '\0';
+      }
+    }
+  }
+}
+
+// Every character BASIC reads from the terminal passes through here
+void basic_input(uint8_t chr)
+{
+  if (chr != 0)
+  {
+    at_prompt = false;
+  }
+  if (layout.vartab == 0 && (isprint(chr) || chr == '\r') && answers_len + 2 < sizeof(answers))
+  {
+    answers[answers_len++] = chr == '\r' ? ',' : chr;
+    answers[answers_len] = '\0';
+  }
+}
+
+// True while BASIC is sitting at OK with nothing typed yet
+bool basic_at_prompt(void)
+{
+  return at_prompt;
+}
+
+bool basic_program_known(void)
+{
+  return layout.keyword_count > 0 && layout.vartab != 0;
+}
+
+// The answers BASIC's startup questions were given, once it has got to OK
+const char* basic_answers(void)
+{
+  return answers;
+}
+
+void basic_get_state(basic_state_t* state)
+{
+  state->layout = layout;
+  state->recent_output = recent_output;
+  state->at_prompt = at_prompt;
+  memcpy(state->answers, answers, sizeof(state->answers));
+}
+
+// Pick up where a snapshot left off.  memory holds BASIC as it was then,
+// the reserved words are found in it again rather than kept.
+void basic_set_state(uint8_t* mem, const basic_state_t* state)
+{
+  memory = mem;
+  layout = state->layout;
+  layout.keyword_table = 0;
+  layout.keyword_count = 0;
+  rem_token = data_token = -1;
+  typing = NULL;
+  recent_output = state->recent_output;
+  at_prompt = state->at_prompt;
+  memcpy(answers, state->answers, sizeof(answers));
+  answers[sizeof(answers) - 1] = '\0';
+  answers_len = strlen(answers);
+
+  find_keywords();
+}
+
+//
+// Tokenizing and listing
+//
+
+static int match_keyword(const char* text, size_t* len)
+{
+  for (int i = 0; i < layout.keyword_count; i++)
+  {
+    const char* word = &keyword_text[keyword_start[i]];
+    size_t n = strlen(word);
+    if (strncmp(text, word, n) == 0)
+    {
+      *len = n;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Crunch a line (without its line number) into tokens the way BASIC
+// does: reserved words anywhere outside strings become tokens, except
+// in the rest of a REM or up to the next ':' after DATA
+size_t basic_crunch(const char* text, uint8_t* out, size_t out_len)
+{
+  size_t n = 0;
+  bool quoted = false;
+  bool rem = false;
+  bool data = false;
+
+  while (*text && n + 1 < out_len)
+  {
+    char chr = *text;
+    size_t len;
+    int token;
+
+    if (rem || quoted || (data && chr != ':'))
+    {
+      if (chr == '"')
+      {
+        quoted = !quoted;
+      }
+      out[n++] = chr;
+      text++;
+    }
+    else if (chr == '"')
+    {
+      quoted = true;
+      out[n++] = chr;
+      text++;
+    }
+    else if (chr == ':')
+    {
+      data = false;
+      out[n++] = chr;
+      text++;
+    }
+    else if ((token = match_keyword(text, &len)) >= 0)
+    {
+      out[n++] = 0x80 + token;
+      text += len;
+      rem = token == rem_token;
+      data = token == data_token;
+    }
+    else
+    {
+      out[n++] = chr;
+      text++;
+    }
+  }
+  out[n] = 0;
+  return n;
+}
+
+// Format the program line at line (its link field) as LIST would
+size_t basic_list_line(const uint8_t* line, char* out, size_t out_len)
+{
+  int written = snprintf(out, out_len, "%u ", line[2] | (line[3] << 8));
+  if (written < 0)
+  {
+    return 0;
+  }
+  size_t n = (size_t) written < out_len ? (size_t) written : out_len - 1;
+
+  for (const uint8_t* p = &line[4]; *p; p++)
+  {
+    const char* text;
+    char single[2] = {0, 0};
+    if (*p >= 0x80 && *p < 0x80 + layout.keyword_count)
+    {
+      text = &keyword_text[keyword_start[*p - 0x80]];
+    }
+    else
+    {
+      single[0] = *p & 0x7f;
+      text = single;
+    }
+    while (*text && n + 1 < out_len)
+    {
+      out[n++] = *text++;
+    }
+  }
+  out[n] = '\0';
+  return n;
+}
+
+// The program text as it stands, up to and including its zero link
+const uint8_t* basic_program(size_t* len)
+{
+  uint16_t vartab = peek16(layout.vartab);
+  *len = vartab > layout.txttab ? vartab - layout.txttab : 0;
+  return &memory[layout.txttab];
+}
+
+// List program text, from memory or as CSAVE put it on tape, a line at a
+// time to write.  The links are not followed since on tape they hold the
+// addresses the program was saved from.  Returns the number of lines
+// listed or -1 if write failed.
+int basic_list_program(const uint8_t* text, size_t len, basic_writer_t write, void* context)
+{
+  char line[BASIC_MAX_LINE * 2];
+  int lines = 0;
+  size_t pos = 0;
+
+  while (pos + 4 < len && (text[pos] | text[pos + 1]) != 0)
+  {
+    const uint8_t* end = memchr(&text[pos + 4], 0, len - pos - 4);
+    if (end == NULL)
+    {
+      break; // cut short
+    }
+    size_t n = basic_list_line(&text[pos], line, sizeof(line) - 2);
+    line[n++] = '\r';
+    line[n++] = '\n';
+    if (!write(line, n, context))
+    {
+      return -1;
+    }
+    lines++;
+    pos = end + 1 - text;
+  }
+  return lines;
+}
+
+//
+// Adding lines to the program text
+//
+// Program lines are stored as a link to the next line, the line number,
+// the tokens and a terminating zero, in line number order and ending
+// with a zero link.  While loading the links are left stale and lines are
+// walked by their contents instead, basic_load_end puts the links right.
+//
+
+static inline uint16_t next_line(uint16_t line)
+{
+  return line + 5 + strlen((const char*) &memory[line + 4]);
+}
+
+static inline bool is_end(uint16_t line)
+{
+  return peek16(line) == 0;
+}
+
+// limit is the first address the program text and variables must not reach
+void basic_load_begin(uint16_t limit)
+{
+  load_limit = limit;
+  load_cursor = layout.txttab;
+  load_cursor_number = 0;
+
+  load_end = layout.txttab;
+  while (!is_end(load_end))
+  {
+    load_end = next_line(load_end);
+  }
+}
+
+// Add, replace or (for a bare line number) delete one line of a listing.
+// Returns false when the program no longer fits.
+bool basic_load_line(const char* text, basic_load_stats_t* stats)
+{
+  while (*text == ' ' || *text == '\t')
+  {
+    text++;
+  }
+  if (*text == '\0')
+  {
+    return true;
+  }
+  if (!isdigit((unsigned char) *text))
+  {
+    stats->skipped++; // direct mode commands have no place in a program
+    return true;
+  }
+
+  uint32_t number = 0;
+  while (isdigit((unsigned char) *text))
+  {
+    number = number * 10 + (*text++ - '0');
+    if (number > 65529)
+    {
+      stats->skipped++;
+      return true;
+    }
+  }
+  while (*text == ' ')
+  {
+    text++;
+  }
+
+  uint8_t tokens[BASIC_MAX_LINE];
+  size_t len = basic_crunch(text, tokens, sizeof(tokens));
+
+  // listings are nearly always in order, so carry on from the last line
+  uint16_t line = number > load_cursor_number ? load_cursor : layout.txttab;
+  while (!is_end(line) && peek16(line + 2) < number)
+  {
+    line = next_line(line);
+  }
+
+  int32_t existing = !is_end(line) && peek16(line + 2) == number ? next_line(line) - line : 0;
+  int32_t needed = len > 0 ? len + 5 : 0;
+  int32_t delta = needed - existing;
+  if ((int32_t) load_end + 2 + delta > (int32_t) load_limit)
+  {
+    return false;
+  }
+
+  memmove(&memory[line + needed], &memory[line + existing], load_end + 2 - (line + existing));
+  load_end += delta;
+
+  if (needed > 0)
+  {
+    poke16(line, 0xffff); // any non-zero link until basic_load_end
+    poke16(line + 2, number);
+    memcpy(&memory[line + 4], tokens, len + 1);
+  }
+  load_cursor = line;
+  load_cursor_number = number;
+  stats->lines++;
+  return true;
+}
+
+// Replace the whole program with text as basic_program gave it, possibly
+// from a BASIC whose program started elsewhere.  Returns false, leaving
+// the program alone, if it does not fit below limit.
+bool basic_set_program(const uint8_t* text, size_t len, uint16_t limit)
+{
+  if (len < 2 || text[len - 2] != 0 || text[len - 1] != 0 ||
+      layout.txttab + len + 2 > limit)
+  {
+    return false;
+  }
+  memmove(&memory[layout.txttab], text, len);
+  basic_load_end();
+  return true;
+}
+
+// Relink the program and clear the variables, as line entry does.  Line
+// entry also runs BASIC's CLEAR, which resets string space, the DATA
+// pointer and where CONT would carry on; rather than find those in every
+// BASIC, BASIC is made to do it by typing CLEAR to it.
+void basic_load_end(void)
+{
+  uint16_t line = layout.txttab;
+  while (!is_end(line))
+  {
+    uint16_t next = next_line(line);
+    poke16(line, next);
+    line = next;
+  }
+
+  uint16_t vartab = line + 2;
+  poke16(layout.vartab, vartab);     // VARTAB
+  poke16(layout.vartab + 2, vartab); // ARYTAB
+  poke16(layout.vartab + 4, vartab); // STREND
+  typing = "CLEAR\r";
+}
+
+// True while there are characters waiting to be typed to BASIC, which the
+// console hands it before any from the keyboard
+bool basic_typing(void)
+{
+  return typing != NULL && *typing != '\0';
+}
+
+uint8_t basic_typed(void)
+{
+  return basic_typing() ? *typing++ : 0;
+}
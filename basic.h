@@ -0,0 +1,66 @@
+#ifndef BASIC_H_
+#define BASIC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Longest line BASIC's own line editor would accept, and then some
+#define BASIC_MAX_LINE (256)
+
+// Room for what is typed in answer to BASIC's startup questions
+#define BASIC_ANSWERS_LEN (32)
+
+// What we have worked out about the BASIC image running in memory[]
+typedef struct
+{
+  uint32_t rom_hash;      // FNV-1a hash of the image as loaded from SD
+  uint32_t rom_size;      // bytes loaded at address 0
+  uint16_t keyword_table; // address of the reserved word list, 0 if not found
+  uint8_t keyword_count;  // reserved words, tokens are 0x80 onwards
+  bool marks_last_char;   // reserved words end (rather than start) with bit 7 set
+  uint16_t vartab;        // address of the VARTAB, ARYTAB, STREND pointers, 0 if unknown
+  uint16_t txttab;        // first byte of program text
+} basic_layout_t;
+
+// What basic.c has learned as BASIC ran, kept with snapshots of the machine
+typedef struct
+{
+  basic_layout_t layout;
+  uint32_t recent_output;
+  bool at_prompt;
+  char answers[BASIC_ANSWERS_LEN];
+} basic_state_t;
+
+typedef struct
+{
+  uint32_t lines;   // lines added, replaced or deleted
+  uint32_t skipped; // lines without a line number
+} basic_load_stats_t;
+
+void basic_init(uint8_t* memory, uint32_t rom_size);
+const basic_layout_t* basic_layout(void);
+void basic_output(uint8_t chr);
+void basic_input(uint8_t chr);
+bool basic_at_prompt(void);
+bool basic_program_known(void);
+const char* basic_answers(void);
+void basic_get_state(basic_state_t* state);
+void basic_set_state(uint8_t* memory, const basic_state_t* state);
+
+size_t basic_crunch(const char* text, uint8_t* out, size_t out_len);
+size_t basic_list_line(const uint8_t* line, char* out, size_t out_len);
+
+// Receives listings a line at a time, returns false to stop
+typedef bool (*basic_writer_t)(const char* text, size_t len, void* context);
+const uint8_t* basic_program(size_t* len);
+int basic_list_program(const uint8_t* text, size_t len, basic_writer_t write, void* context);
+
+void basic_load_begin(uint16_t limit);
+bool basic_load_line(const char* text, basic_load_stats_t* stats);
+void basic_load_end(void);
+bool basic_set_program(const uint8_t* text, size_t len, uint16_t limit);
+bool basic_typing(void);
+uint8_t basic_typed(void);
+
+#endif // BASIC_H_
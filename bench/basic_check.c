@@ -0,0 +1,307 @@
+// Checks the parts of the emulator that handle BASIC's own data, built for
+// the host: basic.c's tokenizer, snapshot.c's packing and tape.c's catalog,
+// the last with the I/O service on a pthread in front of a card kept in a
+// disk image (block_device.c).
+//
+//   listing  lines crunched with basic_crunch and put back with
+//            basic_list_line must come out as they went in, with REM,
+//            DATA and strings left alone and keywords found inside others
+//   packing  random, zero heavy and edge case buffers must unpack to what
+//            was packed, within SNAPSHOT_PACKED_MAX, and cut short packed
+//            data must be refused
+//   catalog  programs with sync bytes in their links, line numbers and
+//            text, and an array, must be catalogued once each, both as
+//            they are written and when the tape is indexed again
+//
+// Usage: basic_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "fat32.h"
+#include "io_service.h"
+#include "block_device.h"
+#include "mkfs.h"
+#include "basic.h"
+#include "snapshot.h"
+#include "tape.h"
+
+#define IMAGE_PATH "basic_check.img"
+#define CARD_BLOCKS 70000    // enough one sector clusters for FAT32
+#define ROM_SIZE 0x400
+#define PACK_SIZE 4096
+
+// The reserved words of 8K BASIC in the order its table has them
+static const char* keywords[] = {
+  "END", "FOR", "NEXT", "DATA", "INPUT", "DIM", "READ", "LET", "GOTO", "RUN", "IF",
+  "RESTORE", "GOSUB", "RETURN", "REM", "STOP", "OUT", "ON", "NULL", "WAIT", "DEF",
+  "POKE", "PRINT", "CONT", "LIST", "CLEAR", "CLOAD", "CSAVE", "NEW", "TAB(", "TO",
+  "FN", "SPC(", "THEN", "NOT", "STEP", "+", "-", "*", "/", "^", "AND", "OR", ">",
+  "=", "<", "SGN", "INT", "ABS", "USR", "FRE", "INP", "POS", "SQR", "RND", "LOG",
+  "EXP", "COS", "SIN", "TAN", "ATN", "PEEK", "LEN", "STR$", "VAL", "ASC", "CHR$",
+  "LEFT$", "RIGHT$", "MID$",
+};
+
+static uint8_t memory[0x10000];
+
+// A ROM holding nothing but the reserved word table, first letters marked
+static void fake_rom(void) {
+  uint32_t addr = 0x100;
+  memset(memory, 0, sizeof(memory));
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+    for (const char* p = keywords[i]; *p; p++) {
+      memory[addr++] = p == keywords[i] ? *p | 0x80 : *p;
+    }
+  }
+  memory[addr] = 0x80; // no more words
+  basic_init(memory, ROM_SIZE);
+}
+
+//
+// Checks
+//
+
+static int check_line(const char* text, int tokens) {
+  uint8_t line[BASIC_MAX_LINE + 5];
+  char listed[BASIC_MAX_LINE * 2];
+  char expected[BASIC_MAX_LINE + 8];
+
+  line[0] = line[1] = 1;
+  line[2] = 100 & 0xff;
+  line[3] = 100 >> 8;
+  size_t n = basic_crunch(text, &line[4], BASIC_MAX_LINE);
+  int found = 0;
+  for (size_t i = 0; i < n; i++) {
+    found += line[4 + i] >= 0x80;
+  }
+
+  basic_list_line(line, listed, sizeof(listed));
+  snprintf(expected, sizeof(expected), "100 %s", text);
+  if (strcmp(listed, expected) != 0 || found != tokens) {
+    printf("  \"%s\" listed as \"%s\" with %d tokens, %d expected\n", text, listed, found, tokens);
+    return 1;
+  }
+  return 0;
+}
+
+static int check_listing(void) {
+  int failures = 0;
+
+  fake_rom();
+  if (basic_layout()->keyword_count != sizeof(keywords) / sizeof(keywords[0])) {
+    printf("  %d reserved words found\n", basic_layout()->keyword_count);
+    return 1;
+  }
+  failures += check_line("PRINT \"HELLO, WORLD\"", 1);
+  failures += check_line("FORI=1TO10STEP2:PRINTI;:NEXTI", 6);
+  failures += check_line("REM PRINT GOTO \"FOR\" : NEXT", 1);
+  failures += check_line("DATA PRINT,\"A:B\",3:PRINT \"END\"", 2);
+  failures += check_line("INPUT \"NAME\";N$:IF N$=\"\" THEN 100", 4);
+  failures += check_line("A$=LEFT$(B$,2)+MID$(B$,3)", 4);
+  failures += check_line("TOTAL=ATN(1)*4", 4);   // TO, =, ATN and *
+  failures += check_line("X=INP(255):ONXGOTO10,20", 4);
+  failures += check_line("PRINT\"UNCLOSED REM PRINT", 1);
+  failures += check_line("", 0);
+  return failures;
+}
+
+static int check_packed(const uint8_t* data, size_t len, const char* what) {
+  static uint8_t packed[SNAPSHOT_PACKED_MAX(PACK_SIZE)];
+  static uint8_t unpacked[PACK_SIZE];
+  size_t size = snapshot_pack(data, len, packed);
+  size_t used = 0;
+
+  if (size > SNAPSHOT_PACKED_MAX(len)) {
+    printf("  %s: %lu bytes packed to %lu\n", what, (unsigned long) len, (unsigned long) size);
+    return 1;
+  }
+  memset(unpacked, 0xa5, sizeof(unpacked));
+  if (!snapshot_unpack(packed, size, &used, unpacked, len) || used != size ||
+      memcmp(unpacked, data, len) != 0) {
+    printf("  %s: %lu bytes do not unpack as packed\n", what, (unsigned long) len);
+    return 1;
+  }
+  used = 0;
+  if (len > 0 && snapshot_unpack(packed, size - 1, &used, unpacked, len)) {
+    printf("  %s: cut short, still unpacked\n", what);
+    return 1;
+  }
+  return 0;
+}
+
+static int check_packing(void) {
+  static uint8_t data[PACK_SIZE];
+  static const size_t lengths[] = {1, 2, 3, 127, 128, 129, 130, 131, 258, 260, 261};
+  char what[64];
+  int failures = 0;
+
+  srand(2);
+  for (int i = 0; i < 200; i++) {
+    size_t len = rand() % PACK_SIZE + 1;
+    for (size_t k = 0; k < len; k++) {
+      data[k] = i % 2 ? rand() : (rand() % 8 ? 0 : rand() % 3);
+    }
+    snprintf(what, sizeof(what), "%s buffer %d", i % 2 ? "random" : "zero heavy", i);
+    failures += check_packed(data, len, what);
+  }
+
+  // runs and literals either side of where the count byte runs out
+  for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    memset(data, 0, lengths[i]);
+    snprintf(what, sizeof(what), "run of %lu", (unsigned long) lengths[i]);
+    failures += check_packed(data, lengths[i], what);
+    for (size_t k = 0; k < lengths[i]; k++) {
+      data[k] = k;
+    }
+    snprintf(what, sizeof(what), "literal of %lu", (unsigned long) lengths[i]);
+    failures += check_packed(data, lengths[i], what);
+    memset(data + lengths[i], 7, 130);
+    snprintf(what, sizeof(what), "literal of %lu then a run", (unsigned long) lengths[i]);
+    failures += check_packed(data, lengths[i] + 130, what);
+  }
+  failures += check_packed(data, 0, "nothing");
+  return failures;
+}
+
+//
+// A tape written as CSAVE would
+//
+
+static uint8_t tape[8192];
+static uint32_t tape_len;
+
+static void put(uint8_t value) {
+  tape[tape_len++] = value;
+}
+
+static void put_sync(uint8_t sync, char name) {
+  put(sync);
+  put(sync);
+  put(sync);
+  put(name);
+}
+
+static void put_line(uint16_t link, uint16_t number, const char* text) {
+  put(link & 0xff);
+  put(link >> 8);
+  put(number & 0xff);
+  put(number >> 8);
+  while (*text) {
+    put(*text++);
+  }
+  put(0);
+}
+
+typedef struct {
+  char name;
+  uint8_t type;
+  uint32_t start;
+} expected_t;
+
+static int check_entries(const expected_t* expected, int count, const char* when) {
+  int failures = 0;
+  if (tape_catalog_count() != count) {
+    printf("  %s: %d programs catalogued, %d expected\n", when, tape_catalog_count(), count);
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    const tape_program_t* p = tape_catalog_entry(i);
+    uint32_t end = i + 1 < count ? expected[i + 1].start : tape_len;
+    if (p->name != expected[i].name || p->type != expected[i].type ||
+        p->start != expected[i].start || p->length != end - expected[i].start) {
+      printf("  %s: program %d is %c at %lu, %lu bytes\n", when, i, p->name,
+          (unsigned long) p->start, (unsigned long) p->length);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+static int check_catalog(void) {
+  expected_t expected[4];
+  int failures = 0;
+
+  // sync bytes in a link, a line number and a string
+  expected[0] = (expected_t) {'A', TAPE_SYNC_PROGRAM, tape_len};
+  put_sync(TAPE_SYNC_PROGRAM, 'A');
+  put_line(0xd3d3, 0xd3d3, "\x96\"\xd3\xd3\xd3\xd3X\"");
+  put_line(0x2010, 20, "\x80");
+  put(0);
+  put(0);
+
+  // an array, then programs straight after it and after some leader
+  expected[1] = (expected_t) {'N', TAPE_SYNC_ARRAY, tape_len};
+  put_sync(TAPE_SYNC_ARRAY, 'N');
+  for (int i = 0; i < 40; i++) {
+    put(i % 5 ? 0 : 0x81);
+  }
+  expected[2] = (expected_t) {'B', TAPE_SYNC_PROGRAM, tape_len};
+  put_sync(TAPE_SYNC_PROGRAM, 'B');
+  put_line(0x3000, 5, "\x80");
+  put(0);
+  put(0);
+  for (int i = 0; i < 16; i++) {
+    put(0);
+  }
+  expected[3] = (expected_t) {'C', TAPE_SYNC_PROGRAM, tape_len};
+  put_sync(TAPE_SYNC_PROGRAM, 'C');
+  put_line(0x1234, 10, "\x80");
+  put(0);
+  put(0);
+
+  block_device_create(IMAGE_PATH, CARD_BLOCKS, true);
+  mkfs_fat32(1);
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+
+  io_service_start();
+  if (tape_open("/tape.dat") != FAT32_OK) {
+    printf("  cannot create /tape.dat\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < tape_len; i++) {
+    tape_write(tape[i]);
+  }
+  failures += check_entries(expected, 4, "written");
+  tape_flush();
+  io_service_stop();
+
+  // and from the tape file alone
+  fat32_delete("/tape.idx");
+  io_service_start();
+  tape_open("/tape.dat");
+  tape_catalog_update();
+  failures += check_entries(expected, 4, "indexed again");
+  io_service_stop();
+  return failures;
+}
+
+int main(void) {
+  fat32_init();
+
+  int failures = 0;
+  int listing_failures = check_listing();
+  printf("listing    %s\n", listing_failures ? "FAILED" : "ok");
+  failures += listing_failures;
+
+  int packing_failures = check_packing();
+  printf("packing    %s\n", packing_failures ? "FAILED" : "ok");
+  failures += packing_failures;
+
+  int catalog_failures = check_catalog();
+  printf("catalog    %s\n", catalog_failures ? "FAILED" : "ok");
+  failures += catalog_failures;
+
+  block_device_close();
+  unlink(IMAGE_PATH);
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
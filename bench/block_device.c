@@ -0,0 +1,340 @@
+// Disk image block device, see block_device.h.
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // pread, pwrite, mmap and nanosleep with -std=c11
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pico/stdlib.h"
+#include "sdcard.h"
+#include "block_device.h"
+
+#define READ_SINCE_WRITE 0x01
+#define WRITTEN 0x02
+
+#define COMMAND_BYTES 8      // the command and the wait for its response
+#define DATA_BYTES (1 + SD_BLOCK_SIZE + 2) // token, block and CRC
+
+static struct {
+  int fd;
+  uint8_t* map;              // the image when it is mapped
+  uint32_t blocks;
+  bool present;
+  uint32_t fail_after;       // blocks written before the power goes
+  uint32_t written;          // since the power was last set to fail
+
+  block_device_timing_t timing;
+  double byte_us;
+  double owed_us;            // modelled time not yet slept
+
+  uint8_t* state;            // per block READ_SINCE_WRITE and WRITTEN
+  uint16_t* writes;          // per block, stops at 65535
+  block_device_stats_t stats;
+} dev = {
+  .fd = -1,
+  .present = true,
+  .fail_after = UINT32_MAX,
+  .timing = {25000000, 100, 5, 400, false},
+  .byte_us = 8e6 / 25000000,
+};
+
+static void sleep_us(double us) {
+  struct timespec ts = {(time_t) (us / 1e6), (long) ((us - (time_t) (us / 1e6) * 1e6) * 1000)};
+  nanosleep(&ts, NULL);
+}
+
+// Count the time a command takes, and wait for it if asked to.  Short
+// waits are saved up, the host cannot sleep for a few microseconds.
+static void take_time(double us) {
+  dev.stats.card_us += us;
+  if (dev.timing.wait) {
+    dev.owed_us += us;
+    if (dev.owed_us >= 100) {
+      sleep_us(dev.owed_us);
+      dev.owed_us = 0;
+    }
+  }
+}
+
+//
+// The image
+//
+
+static int attach(int fd, bool map) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < SD_BLOCK_SIZE) {
+    close(fd);
+    return -1;
+  }
+
+  block_device_close();
+  dev.fd = fd;
+  dev.blocks = st.st_size / SD_BLOCK_SIZE;
+  if (map) {
+    dev.map = mmap(NULL, (size_t) dev.blocks * SD_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dev.map == MAP_FAILED) {
+      dev.map = NULL;
+      block_device_close();
+      return -1;
+    }
+  }
+  dev.state = calloc(dev.blocks, 1);
+  dev.writes = calloc(dev.blocks, sizeof(uint16_t));
+  if (dev.state == NULL || dev.writes == NULL) {
+    block_device_close();
+    return -1;
+  }
+  dev.present = true;
+  dev.fail_after = UINT32_MAX;
+  block_device_reset_stats();
+  return 0;
+}
+
+// A new image of blocks zeroed blocks, replacing any file at path
+int block_device_create(const char* path, uint32_t blocks, bool map) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t) blocks * SD_BLOCK_SIZE) != 0) {
+    close(fd);
+    return -1;
+  }
+  return attach(fd, map);
+}
+
+int block_device_open(const char* path, bool map) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return -1;
+  }
+  return attach(fd, map);
+}
+
+void block_device_close(void) {
+  if (dev.map != NULL) {
+    munmap(dev.map, (size_t) dev.blocks * SD_BLOCK_SIZE);
+    dev.map = NULL;
+  }
+  if (dev.fd >= 0) {
+    close(dev.fd);
+    dev.fd = -1;
+  }
+  free(dev.state);
+  free(dev.writes);
+  dev.state = NULL;
+  dev.writes = NULL;
+  dev.blocks = 0;
+}
+
+uint32_t block_device_blocks(void) {
+  return dev.blocks;
+}
+
+void block_device_get(uint32_t block, uint8_t* data) {
+  if (dev.map != NULL) {
+    memcpy(data, dev.map + (size_t) block * SD_BLOCK_SIZE, SD_BLOCK_SIZE);
+  } else if (pread(dev.fd, data, SD_BLOCK_SIZE, (off_t) block * SD_BLOCK_SIZE) != SD_BLOCK_SIZE) {
+    memset(data, 0, SD_BLOCK_SIZE);
+  }
+}
+
+void block_device_put(uint32_t block, const uint8_t* data) {
+  if (dev.map != NULL) {
+    memcpy(dev.map + (size_t) block * SD_BLOCK_SIZE, data, SD_BLOCK_SIZE);
+  } else if (pwrite(dev.fd, data, SD_BLOCK_SIZE, (off_t) block * SD_BLOCK_SIZE) != SD_BLOCK_SIZE) {
+    perror("block_device_put");
+  }
+}
+
+//
+// Settings
+//
+
+void block_device_set_timing(const block_device_timing_t* timing) {
+  dev.timing = *timing;
+  dev.byte_us = 8e6 / timing->baudrate;
+  dev.owed_us = 0;
+}
+
+void block_device_set_present(bool present) {
+  dev.present = present;
+}
+
+// Blocks written after this many more are lost without a word, the way
+// they are when a card loses power part way through
+void block_device_power_fails_after(uint32_t blocks) {
+  dev.fail_after = blocks;
+  dev.written = 0;
+}
+
+//
+// Accounting
+//
+
+void block_device_get_stats(block_device_stats_t* stats) {
+  *stats = dev.stats;
+}
+
+void block_device_reset_stats(void) {
+  memset(&dev.stats, 0, sizeof(dev.stats));
+  if (dev.state != NULL) {
+    memset(dev.state, 0, dev.blocks);
+    memset(dev.writes, 0, (size_t) dev.blocks * sizeof(uint16_t));
+  }
+}
+
+void block_device_print_stats(const char* label) {
+  const block_device_stats_t* s = &dev.stats;
+  printf("%-10s %lu reads (%lu blocks), %lu writes (%lu blocks), %lu read-modify-writes,"
+      " %lu rewrites, block %lu written %lu times, %.1f ms on the card\n",
+      label, (unsigned long) s->read_commands, (unsigned long) s->blocks_read,
+      (unsigned long) s->write_commands, (unsigned long) s->blocks_written,
+      (unsigned long) s->read_modify_writes, (unsigned long) s->rewrites,
+      (unsigned long) s->hottest_block, (unsigned long) s->hottest_writes, s->card_us / 1000);
+}
+
+//
+// drivers/sdcard.c calls
+//
+
+bool sd_card_present(void) {
+  return dev.present;
+}
+
+void sd_init(void) {
+}
+
+sd_error_t sd_card_init(void) {
+  return dev.fd >= 0 && dev.present ? SD_OK : SD_ERROR_NO_CARD;
+}
+
+bool sd_is_sdhc(void) {
+  return true;
+}
+
+sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t* buffer) {
+  if (!dev.present || dev.fd < 0 || num_blocks == 0 || start_block + num_blocks > dev.blocks) {
+    return SD_ERROR_READ_FAILED;
+  }
+
+  if (dev.map != NULL) {
+    memcpy(buffer, dev.map + (size_t) start_block * SD_BLOCK_SIZE, (size_t) num_blocks * SD_BLOCK_SIZE);
+  } else {
+    size_t size = (size_t) num_blocks * SD_BLOCK_SIZE;
+    if (pread(dev.fd, buffer, size, (off_t) start_block * SD_BLOCK_SIZE) != (ssize_t) size) {
+      return SD_ERROR_READ_FAILED;
+    }
+  }
+  for (uint32_t i = 0; i < num_blocks; i++) {
+    dev.state[start_block + i] |= READ_SINCE_WRITE;
+  }
+
+  dev.stats.read_commands++;
+  dev.stats.blocks_read += num_blocks;
+  double us = COMMAND_BYTES * dev.byte_us + dev.timing.read_latency_us +
+      num_blocks * DATA_BYTES * dev.byte_us + (num_blocks - 1) * dev.timing.stream_gap_us;
+  if (num_blocks > 1) {
+    us += COMMAND_BYTES * dev.byte_us; // CMD12 to stop
+  }
+  take_time(us);
+  return SD_OK;
+}
+
+sd_error_t sd_read_block(uint32_t block, uint8_t* buffer) {
+  return sd_read_blocks(block, 1, buffer);
+}
+
+sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t* buffer) {
+  if (!dev.present || dev.fd < 0 || num_blocks == 0 || start_block + num_blocks > dev.blocks) {
+    return SD_ERROR_WRITE_FAILED;
+  }
+
+  for (uint32_t i = 0; i < num_blocks; i++) {
+    uint32_t block = start_block + i;
+    if (dev.written++ < dev.fail_after) {
+      block_device_put(block, buffer + (size_t) i * SD_BLOCK_SIZE);
+    }
+
+    dev.stats.read_modify_writes += (dev.state[block] & READ_SINCE_WRITE) != 0;
+    dev.stats.rewrites += (dev.state[block] & WRITTEN) != 0;
+    dev.state[block] = WRITTEN;
+    if (dev.writes[block] < UINT16_MAX) {
+      dev.writes[block]++;
+    }
+    if (dev.writes[block] > dev.stats.hottest_writes) {
+      dev.stats.hottest_writes = dev.writes[block];
+      dev.stats.hottest_block = block;
+    }
+  }
+
+  dev.stats.write_commands++;
+  dev.stats.blocks_written += num_blocks;
+  take_time(COMMAND_BYTES * dev.byte_us +
+      num_blocks * ((DATA_BYTES + 1) * dev.byte_us + dev.timing.program_us));
+  return SD_OK;
+}
+
+sd_error_t sd_write_block(uint32_t block, const uint8_t* buffer) {
+  return sd_write_blocks(block, 1, buffer);
+}
+
+void sd_get_stats(sd_stats_t* stats) {
+  stats->read_commands = dev.stats.read_commands;
+  stats->write_commands = dev.stats.write_commands;
+  stats->blocks_read = dev.stats.blocks_read;
+  stats->blocks_written = dev.stats.blocks_written;
+  stats->crc_errors = 0; // an image does not garble blocks
+}
+
+void sd_reset_stats(void) {
+  block_device_reset_stats();
+}
+
+//
+// pico-sdk calls
+//
+
+uint64_t time_us_64(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+uint32_t time_us_32(void) {
+  return (uint32_t) time_us_64();
+}
+
+void busy_wait_us(uint64_t delay_us) {
+  sleep_us(delay_us);
+}
+
+// The SD card detect timer, run by block_device_card_detect
+static repeating_timer_t detect_timer;
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback,
+    void* user_data, repeating_timer_t* out) {
+  (void) delay_ms;
+  detect_timer.callback = callback;
+  detect_timer.user_data = user_data;
+  if (out != NULL) {
+    *out = detect_timer;
+  }
+  return true; // the card only goes away through block_device_set_present
+}
+
+// Run the card detect timer once, as the firmware's would after the card
+// was taken out or put in
+void block_device_card_detect(void) {
+  if (detect_timer.callback != NULL) {
+    detect_timer.callback(&detect_timer);
+  }
+}
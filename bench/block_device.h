@@ -0,0 +1,58 @@
+// A host stand-in for drivers/sdcard.c that keeps the card's blocks in a
+// raw disk image file, so drivers/fat32.c and what is built on it can be
+// run and measured on the development machine.  The image is read and
+// written with pread/pwrite, or mapped into memory.
+//
+// Everything the card is asked to do is counted, including the patterns
+// that cost most on a real card: a block written back after being read
+// (read-modify-write) and a block written more than once.  The time each
+// command would take over SPI is added up from the timings given, and can
+// also be waited out for real so that code running alongside sees it.
+//
+// Also provides the timer calls from include/ that fat32.c is built against.
+
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  uint32_t baudrate;           // SPI clock, bytes take 8 bits of it each
+  uint32_t read_latency_us;    // from a read command to its first data token
+  uint32_t stream_gap_us;      // between the blocks of a multiple block read
+  uint32_t program_us;         // busy after each block written
+  bool wait;                   // sleep for the time too, not just count it
+} block_device_timing_t;
+
+typedef struct {
+  uint32_t read_commands;      // commands, a multiple block transfer is one
+  uint32_t write_commands;
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint32_t read_modify_writes; // blocks written that had been read since last written
+  uint32_t rewrites;           // blocks written that had already been written
+  uint32_t hottest_block;      // the block written most often
+  uint32_t hottest_writes;     // and how often
+  double card_us;              // time the commands would have taken
+} block_device_stats_t;
+
+int block_device_create(const char* path, uint32_t blocks, bool map);
+int block_device_open(const char* path, bool map);
+void block_device_close(void);
+uint32_t block_device_blocks(void);
+
+// Direct access to the image, not counted and never failing
+void block_device_get(uint32_t block, uint8_t* data);
+void block_device_put(uint32_t block, const uint8_t* data);
+
+void block_device_set_timing(const block_device_timing_t* timing);
+void block_device_set_present(bool present);
+void block_device_power_fails_after(uint32_t blocks);
+void block_device_card_detect(void);
+
+void block_device_get_stats(block_device_stats_t* stats);
+void block_device_reset_stats(void);
+void block_device_print_stats(const char* label);
+
+#endif // BLOCK_DEVICE_H
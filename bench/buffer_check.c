@@ -0,0 +1,228 @@
+// Checks the buffers handles can be given with fat32_set_buffer() in
+// drivers/fat32.c, built for the host on a card kept in a disk image
+// (block_device.c).  What is read back is compared with a model of the
+// file, through a second handle without a buffer and after closing.
+//
+//   bypass    whole sectors read or written straight to the card over
+//             sectors the buffer has changed: a read must see the change,
+//             a write must not be undone when the buffer is written out
+//   truncate  sectors buffered past the new end of the file must not be
+//             written out later over clusters another file has taken
+//   append    a byte at a time on from the end of a file, the buffer
+//             joining each new sector on to those it holds, must read back
+//             as written and be written out a buffer at a time
+//
+// Usage: buffer_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "sdcard.h"
+#include "fat32.h"
+#include "block_device.h"
+#include "mkfs.h"
+
+#define IMAGE_PATH "buffer_check.img"
+#define CARD_BLOCKS 70000    // enough one sector clusters for FAT32
+#define BUFFER_SECTORS 4
+#define MODEL_SIZE (16 * 1024)
+#define APPEND_FROM 700
+#define APPEND_BYTES 10000
+
+static uint8_t handle_buffer[BUFFER_SECTORS * FAT32_SECTOR_SIZE];
+static uint8_t model[MODEL_SIZE];
+
+static void fresh_card(void) {
+  if (block_device_create(IMAGE_PATH, CARD_BLOCKS, true) != 0 || mkfs_fat32(1) != 0) {
+    fprintf(stderr, "error: cannot make %s.\n", IMAGE_PATH);
+    exit(1);
+  }
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+}
+
+static int expect(fat32_error_t status, const char* what) {
+  if (status != FAT32_OK) {
+    printf("  %s: %s\n", what, fat32_error_string(status));
+    return 1;
+  }
+  return 0;
+}
+
+static fat32_error_t write_at(fat32_file_t* file, uint32_t position, uint32_t size, uint8_t seed) {
+  size_t written = 0;
+  for (uint32_t i = 0; i < size; i++) {
+    model[position + i] = (uint8_t) (position + i + seed * 31);
+  }
+  fat32_error_t status = fat32_seek(file, position);
+  if (status == FAT32_OK) {
+    status = fat32_write(file, &model[position], size, &written);
+  }
+  return status == FAT32_OK && written != size ? FAT32_ERROR_WRITE_FAILED : status;
+}
+
+// The file as a handle of its own reads it, against what it should hold
+static int compare(const char* path, const uint8_t* expected, uint32_t size, const char* when) {
+  static uint8_t data[MODEL_SIZE];
+  fat32_file_t file;
+  size_t bytes_read = 0;
+
+  if (expect(fat32_open(&file, path), when)) {
+    return 1;
+  }
+  fat32_error_t status = fat32_read(&file, data, sizeof(data), &bytes_read);
+  fat32_close(&file);
+  if (status != FAT32_OK || bytes_read != size || memcmp(data, expected, size) != 0) {
+    uint32_t at = 0;
+    while (at < size && at < bytes_read && data[at] == expected[at]) {
+      at++;
+    }
+    printf("  %s: %s holds %lu bytes, %lu expected, first difference at %lu\n", when, path,
+        (unsigned long) bytes_read, (unsigned long) size, (unsigned long) at);
+    return 1;
+  }
+  return 0;
+}
+
+//
+// Checks
+//
+
+static int check_bypass(void) {
+  static uint8_t data[3 * FAT32_SECTOR_SIZE];
+  fat32_file_t file;
+  size_t bytes_read = 0;
+  int failures = 0;
+
+  fresh_card();
+  memset(model, 0, sizeof(model));
+  failures += expect(fat32_create(&file, "/bypass.dat"), "create /bypass.dat");
+  failures += expect(write_at(&file, 0, 4 * FAT32_SECTOR_SIZE, 1), "write");
+  failures += expect(fat32_flush(&file), "flush");
+  failures += expect(fat32_set_buffer(&file, handle_buffer, sizeof(handle_buffer)), "set buffer");
+
+  // a byte changed in the buffer, then the sectors round it read whole
+  failures += expect(write_at(&file, FAT32_SECTOR_SIZE + 10, 1, 2), "write a byte");
+  failures += expect(fat32_seek(&file, 0), "seek");
+  failures += expect(fat32_read(&file, data, sizeof(data), &bytes_read), "read whole sectors");
+  if (bytes_read != sizeof(data) || memcmp(data, model, sizeof(data)) != 0) {
+    printf("  a whole sector read missed what the buffer held\n");
+    failures++;
+  }
+
+  // and again, then those sectors written whole over it
+  failures += expect(write_at(&file, 2 * FAT32_SECTOR_SIZE + 20, 1, 3), "write a byte");
+  failures += expect(write_at(&file, FAT32_SECTOR_SIZE, 2 * FAT32_SECTOR_SIZE, 4), "write whole sectors");
+  failures += compare("/bypass.dat", model, 4 * FAT32_SECTOR_SIZE, "before closing");
+  failures += expect(fat32_seek(&file, 2 * FAT32_SECTOR_SIZE + 10), "seek");
+  failures += expect(fat32_read(&file, data, 20, &bytes_read), "read");
+  if (memcmp(data, &model[2 * FAT32_SECTOR_SIZE + 10], 20) != 0) {
+    printf("  the buffer still held sectors written round it\n");
+    failures++;
+  }
+  failures += expect(fat32_close(&file), "close");
+  failures += compare("/bypass.dat", model, 4 * FAT32_SECTOR_SIZE, "after closing");
+  return failures;
+}
+
+static int check_truncate(void) {
+  static uint8_t b_model[2048];
+  fat32_file_t a, b, rest;
+  uint64_t free_space;
+  int failures = 0;
+
+  fresh_card();
+  failures += expect(fat32_create(&a, "/a.dat"), "create /a.dat");
+  failures += expect(fat32_set_buffer(&a, handle_buffer, sizeof(handle_buffer)), "set buffer");
+  failures += expect(write_at(&a, 0, 3000, 5), "write /a.dat");
+  failures += expect(write_at(&a, 600, 1, 9), "write a byte to /a.dat"); // held in the buffer
+
+  // the rest of the card taken, so the clusters a lets go are the next used
+  failures += expect(fat32_get_free_space(&free_space), "free space");
+  failures += expect(fat32_create(&rest, "/rest.dat"), "create /rest.dat");
+  failures += expect(fat32_reserve(&rest, (uint32_t) free_space), "reserve /rest.dat");
+  failures += expect(fat32_close(&rest), "close /rest.dat");
+  failures += expect(fat32_truncate(&a, 0), "truncate /a.dat");
+
+  // and are taken by another file while a is still open
+  memset(model, 0, sizeof(model));
+  failures += expect(fat32_create(&b, "/b.dat"), "create /b.dat");
+  failures += expect(write_at(&b, 0, sizeof(b_model), 6), "write /b.dat");
+  failures += expect(fat32_close(&b), "close /b.dat");
+  memcpy(b_model, model, sizeof(b_model));
+  failures += expect(write_at(&a, 0, 10, 7), "write /a.dat again");
+  failures += expect(fat32_close(&a), "close /a.dat");
+
+  failures += compare("/b.dat", b_model, sizeof(b_model), "after /a.dat closed");
+  failures += compare("/a.dat", model, 10, "after truncating");
+  return failures;
+}
+
+static int check_append(void) {
+  fat32_file_t file;
+  fat32_file_stats_t stats;
+  size_t written = 0;
+  int failures = 0;
+
+  fresh_card();
+  memset(model, 0, sizeof(model));
+  failures += expect(fat32_create(&file, "/append.dat"), "create /append.dat");
+  failures += expect(write_at(&file, 0, APPEND_FROM, 8), "write");
+  failures += expect(fat32_close(&file), "close");
+
+  failures += expect(fat32_open(&file, "/append.dat"), "open /append.dat");
+  failures += expect(fat32_set_buffer(&file, handle_buffer, sizeof(handle_buffer)), "set buffer");
+  failures += expect(fat32_seek(&file, APPEND_FROM), "seek to the end");
+  for (uint32_t i = APPEND_FROM; i < APPEND_FROM + APPEND_BYTES; i++) {
+    model[i] = (uint8_t) (i * 7);
+    fat32_error_t status = fat32_write(&file, &model[i], 1, &written);
+    if (status != FAT32_OK) {
+      failures += expect(status, "append");
+      break;
+    }
+  }
+  fat32_get_file_stats(&file, &stats);
+  failures += expect(fat32_close(&file), "close");
+  failures += compare("/append.dat", model, APPEND_FROM + APPEND_BYTES, "after appending");
+
+  // one write out per buffer full, and one for what was left at the end
+  uint32_t sectors = (APPEND_FROM + APPEND_BYTES + FAT32_SECTOR_SIZE - 1) / FAT32_SECTOR_SIZE -
+                     APPEND_FROM / FAT32_SECTOR_SIZE;
+  uint32_t most = (sectors + BUFFER_SECTORS - 1) / BUFFER_SECTORS + 1;
+  if (stats.write_backs > most) {
+    printf("  %lu sectors appended in %lu write outs, at most %lu expected\n",
+        (unsigned long) sectors, (unsigned long) stats.write_backs, (unsigned long) most);
+    failures++;
+  }
+  printf("append     %lu sectors, %lu hits, %lu misses, %lu write outs\n", (unsigned long) sectors,
+      (unsigned long) stats.hits, (unsigned long) stats.misses, (unsigned long) stats.write_backs);
+  return failures;
+}
+
+int main(void) {
+  fat32_init();
+
+  int failures = 0;
+  int bypass_failures = check_bypass();
+  printf("bypass     %s\n", bypass_failures ? "FAILED" : "ok");
+  failures += bypass_failures;
+
+  int truncate_failures = check_truncate();
+  printf("truncate   %s\n", truncate_failures ? "FAILED" : "ok");
+  failures += truncate_failures;
+
+  failures += check_append();
+
+  block_device_close();
+  unlink(IMAGE_PATH);
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,245 @@
+// Checks the C library calls in drivers/clib.c, built for the host with
+// the I/O service on a pthread in front of drivers/fat32.c and a card kept
+// in a disk image (block_device.c).  Each descriptor it opens is given a
+// buffer of CLIB_BUFFER_SIZE bytes, the figures printed are what the card
+// was sent.
+//
+//   write    a byte at a time must go out a buffer full at a time, with
+//            nothing read back from the card
+//   read     and read back a byte at a time as written, a buffer full at
+//            a time
+//   seek     SEEK_CUR and SEEK_END from where the descriptor is, and the
+//            size _fstat gives counting what is still buffered
+//   stat     _stat must give the size without taking memory for a buffer
+//
+// Usage: clib_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "pico/stdlib.h"
+#include "fat32.h"
+#include "io_service.h"
+#include "block_device.h"
+#include "mkfs.h"
+
+#define IMAGE_PATH "clib_check.img"
+#define CARD_BLOCKS 70000    // enough one sector clusters for FAT32
+#define CLIB_BUFFER_SIZE 2048 // as drivers/clib.c has it
+#define BYTES 20000
+
+// drivers/clib.c, which has no header of its own
+int _open(const char* filename, int oflag, ...);
+int _close(int fd);
+off_t _lseek(int fd, off_t offset, int whence);
+int _read(int fd, char* buffer, int length);
+int _write(int fd, const char* buffer, int length);
+int _fstat(int fd, struct stat* buf);
+int _stat(const char* path, struct stat* buf);
+
+// The console, nothing here reads or writes it
+const absolute_time_t at_the_end_of_time = UINT64_MAX;
+
+int stdio_get_until(char* buf, int len, absolute_time_t until) {
+  (void) buf;
+  (void) len;
+  (void) until;
+  return 0;
+}
+
+void stdio_put_string(const char* s, int len, bool newline, bool cr_translation) {
+  (void) newline;
+  (void) cr_translation;
+  fwrite(s, 1, len, stdout);
+}
+
+// Linked with --wrap=malloc, so what clib.c takes is counted
+static int mallocs;
+void* __real_malloc(size_t size);
+
+void* __wrap_malloc(size_t size) {
+  mallocs++;
+  return __real_malloc(size);
+}
+
+static char model[BYTES];
+
+// Each call claims the file system, so what it sent is counted by now
+static block_device_stats_t card_stats(void) {
+  block_device_stats_t stats;
+  block_device_get_stats(&stats);
+  return stats;
+}
+
+static void print_stats(const char* name, const block_device_stats_t* stats) {
+  printf("%-10s %d one byte calls: %lu read and %lu write commands\n", name, BYTES,
+      (unsigned long) stats->read_commands, (unsigned long) stats->write_commands);
+}
+
+//
+// Checks
+//
+
+static int check_write(void) {
+  int failures = 0;
+
+  for (int i = 0; i < BYTES; i++) {
+    model[i] = (char) (i * 7 + (i >> 8));
+  }
+  int fd = _open("/clib.dat", O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0) {
+    printf("  cannot create /clib.dat\n");
+    return 1;
+  }
+  block_device_reset_stats();
+  for (int i = 0; i < BYTES; i++) {
+    if (_write(fd, &model[i], 1) != 1) {
+      printf("  write %d failed\n", i);
+      failures++;
+      break;
+    }
+  }
+
+  // a command per buffer full, the last one still held
+  block_device_stats_t stats = card_stats();
+  print_stats("write", &stats);
+  uint32_t most = BYTES / CLIB_BUFFER_SIZE;
+  if (_close(fd) != 0) {
+    printf("  close failed\n");
+    failures++;
+  }
+  if (stats.read_commands > 0 || stats.write_commands > most) {
+    printf("  at most %lu write commands and no reads expected\n", (unsigned long) most);
+    failures++;
+  }
+  return failures;
+}
+
+static int check_read(void) {
+  int failures = 0;
+  char c;
+
+  int fd = _open("/clib.dat", O_RDONLY);
+  if (fd < 0) {
+    printf("  cannot open /clib.dat\n");
+    return 1;
+  }
+  block_device_reset_stats();
+  for (int i = 0; i < BYTES; i++) {
+    if (_read(fd, &c, 1) != 1 || c != model[i]) {
+      printf("  byte %d not read back as written\n", i);
+      failures++;
+      break;
+    }
+  }
+  if (_read(fd, &c, 1) != 0) {
+    printf("  read past the end\n");
+    failures++;
+  }
+
+  // a command per buffer full
+  block_device_stats_t stats = card_stats();
+  print_stats("read", &stats);
+  uint32_t most = (BYTES + CLIB_BUFFER_SIZE - 1) / CLIB_BUFFER_SIZE;
+  _close(fd);
+  if (stats.read_commands > most || stats.write_commands > 0) {
+    printf("  at most %lu read commands and no writes expected\n", (unsigned long) most);
+    failures++;
+  }
+  return failures;
+}
+
+static int check_seek(void) {
+  struct stat st;
+  int failures = 0;
+  char c = 0;
+
+  int fd = _open("/clib.dat", O_RDWR);
+  if (fd < 0) {
+    printf("  cannot open /clib.dat\n");
+    return 1;
+  }
+  if (_lseek(fd, 100, SEEK_SET) != 100 || _lseek(fd, 50, SEEK_CUR) != 150 ||
+      _read(fd, &c, 1) != 1 || c != model[150]) {
+    printf("  SEEK_CUR went astray\n");
+    failures++;
+  }
+  if (_lseek(fd, -10, SEEK_END) != BYTES - 10 || _read(fd, &c, 1) != 1 ||
+      c != model[BYTES - 10]) {
+    printf("  SEEK_END went astray\n");
+    failures++;
+  }
+
+  // grown in the buffer only, _fstat must still see it
+  if (_lseek(fd, 0, SEEK_END) != BYTES || _write(fd, "xyz", 3) != 3 ||
+      _fstat(fd, &st) != 0 || st.st_size != BYTES + 3) {
+    printf("  the size does not count what is buffered\n");
+    failures++;
+  }
+  _close(fd);
+  return failures;
+}
+
+static int check_stat(void) {
+  struct stat st;
+  int failures = 0;
+
+  mallocs = 0;
+  if (_stat("/clib.dat", &st) != 0 || st.st_size != BYTES + 3 || !S_ISREG(st.st_mode)) {
+    printf("  _stat did not find /clib.dat as it is\n");
+    failures++;
+  }
+  if (mallocs > 0) {
+    printf("  _stat took memory %d times\n", mallocs);
+    failures++;
+  }
+  if (_stat("/none.dat", &st) == 0) {
+    printf("  _stat found a file that is not there\n");
+    failures++;
+  }
+  return failures;
+}
+
+int main(void) {
+  if (block_device_create(IMAGE_PATH, CARD_BLOCKS, true) != 0 || mkfs_fat32(1) != 0) {
+    fprintf(stderr, "error: cannot make %s.\n", IMAGE_PATH);
+    return 1;
+  }
+  fat32_init();
+  if (fat32_get_status() != FAT32_OK) { // mounted now, not in the first check
+    fprintf(stderr, "error: cannot mount %s.\n", IMAGE_PATH);
+    return 1;
+  }
+  io_service_start();
+
+  int failures = 0;
+  int write_failures = check_write();
+  printf("write      %s\n", write_failures ? "FAILED" : "ok");
+  failures += write_failures;
+
+  int read_failures = check_read();
+  printf("read       %s\n", read_failures ? "FAILED" : "ok");
+  failures += read_failures;
+
+  int seek_failures = check_seek();
+  printf("seek       %s\n", seek_failures ? "FAILED" : "ok");
+  failures += seek_failures;
+
+  int stat_failures = check_stat();
+  printf("stat       %s\n", stat_failures ? "FAILED" : "ok");
+  failures += stat_failures;
+
+  io_service_stop();
+  block_device_close();
+  unlink(IMAGE_PATH);
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
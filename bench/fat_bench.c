@@ -0,0 +1,405 @@
+// Measures drivers/fat32.c on freshly made FAT32 disk images served by
+// block_device.c.  Each workload is run on four images: one sector and
+// 32 KB clusters, each either empty or with its free space broken up
+// into single clusters, so that files written to it are fragmented.
+//
+// The results go to stdout as JSON: for each image and workload the wall
+// time on this machine, the time the card would have taken over SPI and
+// the commands and blocks sent to it.  Given a baseline made the same way
+// the results are compared with it on stderr, and the exit status is 1 if
+// any card time or command count has grown by more than 5%.  Wall time is
+// shown but not judged, it depends on the machine.  The workloads ending
+// _buffered give their handle a buffer of its own with fat32_set_buffer(),
+// as clib.c does, and also report how often it held the sector wanted.
+//
+// Usage: fat_bench [baseline.json]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "sdcard.h"
+#include "fat32.h"
+#include "block_device.h"
+#include "mkfs.h"
+
+#define IMAGE_PATH "fat_bench.img"
+#define FILE_SIZE (1024 * 1024)
+#define RANDOM_READS 1000
+#define RANDOM_READ 128
+#define MANY_FILES 1000
+#define DEPTH 8
+#define LOOKUPS 1000
+#define MAX_RESULTS 64
+#define WORSE 1.05
+#define HANDLE_BUFFER 2048   // what clib.c gives each open file
+
+typedef struct {
+  const char* name;
+  uint8_t sectors_per_cluster;
+  uint32_t blocks;
+  uint32_t holes;       // single free clusters making up the free space, or 0
+} image_t;
+
+// Enough holes for every workload, creating a file takes a cluster
+static const image_t images[] = {
+  {"small-contiguous", 1, 131072, 0},
+  {"small-fragmented", 1, 131072, 32768},
+  {"large-contiguous", 64, 66000 * 64, 0},  // sparse, little of it is written
+  {"large-fragmented", 64, 66000 * 64, 2048},
+};
+
+typedef struct {
+  char image[32];
+  char workload[32];
+  unsigned long wall_us;
+  unsigned long card_us;
+  unsigned long read_commands;
+  unsigned long write_commands;
+  unsigned long blocks_read;
+  unsigned long blocks_written;
+  unsigned long buffer_hits;    // for the _buffered workloads
+  unsigned long buffer_misses;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int result_count = 0;
+static const image_t* image;
+static uint64_t started;
+static uint8_t buffer[32 * 1024];
+static uint8_t handle_buffer[HANDLE_BUFFER];
+static fat32_file_stats_t handle_stats;
+
+static void check(fat32_error_t status, const char* what) {
+  if (status != FAT32_OK) {
+    fprintf(stderr, "error: %s on %s: %s\n", what, image->name, fat32_error_string(status));
+    exit(1);
+  }
+}
+
+// As the firmware does, on first use
+static void mount_card(void) {
+  if (!fat32_is_ready()) {
+    check(fat32_get_status(), "mount");
+  }
+}
+
+static void start(void) {
+  block_device_reset_stats();
+  started = time_us_64();
+}
+
+static void stop(const char* workload) {
+  uint64_t wall_us = time_us_64() - started;
+  block_device_stats_t stats;
+  block_device_get_stats(&stats);
+
+  result_t* r = &results[result_count++];
+  snprintf(r->image, sizeof(r->image), "%s", image->name);
+  snprintf(r->workload, sizeof(r->workload), "%s", workload);
+  r->wall_us = wall_us;
+  r->card_us = (unsigned long) stats.card_us;
+  r->read_commands = stats.read_commands;
+  r->write_commands = stats.write_commands;
+  r->blocks_read = stats.blocks_read;
+  r->blocks_written = stats.blocks_written;
+  r->buffer_hits = handle_stats.hits;
+  r->buffer_misses = handle_stats.misses;
+  memset(&handle_stats, 0, sizeof(handle_stats));
+}
+
+// Give the handle a buffer of its own for the _buffered workloads
+static void attach(fat32_file_t* file, bool buffered) {
+  if (buffered) {
+    check(fat32_set_buffer(file, handle_buffer, sizeof(handle_buffer)), "set buffer");
+  }
+}
+
+// Close the handle, keeping its buffer's statistics for stop()
+static void close_file(fat32_file_t* file) {
+  fat32_get_file_stats(file, &handle_stats);
+  check(fat32_close(file), "close");
+}
+
+// The same positions on every machine, unlike rand()
+static uint32_t next_random(uint32_t* state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+//
+// Images
+//
+
+// Two files written a cluster at a time in turn and the rest of the card
+// taken up, then one of the two deleted
+static void fragment(void) {
+  fat32_file_t a, b, rest;
+  uint32_t cluster = fat32_get_cluster_size();
+  uint64_t free_space;
+  size_t written;
+
+  memset(buffer, 0x55, sizeof(buffer));
+  check(fat32_create(&a, "/fill_a.dat"), "create /fill_a.dat");
+  check(fat32_create(&b, "/fill_b.dat"), "create /fill_b.dat");
+  for (uint32_t i = 0; i < image->holes; i++) {
+    check(fat32_write(&a, buffer, cluster, &written), "fill");
+    check(fat32_write(&b, buffer, cluster, &written), "fill");
+  }
+  check(fat32_close(&a), "close /fill_a.dat");
+  check(fat32_close(&b), "close /fill_b.dat");
+  check(fat32_get_free_space(&free_space), "free space");
+  check(fat32_create(&rest, "/fill_rest.dat"), "create /fill_rest.dat");
+  check(fat32_reserve(&rest, (uint32_t) free_space), "reserve /fill_rest.dat");
+  check(fat32_close(&rest), "close /fill_rest.dat");
+  check(fat32_delete("/fill_a.dat"), "delete /fill_a.dat");
+}
+
+static void make_image(void) {
+  if (block_device_create(IMAGE_PATH, image->blocks, true) != 0 ||
+      mkfs_fat32(image->sectors_per_cluster) != 0) {
+    fprintf(stderr, "error: cannot make %s for %s.\n", IMAGE_PATH, image->name);
+    exit(1);
+  }
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+  mount_card();
+  if (image->holes > 0) {
+    fragment();
+  }
+  check(fat32_sync(), "sync");
+}
+
+//
+// Workloads
+//
+
+static void mount(void) {
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+  start();
+  mount_card();
+  stop("mount");
+}
+
+static void write_file(const char* path, uint32_t size, size_t granularity, bool buffered) {
+  fat32_file_t file;
+  size_t written;
+
+  memset(buffer, 0xa5, sizeof(buffer));
+  check(fat32_create(&file, path), "create");
+  attach(&file, buffered);
+  for (uint32_t position = 0; position < size; position += granularity) {
+    check(fat32_write(&file, buffer, granularity, &written), "write");
+  }
+  close_file(&file);
+}
+
+static void sequential_write(const char* workload, const char* path, size_t granularity, bool buffered) {
+  start();
+  write_file(path, FILE_SIZE, granularity, buffered);
+  stop(workload);
+}
+
+static void sequential_read(const char* workload, const char* path, size_t granularity, bool buffered) {
+  fat32_file_t file;
+  size_t bytes_read;
+
+  start();
+  check(fat32_open(&file, path), "open");
+  attach(&file, buffered);
+  do {
+    check(fat32_read(&file, buffer, granularity, &bytes_read), "read");
+  } while (bytes_read == granularity);
+  close_file(&file);
+  stop(workload);
+}
+
+// The way the tape was written: kept open at its end, a byte at a time
+static void append(const char* workload, bool buffered) {
+  fat32_file_t file;
+  size_t written;
+  uint8_t byte = 0x5a;
+
+  write_file("/tape.dat", FILE_SIZE, sizeof(buffer), false);
+  memset(&handle_stats, 0, sizeof(handle_stats));
+  start();
+  check(fat32_open(&file, "/tape.dat"), "open /tape.dat");
+  attach(&file, buffered);
+  check(fat32_seek(&file, fat32_size(&file)), "seek");
+  for (uint32_t i = 0; i < FILE_SIZE; i++) {
+    check(fat32_write(&file, &byte, 1, &written), "append");
+  }
+  close_file(&file);
+  stop(workload);
+  check(fat32_delete("/tape.dat"), "delete /tape.dat");
+}
+
+static void random_read(void) {
+  fat32_file_t file;
+  size_t bytes_read;
+  uint32_t state = 1;
+
+  start();
+  check(fat32_open(&file, "/seq_32k.dat"), "open");
+  for (int i = 0; i < RANDOM_READS; i++) {
+    check(fat32_seek(&file, next_random(&state) % (FILE_SIZE - RANDOM_READ)), "seek");
+    check(fat32_read(&file, buffer, RANDOM_READ, &bytes_read), "read");
+  }
+  check(fat32_close(&file), "close");
+  stop("random_read");
+}
+
+static void many_files(void) {
+  fat32_file_t file;
+  char path[32];
+
+  check(fat32_dir_create(&file, "/many"), "create /many");
+  fat32_close(&file);
+
+  start();
+  for (int i = 0; i < MANY_FILES; i++) {
+    snprintf(path, sizeof(path), "/many/file%04d.dat", i);
+    check(fat32_create(&file, path), "create");
+    check(fat32_close(&file), "close");
+  }
+  stop("create_1000");
+
+  start();
+  for (int i = 0; i < MANY_FILES; i++) {
+    snprintf(path, sizeof(path), "/many/file%04d.dat", i);
+    check(fat32_delete(path), "delete");
+  }
+  stop("delete_1000");
+}
+
+static void deep_lookup(void) {
+  fat32_file_t file;
+  char path[128] = "";
+
+  for (int depth = 1; depth <= DEPTH; depth++) {
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/level%d", depth);
+    check(fat32_dir_create(&file, path), "create directory");
+    fat32_close(&file);
+  }
+  strcat(path, "/deep.dat");
+  check(fat32_create(&file, path), "create");
+  check(fat32_close(&file), "close");
+
+  // cold, with the caches forgotten, so each directory is walked
+  check(fat32_sync(), "sync");
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+  mount_card();
+  start();
+  check(fat32_open(&file, path), "open");
+  check(fat32_close(&file), "close");
+  stop("deep_lookup_cold");
+
+  start();
+  for (int i = 0; i < LOOKUPS; i++) {
+    check(fat32_open(&file, path), "open");
+    check(fat32_close(&file), "close");
+  }
+  stop("deep_lookup_warm");
+}
+
+//
+// Results
+//
+
+static void print_results(void) {
+  printf("{\n  \"results\": [\n");
+  for (int i = 0; i < result_count; i++) {
+    result_t* r = &results[i];
+    printf("    {\"image\": \"%s\", \"workload\": \"%s\", \"wall_us\": %lu, \"card_us\": %lu,"
+        " \"read_commands\": %lu, \"write_commands\": %lu, \"blocks_read\": %lu,"
+        " \"blocks_written\": %lu",
+        r->image, r->workload, r->wall_us, r->card_us, r->read_commands, r->write_commands,
+        r->blocks_read, r->blocks_written);
+    if (r->buffer_hits + r->buffer_misses > 0) {
+      printf(", \"buffer_hit_rate\": %.4f",
+          (double) r->buffer_hits / (r->buffer_hits + r->buffer_misses));
+    }
+    printf("}%s\n", i + 1 < result_count ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+// Reads back what print_results wrote, a result to a line
+static int compare(const char* path) {
+  FILE* f = fopen(path, "r");
+  char line[512];
+  int worse = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "error: cannot open %s.\n", path);
+    return 1;
+  }
+  fprintf(stderr, "%-18s %-18s %21s %21s %15s\n", "", "", "card ms", "commands", "wall ms");
+  while (fgets(line, sizeof(line), f) != NULL) {
+    result_t b;
+    if (sscanf(line, " {\"image\": \"%31[^\"]\", \"workload\": \"%31[^\"]\", \"wall_us\": %lu,"
+        " \"card_us\": %lu, \"read_commands\": %lu, \"write_commands\": %lu,"
+        " \"blocks_read\": %lu, \"blocks_written\": %lu",
+        b.image, b.workload, &b.wall_us, &b.card_us, &b.read_commands, &b.write_commands,
+        &b.blocks_read, &b.blocks_written) != 8) {
+      continue;
+    }
+    for (int i = 0; i < result_count; i++) {
+      result_t* r = &results[i];
+      if (strcmp(r->image, b.image) != 0 || strcmp(r->workload, b.workload) != 0) {
+        continue;
+      }
+      unsigned long commands = r->read_commands + r->write_commands;
+      unsigned long base_commands = b.read_commands + b.write_commands;
+      bool is_worse = r->card_us > b.card_us * WORSE || commands > base_commands * WORSE;
+      worse += is_worse;
+      fprintf(stderr, "%-18s %-18s %9.1f -> %9.1f %9lu -> %9lu %6lu -> %6lu",
+          r->image, r->workload, b.card_us / 1000.0, r->card_us / 1000.0, base_commands,
+          commands, b.wall_us / 1000, r->wall_us / 1000);
+      if (r->buffer_hits + r->buffer_misses > 0) {
+        fprintf(stderr, "  %5.1f%% hits", 100.0 * r->buffer_hits / (r->buffer_hits + r->buffer_misses));
+      }
+      fprintf(stderr, "%s\n", is_worse ? "  WORSE" : "");
+    }
+  }
+  fclose(f);
+  if (worse > 0) {
+    fprintf(stderr, "%d results worse than %s\n", worse, path);
+  }
+  return worse > 0;
+}
+
+int main(int argc, char** argv) {
+  fat32_init();
+
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+    image = &images[i];
+    make_image();
+    mount();
+    sequential_write("write_1", "/seq_1.dat", 1, false);
+    sequential_write("write_1_buffered", "/seq_1b.dat", 1, true);
+    sequential_write("write_512", "/seq_512.dat", 512, false);
+    sequential_write("write_32k", "/seq_32k.dat", 32 * 1024, false);
+    sequential_read("read_1", "/seq_1.dat", 1, false);
+    sequential_read("read_1_buffered", "/seq_1b.dat", 1, true);
+    sequential_read("read_512", "/seq_512.dat", 512, false);
+    sequential_read("read_32k", "/seq_32k.dat", 32 * 1024, false);
+    append("append_1", false);
+    append("append_1_buffered", true);
+    random_read();
+    many_files();
+    deep_lookup();
+  }
+  block_device_close();
+  unlink(IMAGE_PATH);
+
+  print_results();
+  return argc > 1 ? compare(argv[1]) : 0;
+}
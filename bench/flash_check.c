@@ -0,0 +1,375 @@
+// Checks the log-structured tape store in drivers/flash_log.c built for
+// the host, on the NOR flash double in nor_flash_sim.c.  The region is the
+// 256 KB the firmware sets aside.
+//
+//   model       random writes and overwrites, some copied to a card and
+//               marked mirrored, must read back as written, also after
+//               the store is mounted again
+//   compaction  the same range written over and over with no card to copy
+//               to must never fill the store, what is no longer needed is
+//               compacted away
+//   wear        with everything mirrored, how evenly the sectors are worn
+//   power       the power fails after a given number of flash operations,
+//               for a range of those numbers, while the store is full
+//               enough to be compacting.  Every append that returned must
+//               be there after mounting again, the one under way must be
+//               there whole or not at all, and nothing may ever need a
+//               bit set back to 1 without an erase.
+//
+// Usage: flash_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "flash_log.h"
+#include "nor_flash_sim.h"
+
+#define REGION_SIZE (256 * 1024)
+#define MODEL_SIZE (256 * 1024)
+#define TAPE_WRITE 2048        // what the tape hands over at a time
+#define REWRITE_RANGE (64 * 1024)
+#define POWER_RANGE (32 * 1024)
+#define POWER_OPS 120
+#define POWER_POINTS 200
+#define MIRROR_BATCH 8
+
+static const nor_flash_sim_timing_t timing = {400, 45000};
+
+// What the tape should read back as, and what has been copied to the card
+static uint8_t model[MODEL_SIZE];
+static uint8_t card[MODEL_SIZE];
+static uint32_t model_length;
+static uint32_t card_length;
+
+static uint8_t pattern(uint32_t position, uint32_t seed) {
+  return (uint8_t) (position * 7 + (position >> 8) + seed * 13);
+}
+
+static void fresh_flash(void) {
+  nor_flash_sim_init(REGION_SIZE, &timing);
+  memset(model, 0, sizeof(model));
+  memset(card, 0, sizeof(card));
+  model_length = 0;
+  card_length = 0;
+  if (flash_log_mount() != FLASH_LOG_OK) {
+    fprintf(stderr, "error: cannot mount a blank region.\n");
+    exit(1);
+  }
+  flash_log_reset_stats();
+}
+
+static void write_model(uint32_t position, uint32_t size, uint32_t seed) {
+  for (uint32_t i = 0; i < size; i++) {
+    model[position + i] = pattern(position + i, seed);
+  }
+  if (position + size > model_length) {
+    model_length = position + size;
+  }
+}
+
+static flash_log_error_t write(uint32_t position, uint32_t size, uint32_t seed) {
+  static uint8_t data[FLASH_LOG_MAX_RECORD * 2];
+  for (uint32_t i = 0; i < size; i++) {
+    data[i] = pattern(position + i, seed);
+  }
+  flash_log_error_t status = flash_log_append(position, data, size);
+  if (status == FLASH_LOG_OK) {
+    write_model(position, size, seed);
+  }
+  return status;
+}
+
+// As the tape does when the card is there: a batch of records copied,
+// then marked
+static void mirror(uint32_t records) {
+  flash_log_record_t batch[MIRROR_BATCH];
+  while (records > 0 && nor_flash_sim_powered()) {
+    uint32_t count = 0;
+    batch[0].data = NULL;
+    while (count < MIRROR_BATCH && count < records) {
+      if (count > 0) {
+        batch[count] = batch[count - 1];
+      }
+      if (!flash_log_next_unmirrored(&batch[count])) {
+        break;
+      }
+      count++;
+    }
+    if (count == 0) {
+      break;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(&card[batch[i].position], batch[i].data, batch[i].length);
+      if (batch[i].position + batch[i].length > card_length) {
+        card_length = batch[i].position + batch[i].length;
+      }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      flash_log_mark_mirrored(&batch[i]);
+    }
+    records -= count;
+  }
+}
+
+// The card with the store laid over it
+static int check_reads(const char* when) {
+  static uint8_t data[MODEL_SIZE];
+  memcpy(data, card, sizeof(data));
+  uint32_t reach = flash_log_read(0, data, sizeof(data));
+  if (memcmp(data, model, sizeof(data)) != 0) {
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+      if (data[i] != model[i]) {
+        printf("  %s: byte %lu reads %02x, %02x was written\n", when, (unsigned long) i,
+            data[i], model[i]);
+        break;
+      }
+    }
+    return 1;
+  }
+  // the tape is as long as the card's copy or the store, whichever is longer
+  uint32_t length = card_length > flash_log_end() ? card_length : flash_log_end();
+  if (reach > model_length || length != model_length) {
+    printf("  %s: store reaches %lu and the tape ends at %lu, %lu were written\n", when,
+        (unsigned long) reach, (unsigned long) length, (unsigned long) model_length);
+    return 1;
+  }
+  return 0;
+}
+
+static int remount(const char* when) {
+  if (flash_log_mount() != FLASH_LOG_OK) {
+    printf("  %s: cannot mount again\n", when);
+    return 1;
+  }
+  return check_reads(when);
+}
+
+static uint32_t violations(void) {
+  nor_flash_sim_stats_t stats;
+  nor_flash_sim_get_stats(&stats);
+  return stats.violations;
+}
+
+//
+// Checks
+//
+
+static int check_model(void) {
+  int failures = 0;
+
+  fresh_flash();
+  srand(1);
+  for (uint32_t i = 0; i < 20000 && failures == 0; i++) {
+    uint32_t size = 1 + rand() % 3000;
+    uint32_t position = rand() % 4 ? model_length : rand() % (model_length + 1);
+    if (position + size > MODEL_SIZE) {
+      position = rand() % (MODEL_SIZE - size);
+    }
+
+    // with the card gone for a while, then back
+    if (write(position, size, i) == FLASH_LOG_FULL) {
+      mirror(UINT32_MAX);
+      failures += write(position, size, i) != FLASH_LOG_OK;
+    }
+    if (i % 5000 > 2000 && rand() % 3 == 0) {
+      mirror(1 + rand() % 4);
+      flash_log_tidy();
+    }
+    if (i % 997 == 0) {
+      failures += check_reads("reading back");
+      failures += remount("after mounting again");
+    }
+  }
+  failures += remount("at the end");
+  failures += violations() != 0;
+  return failures;
+}
+
+static int check_compaction(void) {
+  flash_log_stats_t stats;
+  int failures = 0;
+  uint32_t written = 0;
+
+  fresh_flash();
+  nor_flash_sim_reset_stats();
+  srand(3);
+  for (uint32_t i = 0; written < 200 * REWRITE_RANGE && failures == 0; i++) {
+    uint32_t size = 1 + rand() % TAPE_WRITE;
+    uint32_t position = rand() % (REWRITE_RANGE - size);
+    flash_log_error_t status = write(position, size, i);
+    if (status != FLASH_LOG_OK) {
+      printf("  %lu KB in: append failed, %d\n", (unsigned long) (written / 1024), status);
+      failures++;
+    }
+    written += size;
+  }
+  failures += remount("after compacting");
+  failures += violations() != 0;
+
+  flash_log_get_stats(&stats);
+  printf("compaction %lu KB written over the same %d KB: %lu records copied, %lu erases,"
+      " %lu with copying, %.1f ms of flash time per KB appended\n",
+      (unsigned long) (stats.bytes / 1024), REWRITE_RANGE / 1024, (unsigned long) stats.copies,
+      (unsigned long) stats.erases, (unsigned long) stats.compactions,
+      stats.busy_us / 1000.0 / (stats.bytes / 1024.0));
+  return failures;
+}
+
+static int check_wear(void) {
+  nor_flash_sim_stats_t stats;
+  int failures = 0;
+  uint32_t megabytes = 16;
+
+  fresh_flash();
+  nor_flash_sim_reset_stats();
+  uint32_t appends = megabytes * 1024 * 1024 / TAPE_WRITE;
+  double append_us = 0;
+  for (uint32_t i = 0; i < appends && failures == 0; i++) {
+    uint32_t position = i * TAPE_WRITE % MODEL_SIZE;
+    double started = nor_flash_sim_time_us();
+    failures += write(position, TAPE_WRITE, i) != FLASH_LOG_OK;
+    append_us += nor_flash_sim_time_us() - started;
+
+    // copied to the card and tidied up while the tape is idle
+    mirror(UINT32_MAX);
+    flash_log_tidy();
+  }
+  failures += remount("after wearing");
+  failures += violations() != 0;
+
+  nor_flash_sim_get_stats(&stats);
+  printf("wear       %lu MB mirrored: %lu erases, each sector erased %lu to %lu times,"
+      " %.1f ms of flash time per %d byte append\n",
+      (unsigned long) megabytes, (unsigned long) stats.erases,
+      (unsigned long) stats.min_sector_erases, (unsigned long) stats.max_sector_erases,
+      append_us / 1000 / appends, TAPE_WRITE);
+  if (stats.max_sector_erases > stats.min_sector_erases + 2) {
+    printf("  wear is uneven\n");
+    failures++;
+  }
+  return failures;
+}
+
+// Fill the store with the range written over unmirrored until it has to
+// compact, then run the same appends and mirroring with the power failing
+// after fail_after flash operations.  Returns how many operations the run
+// took in all.
+static int check_power_cut(uint32_t fail_after, uint32_t* operations) {
+  static uint8_t before[MODEL_SIZE];
+  nor_flash_sim_stats_t stats;
+  uint32_t position = 0, size = 0, seed = 0;
+  bool in_flight = false;
+
+  fresh_flash();
+  srand(4);
+  for (uint32_t i = 0; i < 400; i++) {
+    uint32_t size = 1 + rand() % TAPE_WRITE;
+    write(rand() % (POWER_RANGE - size), size, i);
+  }
+
+  nor_flash_sim_get_stats(&stats);
+  uint32_t started = stats.programs + stats.erases;
+  nor_flash_sim_power_fails_after(fail_after);
+  srand(2);
+  for (uint32_t i = 0; i < POWER_OPS && nor_flash_sim_powered(); i++) {
+    if (i % 16 == 15) {
+      mirror(UINT32_MAX);
+      flash_log_tidy();
+      continue;
+    }
+    size = 1 + rand() % FLASH_LOG_MAX_RECORD;
+    position = rand() % 4 ? model_length : (uint32_t) rand() % POWER_RANGE;
+    if (position + size > MODEL_SIZE) {
+      position = 0;
+    }
+    seed = 100 + i;
+    memcpy(before, model, sizeof(model));
+    uint32_t length = model_length;
+    flash_log_error_t status = write(position, size, seed);
+    if (!nor_flash_sim_powered()) {
+      // it may have said it was done, but the power went
+      in_flight = true;
+      memcpy(model, before, sizeof(model));
+      model_length = length;
+    } else if (status != FLASH_LOG_OK) {
+      printf("  append %lu failed, %d\n", (unsigned long) i, status);
+      return 1;
+    }
+  }
+  nor_flash_sim_get_stats(&stats);
+  *operations = stats.programs + stats.erases - started;
+
+  nor_flash_sim_power_on();
+  if (flash_log_mount() != FLASH_LOG_OK) {
+    printf("  power lost after %lu operations: cannot mount again\n", (unsigned long) fail_after);
+    return 1;
+  }
+
+  // the append under way may be there, but only as a whole
+  char when[64];
+  snprintf(when, sizeof(when), "power lost after %lu operations", (unsigned long) fail_after);
+  if (in_flight) {
+    static uint8_t data[MODEL_SIZE];
+    bool all_new = true, all_old = true;
+    memcpy(data, card, sizeof(data));
+    flash_log_read(0, data, sizeof(data));
+    for (uint32_t i = 0; i < size; i++) {
+      all_new &= data[position + i] == pattern(position + i, seed);
+      all_old &= data[position + i] == model[position + i];
+    }
+    if (all_new) {
+      write_model(position, size, seed);
+    } else if (!all_old) {
+      printf("  %s: the append under way is there in part\n", when);
+      return 1;
+    }
+  }
+
+  int failures = check_reads(when);
+
+  // and it carries on from there
+  for (uint32_t i = 0; i < 32 && failures == 0; i++) {
+    flash_log_error_t status = write(i * 997 % POWER_RANGE, TAPE_WRITE, 1000 + i);
+    if (status != FLASH_LOG_OK) {
+      printf("  %s: append failed afterwards, %d\n", when, status);
+      failures++;
+    }
+  }
+  failures += remount(when);
+  if (violations() != 0) {
+    printf("  %s: %lu bits would have had to be set without an erase\n", when,
+        (unsigned long) violations());
+    failures++;
+  }
+  return failures;
+}
+
+static int check_power(void) {
+  uint32_t total;
+  uint32_t operations;
+  int failures = check_power_cut(UINT32_MAX, &total);
+
+  for (uint32_t point = 0; point < POWER_POINTS; point++) {
+    failures += check_power_cut((uint64_t) total * point / POWER_POINTS, &operations);
+  }
+  printf("power      %d power failures over %lu flash operations\n", POWER_POINTS,
+      (unsigned long) total);
+  return failures;
+}
+
+int main(void) {
+  int failures = check_model();
+  printf("model      %s\n", failures ? "FAILED" : "ok");
+
+  failures += check_compaction();
+  failures += check_wear();
+  failures += check_power();
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+// Host stand-in for hardware/spi.h, the bytes go to the test double.
+
+#ifndef BENCH_HARDWARE_SPI_H
+#define BENCH_HARDWARE_SPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct spi_inst spi_inst_t;
+#define spi0 ((spi_inst_t*) 0)
+
+unsigned int spi_init(spi_inst_t* spi, unsigned int baudrate);
+unsigned int spi_set_baudrate(spi_inst_t* spi, unsigned int baudrate);
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len);
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len);
+
+#endif // BENCH_HARDWARE_SPI_H
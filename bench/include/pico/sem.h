@@ -0,0 +1,7 @@
+// Host stand-in for pico/sem.h, which drivers/fat32.c includes but the
+// benchmarks have no use for.
+
+#ifndef BENCH_PICO_SEM_H
+#define BENCH_PICO_SEM_H
+
+#endif // BENCH_PICO_SEM_H
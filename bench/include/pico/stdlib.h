@@ -0,0 +1,44 @@
+// Host stand-in for the parts of the pico-sdk the drivers use, so they
+// can be built and measured on the development machine. The GPIO and
+// timer calls are provided by the test double the benchmark links with.
+
+#ifndef BENCH_PICO_STDLIB_H
+#define BENCH_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define GPIO_IN false
+#define GPIO_OUT true
+
+enum gpio_function { GPIO_FUNC_SPI = 1 };
+
+void gpio_init(unsigned int gpio);
+void gpio_set_dir(unsigned int gpio, bool out);
+void gpio_pull_up(unsigned int gpio);
+void gpio_set_function(unsigned int gpio, enum gpio_function fn);
+void gpio_put(unsigned int gpio, bool value);
+bool gpio_get(unsigned int gpio);
+
+uint32_t time_us_32(void);
+uint64_t time_us_64(void);
+void busy_wait_us(uint64_t delay_us);
+
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t* rt);
+struct repeating_timer {
+  repeating_timer_callback_t callback;
+  void* user_data;
+};
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback,
+    void* user_data, repeating_timer_t* out);
+
+// The console, for drivers/clib.c's descriptors 0 to 2
+typedef uint64_t absolute_time_t;
+extern const absolute_time_t at_the_end_of_time;
+int stdio_get_until(char* buf, int len, absolute_time_t until);
+void stdio_put_string(const char* s, int len, bool newline, bool cr_translation);
+
+#endif // BENCH_PICO_STDLIB_H
@@ -0,0 +1,431 @@
+// Checks the I/O service in drivers/io_service.c built for the host, where
+// it runs on a pthread in front of drivers/fat32.c and a card kept in a
+// disk image (block_device.c) instead of on the RP2040's second core.
+//
+//   ordering  reads and writes to two files are submitted without waiting
+//             and every read must see exactly the writes submitted before it
+//   crash     the card loses power after a given number of blocks have been
+//             written, for a range of those numbers.  Whatever an io_sync()
+//             had returned for before then must be on the card afterwards,
+//             and the file must hold nothing but what was written to it.
+//   swap      the card is taken out with writes held back and another put
+//             in before the file system is used again, nothing may be
+//             written to the new card but what it is asked to write
+//   late      a read started with io_read_to() is collected after many more
+//             requests and claims, and still has its own result
+//   overlap   with the card taking the given time to program each block,
+//             how long the submitting thread is held up by tape sized writes
+//
+// Usage: io_check [program us]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "sdcard.h"
+#include "fat32.h"
+#include "io_service.h"
+#include "block_device.h"
+#include "mkfs.h"
+
+#define IMAGE_PATH "io_check.img"
+#define CARD_BLOCKS 70000    // enough one sector clusters for FAT32
+#define MODEL_SIZE (256 * 1024)
+#define TAPE_WRITE 2048      // what the tape hands over at a time
+#define TAPE_WRITES 100
+#define CRASH_POINTS 150
+
+// Put back a freshly formatted card, with the file system forgotten
+static void fresh_card(void) {
+  if (block_device_create(IMAGE_PATH, CARD_BLOCKS, true) != 0 || mkfs_fat32(1) != 0) {
+    fprintf(stderr, "error: cannot make %s.\n", IMAGE_PATH);
+    exit(1);
+  }
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+}
+
+static uint32_t blocks_written(void) {
+  block_device_stats_t stats;
+  block_device_get_stats(&stats);
+  return stats.blocks_written;
+}
+
+static uint8_t pattern(uint32_t position, uint32_t seed) {
+  return (uint8_t) (position * 7 + (position >> 8) + seed * 13);
+}
+
+// Compare a file on the card with what it should hold
+static int check_file(const char* path, const uint8_t* expected, uint32_t length) {
+  static uint8_t data[MODEL_SIZE];
+  fat32_file_t file;
+  size_t bytes_read = 0;
+
+  if (fat32_open(&file, path) != FAT32_OK) {
+    printf("  %s is missing\n", path);
+    return 1;
+  }
+  fat32_error_t status = fat32_read(&file, data, sizeof(data), &bytes_read);
+  fat32_close(&file);
+  if (status != FAT32_OK || bytes_read != length || memcmp(data, expected, length) != 0) {
+    printf("  %s holds %lu bytes, %lu expected\n", path, (unsigned long) bytes_read,
+        (unsigned long) length);
+    return 1;
+  }
+  return 0;
+}
+
+//
+// Checks
+//
+
+#define READS_IN_FLIGHT 6
+
+typedef struct {
+  io_ticket_t ticket;
+  uint32_t age;     // requests submitted since
+  uint32_t size;
+  uint8_t data[3000];
+  uint8_t expected[3000];
+} pending_read_t;
+
+static int finish_read(pending_read_t* read) {
+  size_t bytes = 0;
+  fat32_error_t status = io_wait(read->ticket, &bytes);
+  read->ticket = 0;
+  if (status != FAT32_OK || bytes != read->size || memcmp(read->data, read->expected, bytes) != 0) {
+    printf("  read saw %lu bytes not matching the writes before it\n", (unsigned long) bytes);
+    return 1;
+  }
+  return 0;
+}
+
+static int check_ordering(void) {
+  static uint8_t model[2][MODEL_SIZE];
+  static pending_read_t reads[READS_IN_FLIGHT];
+  static const char* paths[2] = {"/a.dat", "/b.dat"};
+  io_handle_t files[2];
+  uint32_t length[2] = {0, 0};
+  int failures = 0;
+
+  fresh_card();
+  io_service_start();
+  for (int f = 0; f < 2; f++) {
+    if (io_open(paths[f], true, &files[f], NULL) != FAT32_OK) {
+      printf("  cannot create %s\n", paths[f]);
+      return 1;
+    }
+  }
+
+  srand(1);
+  for (uint32_t i = 0; i < 20000; i++) {
+    int f = rand() % 2;
+    uint32_t size = 1 + rand() % 3000;
+
+    // a result can be collected until IO_QUEUE_SIZE more requests are made
+    for (int r = 0; r < READS_IN_FLIGHT; r++) {
+      if (reads[r].ticket != 0 && ++reads[r].age >= IO_QUEUE_SIZE - 1) {
+        failures += finish_read(&reads[r]);
+      }
+    }
+
+    if (rand() % 3 == 0 && length[f] > 0) {
+      pending_read_t* read = &reads[i % READS_IN_FLIGHT];
+      if (read->ticket != 0) {
+        failures += finish_read(read);
+      }
+      uint32_t position = rand() % length[f];
+      read->size = position + size > length[f] ? length[f] - position : size;
+      read->age = 0;
+      memcpy(read->expected, &model[f][position], read->size);
+      memset(read->data, 0, sizeof(read->data));
+      read->ticket = io_read(files[f], position, read->data, read->size);
+    } else {
+      uint32_t position = rand() % 4 ? length[f] : rand() % (length[f] + 1);
+      if (position + size > MODEL_SIZE) {
+        continue;
+      }
+      for (uint32_t k = 0; k < size; k++) {
+        model[f][position + k] = pattern(position + k, i);
+      }
+      if (io_write(files[f], position, &model[f][position], size) != FAT32_OK) {
+        printf("  write failed\n");
+        failures++;
+      }
+      if (position + size > length[f]) {
+        length[f] = position + size;
+      }
+    }
+  }
+  for (int r = 0; r < READS_IN_FLIGHT; r++) {
+    if (reads[r].ticket != 0) {
+      failures += finish_read(&reads[r]);
+    }
+  }
+
+  for (int f = 0; f < 2; f++) {
+    if (io_close(files[f]) != FAT32_OK) {
+      printf("  closing %s failed\n", paths[f]);
+      failures++;
+    }
+  }
+  io_service_stop();
+
+  // and from the card itself, mounted afresh
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+  for (int f = 0; f < 2; f++) {
+    failures += check_file(paths[f], model[f], length[f]);
+  }
+  return failures;
+}
+
+// Write the tape with the card losing power after fail_after blocks,
+// returns how much of the tape io_sync() had said was on the card
+static int check_crash(const uint8_t* tape, uint32_t fail_after, uint32_t* synced) {
+  static uint8_t data[MODEL_SIZE];
+  io_handle_t handle;
+  uint32_t length = 0;
+  uint32_t reserved = 0;
+
+  fresh_card();
+  block_device_power_fails_after(fail_after);
+  *synced = 0;
+
+  io_service_start();
+  fat32_error_t status = io_open("/tape.dat", true, &handle, NULL);
+  for (int i = 0; status == FAT32_OK && i < TAPE_WRITES; i++) {
+    uint32_t size = i % 5 == 4 ? 1 + (i * 97) % TAPE_WRITE : TAPE_WRITE;
+    if (length + size > reserved) {
+      reserved = length + size + 64 * 1024;
+      io_reserve(handle, reserved);
+    }
+    io_write(handle, length, &tape[length], size);
+    length += size;
+
+    // the counts are the service's, but io_sync has waited for it
+    if (i % 8 == 7 && io_sync() == FAT32_OK && blocks_written() <= fail_after) {
+      *synced = length;
+    }
+  }
+  if (status == FAT32_OK && io_close(handle) == FAT32_OK && blocks_written() <= fail_after) {
+    *synced = length;
+  }
+  io_service_stop();
+
+  // the card comes back with whatever reached it
+  block_device_set_present(false);
+  fat32_unmount();
+  block_device_set_present(true);
+  block_device_power_fails_after(UINT32_MAX);
+
+  fat32_file_t file;
+  status = fat32_open(&file, "/tape.dat");
+  if (status != FAT32_OK) {
+    if (*synced > 0) {
+      printf("  power lost after %lu blocks: tape is gone, %lu bytes were synced\n",
+          (unsigned long) fail_after, (unsigned long) *synced);
+      return 1;
+    }
+    return 0;
+  }
+
+  size_t bytes_read = 0;
+  uint32_t size = fat32_size(&file);
+  status = fat32_read(&file, data, sizeof(data), &bytes_read);
+  fat32_close(&file);
+  if (status != FAT32_OK || bytes_read != size || size < *synced || size > length) {
+    printf("  power lost after %lu blocks: tape holds %lu of %lu bytes, %lu were synced\n",
+        (unsigned long) fail_after, (unsigned long) bytes_read, (unsigned long) size,
+        (unsigned long) *synced);
+    return 1;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    if (data[i] != tape[i]) {
+      printf("  power lost after %lu blocks: tape differs at byte %lu of %lu, %lu were synced\n",
+          (unsigned long) fail_after, (unsigned long) i, (unsigned long) size,
+          (unsigned long) *synced);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_crashes(void) {
+  static uint8_t tape[MODEL_SIZE];
+  uint32_t synced;
+  int failures = 0;
+
+  for (uint32_t i = 0; i < sizeof(tape); i++) {
+    tape[i] = pattern(i, 0);
+  }
+
+  // once all the way through to see how many blocks it takes
+  failures += check_crash(tape, UINT32_MAX, &synced);
+  uint32_t total = blocks_written();
+  uint32_t first_synced = 0;
+  for (uint32_t point = 0; point < CRASH_POINTS; point++) {
+    uint32_t fail_after = (uint64_t) total * point / CRASH_POINTS;
+    failures += check_crash(tape, fail_after, &synced);
+    if (first_synced == 0 && synced > 0) {
+      first_synced = fail_after;
+    }
+  }
+  printf("crash      %d power failures over %lu blocks written, first synced data after %lu\n",
+      CRASH_POINTS, (unsigned long) total, (unsigned long) first_synced);
+  return failures;
+}
+
+static int check_swap(void) {
+  static uint8_t data[3000];
+  fat32_file_t file;
+  size_t bytes_written = 0;
+
+  fresh_card();
+  memset(data, 0x5a, sizeof(data));
+  if (fat32_create(&file, "/swap.dat") != FAT32_OK ||
+      fat32_write(&file, data, sizeof(data), &bytes_written) != FAT32_OK) {
+    printf("  cannot write /swap.dat\n");
+    return 1;
+  }
+
+  // out, the timer notices, and a freshly formatted card goes in
+  block_device_set_present(false);
+  block_device_card_detect();
+  if (block_device_create(IMAGE_PATH, CARD_BLOCKS, true) != 0 || mkfs_fat32(1) != 0) {
+    fprintf(stderr, "error: cannot make %s.\n", IMAGE_PATH);
+    exit(1);
+  }
+  block_device_reset_stats();
+  block_device_set_present(true);
+
+  int failures = 0;
+  if (!fat32_is_ready()) {
+    printf("  the new card did not mount\n");
+    failures++;
+  }
+  if (blocks_written() != 0) {
+    printf("  %lu blocks of the old card's state written to the new one\n",
+        (unsigned long) blocks_written());
+    failures++;
+  }
+  if (fat32_open(&file, "/swap.dat") == FAT32_OK) {
+    printf("  /swap.dat turned up on the new card\n");
+    failures++;
+  }
+  return failures;
+}
+
+static int check_late(void) {
+  static uint8_t data[TAPE_WRITE];
+  static uint8_t other[100];
+  io_read_result_t result;
+  io_handle_t handle;
+  size_t bytes = 0;
+  int failures = 0;
+
+  fresh_card();
+  io_service_start();
+  if (io_open("/late.dat", true, &handle, NULL) != FAT32_OK) {
+    printf("  cannot create /late.dat\n");
+    return 1;
+  }
+  memset(data, 0x3c, sizeof(data));
+  io_write(handle, 0, data, sizeof(data));
+
+  memset(data, 0, sizeof(data));
+  io_read_to(handle, 0, data, sizeof(data), &result);
+  for (int i = 0; i < 4 * IO_QUEUE_SIZE; i++) {
+    io_wait(io_read(handle, 5, other, sizeof(other)), NULL);
+    io_claim();
+    io_release();
+  }
+  fat32_error_t status = io_wait_result(&result, &bytes);
+  if (status != FAT32_OK || bytes != sizeof(data) || data[0] != 0x3c || data[sizeof(data) - 1] != 0x3c) {
+    printf("  late read gave %lu bytes, %s\n", (unsigned long) bytes, fat32_error_string(status));
+    failures++;
+  }
+  io_close(handle);
+  io_service_stop();
+  return failures;
+}
+
+static int check_overlap(uint32_t program_us) {
+  static uint8_t window[TAPE_WRITE];
+  io_handle_t handle;
+  io_stats_t io;
+  uint64_t held_us = 0;
+
+  fresh_card();
+  io_service_start();
+  if (io_open("/overlap.dat", true, &handle, NULL) != FAT32_OK) {
+    printf("  cannot create /overlap.dat\n");
+    return 1;
+  }
+  io_reserve(handle, TAPE_WRITES * TAPE_WRITE);
+  io_sync();
+  io_reset_stats();
+
+  block_device_timing_t timing = {25000000, 100, 5, program_us, true};
+  block_device_set_timing(&timing);
+
+  uint64_t started = time_us_64();
+  for (int i = 0; i < TAPE_WRITES; i++) {
+    memset(window, i, sizeof(window));
+    uint64_t t0 = time_us_64();
+    io_write(handle, i * TAPE_WRITE, window, sizeof(window));
+    held_us += time_us_64() - t0;
+    // the emulator running BASIC in between, taking twice what the card does
+    busy_wait_us(2 * program_us * TAPE_WRITE / SD_BLOCK_SIZE);
+  }
+  uint64_t t0 = time_us_64();
+  fat32_error_t status = io_close(handle);
+  held_us += time_us_64() - t0;
+  uint64_t elapsed_us = time_us_64() - started;
+  io_get_stats(&io);
+  io_service_stop();
+  timing.wait = false;
+  block_device_set_timing(&timing);
+
+  printf("overlap    %d writes of %d bytes at %lu us per block: held up %lu ms of %lu ms,"
+      " service busy %lu ms, %lu stalls\n",
+      TAPE_WRITES, TAPE_WRITE, (unsigned long) program_us, (unsigned long) (held_us / 1000),
+      (unsigned long) (elapsed_us / 1000), (unsigned long) (io.busy_us / 1000),
+      (unsigned long) io.write_stalls);
+  return status != FAT32_OK;
+}
+
+int main(int argc, char** argv) {
+  uint32_t program_us = argc > 1 ? atoi(argv[1]) : 400;
+
+  fat32_init();
+
+  int failures = check_ordering();
+  printf("ordering   %s\n", failures ? "FAILED" : "ok");
+
+  int crash_failures = check_crashes();
+  failures += crash_failures;
+
+  int swap_failures = check_swap();
+  printf("swap       %s\n", swap_failures ? "FAILED" : "ok");
+  failures += swap_failures;
+
+  int late_failures = check_late();
+  printf("late       %s\n", late_failures ? "FAILED" : "ok");
+  failures += late_failures;
+
+  failures += check_overlap(program_us);
+  block_device_print_stats("card");
+  block_device_close();
+  unlink(IMAGE_PATH);
+
+  if (failures > 0) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
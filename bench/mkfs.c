@@ -0,0 +1,75 @@
+// FAT32 formatting for the host block device, see mkfs.h.
+
+#include <string.h>
+
+#include "sdcard.h"
+#include "block_device.h"
+#include "mkfs.h"
+
+#define RESERVED_SECTORS 32
+#define FATS 2
+
+static void put16(uint8_t* p, uint16_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+  put16(p, value);
+  put16(p + 2, value >> 16);
+}
+
+// No partition table, the boot sector is block 0 and the root directory
+// is cluster 2.  The image is taken to be zeroed already, as a new one
+// from block_device_create is.  Fails if there would be too few clusters
+// for the volume to count as FAT32.
+int mkfs_fat32(uint8_t sectors_per_cluster) {
+  uint32_t blocks = block_device_blocks();
+  uint32_t clusters = (blocks - RESERVED_SECTORS) / sectors_per_cluster;
+  uint32_t fat_sectors = ((clusters + 2) * 4 + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+  clusters = (blocks - RESERVED_SECTORS - FATS * fat_sectors) / sectors_per_cluster;
+  if (sectors_per_cluster == 0 || clusters < 65525) {
+    return -1;
+  }
+
+  uint8_t boot[SD_BLOCK_SIZE] = {0};
+  memcpy(boot, "\xeb\x58\x90" "MSWIN4.1", 11);
+  put16(boot + 11, SD_BLOCK_SIZE);
+  boot[13] = sectors_per_cluster;
+  put16(boot + 14, RESERVED_SECTORS);
+  boot[16] = FATS;
+  boot[21] = 0xf8; // fixed disk
+  put32(boot + 32, blocks);
+  put32(boot + 36, fat_sectors);
+  put32(boot + 44, 2); // root directory cluster
+  put16(boot + 48, 1); // FSInfo sector
+  put16(boot + 50, 6); // backup boot sector
+  boot[66] = 0x29;
+  memcpy(boot + 71, "BENCH      FAT32   ", 19);
+  put16(boot + 510, 0xaa55);
+  block_device_put(0, boot);
+  block_device_put(6, boot);
+
+  uint8_t fsinfo[SD_BLOCK_SIZE] = {0};
+  put32(fsinfo, 0x41615252);
+  put32(fsinfo + 484, 0x61417272);
+  put32(fsinfo + 488, clusters - 1); // all but the root directory
+  put32(fsinfo + 492, 3);
+  put32(fsinfo + 508, 0xaa550000);
+  block_device_put(1, fsinfo);
+
+  uint8_t fat[SD_BLOCK_SIZE] = {0};
+  put32(fat, 0x0ffffff8);
+  put32(fat + 4, 0x0fffffff);
+  put32(fat + 8, 0x0fffffff); // root directory
+  for (int i = 0; i < FATS; i++) {
+    block_device_put(RESERVED_SECTORS + i * fat_sectors, fat);
+  }
+
+  // an old root directory cluster would otherwise show through
+  uint8_t zero[SD_BLOCK_SIZE] = {0};
+  for (int i = 0; i < sectors_per_cluster; i++) {
+    block_device_put(RESERVED_SECTORS + FATS * fat_sectors + i, zero);
+  }
+  return 0;
+}
@@ -0,0 +1,10 @@
+// Lays an empty FAT32 file system over the whole of the host block device.
+
+#ifndef MKFS_H
+#define MKFS_H
+
+#include <stdint.h>
+
+int mkfs_fat32(uint8_t sectors_per_cluster);
+
+#endif // MKFS_H
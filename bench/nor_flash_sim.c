@@ -0,0 +1,181 @@
+// NOR flash test double, see nor_flash_sim.h.  Also provides the flash
+// and timer calls drivers/flash_log.c is built against on the host.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "flash_log.h"
+#include "nor_flash_sim.h"
+
+static struct {
+  uint8_t* memory;
+  uint32_t size;
+  nor_flash_sim_timing_t timing;
+  double now_us;
+  uint32_t fail_after;         // operations before the power goes
+  bool powered;
+  uint32_t garbage;            // what a cut short erase leaves
+  uint32_t* sector_erases;
+  nor_flash_sim_stats_t stats;
+} flash;
+
+void nor_flash_sim_init(uint32_t size, const nor_flash_sim_timing_t* timing) {
+  free(flash.memory);
+  free(flash.sector_erases);
+  memset(&flash, 0, sizeof(flash));
+  flash.size = size;
+  flash.timing = *timing;
+  flash.memory = malloc(size);
+  flash.sector_erases = calloc(size / FLASH_LOG_SECTOR_SIZE, sizeof(uint32_t));
+  if (flash.memory == NULL || flash.sector_erases == NULL) {
+    fprintf(stderr, "error: can't allocate %lu bytes of flash.\n", (unsigned long) size);
+    exit(1);
+  }
+  memset(flash.memory, 0xff, size); // as it comes from the factory
+  flash.fail_after = UINT32_MAX;
+  flash.powered = true;
+  flash.garbage = 1;
+}
+
+// The operation after this many more is cut short and none after it
+// happen at all
+void nor_flash_sim_power_fails_after(uint32_t operations) {
+  flash.fail_after = operations;
+}
+
+bool nor_flash_sim_powered(void) {
+  return flash.powered;
+}
+
+void nor_flash_sim_power_on(void) {
+  flash.powered = true;
+  flash.fail_after = UINT32_MAX;
+}
+
+double nor_flash_sim_time_us(void) {
+  return flash.now_us;
+}
+
+void nor_flash_sim_get_stats(nor_flash_sim_stats_t* stats) {
+  *stats = flash.stats;
+  stats->min_sector_erases = UINT32_MAX;
+  stats->max_sector_erases = 0;
+  for (uint32_t s = 0; s < flash.size / FLASH_LOG_SECTOR_SIZE; s++) {
+    if (flash.sector_erases[s] < stats->min_sector_erases) {
+      stats->min_sector_erases = flash.sector_erases[s];
+    }
+    if (flash.sector_erases[s] > stats->max_sector_erases) {
+      stats->max_sector_erases = flash.sector_erases[s];
+    }
+  }
+}
+
+void nor_flash_sim_reset_stats(void) {
+  memset(&flash.stats, 0, sizeof(flash.stats));
+  memset(flash.sector_erases, 0, flash.size / FLASH_LOG_SECTOR_SIZE * sizeof(uint32_t));
+}
+
+// Whether the next operation happens, and if it is the one the power
+// fails during
+static bool operation(bool* cut_short) {
+  *cut_short = false;
+  if (!flash.powered) {
+    return false;
+  }
+  if (flash.fail_after == 0) {
+    flash.powered = false;
+    *cut_short = true;
+    return true;
+  }
+  if (flash.fail_after != UINT32_MAX) {
+    flash.fail_after--;
+  }
+  return true;
+}
+
+//
+// drivers/flash_log.c calls
+//
+
+uint32_t flash_log_hw_size(void) {
+  return flash.size;
+}
+
+const uint8_t* flash_log_hw_contents(void) {
+  return flash.memory;
+}
+
+bool flash_log_hw_erase(uint32_t offset) {
+  bool cut_short;
+  if (offset % FLASH_LOG_SECTOR_SIZE != 0 || offset >= flash.size) {
+    return false;
+  }
+  if (!operation(&cut_short)) {
+    return true; // the program has no way to know
+  }
+
+  uint8_t* sector = flash.memory + offset;
+  if (cut_short) {
+    for (uint32_t i = 0; i < FLASH_LOG_SECTOR_SIZE; i++) {
+      flash.garbage = flash.garbage * 1103515245 + 12345;
+      sector[i] |= flash.garbage >> 16;
+    }
+  } else {
+    memset(sector, 0xff, FLASH_LOG_SECTOR_SIZE);
+  }
+  flash.sector_erases[offset / FLASH_LOG_SECTOR_SIZE]++;
+  flash.stats.erases++;
+  flash.now_us += flash.timing.sector_erase_us;
+  return true;
+}
+
+// A page at a time, as the chip takes them
+bool flash_log_hw_program(uint32_t offset, const void* data, size_t size) {
+  const uint8_t* bytes = data;
+  if (offset + size > flash.size) {
+    return false;
+  }
+
+  while (size > 0) {
+    uint32_t start = offset % FLASH_LOG_PAGE_SIZE;
+    size_t part = FLASH_LOG_PAGE_SIZE - start < size ? FLASH_LOG_PAGE_SIZE - start : size;
+    bool cut_short;
+    if (!operation(&cut_short)) {
+      return true;
+    }
+
+    // cut short, only the first half of the bytes get there
+    size_t programmed = cut_short ? part / 2 : part;
+    for (size_t i = 0; i < programmed; i++) {
+      uint8_t* cell = &flash.memory[offset + i];
+      if (bytes[i] & ~*cell) {
+        flash.stats.violations++;
+      }
+      *cell &= bytes[i];
+    }
+    flash.stats.programs++;
+    flash.now_us += flash.timing.page_program_us;
+    offset += part;
+    bytes += part;
+    size -= part;
+  }
+  return true;
+}
+
+//
+// pico-sdk calls
+//
+
+uint32_t time_us_32(void) {
+  return (uint32_t) flash.now_us;
+}
+
+uint64_t time_us_64(void) {
+  return (uint64_t) flash.now_us;
+}
+
+void busy_wait_us(uint64_t delay_us) {
+  flash.now_us += delay_us;
+}
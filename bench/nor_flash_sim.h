@@ -0,0 +1,41 @@
+// A test double for the QSPI NOR flash region drivers/flash_log.c keeps
+// its records in, built with -DFLASH_LOG_HOST in place of the RP2040
+// flash calls.  It holds the region in memory and behaves the way NOR
+// flash does: an erase sets a whole 4 KB sector to 1s and programming
+// can only clear bits.  A program that would need to set a bit back to 1
+// is counted as a violation and leaves the bit as it was, as the chip
+// would.
+//
+// The time each operation takes is kept on a simulated clock, which is
+// what time_us_64() returns.  The power can be made to fail part way
+// through an operation: a program is cut short, an erase leaves the
+// sector in no particular state, and nothing after it reaches the flash.
+
+#ifndef NOR_FLASH_SIM_H
+#define NOR_FLASH_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  uint32_t page_program_us;    // typical for a 256 byte page
+  uint32_t sector_erase_us;    // typical for a 4 KB sector
+} nor_flash_sim_timing_t;
+
+typedef struct {
+  uint32_t programs;           // page program operations
+  uint32_t erases;             // sector erase operations
+  uint32_t violations;         // bits a program would have had to set
+  uint32_t min_sector_erases;  // fewest and most times any sector was erased
+  uint32_t max_sector_erases;
+} nor_flash_sim_stats_t;
+
+void nor_flash_sim_init(uint32_t size, const nor_flash_sim_timing_t* timing);
+void nor_flash_sim_power_fails_after(uint32_t operations);
+bool nor_flash_sim_powered(void);
+void nor_flash_sim_power_on(void);
+double nor_flash_sim_time_us(void);
+void nor_flash_sim_get_stats(nor_flash_sim_stats_t* stats);
+void nor_flash_sim_reset_stats(void);
+
+#endif // NOR_FLASH_SIM_H
@@ -0,0 +1,151 @@
+// Measures SD block transfer throughput through drivers/sdcard.c against
+// the SPI card test double in sd_card_sim.c. Times are simulated: bytes
+// take as long as they would on the SPI bus at SD_BAUDRATE and the card
+// takes the access and programming times given in the configuration
+// below, so the figures show what the protocol costs rather than how fast
+// this machine is.  Then it garbles blocks on the bus to check that the
+// CRCs catch them, and times working the CRCs out, in real time.
+//
+// Usage: sd_bench [read latency us] [program us] [pre-erased program us]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdcard.h"
+#include "crc.h"
+#include "sd_card_sim.h"
+
+#define TOTAL_BLOCKS 2048 // 1 MB per measurement
+#define GARBLE_EVERY 64
+
+static uint8_t data[TOTAL_BLOCKS * SD_BLOCK_SIZE];
+static uint8_t check[TOTAL_BLOCKS * SD_BLOCK_SIZE];
+
+static double kb_per_second(double us) {
+  return (TOTAL_BLOCKS * SD_BLOCK_SIZE / 1024.0) / (us / 1e6);
+}
+
+// Write a MB in transfers of run blocks, read it back and check it
+static int transfer(uint32_t run, uint32_t start, uint32_t seed, double* read_us, double* write_us) {
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t) (i * 7 + (i >> 9) + seed);
+  }
+
+  double t0 = sd_card_sim_time_us();
+  for (uint32_t b = 0; b < TOTAL_BLOCKS; b += run) {
+    if (sd_write_blocks(start + b, run, data + b * SD_BLOCK_SIZE) != SD_OK) {
+      fprintf(stderr, "error: write of %lu blocks at %lu failed.\n",
+          (unsigned long) run, (unsigned long) (start + b));
+      return 1;
+    }
+  }
+  *write_us = sd_card_sim_time_us() - t0;
+
+  t0 = sd_card_sim_time_us();
+  for (uint32_t b = 0; b < TOTAL_BLOCKS; b += run) {
+    if (sd_read_blocks(start + b, run, check + b * SD_BLOCK_SIZE) != SD_OK) {
+      fprintf(stderr, "error: read of %lu blocks at %lu failed.\n",
+          (unsigned long) run, (unsigned long) (start + b));
+      return 1;
+    }
+  }
+  *read_us = sd_card_sim_time_us() - t0;
+
+  if (memcmp(data, check, sizeof(data)) != 0 ||
+      memcmp(data, sd_card_sim_image() + (size_t) start * SD_BLOCK_SIZE, sizeof(data)) != 0) {
+    fprintf(stderr, "error: data read back differs for %lu block transfers.\n",
+        (unsigned long) run);
+    return 1;
+  }
+  return 0;
+}
+
+// Real time this time, the simulated clock only moves with the bus
+static double crc_us(uint16_t (*crc)(const uint8_t*, size_t)) {
+  struct timespec t0, t1;
+  volatile uint16_t sink = 0;
+
+  timespec_get(&t0, TIME_UTC);
+  for (uint32_t b = 0; b < TOTAL_BLOCKS; b++) {
+    sink ^= crc(data + b * SD_BLOCK_SIZE, SD_BLOCK_SIZE);
+  }
+  timespec_get(&t1, TIME_UTC);
+  (void) sink;
+  return ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3) / TOTAL_BLOCKS;
+}
+
+int main(int argc, char** argv) {
+  sd_card_sim_config_t config = {
+    .blocks = 4 * TOTAL_BLOCKS,
+    .read_latency_us = 100,
+    .stream_gap_us = 5,
+    .program_us = 400,
+    .erased_program_us = 150,
+  };
+  if (argc > 1) {
+    config.read_latency_us = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    config.program_us = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    config.erased_program_us = atoi(argv[3]);
+  }
+
+  sd_card_sim_init(&config);
+  sd_init();
+  if (sd_card_init() != SD_OK || !sd_is_sdhc()) {
+    fprintf(stderr, "error: card did not initialise.\n");
+    return 1;
+  }
+
+  printf("SPI at %d Hz, read latency %lu us, program %lu us (%lu us pre-erased)\n\n",
+      SD_BAUDRATE, (unsigned long) config.read_latency_us,
+      (unsigned long) config.program_us, (unsigned long) config.erased_program_us);
+  printf("blocks/transfer  read KB/s  write KB/s  bytes clocked/block\n");
+
+  static const uint32_t runs[] = {1, 2, 8, 32, 128};
+  for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+    sd_card_sim_stats_t before;
+    sd_card_sim_stats_t after;
+    double read_us, write_us;
+
+    sd_card_sim_get_stats(&before);
+    if (transfer(runs[r], (r % 2) * TOTAL_BLOCKS, r, &read_us, &write_us) != 0) {
+      return 1;
+    }
+    sd_card_sim_get_stats(&after);
+    printf("%15lu  %9.0f  %10.0f  %19.1f\n", (unsigned long) runs[r],
+        kb_per_second(read_us), kb_per_second(write_us),
+        (double) (after.bytes_clocked - before.bytes_clocked) / (2 * TOTAL_BLOCKS));
+  }
+
+  // Blocks garbled on the bus are caught by their CRCs and sent again
+  sd_card_sim_stats_t sim;
+  sd_stats_t sd;
+  double read_us, write_us;
+  sd_reset_stats();
+  sd_card_sim_garble_every(GARBLE_EVERY);
+  if (transfer(8, 0, 99, &read_us, &write_us) != 0) {
+    return 1;
+  }
+  sd_card_sim_garble_every(0);
+  sd_card_sim_get_stats(&sim);
+  sd_get_stats(&sd);
+  printf("\nevery %d blocks garbled: %lu garbled, %lu CRC errors, data intact,"
+      " %.0f KB/s read, %.0f KB/s write\n",
+      GARBLE_EVERY, (unsigned long) sim.garbled, (unsigned long) sd.crc_errors,
+      kb_per_second(read_us), kb_per_second(write_us));
+
+  // What working out the CRC costs against moving the block, on this machine
+  double block_us = (1 + SD_BLOCK_SIZE + 2) * 8e6 / SD_BAUDRATE;
+  double table_us = crc_us(crc16);
+  double bitwise_us = crc_us(crc16_bitwise);
+  printf("CRC16 of a block: %.3f us slice-by-8 (%.2f%% of the %.1f us it takes on the bus),"
+      " %.3f us a bit at a time\n",
+      table_us, 100 * table_us / block_us, block_us, bitwise_us);
+
+  return 0;
+}
@@ -0,0 +1,355 @@
+// SPI mode SD card test double, see sd_card_sim.h. Also provides the GPIO,
+// SPI and timer calls from include/ that drivers/sdcard.c is built against.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/spi.h"
+#include "sdcard.h"
+#include "crc.h"
+#include "sd_card_sim.h"
+
+#define QUEUE_SIZE 1024
+
+static struct {
+  sd_card_sim_config_t config;
+  uint8_t* image;
+  double now_us;
+  double byte_us;      // time to clock one byte
+  bool selected;
+
+  uint8_t command[6];  // command being received
+  int command_len;
+  bool app_command;    // last command was CMD55
+  bool ready;          // ACMD41 has been seen
+  bool crc_on;         // CMD59, data CRCs are checked
+  uint32_t garble_every; // flip a bit in every this many blocks, 0 for none
+  uint32_t blocks_moved;
+
+  uint8_t queue[QUEUE_SIZE]; // bytes the card has lined up to send
+  int queue_head;
+  int queue_tail;
+
+  uint8_t reading;     // 17 or 18 while a read is under way
+  uint32_t read_block;
+  double data_at;      // when the next block's data token can go out
+
+  uint8_t writing;     // 24 or 25 while a write is under way
+  uint32_t write_block;
+  bool receiving;      // taking in a block's data and CRC
+  uint8_t write_buffer[SD_BLOCK_SIZE + 2];
+  int write_len;
+  uint32_t erase_count; // from ACMD23
+  double busy_until;
+
+  sd_card_sim_stats_t stats;
+} card;
+
+void sd_card_sim_init(const sd_card_sim_config_t* config) {
+  free(card.image);
+  memset(&card, 0, sizeof(card));
+  card.config = *config;
+  card.image = calloc(config->blocks, SD_BLOCK_SIZE);
+  if (card.image == NULL) {
+    fprintf(stderr, "error: can't allocate a %lu block card.\n",
+        (unsigned long) config->blocks);
+    exit(1);
+  }
+  card.byte_us = 8e6 / SD_INIT_BAUDRATE;
+  crc_init();
+}
+
+void sd_card_sim_garble_every(uint32_t blocks) {
+  card.garble_every = blocks;
+}
+
+// Whether the block now crossing the bus is the one to garble
+static bool garble(void) {
+  if (card.garble_every == 0 || ++card.blocks_moved % card.garble_every != 0) {
+    return false;
+  }
+  card.stats.garbled++;
+  return true;
+}
+
+uint8_t* sd_card_sim_image(void) {
+  return card.image;
+}
+
+double sd_card_sim_time_us(void) {
+  return card.now_us;
+}
+
+void sd_card_sim_get_stats(sd_card_sim_stats_t* stats) {
+  *stats = card.stats;
+}
+
+static void send(uint8_t value) {
+  if (card.queue_tail - card.queue_head < QUEUE_SIZE) {
+    card.queue[card.queue_tail++ % QUEUE_SIZE] = value;
+  }
+}
+
+static void send_r1(uint8_t r1) {
+  send(0xff); // a byte of NCR before the response
+  send(r1);
+}
+
+static void execute(void) {
+  uint8_t index = card.command[0] & 0x3f;
+  uint32_t arg = ((uint32_t) card.command[1] << 24) | (card.command[2] << 16) |
+                 (card.command[3] << 8) | card.command[4];
+  bool app = card.app_command;
+  card.app_command = false;
+  card.stats.commands++;
+
+  // CMD0 and CMD8 are always checked, the rest once CMD59 says so
+  if ((card.crc_on || index == SD_CMD0 || index == SD_CMD8) &&
+      card.command[5] != crc7(card.command, 5)) {
+    card.stats.crc_rejected++;
+    send_r1(SD_R1_COM_CRC_ERROR);
+    return;
+  }
+
+  if (index == SD_CMD12) {
+    // The byte after CMD12 is not defined, send something that is not a response
+    card.reading = 0;
+    card.queue_head = card.queue_tail = 0;
+    send(0x3f);
+    send(0x00);
+    return;
+  }
+
+  switch (index) {
+  case SD_CMD0:
+    card.ready = false;
+    send_r1(SD_R1_IDLE_STATE);
+    break;
+  case SD_CMD8:
+    send_r1(SD_R1_IDLE_STATE);
+    send(0x00);
+    send(0x00);
+    send(card.command[3]);
+    send(card.command[4]);
+    break;
+  case SD_CMD55:
+    card.app_command = true;
+    send_r1(card.ready ? 0 : SD_R1_IDLE_STATE);
+    break;
+  case SD_CMD58:
+    send_r1(0);
+    send(0xc0); // powered up, high capacity
+    send(0xff);
+    send(0x80);
+    send(0x00);
+    break;
+  case SD_CMD17:
+  case SD_CMD18:
+    if (arg >= card.config.blocks) {
+      send_r1(SD_R1_ADDRESS_ERROR);
+      break;
+    }
+    send_r1(0);
+    card.reading = index;
+    card.read_block = arg;
+    card.data_at = card.now_us + 2 * card.byte_us + card.config.read_latency_us;
+    break;
+  case SD_CMD24:
+  case SD_CMD25:
+    if (arg >= card.config.blocks) {
+      send_r1(SD_R1_ADDRESS_ERROR);
+      break;
+    }
+    send_r1(0);
+    card.writing = index;
+    card.write_block = arg;
+    card.receiving = false;
+    break;
+  default:
+    if (app && index == SD_ACMD41) {
+      card.ready = true;
+      send_r1(0);
+    } else if (app && index == SD_ACMD23) {
+      card.erase_count = arg;
+      send_r1(0);
+    } else if (index == SD_CMD59) {
+      card.crc_on = arg & 1;
+      send_r1(0);
+    } else if (index == SD_CMD16) {
+      send_r1(0);
+    } else {
+      send_r1(SD_R1_ILLEGAL_COMMAND);
+    }
+    break;
+  }
+}
+
+static void receive_write(uint8_t in) {
+  if (card.receiving) {
+    card.write_buffer[card.write_len++] = in;
+    if (card.write_len < (int) sizeof(card.write_buffer)) {
+      return;
+    }
+
+    card.receiving = false;
+    if (garble()) {
+      card.write_buffer[card.blocks_moved % SD_BLOCK_SIZE] ^= 0x10;
+    }
+    uint16_t crc = (card.write_buffer[SD_BLOCK_SIZE] << 8) | card.write_buffer[SD_BLOCK_SIZE + 1];
+    if (card.crc_on && crc != crc16(card.write_buffer, SD_BLOCK_SIZE)) {
+      card.stats.crc_rejected++;
+      send(0xe0 | SD_DATA_CRC_ERROR);
+      if (card.writing == SD_CMD24) {
+        card.writing = 0;
+      }
+      return;
+    }
+    if (card.write_block >= card.config.blocks) {
+      send(0x0d); // write error
+      card.writing = 0;
+      return;
+    }
+    memcpy(card.image + (size_t) card.write_block * SD_BLOCK_SIZE,
+        card.write_buffer, SD_BLOCK_SIZE);
+    card.write_block++;
+    card.stats.blocks_written++;
+
+    send(0xe0 | SD_DATA_ACCEPTED);
+    uint32_t program = card.config.program_us;
+    if (card.writing == SD_CMD25 && card.erase_count > 0) {
+      program = card.config.erased_program_us;
+      card.erase_count--;
+    }
+    card.busy_until = card.now_us + 2 * card.byte_us + program;
+    if (card.writing == SD_CMD24) {
+      card.writing = 0;
+    }
+  } else if ((card.writing == SD_CMD24 && in == SD_DATA_START_BLOCK) ||
+             (card.writing == SD_CMD25 && in == SD_DATA_START_BLOCK_MULT)) {
+    card.receiving = true;
+    card.write_len = 0;
+  } else if (card.writing == SD_CMD25 && in == SD_DATA_STOP_MULT) {
+    card.writing = 0;
+    card.erase_count = 0;
+    send(0xff);
+    card.busy_until = card.now_us + 2 * card.byte_us + card.config.erased_program_us;
+  }
+}
+
+static uint8_t exchange(uint8_t in) {
+  uint8_t out = 0xff;
+  card.stats.bytes_clocked++;
+
+  if (card.selected) {
+    if (card.queue_head != card.queue_tail) {
+      out = card.queue[card.queue_head++ % QUEUE_SIZE];
+    } else if (card.now_us < card.busy_until) {
+      out = 0x00;
+    } else if (card.reading && card.now_us >= card.data_at) {
+      // Line up the next block: token, data and CRC
+      send(SD_DATA_START_BLOCK);
+      const uint8_t* data = card.image + (size_t) card.read_block * SD_BLOCK_SIZE;
+      int garbled_at = garble() ? (int) (card.blocks_moved % SD_BLOCK_SIZE) : -1;
+      for (int i = 0; i < SD_BLOCK_SIZE; i++) {
+        send(i == garbled_at ? data[i] ^ 0x10 : data[i]);
+      }
+      uint16_t crc = crc16(data, SD_BLOCK_SIZE);
+      send(crc >> 8);
+      send(crc & 0xff);
+      card.stats.blocks_read++;
+      card.read_block++;
+      card.data_at = card.now_us + (SD_BLOCK_SIZE + 3) * card.byte_us + card.config.stream_gap_us;
+      if (card.reading == SD_CMD17 || card.read_block >= card.config.blocks) {
+        card.reading = 0;
+      }
+      out = card.queue[card.queue_head++ % QUEUE_SIZE];
+    }
+
+    if (card.writing && card.command_len == 0) {
+      receive_write(in);
+    } else if (card.command_len > 0 || (in & 0xc0) == 0x40) {
+      card.command[card.command_len++] = in;
+      if (card.command_len == 6) {
+        card.command_len = 0;
+        execute();
+      }
+    }
+  }
+
+  card.now_us += card.byte_us;
+  return out;
+}
+
+//
+// pico-sdk calls
+//
+
+void gpio_init(unsigned int gpio) {
+  (void) gpio;
+}
+
+void gpio_set_dir(unsigned int gpio, bool out) {
+  (void) gpio;
+  (void) out;
+}
+
+void gpio_pull_up(unsigned int gpio) {
+  (void) gpio;
+}
+
+void gpio_set_function(unsigned int gpio, enum gpio_function fn) {
+  (void) gpio;
+  (void) fn;
+}
+
+void gpio_put(unsigned int gpio, bool value) {
+  if (gpio == SD_CS) {
+    card.selected = !value;
+    card.command_len = 0;
+  }
+}
+
+bool gpio_get(unsigned int gpio) {
+  (void) gpio;
+  return false; // card detect is active low, the card is always there
+}
+
+uint32_t time_us_32(void) {
+  return (uint32_t) card.now_us;
+}
+
+uint64_t time_us_64(void) {
+  return (uint64_t) card.now_us;
+}
+
+void busy_wait_us(uint64_t delay_us) {
+  card.now_us += delay_us;
+}
+
+unsigned int spi_init(spi_inst_t* spi, unsigned int baudrate) {
+  return spi_set_baudrate(spi, baudrate);
+}
+
+unsigned int spi_set_baudrate(spi_inst_t* spi, unsigned int baudrate) {
+  (void) spi;
+  card.byte_us = 8e6 / baudrate;
+  return baudrate;
+}
+
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len) {
+  (void) spi;
+  for (size_t i = 0; i < len; i++) {
+    exchange(src[i]);
+  }
+  return (int) len;
+}
+
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len) {
+  (void) spi;
+  for (size_t i = 0; i < len; i++) {
+    dst[i] = exchange(src[i]);
+  }
+  return (int) len;
+}
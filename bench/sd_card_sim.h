@@ -0,0 +1,40 @@
+// A test double for the SD card at the far end of the SPI bus. It answers
+// the SPI mode commands drivers/sdcard.c sends, keeps the card's blocks in
+// memory and keeps a simulated clock: every byte clocked takes the time it
+// would at the current baud rate, and the card takes the time configured
+// below to find data and to program it.
+//
+// Like a real card it checks command CRCs and, once CMD59 has turned CRC
+// checking on, data CRCs too.  Blocks can be garbled on the way across
+// the bus to see that the driver notices and sends them again.
+
+#ifndef SD_CARD_SIM_H
+#define SD_CARD_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+  uint32_t blocks;             // card size in 512-byte blocks
+  uint32_t read_latency_us;    // from a read command to its first data token
+  uint32_t stream_gap_us;      // between the blocks of a CMD18
+  uint32_t program_us;         // busy after each block written
+  uint32_t erased_program_us;  // busy after each block of a CMD25 announced with ACMD23
+} sd_card_sim_config_t;
+
+typedef struct {
+  uint32_t commands;      // commands received
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint64_t bytes_clocked; // bytes exchanged with CS low or high
+  uint32_t garbled;       // blocks that had a bit flipped on the way
+  uint32_t crc_rejected;  // commands and blocks refused for a bad CRC
+} sd_card_sim_stats_t;
+
+void sd_card_sim_init(const sd_card_sim_config_t* config);
+uint8_t* sd_card_sim_image(void);
+double sd_card_sim_time_us(void);
+void sd_card_sim_garble_every(uint32_t blocks);
+void sd_card_sim_get_stats(sd_card_sim_stats_t* stats);
+
+#endif // SD_CARD_SIM_H
@@ -14,10 +14,19 @@
 #include <errno.h>
 #include "pico/stdlib.h"
 #include "fat32.h"
+#include "io_service.h"
 
 #define FD_FLAG_MASK 0x4000 // Mask to indicate a file descriptor
 #define MAX_OPEN_FILES 16
 
+// Bytes of buffer given to each open file, a whole number of sectors, 0 for none.
+// Small reads and writes are served from it, reads carrying on from the last
+// fill it ahead, and writes are held there until it fills or moves on, or the
+// file is synced or closed.
+#ifndef CLIB_BUFFER_SIZE
+#define CLIB_BUFFER_SIZE 2048
+#endif
+
 static int initialized = 0;
 static fat32_file_t files[MAX_OPEN_FILES];
 
@@ -63,17 +72,17 @@ static int fat32_error_to_errno(fat32_error_t error)
         return ESPIPE;
     case FAT32_ERROR_INVALID_PARAMETER:
         return EINVAL;
+    case FAT32_ERROR_OUT_OF_MEMORY:
+        return ENOMEM;
     default:
         return EIO; // General I/O error for unknown errors
     }
 }
 
-int _open(const char *filename, int oflag, ...)
+static int open_file(const char *filename, int oflag)
 {
     fat32_error_t result;
 
-    init(); // Ensure files are initialized
-
     for (int i = 0; i < MAX_OPEN_FILES; i++)
     {
         if (files[i].is_open == 0)
@@ -105,8 +114,12 @@ int _open(const char *filename, int oflag, ...)
             if (oflag & O_TRUNC)
             {
                 // If O_TRUNC is set, truncate the file
-                files[i].file_size = 0;
-                files[i].position = 0;
+                if ((result = fat32_truncate(&files[i], 0)) != FAT32_OK)
+                {
+                    fat32_close(&files[i]);
+                    errno = fat32_error_to_errno(result);
+                    return -1;
+                }
             }
             else if (oflag & O_APPEND)
             {
@@ -121,6 +134,23 @@ int _open(const char *filename, int oflag, ...)
     return -1;
 }
 
+int _open(const char *filename, int oflag, ...)
+{
+    init(); // Ensure files are initialized
+
+    io_claim(); // The file system belongs to the I/O service otherwise
+    int fd = open_file(filename, oflag);
+#if CLIB_BUFFER_SIZE > 0
+    void *buffer = fd >= 0 ? malloc(CLIB_BUFFER_SIZE) : NULL;
+    if (buffer)
+    {
+        fat32_set_buffer(&files[fd & ~FD_FLAG_MASK], buffer, CLIB_BUFFER_SIZE); // Unbuffered if there is no memory
+    }
+#endif
+    io_release();
+    return fd;
+}
+
 int _close(int fd)
 {
     fat32_error_t result;
@@ -139,7 +169,12 @@ int _close(int fd)
     }
 
     fat32_file_t *file = &files[fd];
-    if ((result = fat32_close(file)) == FAT32_OK)
+    void *buffer = file->buffer;
+    io_claim();
+    result = fat32_close(file); // Writes out what is buffered
+    io_release();
+    free(buffer);
+    if (result == FAT32_OK)
     {
         file->is_open = 0; // Mark as closed
         return 0;          // Success
@@ -167,21 +202,32 @@ off_t _lseek(int fd, off_t offset, int whence)
     }
 
     fat32_file_t *file = &files[fd];
+    off_t position = file->position;
 
     if (whence == SEEK_SET)
     {
-        file->position = offset;
+        position = offset;
     }
     else if (whence == SEEK_CUR)
     {
-        file->position += offset;
+        position += offset;
     }
     else if (whence == SEEK_END)
     {
-        file->position = file->file_size + offset;
+        position = file->file_size + offset;
     }
 
-    if ((result = fat32_seek(file, offset)) == FAT32_OK)
+    if (position < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The file's buffer stays as it is, seeking back into it costs nothing
+    io_claim();
+    result = fat32_seek(file, position);
+    io_release();
+    if (result == FAT32_OK)
     {
         return file->position; // Success
     }
@@ -216,7 +262,10 @@ int _read(int fd, char *buffer, int length)
 
     fat32_file_t *file = &files[fd];
     size_t bytes_read = 0;
-    if ((result = fat32_read(file, buffer, length, &bytes_read)) != FAT32_OK)
+    io_claim();
+    result = fat32_read(file, buffer, length, &bytes_read);
+    io_release();
+    if (result != FAT32_OK)
     {
         errno = fat32_error_to_errno(result);
         return -1; // Read failed
@@ -262,7 +311,10 @@ int _write(int fd, const char *buffer, int length)
 
     fat32_file_t *file = &files[fd];
     size_t bytes_written = 0;
-    if ((result = fat32_write(file, buffer, length, &bytes_written)) != FAT32_OK)
+    io_claim();
+    result = fat32_write(file, buffer, length, &bytes_written);
+    io_release();
+    if (result != FAT32_OK)
     {
         errno = fat32_error_to_errno(result);
         return -1; // Write failed
@@ -294,7 +346,8 @@ int _fstat(int fd, struct stat *buf)
     }
 
     fat32_file_t *file = &files[fd];
-    buf->st_size = file->file_size;
+    buf->st_size = file->file_size; // Includes anything still buffered
+    buf->st_blksize = CLIB_BUFFER_SIZE > 0 ? CLIB_BUFFER_SIZE : 512;
 
     if (file->attributes & FAT32_ATTR_DIRECTORY)
     {
@@ -318,11 +371,46 @@ int _fstat(int fd, struct stat *buf)
     return 0; // Success
 }
 
+int fsync(int fd)
+{
+    fat32_error_t result;
+
+    if ((fd & FD_FLAG_MASK) == 0)
+    {
+        errno = EBADF; // Invalid file descriptor
+        return -1;
+    }
+
+    fd &= ~FD_FLAG_MASK; // Clear the file descriptor flag
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !files[fd].is_open)
+    {
+        errno = EBADF; // Invalid file descriptor
+        return -1;
+    }
+
+    // Write out the file's buffer and anything else held back
+    io_claim();
+    result = fat32_flush(&files[fd]);
+    io_release();
+    if (result != FAT32_OK)
+    {
+        errno = fat32_error_to_errno(result);
+        return -1;
+    }
+    return 0; // Success
+}
+
 int _stat(const char *path, struct stat *buf)
 {
-    int fd = _open(path, O_RDONLY);
+    init();
+
+    // Only long enough to look at, so without a buffer
+    io_claim();
+    int fd = open_file(path, O_RDONLY);
+    io_release();
     if (fd < 0) {
-        // _open sets errno
+        // open_file sets errno
         return -1;
     }
 
@@ -341,7 +429,10 @@ int _unlink(const char *filename)
 {
     fat32_error_t result;
 
-    if ((result = fat32_delete(filename)) != FAT32_OK)
+    io_claim();
+    result = fat32_delete(filename);
+    io_release();
+    if (result != FAT32_OK)
     {
         errno = fat32_error_to_errno(result);
         return -1; // Deletion failed
@@ -353,7 +444,10 @@ int rename(const char *oldpath, const char *newpath)
 {
     fat32_error_t result;
 
-    if ((result = fat32_rename(oldpath, newpath)) != FAT32_OK)
+    io_claim();
+    result = fat32_rename(oldpath, newpath);
+    io_release();
+    if (result != FAT32_OK)
     {
         errno = fat32_error_to_errno(result);
         return -1; // Rename failed
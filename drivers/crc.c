@@ -0,0 +1,103 @@
+//
+// CRCs for the SD card and FNV-1a, see crc.h.
+//
+
+#include <stdbool.h>
+
+#include "crc.h"
+
+#define CRC7_POLYNOMIAL (0x09 << 1) // x^7 + x^3 + 1, kept in the top seven bits
+#define CRC16_POLYNOMIAL (0x1021)   // x^16 + x^12 + x^5 + 1
+#define CRC16_SLICES (8)
+
+static bool crc_tables_built = false;
+static uint8_t crc7_table[256];
+static uint16_t crc16_table[CRC16_SLICES][256]; // [k][n] is byte n followed by k zero bytes
+
+void crc_init(void)
+{
+    if (crc_tables_built)
+    {
+        return;
+    }
+
+    for (int n = 0; n < 256; n++)
+    {
+        uint8_t crc = n;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x80 ? (crc << 1) ^ CRC7_POLYNOMIAL : crc << 1;
+        }
+        crc7_table[n] = crc;
+
+        crc16_table[0][n] = crc16_bitwise(&(uint8_t){n}, 1);
+    }
+    for (int k = 1; k < CRC16_SLICES; k++)
+    {
+        for (int n = 0; n < 256; n++)
+        {
+            uint16_t crc = crc16_table[k - 1][n];
+            crc16_table[k][n] = (crc << 8) ^ crc16_table[0][crc >> 8];
+        }
+    }
+
+    crc_tables_built = true;
+}
+
+uint8_t crc7(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+    while (len--)
+    {
+        crc = crc7_table[crc ^ *data++];
+    }
+    return crc | 0x01;
+}
+
+uint16_t crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0;
+
+    // The running CRC folds into the first two bytes of each eight
+    while (len >= CRC16_SLICES)
+    {
+        crc = crc16_table[7][data[0] ^ (crc >> 8)] ^
+              crc16_table[6][data[1] ^ (crc & 0xFF)] ^
+              crc16_table[5][data[2]] ^
+              crc16_table[4][data[3]] ^
+              crc16_table[3][data[4]] ^
+              crc16_table[2][data[5]] ^
+              crc16_table[1][data[6]] ^
+              crc16_table[0][data[7]];
+        data += CRC16_SLICES;
+        len -= CRC16_SLICES;
+    }
+    while (len--)
+    {
+        crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data++];
+    }
+    return crc;
+}
+
+uint16_t crc16_bitwise(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0;
+    while (len--)
+    {
+        crc ^= *data++ << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ CRC16_POLYNOMIAL : crc << 1;
+        }
+    }
+    return crc;
+}
+
+uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
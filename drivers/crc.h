@@ -0,0 +1,30 @@
+#pragma once
+
+//
+//  CRCs for the SD card
+//
+//  CRC7 protects commands and CRC16-CCITT protects data blocks.  The CRC16
+//  is worked out eight bytes at a time (slice-by-8) from tables built by
+//  crc_init(); they are not const so they are kept in SRAM rather than
+//  being fetched from flash through the XIP cache.
+//
+//  Also the FNV-1a hash BASIC images are fingerprinted with.
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+void crc_init(void);
+
+// The CRC7 of a command, shifted up and with the end bit set, ready to send
+uint8_t crc7(const uint8_t *data, size_t len);
+
+// CRC16-CCITT (polynomial 0x1021, starting from 0) as sent after a data block
+uint16_t crc16(const uint8_t *data, size_t len);
+
+// The same a bit at a time, for checking and for comparison
+uint16_t crc16_bitwise(const uint8_t *data, size_t len);
+
+// FNV-1a, hash = fnv1a(FNV1A_INIT, data, len), or carried on across calls
+#define FNV1A_INIT (2166136261u)
+uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t len);
@@ -61,8 +61,10 @@ static uint32_t current_dir_cluster = 0; // Current directory cluster
 static uint8_t sector_buffer[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
 static fat32_lfn_entry_t lfn_buffer[MAX_LFN_PART]; // Buffer for long file name entries
 
-// Timer for SD card detection
+// Timer for SD card detection, it only notes that the card went away
+// since the file system may belong to the other core's I/O service
 static repeating_timer_t sd_card_detect_timer;
+static volatile bool sd_card_removed = false;
 
 //
 //  Sector-level access functions
@@ -83,6 +85,101 @@ static inline fat32_error_t write_sector(uint32_t sector, const uint8_t *buffer)
     return sd_write_block(volume_start_block + sector, buffer);
 }
 
+static inline fat32_error_t read_sectors(uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    return sd_read_blocks(volume_start_block + sector, count, buffer);
+}
+
+static inline fat32_error_t write_sectors(uint32_t sector, uint32_t count, const uint8_t *buffer)
+{
+    return sd_write_blocks(volume_start_block + sector, count, buffer);
+}
+
+//
+//  FAT sector cache
+//
+//  FAT sectors are kept in a small write-back cache so that following or
+//  changing a cluster chain touches the card once per FAT sector rather
+//  than once per cluster.  Dirty sectors are written to every copy of the
+//  FAT when they are evicted or on fat32_sync().
+//
+
+typedef struct
+{
+    uint32_t sector;    // Sector number within the FAT
+    uint32_t last_used; // LRU stamp
+    bool valid;
+    bool dirty;
+    uint8_t data[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+} fat_cache_entry_t;
+
+static fat_cache_entry_t fat_cache[FAT32_FAT_CACHE_SECTORS];
+static uint32_t fat_cache_clock = 0;
+static fat32_cache_stats_t fat_cache_stats;
+
+static fat32_error_t fat_cache_write_back(fat_cache_entry_t *entry)
+{
+    if (!entry->valid || !entry->dirty)
+    {
+        return FAT32_OK;
+    }
+
+    for (uint32_t fat = 0; fat < boot_sector.num_fats; fat++)
+    {
+        uint32_t sector = boot_sector.reserved_sectors + fat * boot_sector.fat_size_32 + entry->sector;
+        RETURN_ON_ERROR(write_sector(sector, entry->data));
+    }
+    entry->dirty = false;
+    fat_cache_stats.write_backs++;
+    return FAT32_OK;
+}
+
+static fat32_error_t fat_cache_flush(void)
+{
+    for (int i = 0; i < FAT32_FAT_CACHE_SECTORS; i++)
+    {
+        RETURN_ON_ERROR(fat_cache_write_back(&fat_cache[i]));
+    }
+    return FAT32_OK;
+}
+
+static void fat_cache_invalidate(void)
+{
+    memset(fat_cache, 0, sizeof(fat_cache));
+}
+
+// Get FAT sector fat_sector (counted from the start of the FAT) into the cache
+static fat32_error_t fat_cache_get(uint32_t fat_sector, fat_cache_entry_t **result)
+{
+    fat_cache_entry_t *victim = &fat_cache[0];
+    for (int i = 0; i < FAT32_FAT_CACHE_SECTORS; i++)
+    {
+        fat_cache_entry_t *entry = &fat_cache[i];
+        if (entry->valid && entry->sector == fat_sector)
+        {
+            fat_cache_stats.hits++;
+            entry->last_used = ++fat_cache_clock;
+            *result = entry;
+            return FAT32_OK;
+        }
+        if (!entry->valid || (victim->valid && entry->last_used < victim->last_used))
+        {
+            victim = entry;
+        }
+    }
+
+    fat_cache_stats.misses++;
+    RETURN_ON_ERROR(fat_cache_write_back(victim));
+    victim->valid = false;
+    RETURN_ON_ERROR(read_sector(boot_sector.reserved_sectors + fat_sector, victim->data));
+    victim->valid = true;
+    victim->dirty = false;
+    victim->sector = fat_sector;
+    victim->last_used = ++fat_cache_clock;
+    *result = victim;
+    return FAT32_OK;
+}
+
 //
 // FAT32 file system functions
 //
@@ -172,10 +269,502 @@ static fat32_error_t is_valid_fat32_boot_sector(const fat32_boot_sector_t *bs)
     return FAT32_OK;
 }
 
+//
+//  Deferred metadata
+//
+//  A file's size in its directory entry and the free cluster count in
+//  the FSInfo sector change with almost every write.  Rather than
+//  rewriting those sectors each time, the new values are kept here and
+//  written back by fat32_sync(), which fat32_close() calls, and once
+//  FAT32_SYNC_BYTES have been written or FAT32_SYNC_INTERVAL_MS has passed.
+//  Lookups see the pending sizes as if they were already on the card.
+//
+
+typedef struct
+{
+    uint32_t sector; // Directory entry to update, 0 if unused
+    uint32_t offset;
+    uint32_t size;
+} pending_entry_t;
+
+static pending_entry_t pending_entries[FAT32_PENDING_ENTRIES];
+static bool fsinfo_dirty = false;
+static bool metadata_dirty = false;
+static uint64_t metadata_dirty_since = 0;
+static uint32_t bytes_since_sync = 0;
+
+static void metadata_changed(void)
+{
+    if (!metadata_dirty)
+    {
+        metadata_dirty = true;
+        metadata_dirty_since = time_us_64();
+    }
+}
+
+static void metadata_forget(void)
+{
+    memset(pending_entries, 0, sizeof(pending_entries));
+    fsinfo_dirty = false;
+    metadata_dirty = false;
+    bytes_since_sync = 0;
+}
+
+static fat32_error_t pending_entries_write_back(void)
+{
+    for (int i = 0; i < FAT32_PENDING_ENTRIES; i++)
+    {
+        uint32_t sector = pending_entries[i].sector;
+        if (!sector)
+        {
+            continue;
+        }
+
+        // One read and write for all the entries in this sector
+        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+        for (int j = i; j < FAT32_PENDING_ENTRIES; j++)
+        {
+            pending_entry_t *pending = &pending_entries[j];
+            if (pending->sector == sector)
+            {
+                fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + pending->offset);
+                dir_entry->file_size = pending->size;
+                pending->sector = 0;
+            }
+        }
+        RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t metadata_write_back(void)
+{
+    RETURN_ON_ERROR(pending_entries_write_back());
+    if (fsinfo_dirty)
+    {
+        RETURN_ON_ERROR(write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo));
+        fsinfo_dirty = false;
+    }
+    metadata_dirty = false;
+    bytes_since_sync = 0;
+    return FAT32_OK;
+}
+
+static fat32_error_t pending_entry_set(uint32_t sector, uint32_t offset, uint32_t size)
+{
+    pending_entry_t *slot = NULL;
+    for (int i = 0; i < FAT32_PENDING_ENTRIES; i++)
+    {
+        pending_entry_t *pending = &pending_entries[i];
+        if (pending->sector == sector && pending->offset == offset)
+        {
+            slot = pending;
+            break;
+        }
+        if (!pending->sector && !slot)
+        {
+            slot = pending;
+        }
+    }
+    if (!slot)
+    {
+        // Table full, make room, the FAT first as fat32_sync() does so
+        // no size written covers clusters not yet in the chain
+        RETURN_ON_ERROR(fat_cache_flush());
+        RETURN_ON_ERROR(pending_entries_write_back());
+        slot = &pending_entries[0];
+    }
+
+    slot->sector = sector;
+    slot->offset = offset;
+    slot->size = size;
+    metadata_changed();
+    return FAT32_OK;
+}
+
+// The directory entry is going away, its pending size must not be written over it
+static void pending_entry_drop(uint32_t sector, uint32_t offset)
+{
+    for (int i = 0; i < FAT32_PENDING_ENTRIES; i++)
+    {
+        if (pending_entries[i].sector == sector && pending_entries[i].offset == offset)
+        {
+            pending_entries[i].sector = 0;
+        }
+    }
+}
+
+// The size a directory entry read from the card will have once pending updates are written
+static uint32_t pending_entry_size(uint32_t sector, uint32_t offset, uint32_t size)
+{
+    for (int i = 0; i < FAT32_PENDING_ENTRIES; i++)
+    {
+        if (pending_entries[i].sector == sector && pending_entries[i].offset == offset)
+        {
+            return pending_entries[i].size;
+        }
+    }
+    return size;
+}
+
+//
+//  Path lookup cache
+//
+//  The result of looking up a path, including "not found", is kept
+//  against the path so opening the same file again needs no directory
+//  reads at all.  Anything that adds, removes or renames an entry empties
+//  the cache; file sizes are kept up to date as files are written.
+//  Entries are found by a hash of the path and then compared in full.
+//
+
+static uint32_t name_hash(const char *name, size_t len);
+
+typedef struct
+{
+    uint32_t base_cluster; // Directory the path is relative to
+    uint32_t hash;         // name_hash of path
+    uint32_t last_used;
+    fat32_error_t result;  // FAT32_OK or why the path was not found
+    uint32_t size;
+    uint32_t start_cluster;
+    uint32_t sector; // Where the directory entry is
+    uint32_t offset;
+    uint16_t date;
+    uint16_t time;
+    uint8_t attr;
+    char path[FAT32_MAX_PATH_LEN];
+} path_cache_entry_t;
+
+static path_cache_entry_t path_cache[FAT32_PATH_CACHE_ENTRIES];
+static uint32_t path_cache_clock = 0;
+
+static void path_cache_invalidate(void)
+{
+    for (int i = 0; i < FAT32_PATH_CACHE_ENTRIES; i++)
+    {
+        path_cache[i].path[0] = '\0';
+    }
+}
+
+// Lower case path without leading, trailing or repeated slashes, false if too long
+static bool path_cache_key(const char *path, char *key)
+{
+    size_t len = 0;
+    for (const char *p = path; *p; p++)
+    {
+        if (*p == '/' && (len == 0 || key[len - 1] == '/'))
+        {
+            continue;
+        }
+        if (len + 1 >= FAT32_MAX_PATH_LEN)
+        {
+            return false;
+        }
+        key[len++] = tolower((unsigned char)*p);
+    }
+    if (len > 0 && key[len - 1] == '/')
+    {
+        len--;
+    }
+    key[len] = '\0';
+    return true;
+}
+
+static path_cache_entry_t *path_cache_find(uint32_t base_cluster, const char *key)
+{
+    uint32_t hash = name_hash(key, strlen(key));
+    for (int i = 0; i < FAT32_PATH_CACHE_ENTRIES; i++)
+    {
+        path_cache_entry_t *cached = &path_cache[i];
+        if (cached->path[0] && cached->hash == hash && cached->base_cluster == base_cluster &&
+            strcmp(cached->path, key) == 0)
+        {
+            cached->last_used = ++path_cache_clock;
+            return cached;
+        }
+    }
+    return NULL;
+}
+
+static void path_cache_add(uint32_t base_cluster, const char *key, fat32_error_t result, const fat32_entry_t *entry)
+{
+    path_cache_entry_t *victim = &path_cache[0];
+    for (int i = 1; i < FAT32_PATH_CACHE_ENTRIES && victim->path[0]; i++)
+    {
+        if (!path_cache[i].path[0] || path_cache[i].last_used < victim->last_used)
+        {
+            victim = &path_cache[i];
+        }
+    }
+
+    victim->base_cluster = base_cluster;
+    victim->hash = name_hash(key, strlen(key));
+    victim->last_used = ++path_cache_clock;
+    victim->result = result;
+    victim->size = entry->size;
+    victim->start_cluster = entry->start_cluster;
+    victim->sector = entry->sector;
+    victim->offset = entry->offset;
+    victim->date = entry->date;
+    victim->time = entry->time;
+    victim->attr = entry->attr;
+    strcpy(victim->path, key);
+}
+
+// Names have been added, lookups that found nothing may find them now
+static void path_cache_forget_missing(void)
+{
+    for (int i = 0; i < FAT32_PATH_CACHE_ENTRIES; i++)
+    {
+        if (path_cache[i].result != FAT32_OK)
+        {
+            path_cache[i].path[0] = '\0';
+        }
+    }
+}
+
+// A file has been written, keep any cached size for it right
+static void path_cache_update_size(uint32_t sector, uint32_t offset, uint32_t size)
+{
+    for (int i = 0; i < FAT32_PATH_CACHE_ENTRIES; i++)
+    {
+        path_cache_entry_t *cached = &path_cache[i];
+        if (cached->path[0] && cached->result == FAT32_OK &&
+            cached->sector == sector && cached->offset == offset)
+        {
+            cached->size = size;
+        }
+    }
+}
+
+//
+//  Directory index
+//
+//  The first lookup in a directory scans all of it and remembers where
+//  each name lives under a hash of the name.  Further lookups in that
+//  directory read only the sector holding the entry, and names that are
+//  not there need no reads at all.  Only one directory is indexed at a
+//  time; names created in it are added, any other change drops the index.
+//
+
+#if FAT32_DIR_INDEX_ENTRIES > 0
+typedef struct
+{
+    uint32_t hash;
+    uint32_t cluster; // Cluster holding the first entry for the name, 0 if unused
+    uint16_t slot;    // Entry number within that cluster
+} dir_index_entry_t;
+
+static struct
+{
+    uint32_t cluster; // Directory indexed, 0 if none
+    uint16_t count;
+    bool complete;    // Every name in the directory is in the index
+    dir_index_entry_t entries[FAT32_DIR_INDEX_ENTRIES];
+} dir_index;
+#endif
+
+static void dir_index_invalidate(void)
+{
+#if FAT32_DIR_INDEX_ENTRIES > 0
+    dir_index.cluster = 0;
+#endif
+}
+
+//
+//  Directory slot allocation
+//
+//  A new entry needs a run of free slots for its long name parts and short
+//  entry, and a long name needs a short alias no other entry has.  One pass
+//  over the directory notes where its entries end, the first few gaps left
+//  by deleted entries, and every short name in a small filter.  Further
+//  entries created in that directory go in a gap or after the end and add
+//  their short names to the filter, so they need no reads at all.  Like the
+//  directory index this covers one directory at a time.
+//
+
+#define DIR_ALLOC_GAPS (4)
+
+typedef struct
+{
+    uint32_t cluster; // Cluster holding the run of free slots
+    uint16_t slot;    // First slot of the run within it
+    uint16_t length;
+} dir_gap_t;
+
+static struct
+{
+    uint32_t cluster;     // Directory covered, 0 if none
+    uint32_t end_cluster; // Cluster and slot of the end marker, the slot may
+    uint32_t end_slot;    // be one past the cluster if the directory is full
+    dir_gap_t gaps[DIR_ALLOC_GAPS];
+    uint32_t filter[FAT32_SHORT_NAME_FILTER_BITS / 32]; // Short names taken, two bits each
+} dir_alloc;
+
+static void dir_alloc_invalidate(void)
+{
+    dir_alloc.cluster = 0;
+}
+
+static inline uint32_t short_name_hash(const char *shortname)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++)
+    {
+        hash = (hash ^ (uint8_t)shortname[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void short_name_note(const char *shortname)
+{
+    uint32_t hash = short_name_hash(shortname);
+    uint32_t bit1 = hash % FAT32_SHORT_NAME_FILTER_BITS;
+    uint32_t bit2 = (hash >> 16 | hash << 16) % FAT32_SHORT_NAME_FILTER_BITS;
+    dir_alloc.filter[bit1 / 32] |= 1u << (bit1 % 32);
+    dir_alloc.filter[bit2 / 32] |= 1u << (bit2 % 32);
+}
+
+// False only if no entry has the short name, true may be a false alarm
+static bool short_name_taken(const char *shortname)
+{
+    uint32_t hash = short_name_hash(shortname);
+    uint32_t bit1 = hash % FAT32_SHORT_NAME_FILTER_BITS;
+    uint32_t bit2 = (hash >> 16 | hash << 16) % FAT32_SHORT_NAME_FILTER_BITS;
+    return (dir_alloc.filter[bit1 / 32] >> (bit1 % 32) & 1) && (dir_alloc.filter[bit2 / 32] >> (bit2 % 32) & 1);
+}
+
+// Hash of one character of a name, summed so long name parts can come in any order
+static inline uint32_t name_hash_char(uint32_t pos, char c)
+{
+    uint32_t x = (pos << 8) | (uint8_t)tolower((unsigned char)c);
+    x *= 0x9E3779B1;
+    x ^= x >> 15;
+    x *= 0x85EBCA77;
+    x ^= x >> 13;
+    return x;
+}
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+    uint32_t hash = len * 0x27D4EB2F;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash += name_hash_char(i, name[i]);
+    }
+    return hash;
+}
+
+//
+//  Free cluster map
+//
+//  Built once at mount from a single pass over the FAT and kept up to
+//  date by write_cluster_fat_entry, so finding a free cluster or the free
+//  space never has to search the FAT.  Small cards get a bitmap with a
+//  bit per cluster; for cards with too many clusters for that the map
+//  holds the number of free clusters in each group of FAT sectors, and
+//  only a group known to have a free cluster is searched.
+//
+
+static uint32_t free_map[FAT32_FREE_MAP_BYTES / sizeof(uint32_t)];
+static uint32_t free_map_group;  // FAT sectors per summary entry
+static uint32_t free_map_hint;   // Where to start looking for a free cluster
+static fat32_free_map_stats_t free_map_stats;
+
+#define CLUSTERS_PER_FAT_SECTOR (FAT32_SECTOR_SIZE / 4)
+
+static void free_map_note(uint32_t cluster, bool free)
+{
+    if (cluster >= cluster_count + 2)
+    {
+        return;
+    }
+
+    if (free_map_stats.mode == FAT32_FREE_MAP_BITMAP)
+    {
+        if (free)
+        {
+            free_map[cluster / 32] |= 1u << (cluster % 32);
+        }
+        else
+        {
+            free_map[cluster / 32] &= ~(1u << (cluster % 32));
+        }
+    }
+    else if (free_map_stats.mode == FAT32_FREE_MAP_SUMMARY)
+    {
+        uint16_t *counts = (uint16_t *)free_map;
+        counts[cluster / CLUSTERS_PER_FAT_SECTOR / free_map_group] += free ? 1 : -1;
+    }
+    else
+    {
+        return;
+    }
+    free_map_stats.free_clusters += free ? 1 : -1;
+}
+
+// The FAT is read a run of sectors at a time rather than one command per sector
+static uint8_t free_map_scratch[FAT32_FREE_MAP_READ_SECTORS * FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+
+static fat32_error_t free_map_build(void)
+{
+    uint64_t started = time_us_64();
+    uint32_t fat_sectors = ((cluster_count + 2) * 4 + FAT32_SECTOR_SIZE - 1) / FAT32_SECTOR_SIZE;
+
+    memset(free_map, 0, sizeof(free_map));
+    memset(&free_map_stats, 0, sizeof(free_map_stats));
+    if (cluster_count + 2 <= sizeof(free_map) * 8)
+    {
+        free_map_stats.mode = FAT32_FREE_MAP_BITMAP;
+    }
+    else
+    {
+        uint32_t entries = sizeof(free_map) / sizeof(uint16_t);
+        free_map_group = (fat_sectors + entries - 1) / entries;
+        if (free_map_group * CLUSTERS_PER_FAT_SECTOR > 0xFFFF)
+        {
+            return FAT32_OK; // Too big to summarise, search the FAT instead
+        }
+        free_map_stats.mode = FAT32_FREE_MAP_SUMMARY;
+    }
+
+    for (uint32_t sector = 0; sector < fat_sectors; sector += FAT32_FREE_MAP_READ_SECTORS)
+    {
+        uint32_t count = fat_sectors - sector;
+        if (count > FAT32_FREE_MAP_READ_SECTORS)
+        {
+            count = FAT32_FREE_MAP_READ_SECTORS;
+        }
+        fat32_error_t result = read_sectors(boot_sector.reserved_sectors + sector, count, free_map_scratch);
+        if (result != FAT32_OK)
+        {
+            free_map_stats.mode = FAT32_FREE_MAP_NONE;
+            return result;
+        }
+        for (uint32_t i = 0; i < count * CLUSTERS_PER_FAT_SECTOR; i++)
+        {
+            uint32_t cluster = sector * CLUSTERS_PER_FAT_SECTOR + i;
+            uint32_t entry = ((uint32_t *)free_map_scratch)[i] & 0x0FFFFFFF;
+            if (cluster >= 2 && cluster < cluster_count + 2 && entry == FAT32_FAT_ENTRY_FREE)
+            {
+                free_map_note(cluster, true);
+            }
+        }
+    }
+
+    free_map_stats.build_sectors = fat_sectors;
+    free_map_stats.build_us = time_us_64() - started;
+    free_map_hint = fsinfo.next_free >= 2 && fsinfo.next_free < cluster_count + 2 ? fsinfo.next_free : 2;
+    fsinfo.free_count = free_map_stats.free_clusters; // Now known to be right
+    return FAT32_OK;
+}
+
 static fat32_error_t update_fsinfo()
 {
-    // Write the updated FSInfo sector back to disk
-    return write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo);
+    // The FSInfo sector is written back with the rest of the metadata
+    fsinfo_dirty = true;
+    metadata_changed();
+    return FAT32_OK;
 }
 
 static fat32_error_t read_cluster_fat_entry(uint32_t cluster, uint32_t *value)
@@ -187,13 +776,13 @@ static fat32_error_t read_cluster_fat_entry(uint32_t cluster, uint32_t *value)
     }
 
     uint32_t fat_offset = cluster * 4; // 4 bytes per entry in FAT32
-    uint32_t fat_sector = boot_sector.reserved_sectors + (fat_offset / FAT32_SECTOR_SIZE);
     uint32_t entry_offset = fat_offset % FAT32_SECTOR_SIZE;
 
     // Read the FAT sector
-    RETURN_ON_ERROR(read_sector(fat_sector, sector_buffer));
+    fat_cache_entry_t *fat_sector;
+    RETURN_ON_ERROR(fat_cache_get(fat_offset / FAT32_SECTOR_SIZE, &fat_sector));
 
-    uint32_t entry = *(uint32_t *)(sector_buffer + entry_offset);
+    uint32_t entry = *(uint32_t *)(fat_sector->data + entry_offset);
     *value = entry & 0x0FFFFFFF; // Mask out upper 4 bits for FAT32
     return FAT32_OK;
 }
@@ -207,24 +796,96 @@ static fat32_error_t write_cluster_fat_entry(uint32_t cluster, uint32_t value)
     }
 
     uint32_t fat_offset = cluster * 4; // 4 bytes per entry in FAT32
-    uint32_t fat_sector = boot_sector.reserved_sectors + (fat_offset / FAT32_SECTOR_SIZE);
     uint32_t entry_offset = fat_offset % FAT32_SECTOR_SIZE;
 
     // Read the FAT sector
-    RETURN_ON_ERROR(read_sector(fat_sector, sector_buffer));
+    fat_cache_entry_t *fat_sector;
+    RETURN_ON_ERROR(fat_cache_get(fat_offset / FAT32_SECTOR_SIZE, &fat_sector));
 
-    // Write the FAT entry
-    *(uint32_t *)(sector_buffer + entry_offset) &= 0xF0000000;
-    *(uint32_t *)(sector_buffer + entry_offset) |= value & 0x0FFFFFFF;
+    // Keep the free cluster map in step
+    uint32_t old_value = *(uint32_t *)(fat_sector->data + entry_offset) & 0x0FFFFFFF;
+    if ((old_value == FAT32_FAT_ENTRY_FREE) != ((value & 0x0FFFFFFF) == FAT32_FAT_ENTRY_FREE))
+    {
+        free_map_note(cluster, old_value != FAT32_FAT_ENTRY_FREE);
+    }
 
-    // Write the modified sector back
-    RETURN_ON_ERROR(write_sector(fat_sector, sector_buffer));
+    // Write the FAT entry, the sector goes back to the card later
+    *(uint32_t *)(fat_sector->data + entry_offset) &= 0xF0000000;
+    *(uint32_t *)(fat_sector->data + entry_offset) |= value & 0x0FFFFFFF;
+    fat_sector->dirty = true;
 
     return FAT32_OK;
 }
 
+// First free cluster from first up to (not including) last
+static fat32_error_t free_map_search(uint32_t first, uint32_t last, uint32_t *cluster)
+{
+    if (free_map_stats.mode == FAT32_FREE_MAP_BITMAP)
+    {
+        for (uint32_t i = first; i < last; i++)
+        {
+            uint32_t word = free_map[i / 32] >> (i % 32);
+            if (word == 0)
+            {
+                i |= 31; // Nothing free in the rest of this word
+                continue;
+            }
+            i += __builtin_ctz(word);
+            if (i < last)
+            {
+                *cluster = i;
+                return FAT32_OK;
+            }
+        }
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    // Only look in the FAT where the summary says there is something free
+    const uint16_t *counts = (const uint16_t *)free_map;
+    uint32_t group_clusters = free_map_group * CLUSTERS_PER_FAT_SECTOR;
+    for (uint32_t i = first; i < last;)
+    {
+        if (counts[i / group_clusters] == 0)
+        {
+            i = (i / group_clusters + 1) * group_clusters;
+            continue;
+        }
+        uint32_t value;
+        RETURN_ON_ERROR(read_cluster_fat_entry(i, &value));
+        if (value == FAT32_FAT_ENTRY_FREE)
+        {
+            *cluster = i;
+            return FAT32_OK;
+        }
+        i++;
+    }
+    return FAT32_ERROR_DISK_FULL;
+}
+
 static fat32_error_t get_next_free_cluster(uint32_t *cluster)
 {
+    if (free_map_stats.mode != FAT32_FREE_MAP_NONE)
+    {
+        if (free_map_stats.free_clusters == 0)
+        {
+            return FAT32_ERROR_DISK_FULL;
+        }
+
+        uint64_t started = time_us_64();
+        fat32_error_t result = free_map_search(free_map_hint, cluster_count + 2, cluster);
+        if (result == FAT32_ERROR_DISK_FULL)
+        {
+            result = free_map_search(2, free_map_hint, cluster); // Wrap around
+        }
+        if (result == FAT32_OK)
+        {
+            free_map_hint = *cluster + 1;
+        }
+        free_map_stats.searches++;
+        free_map_stats.search_us += time_us_64() - started;
+        return result;
+    }
+
     // Start searching from next free or first data cluster
     uint32_t start_cluster = fsinfo.next_free != 0xFFFFFFFF ? fsinfo.next_free : 2;
 
@@ -243,6 +904,107 @@ static fat32_error_t get_next_free_cluster(uint32_t *cluster)
     return FAT32_ERROR_DISK_FULL; // No free clusters found
 }
 
+static fat32_error_t cluster_is_free(uint32_t cluster, bool *free)
+{
+    if (cluster < 2 || cluster >= cluster_count + 2)
+    {
+        *free = false;
+        return FAT32_OK;
+    }
+    if (free_map_stats.mode == FAT32_FREE_MAP_BITMAP)
+    {
+        *free = (free_map[cluster / 32] >> (cluster % 32)) & 1;
+        return FAT32_OK;
+    }
+    uint32_t value;
+    RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &value));
+    *free = value == FAT32_FAT_ENTRY_FREE;
+    return FAT32_OK;
+}
+
+// Best fit: the shortest run of free clusters at least want long, or
+// failing that the longest there is.  With only the summary map to go on,
+// just runs of entirely free groups of FAT sectors are seen.
+static bool free_run_find(uint32_t want, uint32_t *start, uint32_t *length)
+{
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    uint32_t end = cluster_count + 2;
+
+    uint32_t unit;
+    if (free_map_stats.mode == FAT32_FREE_MAP_BITMAP)
+    {
+        unit = 1;
+    }
+    else if (free_map_stats.mode == FAT32_FREE_MAP_SUMMARY)
+    {
+        unit = free_map_group * CLUSTERS_PER_FAT_SECTOR;
+    }
+    else
+    {
+        return false;
+    }
+
+    for (uint32_t cluster = 2; cluster <= end;)
+    {
+        uint32_t step = unit;
+        bool free = false;
+        if (cluster < end)
+        {
+            if (unit == 1)
+            {
+                uint32_t word = free_map[cluster / 32];
+                if (cluster % 32 == 0 && (word == 0 || word == 0xFFFFFFFF) && cluster + 32 <= end)
+                {
+                    step = 32; // A whole word the same
+                }
+                free = (word >> (cluster % 32)) & 1;
+            }
+            else
+            {
+                const uint16_t *counts = (const uint16_t *)free_map;
+                free = counts[cluster / unit] == unit;
+                step = unit - cluster % unit;
+            }
+        }
+
+        if (free)
+        {
+            if (run_length == 0)
+            {
+                run_start = cluster;
+            }
+            run_length += step;
+        }
+        else if (run_length > 0)
+        {
+            bool fits = run_length >= want;
+            bool best_fits = best_length >= want;
+            if ((fits && (!best_fits || run_length < best_length)) || (!best_fits && run_length > best_length))
+            {
+                best_start = run_start;
+                best_length = run_length;
+            }
+            run_length = 0;
+        }
+        cluster += step;
+        if (cluster > end)
+        {
+            break;
+        }
+    }
+
+    if (best_length == 0)
+    {
+        return false;
+    }
+    *start = best_start;
+    *length = best_length < end - best_start ? best_length : end - best_start;
+    return true;
+}
+
 static fat32_error_t release_cluster_chain(uint32_t start_cluster)
 {
     uint32_t total_clusters = 0;
@@ -273,36 +1035,232 @@ static fat32_error_t release_cluster_chain(uint32_t start_cluster)
     {
         fsinfo.next_free = lowest_cluster; // Update next free cluster if needed
     }
-    // Write the updated FSInfo sector back to disk
-    RETURN_ON_ERROR(write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo));
+    return update_fsinfo();
+}
+
+static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *new_cluster)
+{
+    RETURN_ON_ERROR(get_next_free_cluster(new_cluster));
+    RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, *new_cluster));
+    RETURN_ON_ERROR(write_cluster_fat_entry(*new_cluster, FAT32_FAT_ENTRY_EOC));
+
+    if (fsinfo.free_count != 0xFFFFFFFF)
+    {
+        fsinfo.free_count--; // Decrease free count
+        update_fsinfo();     // Update FSInfo sector
+    }
+
+    return FAT32_OK;
+}
+
+// Allocate up to want clusters in one contiguous run, carrying on from the
+// cluster after, if any, when that is free and otherwise from the best fit
+// for the whole request.  The run is chained on to after and ended.
+static fat32_error_t allocate_run(uint32_t after, uint32_t want, uint32_t *first, uint32_t *length)
+{
+    bool free = false;
+    if (after >= 2)
+    {
+        RETURN_ON_ERROR(cluster_is_free(after + 1, &free));
+    }
+
+    if (free)
+    {
+        *first = after + 1;
+    }
+    else if (want == 1 || !free_run_find(want, first, length))
+    {
+        RETURN_ON_ERROR(get_next_free_cluster(first));
+    }
+
+    // See how far the run goes
+    *length = 1;
+    while (*length < want)
+    {
+        RETURN_ON_ERROR(cluster_is_free(*first + *length, &free));
+        if (!free)
+        {
+            break;
+        }
+        (*length)++;
+    }
+
+    uint32_t last = *first + *length - 1;
+    for (uint32_t cluster = *first; cluster < last; cluster++)
+    {
+        RETURN_ON_ERROR(write_cluster_fat_entry(cluster, cluster + 1));
+    }
+    RETURN_ON_ERROR(write_cluster_fat_entry(last, FAT32_FAT_ENTRY_EOC));
+    if (after >= 2)
+    {
+        RETURN_ON_ERROR(write_cluster_fat_entry(after, *first));
+    }
+    free_map_hint = last + 1;
+
+    if (fsinfo.free_count != 0xFFFFFFFF)
+    {
+        fsinfo.free_count -= *length;
+        update_fsinfo();
+    }
+    return FAT32_OK;
+}
+
+//
+//  File cluster maps
+//
+//  Each open file remembers its cluster chain as a few extents (runs of
+//  contiguous clusters) plus its last cluster.  Finding the cluster for a
+//  file position is then a lookup rather than a walk of the chain from
+//  its start, and appending does not walk the chain at all.  The map is
+//  built as the chain is followed and grows as clusters are added.
+//
+
+static void file_forget_chain(fat32_file_t *file)
+{
+    file->current_cluster = file->start_cluster;
+    file->current_index = 0;
+    file->tail_cluster = 0;
+    file->cluster_total = 0;
+    file->mapped_clusters = 0;
+    file->extent_count = 0;
+}
+
+// Note that cluster is the file's index'th, extents only grow at the end
+static void file_map_cluster(fat32_file_t *file, uint32_t index, uint32_t cluster)
+{
+    if (index != file->mapped_clusters)
+    {
+        return;
+    }
+
+    fat32_extent_t *last = file->extent_count > 0 ? &file->extents[file->extent_count - 1] : NULL;
+    if (last && last->cluster + last->count == cluster)
+    {
+        last->count++;
+    }
+    else if (file->extent_count < FAT32_FILE_EXTENTS)
+    {
+        fat32_extent_t *extent = &file->extents[file->extent_count++];
+        extent->file_cluster = index;
+        extent->cluster = cluster;
+        extent->count = 1;
+    }
+    else
+    {
+        return; // Too fragmented to map any further
+    }
+    file->mapped_clusters++;
+}
+
+// Find the file's index'th cluster, FAT32_ERROR_INVALID_POSITION if the
+// chain is shorter than that
+static fat32_error_t file_cluster(fat32_file_t *file, uint32_t index, uint32_t *result)
+{
+    if (file->start_cluster < 2 || (file->cluster_total != 0 && index >= file->cluster_total))
+    {
+        return FAT32_ERROR_INVALID_POSITION;
+    }
+
+    if (file->current_cluster >= 2 && file->current_index == index)
+    {
+        *result = file->current_cluster;
+        return FAT32_OK;
+    }
+
+    if (file->mapped_clusters == 0)
+    {
+        file_map_cluster(file, 0, file->start_cluster);
+    }
+
+    uint32_t cluster;
+    uint32_t at;
+    if (index < file->mapped_clusters)
+    {
+        int i = file->extent_count - 1;
+        while (file->extents[i].file_cluster > index)
+        {
+            i--;
+        }
+        cluster = file->extents[i].cluster + (index - file->extents[i].file_cluster);
+        at = index;
+    }
+    else if (file->current_cluster >= 2 && file->current_index < index &&
+             file->current_index >= file->mapped_clusters)
+    {
+        cluster = file->current_cluster; // Carry on from where we are
+        at = file->current_index;
+    }
+    else
+    {
+        const fat32_extent_t *last = &file->extents[file->extent_count - 1];
+        cluster = last->cluster + last->count - 1;
+        at = file->mapped_clusters - 1;
+    }
+
+    // Follow the chain for whatever is not mapped
+    while (at < index)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+        {
+            file->tail_cluster = cluster;
+            file->cluster_total = at + 1;
+            return FAT32_ERROR_INVALID_POSITION;
+        }
+        cluster = next_cluster;
+        at++;
+        file_map_cluster(file, at, cluster);
+    }
 
+    file->current_cluster = cluster;
+    file->current_index = index;
+    *result = cluster;
     return FAT32_OK;
 }
 
-static fat32_error_t find_last_cluster(uint32_t start_cluster, uint32_t count, uint32_t *last_cluster)
+// Note a run of clusters just chained on to the end of the file
+static void file_add_run(fat32_file_t *file, uint32_t first, uint32_t length)
 {
-    *last_cluster = start_cluster;
-    for (uint32_t i = 1; i < count; i++)
+    for (uint32_t i = 0; i < length; i++)
     {
-        uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(*last_cluster, &next_cluster));
-        *last_cluster = next_cluster;
+        file_map_cluster(file, file->cluster_total + i, first + i);
     }
-    return FAT32_OK;
+    file->tail_cluster = first + length - 1;
+    file->cluster_total += length;
 }
 
-static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *new_cluster)
+// Make sure the file has at least count clusters
+static fat32_error_t file_grow(fat32_file_t *file, uint32_t count)
 {
-    RETURN_ON_ERROR(get_next_free_cluster(new_cluster));
-    RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, *new_cluster));
-    RETURN_ON_ERROR(write_cluster_fat_entry(*new_cluster, FAT32_FAT_ENTRY_EOC));
+    uint32_t first;
+    uint32_t length;
 
-    if (fsinfo.free_count != 0xFFFFFFFF)
+    if (file->start_cluster < 2)
     {
-        fsinfo.free_count--; // Decrease free count
-        update_fsinfo();     // Update FSInfo sector
+        // First clusters for empty file
+        RETURN_ON_ERROR(allocate_run(0, count > 0 ? count : 1, &first, &length));
+        file->start_cluster = first;
+        file_forget_chain(file);
+        file_add_run(file, first, length);
     }
 
+    if (file->cluster_total == 0)
+    {
+        // Walk to the end of the chain to find its last cluster
+        uint32_t cluster;
+        fat32_error_t result = file_cluster(file, 0xFFFFFFFF, &cluster);
+        if (result != FAT32_ERROR_INVALID_POSITION)
+        {
+            return result;
+        }
+    }
+
+    while (file->cluster_total < count)
+    {
+        RETURN_ON_ERROR(allocate_run(file->tail_cluster, count - file->cluster_total, &first, &length));
+        file_add_run(file, first, length);
+    }
     return FAT32_OK;
 }
 
@@ -409,7 +1367,7 @@ fat32_error_t fat32_mount(void)
     // Calculate important sectors/clusters
     bytes_per_cluster = boot_sector.sectors_per_cluster * FAT32_SECTOR_SIZE;
     first_data_sector = boot_sector.reserved_sectors + (boot_sector.num_fats * boot_sector.fat_size_32);
-    data_region_sectors = boot_sector.total_sectors_32 - (boot_sector.num_fats * boot_sector.fat_size_32);
+    data_region_sectors = boot_sector.total_sectors_32 - first_data_sector;
     cluster_count = data_region_sectors / boot_sector.sectors_per_cluster;
     if (cluster_count < 65525)
     {
@@ -417,6 +1375,8 @@ fat32_error_t fat32_mount(void)
     }
 
     current_dir_cluster = boot_sector.root_cluster; // Start at root directory
+    fat_cache_invalidate();
+    metadata_forget();
 
     // Cache the FSInfo sector
     RETURN_ON_ERROR(read_sector(boot_sector.fat32_info, sector_buffer));
@@ -429,12 +1389,27 @@ fat32_error_t fat32_mount(void)
         return FAT32_ERROR_INVALID_FORMAT; // FSInfo is not valid
     }
 
+    RETURN_ON_ERROR(free_map_build());
+
     fat32_mounted = true;
     return FAT32_OK;
 }
 
-void fat32_unmount(void)
+// With write_back false whatever has not reached the card is thrown away,
+// for when the card in the slot may not be the one it was meant for
+static void unmount(bool write_back)
 {
+    if (fat32_mounted && write_back)
+    {
+        fat32_sync();
+    }
+    fat_cache_invalidate();
+    metadata_forget();
+    path_cache_invalidate();
+    dir_index_invalidate();
+    dir_alloc_invalidate();
+    free_map_stats.mode = FAT32_FREE_MAP_NONE;
+
     fat32_mounted = false;
     mount_status = FAT32_ERROR_NO_CARD;
     volume_start_block = 0;
@@ -445,6 +1420,12 @@ void fat32_unmount(void)
     current_dir_cluster = 0;
 }
 
+void fat32_unmount(void)
+{
+    // Write back what we can, the card may already be gone
+    unmount(sd_card_present());
+}
+
 bool fat32_is_mounted(void)
 {
     return fat32_mounted;
@@ -452,6 +1433,17 @@ bool fat32_is_mounted(void)
 
 bool fat32_is_ready(void)
 {
+    if (sd_card_removed)
+    {
+        sd_card_removed = false;
+        if (fat32_mounted)
+        {
+            // The card may have been changed since, writing back now
+            // would put the old card's FAT and sizes on the new one
+            unmount(false);
+        }
+    }
+
     if (sd_card_present())
     {
         if (!fat32_mounted)
@@ -486,6 +1478,12 @@ fat32_error_t fat32_get_free_space(uint64_t *free_space)
         return mount_status;
     }
 
+    if (free_map_stats.mode != FAT32_FREE_MAP_NONE)
+    {
+        *free_space = ((uint64_t)free_map_stats.free_clusters) * bytes_per_cluster;
+        return FAT32_OK;
+    }
+
     if (fsinfo.free_count != 0xFFFFFFFF &&
         fsinfo.free_count <= cluster_count)
     {
@@ -494,6 +1492,7 @@ fat32_error_t fat32_get_free_space(uint64_t *free_space)
     }
 
     // If FSInfo is not valid, we will count free clusters manually
+    RETURN_ON_ERROR(fat_cache_flush());
     uint64_t free_clusters = 0;
     for (uint32_t sector = 0; sector < boot_sector.fat_size_32; sector++)
     {
@@ -753,27 +1752,12 @@ static uint8_t filename_to_lfn(const char *filename)
     return part_count; // Return number of LFN parts created
 }
 
-static bool shortname_exists(const char *shortname, fat32_file_t *dir)
-{
-    fat32_file_t scan = *dir;
-    fat32_entry_t entry;
-    scan.position = 0;
-    while (fat32_dir_read(&scan, &entry) == FAT32_OK && entry.filename[0])
-    {
-        char entry83[12];
-        filename_to_shortname(entry.filename, entry83);
-        if (memcmp(entry83, shortname, 11) == 0)
-        {
-            return true;
-        }
-    }
-    return false;
-}
+static fat32_error_t short_name_in_dir(uint32_t cluster, const char *shortname, bool *found);
 
-static fat32_error_t unique_shortname(fat32_file_t *dir, const char *longname, char *shortname)
+static fat32_error_t unique_shortname(uint32_t dir_cluster, const char *longname, char *shortname)
 {
     // Generates a unique FAT 8.3 short name for a given long filename in a directory
-    // dir: open directory to check for collisions
+    // dir_cluster: directory the slot allocator covers, checked against its filter
     // longname: input long filename (UTF-8, ASCII only here)
     // shortname: output buffer, must be at least 12 bytes (11 chars + null terminator)
 
@@ -857,7 +1841,7 @@ static fat32_error_t unique_shortname(fat32_file_t *dir, const char *longname, c
     candidate[11] = '\0';
 
     // Check if numeric tail is needed
-    bool need_tail = lossy || name_len > 8 || ext_len > 3 || shortname_exists(candidate, dir);
+    bool need_tail = lossy || name_len > 8 || ext_len > 3 || short_name_taken(candidate);
 
     if (!need_tail)
     {
@@ -865,64 +1849,545 @@ static fat32_error_t unique_shortname(fat32_file_t *dir, const char *longname, c
         return FAT32_OK;
     }
 
-    // Numeric tail generation: try ~1 to ~999999
-    for (int n = 1; n < 1000000; n++)
+    // Numeric tail generation: ~1 to ~4 as they are, then like Windows two
+    // characters of the name and four hex digits of a hash of the long name
+    // so that many similar names do not have to try tail after tail
+    uint32_t hash = name_hash(longname, len);
+    hash = (hash ^ (hash >> 16)) & 0xFFFF;
+    size_t base_len = strlen(base);
+    for (uint32_t n = 1; n < 4 + 9 * 0x10000; n++)
     {
         char tail[8];
-        snprintf(tail, sizeof(tail), "~%d", n);
+        size_t prefix_len;
+        if (n <= 4)
+        {
+            snprintf(tail, sizeof(tail), "~%lu", (unsigned long)n);
+            prefix_len = base_len < 6 ? base_len : 6;
+        }
+        else
+        {
+            uint32_t attempt = n - 5;
+            snprintf(tail, sizeof(tail), "%04lX~%lu", (unsigned long)((hash + attempt / 9) & 0xFFFF),
+                     (unsigned long)(attempt % 9 + 1));
+            prefix_len = base_len < 2 ? base_len : 2;
+        }
         size_t tail_len = strlen(tail);
 
-        size_t base_len = 8 - tail_len;
-        if (base_len > strlen(base))
-            base_len = strlen(base);
+        memset(candidate, ' ', 11);
+        memcpy(candidate, base, prefix_len);
+        memcpy(candidate + prefix_len, tail, tail_len);
+        memcpy(candidate + 8, ext, strlen(ext));
+        candidate[11] = '\0';
+
+        // Once the first few hashed names have all seemed to be taken the
+        // filter may be too full to go on, so ask the directory itself
+        bool taken = short_name_taken(candidate);
+        if (taken && n > 4 + 9)
+        {
+            RETURN_ON_ERROR(short_name_in_dir(dir_cluster, candidate, &taken));
+        }
+        if (!taken)
+        {
+            memcpy(shortname, candidate, 12);
+            return FAT32_OK;
+        }
+    }
+
+    // If we get here, we failed to generate a unique name
+    return FAT32_ERROR_DISK_FULL;
+}
+
+static uint8_t shortname_checksum(const char *shortname)
+{
+    // Calculate checksum for 8.3 filename
+    uint8_t sum = 0;
+    for (uint8_t i = 11; i > 0; i--)
+    {
+        // NOTE: The operation is an unsigned char rotate right
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (uint8_t)*shortname++;
+    }
+    return sum;
+}
+
+static void lfn_to_str(fat32_lfn_entry_t *lfn_entry, char *buffer)
+{
+    // Convert UTF-16 parts to UTF-8
+    *(buffer++) = utf16_to_utf8(lfn_entry->name1[0]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name1[1]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name1[2]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name1[3]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name1[4]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[0]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[1]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[2]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[3]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[4]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name2[5]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name3[0]);
+    *(buffer++) = utf16_to_utf8(lfn_entry->name3[1]);
+}
+
+//
+//  Directory scanning
+//
+//  Lookups read each directory sector once and match entries straight
+//  from the sector buffer.  A long name is ruled out by its length as soon
+//  as its last part is seen and compared part by part as the rest arrive,
+//  so names are never assembled just to be thrown away.
+//
+
+typedef struct
+{
+    const char *name;      // Name to look for, NULL when only building the index
+    size_t name_len;
+    bool single;           // Stop after the first short entry
+    bool build;            // Add every name seen to the directory index
+    bool found;
+    fat32_entry_t *entry;  // Filled in when found
+} dir_scan_t;
+
+static inline uint16_t lfn_char(const fat32_lfn_entry_t *lfn, int index)
+{
+    if (index < 5)
+    {
+        return lfn->name1[index];
+    }
+    if (index < 11)
+    {
+        return lfn->name2[index - 5];
+    }
+    return lfn->name3[index - 11];
+}
+
+// Length of the long name whose last part this is
+static size_t lfn_length(const fat32_lfn_entry_t *lfn)
+{
+    size_t offset = ((lfn->seq & 0x3F) - 1) * FAT32_DIR_LFN_PART_SIZE;
+    for (int i = 0; i < FAT32_DIR_LFN_PART_SIZE; i++)
+    {
+        if (lfn_char(lfn, i) == 0)
+        {
+            return offset + i;
+        }
+    }
+    return offset + FAT32_DIR_LFN_PART_SIZE;
+}
+
+static bool lfn_part_matches(const fat32_lfn_entry_t *lfn, const char *name, size_t len)
+{
+    size_t offset = ((lfn->seq & 0x3F) - 1) * FAT32_DIR_LFN_PART_SIZE;
+    for (int i = 0; i < FAT32_DIR_LFN_PART_SIZE && offset + i < len; i++)
+    {
+        if (tolower((unsigned char)utf16_to_utf8(lfn_char(lfn, i))) != tolower((unsigned char)name[offset + i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t lfn_part_hash(const fat32_lfn_entry_t *lfn, size_t len)
+{
+    size_t offset = ((lfn->seq & 0x3F) - 1) * FAT32_DIR_LFN_PART_SIZE;
+    uint32_t hash = 0;
+    for (int i = 0; i < FAT32_DIR_LFN_PART_SIZE && offset + i < len; i++)
+    {
+        hash += name_hash_char(offset + i, utf16_to_utf8(lfn_char(lfn, i)));
+    }
+    return hash;
+}
+
+#if FAT32_DIR_INDEX_ENTRIES > 0
+static void dir_index_add(uint32_t hash, uint32_t cluster, uint32_t slot)
+{
+    // Keep the table no more than three quarters full
+    if (dir_index.count >= FAT32_DIR_INDEX_ENTRIES / 4 * 3)
+    {
+        dir_index.complete = false;
+        return;
+    }
+
+    uint32_t i = hash % FAT32_DIR_INDEX_ENTRIES;
+    while (dir_index.entries[i].cluster)
+    {
+        i = (i + 1) % FAT32_DIR_INDEX_ENTRIES;
+    }
+    dir_index.entries[i].hash = hash;
+    dir_index.entries[i].cluster = cluster;
+    dir_index.entries[i].slot = slot;
+    dir_index.count++;
+}
+#endif
+
+// Scan a directory from entry slot of cluster onwards
+static fat32_error_t dir_scan(uint32_t cluster, uint32_t slot, dir_scan_t *scan)
+{
+    const uint32_t entries_per_sector = FAT32_SECTOR_SIZE / FAT32_DIR_ENTRY_SIZE;
+    const uint32_t entries_per_cluster = bytes_per_cluster / FAT32_DIR_ENTRY_SIZE;
+
+    // The long name being collected, if any
+    uint8_t lfn_next = 0; // Sequence number of the part expected next
+    bool lfn_done = false;
+    bool lfn_match = false;
+    uint8_t lfn_checksum = 0;
+    size_t lfn_len = 0;
+    uint32_t lfn_hash = 0;
+    uint32_t lfn_cluster = 0;
+    uint32_t lfn_slot = 0;
+
+    while (true)
+    {
+        uint32_t sector = cluster_to_sector(cluster) + slot / entries_per_sector;
+        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+        fat_cache_stats.dir_sectors++;
+
+        do
+        {
+            const fat32_dir_entry_t *entry = (const fat32_dir_entry_t *)(sector_buffer + (slot % entries_per_sector) * FAT32_DIR_ENTRY_SIZE);
+
+            if (entry->shortname[0] == FAT32_DIR_ENTRY_END_MARKER)
+            {
+                return FAT32_OK;
+            }
+            else if (entry->attr == FAT32_ATTR_LONG_NAME)
+            {
+                const fat32_lfn_entry_t *lfn = (const fat32_lfn_entry_t *)entry;
+                uint8_t seq = lfn->seq & 0x3F;
+                if (lfn->seq & 0x40)
+                {
+                    // Last part of the name comes first, it tells us the length
+                    lfn_len = lfn_length(lfn);
+                    lfn_checksum = lfn->checksum;
+                    lfn_match = scan->name && lfn_len == scan->name_len;
+                    lfn_hash = lfn_len * 0x27D4EB2F;
+                    lfn_cluster = cluster;
+                    lfn_slot = slot;
+                    lfn_next = seq;
+                    lfn_done = false;
+                }
+                if (seq == lfn_next && seq > 0 && lfn->checksum == lfn_checksum)
+                {
+                    lfn_match = lfn_match && lfn_part_matches(lfn, scan->name, lfn_len);
+                    if (scan->build)
+                    {
+                        lfn_hash += lfn_part_hash(lfn, lfn_len);
+                    }
+                    lfn_next--;
+                    lfn_done = lfn_next == 0;
+                }
+                else
+                {
+                    lfn_next = 0;
+                    lfn_done = false;
+                }
+            }
+            else if (entry->shortname[0] != FAT32_DIR_ENTRY_FREE)
+            {
+                bool has_lfn = lfn_done && shortname_checksum(entry->shortname) == lfn_checksum;
+                bool match = false;
+                char filename[13];
+                uint32_t hash = lfn_hash;
+
+                if (has_lfn)
+                {
+                    match = lfn_match;
+                }
+                else
+                {
+                    lfn_cluster = cluster;
+                    lfn_slot = slot;
+                    if (scan->build || (scan->name && tolower(entry->shortname[0]) == tolower((unsigned char)scan->name[0])))
+                    {
+                        shortname_to_filename(entry->shortname, filename);
+                        match = scan->name && strcasecmp(filename, scan->name) == 0;
+                        hash = name_hash(filename, strlen(filename));
+                    }
+                }
+
+#if FAT32_DIR_INDEX_ENTRIES > 0
+                if (scan->build)
+                {
+                    dir_index_add(hash, lfn_cluster, lfn_slot);
+                }
+#endif
+
+                if (match && !scan->found)
+                {
+                    fat32_entry_t *dir_entry = scan->entry;
+                    strncpy(dir_entry->filename, has_lfn ? scan->name : filename, FAT32_MAX_FILENAME_LEN);
+                    dir_entry->filename[FAT32_MAX_FILENAME_LEN] = '\0';
+                    dir_entry->attr = entry->attr;
+                    dir_entry->start_cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
+                    dir_entry->date = entry->wrt_date;
+                    dir_entry->time = entry->wrt_time;
+                    dir_entry->sector = sector;
+                    dir_entry->offset = (slot % entries_per_sector) * FAT32_DIR_ENTRY_SIZE;
+                    dir_entry->size = pending_entry_size(sector, dir_entry->offset, entry->file_size);
+                    scan->found = true;
+                    if (!scan->build)
+                    {
+                        return FAT32_OK;
+                    }
+                }
+                if (scan->single)
+                {
+                    return FAT32_OK;
+                }
+                lfn_next = 0;
+                lfn_done = false;
+            }
+            else
+            {
+                lfn_next = 0;
+                lfn_done = false;
+            }
+
+            slot++;
+        } while (slot % entries_per_sector != 0);
+
+        if (slot == entries_per_cluster)
+        {
+            uint32_t next_cluster;
+            RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+            if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+            {
+                return FAT32_OK;
+            }
+            cluster = next_cluster;
+            slot = 0;
+        }
+    }
+}
+
+// Find name in the directory starting at cluster, indexing the directory if asked
+static fat32_error_t dir_find(uint32_t cluster, const char *name, fat32_entry_t *dir_entry, bool index)
+{
+    dir_scan_t scan = {0};
+    scan.name = name;
+    scan.name_len = strlen(name);
+    scan.entry = dir_entry;
+
+#if FAT32_DIR_INDEX_ENTRIES > 0
+    if (dir_index.cluster == cluster && dir_index.complete)
+    {
+        uint32_t hash = name_hash(name, scan.name_len);
+        scan.single = true;
+        for (uint32_t i = hash % FAT32_DIR_INDEX_ENTRIES; dir_index.entries[i].cluster; i = (i + 1) % FAT32_DIR_INDEX_ENTRIES)
+        {
+            const dir_index_entry_t *indexed = &dir_index.entries[i];
+            if (indexed->hash == hash)
+            {
+                RETURN_ON_ERROR(dir_scan(indexed->cluster, indexed->slot, &scan));
+                if (scan.found)
+                {
+                    return FAT32_OK;
+                }
+            }
+        }
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+
+    // Index this directory while looking, unless it is already known to be too big
+    if (index && dir_index.cluster != cluster)
+    {
+        memset(&dir_index, 0, sizeof(dir_index));
+        dir_index.cluster = cluster;
+        dir_index.complete = true;
+        scan.build = true;
+    }
+    fat32_error_t result = dir_scan(cluster, 0, &scan);
+    if (result != FAT32_OK)
+    {
+        dir_index_invalidate();
+        return result;
+    }
+#else
+    RETURN_ON_ERROR(dir_scan(cluster, 0, &scan));
+#endif
+
+    return scan.found ? FAT32_OK : FAT32_ERROR_FILE_NOT_FOUND;
+}
+
+// Note a run of free slots for the slot allocator, keeping the longest few
+static void dir_alloc_gap(uint32_t cluster, uint32_t slot, uint32_t length)
+{
+    if (length < 2)
+    {
+        return; // Too short for any long name
+    }
+
+    dir_gap_t *shortest = &dir_alloc.gaps[0];
+    for (int i = 1; i < DIR_ALLOC_GAPS; i++)
+    {
+        if (dir_alloc.gaps[i].length < shortest->length)
+        {
+            shortest = &dir_alloc.gaps[i];
+        }
+    }
+    if (length > shortest->length)
+    {
+        shortest->cluster = cluster;
+        shortest->slot = slot;
+        shortest->length = length;
+    }
+}
+
+// Make the slot allocator cover the directory starting at cluster
+static fat32_error_t dir_alloc_scan(uint32_t cluster)
+{
+    const uint32_t entries_per_sector = FAT32_SECTOR_SIZE / FAT32_DIR_ENTRY_SIZE;
+    const uint32_t entries_per_cluster = bytes_per_cluster / FAT32_DIR_ENTRY_SIZE;
+
+    if (dir_alloc.cluster == cluster)
+    {
+        return FAT32_OK;
+    }
+    memset(&dir_alloc, 0, sizeof(dir_alloc));
+
+    uint32_t start_cluster = cluster;
+    uint32_t slot = 0;
+    uint32_t run = 0; // Free slots just seen
+    while (true)
+    {
+        RETURN_ON_ERROR(read_sector(cluster_to_sector(cluster) + slot / entries_per_sector, sector_buffer));
+        fat_cache_stats.dir_sectors++;
+
+        do
+        {
+            const fat32_dir_entry_t *entry = (const fat32_dir_entry_t *)(sector_buffer + (slot % entries_per_sector) * FAT32_DIR_ENTRY_SIZE);
+            if (entry->shortname[0] == FAT32_DIR_ENTRY_END_MARKER)
+            {
+                dir_alloc_gap(cluster, slot - run, run);
+                dir_alloc.end_cluster = cluster;
+                dir_alloc.end_slot = slot;
+                dir_alloc.cluster = start_cluster;
+                return FAT32_OK;
+            }
+
+            if (entry->shortname[0] == FAT32_DIR_ENTRY_FREE)
+            {
+                run++;
+            }
+            else
+            {
+                dir_alloc_gap(cluster, slot - run, run);
+                run = 0;
+                if (entry->attr != FAT32_ATTR_LONG_NAME)
+                {
+                    short_name_note(entry->shortname);
+                }
+            }
+            slot++;
+        } while (slot % entries_per_sector != 0);
+
+        if (slot == entries_per_cluster)
+        {
+            // Gaps are kept within a cluster
+            dir_alloc_gap(cluster, slot - run, run);
+            run = 0;
+
+            uint32_t next_cluster;
+            RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+            if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+            {
+                // Full, with no end marker
+                dir_alloc.end_cluster = cluster;
+                dir_alloc.end_slot = slot;
+                dir_alloc.cluster = start_cluster;
+                return FAT32_OK;
+            }
+            cluster = next_cluster;
+            slot = 0;
+        }
+    }
+}
 
-        memset(candidate, ' ', 11);
-        memcpy(candidate, base, base_len);
-        memcpy(candidate + base_len, tail, tail_len);
-        memcpy(candidate + 8, ext, strlen(ext));
-        candidate[11] = '\0';
+// Whether an entry in the directory starting at cluster has the short name,
+// for when the filter is no help
+static fat32_error_t short_name_in_dir(uint32_t cluster, const char *shortname, bool *found)
+{
+    *found = false;
+    while (true)
+    {
+        uint32_t sector = cluster_to_sector(cluster);
+        for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++)
+        {
+            RETURN_ON_ERROR(read_sector(sector + i, sector_buffer));
+            fat_cache_stats.dir_sectors++;
+            for (uint32_t offset = 0; offset < FAT32_SECTOR_SIZE; offset += FAT32_DIR_ENTRY_SIZE)
+            {
+                const fat32_dir_entry_t *entry = (const fat32_dir_entry_t *)(sector_buffer + offset);
+                if (entry->shortname[0] == FAT32_DIR_ENTRY_END_MARKER)
+                {
+                    return FAT32_OK;
+                }
+                if (entry->shortname[0] != FAT32_DIR_ENTRY_FREE && entry->attr != FAT32_ATTR_LONG_NAME &&
+                    memcmp(entry->shortname, shortname, 11) == 0)
+                {
+                    *found = true;
+                    return FAT32_OK;
+                }
+            }
+        }
 
-        if (!shortname_exists(candidate, dir))
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
         {
-            memcpy(shortname, candidate, 12);
             return FAT32_OK;
         }
+        cluster = next_cluster;
     }
-
-    // If we get here, we failed to generate a unique name
-    return FAT32_ERROR_DISK_FULL;
 }
 
-static uint8_t shortname_checksum(const char *shortname)
+// Take count free slots in the directory the slot allocator covers, from a
+// gap if one is big enough or else from the end, growing the directory if
+// need be.  The slot returned is within the cluster returned.
+static fat32_error_t dir_alloc_take(uint32_t count, uint32_t *cluster, uint32_t *slot)
 {
-    // Calculate checksum for 8.3 filename
-    uint8_t sum = 0;
-    for (uint8_t i = 11; i > 0; i--)
+    const uint32_t entries_per_cluster = bytes_per_cluster / FAT32_DIR_ENTRY_SIZE;
+
+    for (int i = 0; i < DIR_ALLOC_GAPS; i++)
     {
-        // NOTE: The operation is an unsigned char rotate right
-        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + (uint8_t)*shortname++;
+        dir_gap_t *gap = &dir_alloc.gaps[i];
+        if (gap->length >= count)
+        {
+            *cluster = gap->cluster;
+            *slot = gap->slot;
+            gap->slot += count;
+            gap->length -= count;
+            return FAT32_OK;
+        }
     }
-    return sum;
-}
 
-static void lfn_to_str(fat32_lfn_entry_t *lfn_entry, char *buffer)
-{
-    // Convert UTF-16 parts to UTF-8
-    *(buffer++) = utf16_to_utf8(lfn_entry->name1[0]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name1[1]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name1[2]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name1[3]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name1[4]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[0]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[1]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[2]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[3]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[4]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name2[5]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name3[0]);
-    *(buffer++) = utf16_to_utf8(lfn_entry->name3[1]);
+    *cluster = dir_alloc.end_cluster;
+    *slot = dir_alloc.end_slot;
+    uint32_t at = *cluster;
+    uint32_t end = *slot + count; // Slots used from the start of cluster at
+    while (end > entries_per_cluster)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(at, &next_cluster));
+        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+        {
+            RETURN_ON_ERROR(allocate_and_link_cluster(at, &next_cluster));
+            RETURN_ON_ERROR(clear_cluster(next_cluster));
+        }
+        at = next_cluster;
+        end -= entries_per_cluster;
+        if (*slot >= entries_per_cluster)
+        {
+            *cluster = at;
+            *slot -= entries_per_cluster;
+        }
+    }
+    dir_alloc.end_cluster = at;
+    dir_alloc.end_slot = end;
+    return FAT32_OK;
 }
 
+static fat32_error_t lookup_entry(fat32_entry_t *dir_entry, const char *path, uint32_t cluster);
+
 static fat32_error_t find_entry(fat32_entry_t *dir_entry, const char *path)
 {
     if (!dir_entry || !path)
@@ -958,6 +2423,44 @@ static fat32_error_t find_entry(fat32_entry_t *dir_entry, const char *path)
         cluster = boot_sector.root_cluster;
     }
 
+    char key[FAT32_MAX_PATH_LEN];
+    bool cacheable = path_cache_key(path, key);
+    if (cacheable)
+    {
+        path_cache_entry_t *cached = path_cache_find(cluster, key);
+        if (cached)
+        {
+            fat_cache_stats.path_hits++;
+            if (cached->result == FAT32_OK)
+            {
+                const char *name = strrchr(key, '/');
+                strncpy(dir_entry->filename, name ? name + 1 : key, FAT32_MAX_FILENAME_LEN);
+                dir_entry->filename[FAT32_MAX_FILENAME_LEN] = '\0';
+                dir_entry->size = cached->size;
+                dir_entry->start_cluster = cached->start_cluster;
+                dir_entry->sector = cached->sector;
+                dir_entry->offset = cached->offset;
+                dir_entry->date = cached->date;
+                dir_entry->time = cached->time;
+                dir_entry->attr = cached->attr;
+            }
+            return cached->result;
+        }
+    }
+
+    fat_cache_stats.path_misses++;
+    fat32_error_t result = lookup_entry(dir_entry, path, cluster);
+    if (cacheable && (result == FAT32_OK || result == FAT32_ERROR_FILE_NOT_FOUND ||
+                      result == FAT32_ERROR_DIR_NOT_FOUND))
+    {
+        path_cache_add(cluster, key, result, dir_entry);
+    }
+    return result;
+}
+
+// Look path up by reading each directory along it, starting from cluster
+static fat32_error_t lookup_entry(fat32_entry_t *dir_entry, const char *path, uint32_t cluster)
+{
     // Copy path and tokenize
     char path_copy[FAT32_MAX_PATH_LEN];
     strncpy(path_copy, path + (path[0] == '/' ? 1 : 0), sizeof(path_copy) - 1);
@@ -967,45 +2470,74 @@ static fat32_error_t find_entry(fat32_entry_t *dir_entry, const char *path)
     char *token = strtok_r(path_copy, "/", &saveptr);
     char *next_token = NULL;
 
+    // Directories on the way are looked for in the path cache first
+    uint32_t base_cluster = cluster;
+    char prefix[FAT32_MAX_PATH_LEN];
+    size_t prefix_len = 0;
+
     while (token)
     {
         next_token = strtok_r(NULL, "/", &saveptr);
 
-        // Open the current directory cluster
-        fat32_file_t dir = {0};
-        dir.is_open = true;
-        dir.attributes = FAT32_ATTR_DIRECTORY;
-        dir.start_cluster = cluster;
-        dir.current_cluster = cluster;
-        dir.position = 0;
-
-        bool found = false;
         fat32_entry_t entry;
-        while (fat32_dir_read(&dir, &entry) == FAT32_OK && entry.filename[0])
+        fat32_error_t result;
+        if (!next_token)
         {
-            if (strcasecmp(entry.filename, token) == 0)
+            // Last component, this is the entry
+            result = dir_find(cluster, token, &entry, true);
+            if (result == FAT32_OK)
             {
-                // If this is the last component, return the entry
-                if (!next_token)
-                {
-                    memcpy(dir_entry, &entry, sizeof(fat32_entry_t));
-                    fat32_close(&dir);
-                    return FAT32_OK;
-                }
-                // If not last, must be a directory
-                if (entry.attr & FAT32_ATTR_DIRECTORY)
-                {
-                    cluster = entry.start_cluster ? entry.start_cluster : boot_sector.root_cluster;
-                    found = true;
-                    break;
-                }
+                memcpy(dir_entry, &entry, sizeof(fat32_entry_t));
             }
+            return result;
         }
-        fat32_close(&dir);
-        if (!found && next_token)
+
+        size_t token_len = strlen(token);
+        bool cacheable = prefix_len + token_len + 1 < sizeof(prefix);
+        path_cache_entry_t *cached = NULL;
+        if (cacheable)
+        {
+            if (prefix_len > 0)
+            {
+                prefix[prefix_len++] = '/';
+            }
+            for (size_t i = 0; i <= token_len; i++)
+            {
+                prefix[prefix_len + i] = tolower((unsigned char)token[i]);
+            }
+            prefix_len += token_len;
+            cached = path_cache_find(base_cluster, prefix);
+        }
+        else
+        {
+            prefix_len = sizeof(prefix); // Too long from here on
+        }
+
+        if (cached)
+        {
+            result = cached->result;
+            entry.attr = cached->attr;
+            entry.start_cluster = cached->start_cluster;
+        }
+        else
+        {
+            result = dir_find(cluster, token, &entry, false);
+            if (result != FAT32_OK && result != FAT32_ERROR_FILE_NOT_FOUND)
+            {
+                return result;
+            }
+            if (cacheable)
+            {
+                path_cache_add(base_cluster, prefix, result, &entry);
+            }
+        }
+
+        // Not the last component, it must be a directory
+        if (result != FAT32_OK || !(entry.attr & FAT32_ATTR_DIRECTORY))
         {
             return FAT32_ERROR_DIR_NOT_FOUND; // Intermediate directory not found
         }
+        cluster = entry.start_cluster ? entry.start_cluster : boot_sector.root_cluster;
         token = next_token;
     }
 
@@ -1048,12 +2580,32 @@ static fat32_error_t unlink_entry(fat32_entry_t *entry)
     // Mark 8.3 entry as deleted
     fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + offset);
     dir_entry->shortname[0] = FAT32_DIR_ENTRY_FREE;
+    pending_entry_drop(sector, offset);
 
     RETURN_ON_ERROR(write_sector(sector, sector_buffer));
 
     return FAT32_OK;
 }
 
+// Sector and byte within it of the directory entry offset bytes on from the start of cluster
+static fat32_error_t dir_entry_location(uint32_t cluster, uint32_t offset, uint32_t *sector, uint32_t *byte)
+{
+    while (offset >= bytes_per_cluster)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+        {
+            return FAT32_ERROR_DISK_FULL;
+        }
+        cluster = next_cluster;
+        offset -= bytes_per_cluster;
+    }
+    *sector = cluster_to_sector(cluster) + offset / FAT32_SECTOR_SIZE;
+    *byte = offset % FAT32_SECTOR_SIZE;
+    return FAT32_OK;
+}
+
 static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
 {
     if (!entry || !path)
@@ -1102,78 +2654,29 @@ static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
     // We always use long files names to preserve case and special characters
     char shortname[12];
     size_t needed_entries = filename_to_lfn(filename);
+    uint32_t dir_cluster = dir.start_cluster;
+    CLOSE_AND_RETURN_ON_ERROR(dir_alloc_scan(dir_cluster));
 
-    if (valid_shortname(filename))
+    bool have_shortname = valid_shortname(filename);
+    if (have_shortname)
     {
         filename_to_shortname(filename, shortname);
+        have_shortname = !short_name_taken(shortname);
     }
-    else
+    if (!have_shortname)
     {
-        CLOSE_AND_RETURN_ON_ERROR(unique_shortname(&dir, filename, shortname));
+        CLOSE_AND_RETURN_ON_ERROR(unique_shortname(dir_cluster, filename, shortname));
     }
 
     // Find enough free directory entries (LFN + 8.3)
-    uint32_t free_entry_pos = 0;
-    uint32_t free_entry_cluster = dir.current_cluster;
-    size_t free_count = 0;
-    bool found = false;
-    dir.position = 0;
-    uint32_t entry_pos = 0;
-    uint32_t cluster = dir.current_cluster;
-    while (!found)
-    {
-        uint32_t cluster_offset = entry_pos % bytes_per_cluster;
-        uint32_t sector_in_cluster = cluster_offset / FAT32_SECTOR_SIZE;
-        uint32_t sector = cluster_to_sector(cluster) + sector_in_cluster;
-
-        CLOSE_AND_RETURN_ON_ERROR(read_sector(sector, sector_buffer));
-
-        for (uint32_t i = 0; i < FAT32_SECTOR_SIZE; i += 32)
-        {
-            fat32_dir_entry_t *entry_ptr = (fat32_dir_entry_t *)(sector_buffer + i);
-            if (entry_ptr->shortname[0] == FAT32_DIR_ENTRY_FREE || entry_ptr->shortname[0] == FAT32_DIR_ENTRY_END_MARKER)
-            {
-                if (free_count == 0)
-                {
-                    free_entry_pos = entry_pos + i;
-                    free_entry_cluster = cluster;
-                }
-                free_count++;
-                if (free_count > needed_entries)
-                {
-                    found = true;
-                    break;
-                }
-            }
-            else
-            {
-                free_count = 0;
-            }
-        }
-        if (found)
-        {
-            break;
-        }
+    uint32_t free_entry_cluster;
+    uint32_t free_entry_slot;
+    CLOSE_AND_RETURN_ON_ERROR(dir_alloc_take(needed_entries + 1, &free_entry_cluster, &free_entry_slot));
+    uint32_t free_entry_pos = free_entry_slot * FAT32_DIR_ENTRY_SIZE;
 
-        entry_pos += FAT32_SECTOR_SIZE;
-        if ((entry_pos % bytes_per_cluster) == 0)
-        {
-            uint32_t next_cluster;
-            result = read_cluster_fat_entry(cluster, &next_cluster);
-            if (result != FAT32_OK || next_cluster >= FAT32_FAT_ENTRY_EOC)
-            {
-                // Allocate a new cluster for the directory
-                uint32_t new_dir_cluster = 0;
-                CLOSE_AND_RETURN_ON_ERROR(allocate_and_link_cluster(cluster, &new_dir_cluster));
-                CLOSE_AND_RETURN_ON_ERROR(clear_cluster(new_dir_cluster));
-                cluster = new_dir_cluster;
-            }
-            else
-            {
-                cluster = next_cluster;
-            }
-        }
-    }
+    // The directory may have grown into a new cluster, the card's FAT has
+    // to hold it before entries are written into it
+    CLOSE_AND_RETURN_ON_ERROR(fat_cache_flush());
 
     // Update the directory entry with the new cluster
     uint8_t checksum = shortname_checksum(shortname);
@@ -1183,28 +2686,11 @@ static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
     {
         uint8_t index = needed_entries - i - 1;
 
-        // Calculate position for this LFN entry
-        uint32_t entry_offset = free_entry_pos + (i * 32);
-        uint32_t entry_cluster_offset = entry_offset % bytes_per_cluster;
-        uint32_t entry_sector_in_cluster = entry_cluster_offset / FAT32_SECTOR_SIZE;
-        uint32_t entry_byte_in_sector = entry_cluster_offset % FAT32_SECTOR_SIZE;
-        uint32_t current_cluster = free_entry_cluster;
-
-        // Check if we need to move to next cluster
-        while (entry_sector_in_cluster >= boot_sector.sectors_per_cluster)
-        {
-            uint32_t next_cluster;
-            result = read_cluster_fat_entry(current_cluster, &next_cluster);
-            if (result != FAT32_OK || next_cluster >= FAT32_FAT_ENTRY_EOC)
-            {
-                fat32_close(&dir);
-                return FAT32_ERROR_DISK_FULL;
-            }
-            current_cluster = next_cluster;
-            entry_sector_in_cluster -= boot_sector.sectors_per_cluster;
-        }
-
-        uint32_t entry_sector = cluster_to_sector(current_cluster) + entry_sector_in_cluster;
+        // Calculate position for this LFN entry, the run may go on into the next cluster
+        uint32_t entry_sector;
+        uint32_t entry_byte_in_sector;
+        CLOSE_AND_RETURN_ON_ERROR(dir_entry_location(free_entry_cluster, free_entry_pos % bytes_per_cluster + (i * 32),
+                                                     &entry_sector, &entry_byte_in_sector));
 
         // Read the sector if needed
         CLOSE_AND_RETURN_ON_ERROR(read_sector(entry_sector, sector_buffer));
@@ -1237,6 +2723,10 @@ static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
         }
     }
 
+    // FAT before directory: an entry must never reach the card pointing at
+    // a cluster the card's FAT still has free
+    CLOSE_AND_RETURN_ON_ERROR(fat_cache_flush());
+
     // Write 8.3 entry
     fat32_dir_entry_t dir_entry = {0};
     memcpy(dir_entry.shortname, shortname, 11);
@@ -1252,77 +2742,265 @@ static fat32_error_t link_entry(fat32_entry_t *entry, const char *path)
     dir_entry.fst_clus_lo = entry->start_cluster & 0xFFFF;
     dir_entry.file_size = entry->size;
 
-    uint32_t raw_offset = free_entry_pos + (needed_entries * 32);
-    entry->sector = cluster_to_sector(free_entry_cluster) + ((raw_offset % bytes_per_cluster) / FAT32_SECTOR_SIZE);
-    entry->offset = (raw_offset % FAT32_SECTOR_SIZE);
+    CLOSE_AND_RETURN_ON_ERROR(dir_entry_location(free_entry_cluster, free_entry_pos % bytes_per_cluster + (needed_entries * 32),
+                                                 &entry->sector, &entry->offset));
     CLOSE_AND_RETURN_ON_ERROR(read_sector(entry->sector, sector_buffer));
     memcpy(sector_buffer + entry->offset, &dir_entry, sizeof(dir_entry));
     CLOSE_AND_RETURN_ON_ERROR(write_sector(entry->sector, sector_buffer));
 
+    // Keep the slot allocator and directory index up to date with the new name
+    short_name_note(shortname);
+#if FAT32_DIR_INDEX_ENTRIES > 0
+    if (dir_index.cluster == dir_cluster && dir_index.complete)
+    {
+        dir_index_add(name_hash(filename, strlen(filename)), free_entry_cluster, free_entry_slot);
+    }
+#endif
+
     fat32_close(&dir);
 
     return FAT32_OK; // Successfully linked the entry
 }
 
-static fat32_error_t new_entry(fat32_file_t *file, const char *path, uint8_t attr)
+static fat32_error_t new_entry(fat32_file_t *file, const char *path, uint8_t attr)
+{
+    if (!file || !path)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    memset(file, 0, sizeof(fat32_file_t));
+
+    fat32_entry_t entry;
+    memset(&entry, 0, sizeof(fat32_entry_t));
+    entry.attr = attr;
+
+    fat32_error_t result = link_entry(&entry, path);
+    if (result == FAT32_OK)
+    {
+        // The directory index and slot allocator have the new name, and
+        // opening it straight after needs no directory reads
+        path_cache_forget_missing();
+        char key[FAT32_MAX_PATH_LEN];
+        if (path_cache_key(path, key))
+        {
+            path_cache_add(path[0] == '/' ? boot_sector.root_cluster : current_dir_cluster, key, FAT32_OK, &entry);
+        }
+    }
+    else
+    {
+        path_cache_invalidate();
+        dir_index_invalidate();
+        dir_alloc_invalidate();
+    }
+    RETURN_ON_ERROR(result);
+
+    file->is_open = true;
+    file->start_cluster = entry.start_cluster;
+    file->current_cluster = file->start_cluster;
+    file->attributes = entry.attr;
+    file->dir_entry_sector = entry.sector;
+    file->dir_entry_offset = entry.offset;
+
+    return FAT32_OK; // Successfully created new file
+}
+
+static fat32_error_t delete_entry(const char *path)
+{
+    fat32_entry_t entry;
+    RETURN_ON_ERROR(find_entry(&entry, path));
+
+    if (entry.attr & FAT32_ATTR_DIRECTORY)
+    {
+        // Check if directory is empty (only "." and ".." allowed)
+        fat32_file_t dir;
+        RETURN_ON_ERROR(fat32_open(&dir, path));
+
+        fat32_entry_t sub_entry;
+        int entry_count = 0;
+        while (fat32_dir_read(&dir, &sub_entry) == FAT32_OK && sub_entry.filename[0])
+        {
+            if (strcmp(sub_entry.filename, ".") != 0 && strcmp(sub_entry.filename, "..") != 0)
+            {
+                fat32_close(&dir);
+                return FAT32_ERROR_DIR_NOT_EMPTY;
+            }
+            entry_count++;
+        }
+        fat32_close(&dir);
+    }
+
+    // Unlink the entry
+    fat32_error_t result = unlink_entry(&entry);
+    path_cache_invalidate();
+    dir_index_invalidate();
+    dir_alloc_invalidate();
+    RETURN_ON_ERROR(result);
+
+    // Free the clusters used by the entry
+    RETURN_ON_ERROR(release_cluster_chain(entry.start_cluster));
+
+    return FAT32_OK;
+}
+
+//
+//  Handle buffers
+//
+//  A handle given a buffer of its own with fat32_set_buffer() keeps the
+//  sectors it last used there rather than in the shared sector buffer, so
+//  small reads and writes cost a memcpy until they move on to another
+//  sector, whatever other files are used in between.  A read carrying on
+//  from where the last one ended fills the whole buffer in one transfer, as
+//  far as the clusters run on and the file goes.  Changed sectors are kept
+//  until the buffer moves on or the handle is flushed or closed.  Other
+//  handles on the same file do not see them until then, nor does a handle
+//  see changes made through others to sectors it holds.
+//
+
+// Sectors on from the one holding position, up to wanted, that follow one
+// another on the card.  The handle's idea of its current cluster is left
+// as it was.
+static fat32_error_t contiguous_sectors(fat32_file_t *file, uint32_t position, uint32_t wanted, uint32_t *count)
+{
+    uint32_t current_cluster = file->current_cluster;
+    uint32_t current_index = file->current_index;
+
+    uint32_t index = position / bytes_per_cluster;
+    uint32_t last_cluster;
+    fat32_error_t result = file_cluster(file, index, &last_cluster);
+    *count = boot_sector.sectors_per_cluster - (position % bytes_per_cluster) / FAT32_SECTOR_SIZE;
+    while (result == FAT32_OK && *count < wanted)
+    {
+        uint32_t next_cluster;
+        result = file_cluster(file, ++index, &next_cluster);
+        if (result != FAT32_OK || next_cluster != last_cluster + 1)
+        {
+            break;
+        }
+        last_cluster = next_cluster;
+        *count += boot_sector.sectors_per_cluster;
+    }
+    if (*count > wanted)
+    {
+        *count = wanted;
+    }
+
+    file->current_cluster = current_cluster;
+    file->current_index = current_index;
+    return result == FAT32_ERROR_INVALID_POSITION ? FAT32_OK : result;
+}
+
+static fat32_error_t file_buffer_write_back(fat32_file_t *file)
+{
+    if (file->buffer_dirty_end > file->buffer_dirty_start)
+    {
+        uint32_t first = file->buffer_dirty_start;
+        RETURN_ON_ERROR(write_sectors(file->buffer_sector + first, file->buffer_dirty_end - first,
+                                      file->buffer + first * FAT32_SECTOR_SIZE));
+        file->buffer_dirty_start = file->buffer_dirty_end = 0;
+        file->stats.write_backs++;
+    }
+    return FAT32_OK;
+}
+
+// Before the card is read or written directly at size bytes from position,
+// write back what the buffer has changed there and, for a write, forget
+// what it holds
+static fat32_error_t file_buffer_bypass(fat32_file_t *file, uint32_t position, uint32_t size, bool write)
 {
-    if (!file || !path)
+    uint32_t end = file->buffer_offset + file->buffer_count * FAT32_SECTOR_SIZE;
+    if (file->buffer_count > 0 && position < end && file->buffer_offset < position + size)
     {
-        return FAT32_ERROR_INVALID_PARAMETER;
+        RETURN_ON_ERROR(file_buffer_write_back(file));
+        if (write)
+        {
+            file->buffer_count = 0;
+        }
     }
-
-    memset(file, 0, sizeof(fat32_file_t));
-
-    fat32_entry_t entry;
-    memset(&entry, 0, sizeof(fat32_entry_t));
-    entry.attr = attr;
-
-    RETURN_ON_ERROR(link_entry(&entry, path));
-
-    file->is_open = true;
-    file->start_cluster = entry.start_cluster;
-    file->current_cluster = file->start_cluster;
-    file->attributes = entry.attr;
-    file->dir_entry_sector = entry.sector;
-    file->dir_entry_offset = entry.offset;
-
-    return FAT32_OK; // Successfully created new file
+    return FAT32_OK;
 }
 
-static fat32_error_t delete_entry(const char *path)
+// Point data at the buffered copy of the sector holding position, which is
+// on the card at sector.  On a miss the buffer is refilled: with ahead set
+// as far on as it can hold, and with fill clear the sectors are past the
+// end of the file so they are cleared rather than read, and a sector that
+// carries straight on from those held is added to them if there is room.
+static fat32_error_t file_buffer_get(fat32_file_t *file, uint32_t position, uint32_t sector, bool ahead, bool fill,
+                                     uint8_t **data)
 {
-    fat32_entry_t entry;
-    RETURN_ON_ERROR(find_entry(&entry, path));
+    uint32_t offset = position - position % FAT32_SECTOR_SIZE;
+    if (file->buffer_count > 0 && offset >= file->buffer_offset &&
+        offset < file->buffer_offset + file->buffer_count * FAT32_SECTOR_SIZE)
+    {
+        file->stats.hits++;
+        *data = file->buffer + (offset - file->buffer_offset);
+        return FAT32_OK;
+    }
 
-    if (entry.attr & FAT32_ATTR_DIRECTORY)
+    file->stats.misses++;
+    if (!fill && file->buffer_count > 0 && file->buffer_count < file->buffer_sectors &&
+        offset == file->buffer_offset + file->buffer_count * FAT32_SECTOR_SIZE &&
+        sector == file->buffer_sector + file->buffer_count)
     {
-        // Check if directory is empty (only "." and ".." allowed)
-        fat32_file_t dir;
-        RETURN_ON_ERROR(fat32_open(&dir, path));
+        // Appending on to the sectors held, and next to them on the card
+        *data = file->buffer + file->buffer_count * FAT32_SECTOR_SIZE;
+        memset(*data, 0, FAT32_SECTOR_SIZE);
+        file->buffer_count++;
+        return FAT32_OK;
+    }
+    RETURN_ON_ERROR(file_buffer_write_back(file));
+    file->buffer_count = 0;
 
-        fat32_entry_t sub_entry;
-        int entry_count = 0;
-        while (fat32_dir_read(&dir, &sub_entry) == FAT32_OK && sub_entry.filename[0])
+    uint32_t count = 1;
+    if (ahead)
+    {
+        uint32_t wanted = file->buffer_sectors;
+        if (fill)
         {
-            if (strcmp(sub_entry.filename, ".") != 0 && strcmp(sub_entry.filename, "..") != 0)
+            uint32_t left = (file->file_size - offset + FAT32_SECTOR_SIZE - 1) / FAT32_SECTOR_SIZE;
+            if (left < wanted)
             {
-                fat32_close(&dir);
-                return FAT32_ERROR_DIR_NOT_EMPTY;
+                wanted = left;
             }
-            entry_count++;
         }
-        fat32_close(&dir);
+        RETURN_ON_ERROR(contiguous_sectors(file, position, wanted, &count));
     }
 
-    // Unlink the entry
-    RETURN_ON_ERROR(unlink_entry(&entry));
-
-    // Free the clusters used by the entry
-    RETURN_ON_ERROR(release_cluster_chain(entry.start_cluster));
-
+    if (fill)
+    {
+        RETURN_ON_ERROR(read_sectors(sector, count, file->buffer));
+        file->stats.read_ahead += count - 1;
+    }
+    else
+    {
+        memset(file->buffer, 0, count * FAT32_SECTOR_SIZE);
+    }
+    file->buffer_offset = offset;
+    file->buffer_sector = sector;
+    file->buffer_count = count;
+    *data = file->buffer;
     return FAT32_OK;
 }
 
+// Note that the buffered sector holding position has been changed
+static void file_buffer_changed(fat32_file_t *file, uint32_t position)
+{
+    uint32_t index = (position - file->buffer_offset) / FAT32_SECTOR_SIZE;
+    if (file->buffer_dirty_end == file->buffer_dirty_start)
+    {
+        file->buffer_dirty_start = index;
+        file->buffer_dirty_end = index + 1;
+    }
+    else if (index < file->buffer_dirty_start)
+    {
+        file->buffer_dirty_start = index;
+    }
+    else if (index >= file->buffer_dirty_end)
+    {
+        file->buffer_dirty_end = index + 1;
+    }
+}
+
 //
 // File operations (simplified implementation)
 //
@@ -1381,14 +3059,90 @@ fat32_error_t fat32_create(fat32_file_t *file, const char *path)
 
 fat32_error_t fat32_close(fat32_file_t *file)
 {
+    fat32_error_t status = FAT32_OK;
     if (file && file->is_open)
     {
+        status = fat32_flush(file);
         memset(file, 0, sizeof(fat32_file_t));
     }
 
+    return status;
+}
+
+// Give the handle a buffer of its own, a whole number of sectors, or take
+// it away with a NULL buffer.  It lasts until the handle is closed.
+fat32_error_t fat32_set_buffer(fat32_file_t *file, void *buffer, size_t size)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->attributes & FAT32_ATTR_DIRECTORY)
+    {
+        return FAT32_ERROR_NOT_A_FILE;
+    }
+
+    if (file->buffer && fat32_mounted)
+    {
+        RETURN_ON_ERROR(file_buffer_write_back(file));
+    }
+
+    file->buffer_sectors = buffer ? size / FAT32_SECTOR_SIZE : 0;
+    file->buffer = file->buffer_sectors > 0 ? (uint8_t *)buffer : NULL;
+    file->buffer_count = 0;
+    file->buffer_dirty_start = file->buffer_dirty_end = 0;
     return FAT32_OK;
 }
 
+// Write out what the handle's buffer has changed, then sync
+fat32_error_t fat32_flush(fat32_file_t *file)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->buffer && fat32_mounted)
+    {
+        RETURN_ON_ERROR(file_buffer_write_back(file));
+    }
+    return fat32_sync();
+}
+
+void fat32_get_file_stats(fat32_file_t *file, fat32_file_stats_t *stats)
+{
+    *stats = file->stats;
+}
+
+// Write any cached file system changes out to the card
+fat32_error_t fat32_sync(void)
+{
+    if (!fat32_mounted)
+    {
+        return FAT32_OK;
+    }
+
+    // The FAT goes first so a size never covers clusters not yet in the chain
+    RETURN_ON_ERROR(fat_cache_flush());
+    return metadata_write_back();
+}
+
+void fat32_get_cache_stats(fat32_cache_stats_t *stats)
+{
+    *stats = fat_cache_stats;
+}
+
+void fat32_reset_cache_stats(void)
+{
+    memset(&fat_cache_stats, 0, sizeof(fat_cache_stats));
+}
+
+void fat32_get_free_map_stats(fat32_free_map_stats_t *stats)
+{
+    *stats = free_map_stats;
+}
+
 fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read)
 {
     if (!file || !file->is_open || !buffer)
@@ -1422,11 +3176,12 @@ fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *
         size = remaining;
     }
 
+    // A read carrying on from the last one reads ahead into the handle's buffer
+    bool sequential = file->position == file->next_position;
+
     // Ensure current_cluster is correct for current file position
     uint32_t cluster = 0;
-    uint32_t cluster_offset = file->position / bytes_per_cluster;
-    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, cluster_offset, &cluster));
-    file->current_cluster = cluster;
+    RETURN_ON_ERROR(file_cluster(file, file->position / bytes_per_cluster, &cluster));
 
     size_t total_read = 0;
     uint8_t *dest = (uint8_t *)buffer;
@@ -1439,32 +3194,81 @@ fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *
 
         uint32_t sector = cluster_to_sector(file->current_cluster) + sector_in_cluster;
 
-        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
-
-        size_t bytes_to_copy = FAT32_SECTOR_SIZE - byte_in_sector;
-        if (bytes_to_copy > size - total_read)
+        if (byte_in_sector == 0 && size - total_read >= FAT32_SECTOR_SIZE)
         {
-            bytes_to_copy = size - total_read;
+            // Whole sectors go straight into the caller's buffer, as many
+            // in one transfer as there are contiguous clusters to read from
+            uint32_t wanted = (size - total_read) / FAT32_SECTOR_SIZE;
+            uint32_t count = boot_sector.sectors_per_cluster - sector_in_cluster;
+            uint32_t last_cluster = file->current_cluster;
+            uint32_t index = file->position / bytes_per_cluster;
+            while (count < wanted)
+            {
+                uint32_t next_cluster;
+                fat32_error_t result = file_cluster(file, ++index, &next_cluster);
+                if (result == FAT32_ERROR_INVALID_POSITION)
+                {
+                    break;
+                }
+                RETURN_ON_ERROR(result);
+                if (next_cluster != last_cluster + 1)
+                {
+                    break;
+                }
+                last_cluster = next_cluster;
+                count += boot_sector.sectors_per_cluster;
+            }
+            if (count > wanted)
+            {
+                count = wanted;
+            }
+
+            if (file->buffer)
+            {
+                RETURN_ON_ERROR(file_buffer_bypass(file, file->position, count * FAT32_SECTOR_SIZE, false));
+            }
+            RETURN_ON_ERROR(read_sectors(sector, count, dest + total_read));
+            total_read += count * FAT32_SECTOR_SIZE;
+            file->position += count * FAT32_SECTOR_SIZE;
         }
+        else
+        {
+            uint8_t *data = sector_buffer;
+            if (file->buffer)
+            {
+                RETURN_ON_ERROR(file_buffer_get(file, file->position, sector, sequential, true, &data));
+            }
+            else
+            {
+                RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+            }
+
+            size_t bytes_to_copy = FAT32_SECTOR_SIZE - byte_in_sector;
+            if (bytes_to_copy > size - total_read)
+            {
+                bytes_to_copy = size - total_read;
+            }
 
-        memcpy(dest + total_read, sector_buffer + byte_in_sector, bytes_to_copy);
-        total_read += bytes_to_copy;
-        file->position += bytes_to_copy;
+            memcpy(dest + total_read, data + byte_in_sector, bytes_to_copy);
+            total_read += bytes_to_copy;
+            file->position += bytes_to_copy;
+        }
 
-        // Check if we need to move to the next cluster
-        if ((file->position % bytes_per_cluster) == 0 && total_read < size)
+        // Check if we need to move to the next cluster, or back to the
+        // one holding the position after looking ahead
+        if (total_read < size)
         {
-            uint32_t next_cluster;
-            RETURN_ON_ERROR(read_cluster_fat_entry(file->current_cluster, &next_cluster));
-            if (next_cluster >= FAT32_FAT_ENTRY_EOC)
+            fat32_error_t result = file_cluster(file, file->position / bytes_per_cluster, &cluster);
+            if (result == FAT32_ERROR_INVALID_POSITION)
             {
-                // End of cluster chain or error
+                // End of cluster chain
                 break;
             }
-            file->current_cluster = next_cluster;
+            RETURN_ON_ERROR(result);
         }
     }
 
+    file->next_position = file->position;
     if (bytes_read)
     {
         *bytes_read = total_read;
@@ -1496,71 +3300,22 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
 
     uint32_t old_file_size = file->file_size;
 
-    // Ensure current_cluster is correct for current file position
-    uint32_t cluster = file->start_cluster;
-    uint32_t cluster_offset = file->position / bytes_per_cluster;
-    for (uint32_t i = 0; i < cluster_offset; i++)
-    {
-        uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
-        if (next_cluster >= FAT32_FAT_ENTRY_EOC)
-        {
-            // Allocate a new cluster and link it
-            uint32_t new_cluster = 0;
-            RETURN_ON_ERROR(allocate_and_link_cluster(cluster, &new_cluster));
-            next_cluster = new_cluster;
-        }
-        cluster = next_cluster;
-    }
-    file->current_cluster = cluster;
-
     size_t total_written = 0;
     const uint8_t *src = (const uint8_t *)buffer;
 
-    // Calculate how many clusters are needed for the write
+    // Make sure the chain reaches as far as the write goes, and at least
+    // to the cluster holding the current position
     uint32_t end_pos = file->position + size;
     uint32_t needed_clusters = (end_pos + bytes_per_cluster - 1) / bytes_per_cluster;
-    uint32_t current_clusters = file->file_size == 0 ? 1 : (file->file_size + bytes_per_cluster - 1) / bytes_per_cluster;
-
-    // Find last cluster in chain
-    cluster = file->start_cluster;
-    uint32_t last_cluster = cluster;
-    if (current_clusters > 0)
-    {
-        RETURN_ON_ERROR(find_last_cluster(cluster, current_clusters, &last_cluster));
-    }
-
-    // Allocate clusters if needed
-    for (uint32_t i = current_clusters; i < needed_clusters; i++)
+    if (needed_clusters <= file->position / bytes_per_cluster)
     {
-        uint32_t new_cluster = 0;
-
-        if (current_clusters > 0 || i > 0)
-        {
-            RETURN_ON_ERROR(allocate_and_link_cluster(last_cluster, &new_cluster));
-        }
-        else
-        {
-            // First cluster for empty file
-            RETURN_ON_ERROR(get_next_free_cluster(&new_cluster));
-            RETURN_ON_ERROR(write_cluster_fat_entry(new_cluster, FAT32_FAT_ENTRY_EOC));
-
-            if (fsinfo.free_count != 0xFFFFFFFF)
-            {
-                fsinfo.free_count--;
-                update_fsinfo();
-            }
-
-            file->start_cluster = new_cluster;
-        }
-        last_cluster = new_cluster;
+        needed_clusters = file->position / bytes_per_cluster + 1;
     }
+    RETURN_ON_ERROR(file_grow(file, needed_clusters));
 
     // Find cluster for file->position
-    cluster = 0;
-    cluster_offset = file->position / bytes_per_cluster;
-    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, cluster_offset, &cluster));
-    file->current_cluster = cluster;
+    uint32_t cluster = 0;
+    RETURN_ON_ERROR(file_cluster(file, file->position / bytes_per_cluster, &cluster));
 
     size_t pos_in_file = file->position;
     while (total_written < size)
@@ -1569,18 +3324,65 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
         uint32_t sector_in_cluster = offset_in_cluster / FAT32_SECTOR_SIZE;
         uint32_t byte_in_sector = offset_in_cluster % FAT32_SECTOR_SIZE;
         uint32_t sector = cluster_to_sector(cluster) + sector_in_cluster;
+        size_t bytes_to_write;
 
-        RETURN_ON_ERROR(read_sector(sector, sector_buffer));
-
-        size_t bytes_to_write = FAT32_SECTOR_SIZE - byte_in_sector;
-        if (bytes_to_write > size - total_written)
+        if (byte_in_sector == 0 && size - total_written >= FAT32_SECTOR_SIZE)
         {
-            bytes_to_write = size - total_written;
-        }
+            // Whole sectors go straight from the caller's buffer, as many in
+            // one transfer as there are contiguous clusters to write to
+            uint32_t wanted = (size - total_written) / FAT32_SECTOR_SIZE;
+            uint32_t count = boot_sector.sectors_per_cluster - sector_in_cluster;
+            uint32_t index = pos_in_file / bytes_per_cluster;
+            uint32_t next_cluster;
+            while (count < wanted && file_cluster(file, ++index, &next_cluster) == FAT32_OK &&
+                   next_cluster == cluster + 1)
+            {
+                cluster = next_cluster;
+                count += boot_sector.sectors_per_cluster;
+            }
+            if (count > wanted)
+            {
+                count = wanted;
+            }
 
-        memcpy(sector_buffer + byte_in_sector, src + total_written, bytes_to_write);
+            if (file->buffer)
+            {
+                RETURN_ON_ERROR(file_buffer_bypass(file, pos_in_file, count * FAT32_SECTOR_SIZE, true));
+            }
+            RETURN_ON_ERROR(write_sectors(sector, count, src + total_written));
+            bytes_to_write = count * FAT32_SECTOR_SIZE;
+        }
+        else
+        {
+            bytes_to_write = FAT32_SECTOR_SIZE - byte_in_sector;
+            if (bytes_to_write > size - total_written)
+            {
+                bytes_to_write = size - total_written;
+            }
 
-        RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+            // A sector wholly past the end of the file has nothing to keep
+            bool past_end = pos_in_file - byte_in_sector >= file->file_size;
+            if (file->buffer)
+            {
+                uint8_t *data;
+                RETURN_ON_ERROR(file_buffer_get(file, pos_in_file, sector, past_end, !past_end, &data));
+                memcpy(data + byte_in_sector, src + total_written, bytes_to_write);
+                file_buffer_changed(file, pos_in_file);
+            }
+            else
+            {
+                if (past_end)
+                {
+                    memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
+                }
+                else
+                {
+                    RETURN_ON_ERROR(read_sector(sector, sector_buffer));
+                }
+                memcpy(sector_buffer + byte_in_sector, src + total_written, bytes_to_write);
+                RETURN_ON_ERROR(write_sector(sector, sector_buffer));
+            }
+        }
 
         total_written += bytes_to_write;
         pos_in_file += bytes_to_write;
@@ -1588,14 +3390,11 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
         // Move to next cluster if needed
         if ((pos_in_file % bytes_per_cluster) == 0 && total_written < size)
         {
-            uint32_t next_cluster;
-            fat32_error_t fat_res = read_cluster_fat_entry(cluster, &next_cluster);
-            if (fat_res != FAT32_OK || next_cluster >= FAT32_FAT_ENTRY_EOC)
+            fat32_error_t fat_res = file_cluster(file, pos_in_file / bytes_per_cluster, &cluster);
+            if (fat_res != FAT32_OK)
             {
                 return FAT32_ERROR_DISK_FULL;
             }
-            cluster = next_cluster;
-            file->current_cluster = cluster;
         }
     }
 
@@ -1642,22 +3441,28 @@ fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, s
                 release_cluster_chain(file->start_cluster);
                 file->start_cluster = 0;
             }
+            file_forget_chain(file);
         }
     }
 
-    // Update directory entry file size on disk
-    // After updating file->file_size:
-    if (file->dir_entry_sector && file->dir_entry_offset < FAT32_SECTOR_SIZE)
+    // The new size goes to the directory entry on the next sync
+    if (file->dir_entry_sector && file->dir_entry_offset < FAT32_SECTOR_SIZE && file->file_size != old_file_size)
     {
-        RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
-
-        fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
-        dir_entry->file_size = file->file_size;
-
-        RETURN_ON_ERROR(write_sector(file->dir_entry_sector, sector_buffer));
+        RETURN_ON_ERROR(pending_entry_set(file->dir_entry_sector, file->dir_entry_offset, file->file_size));
+        path_cache_update_size(file->dir_entry_sector, file->dir_entry_offset, file->file_size);
     }
 
+#if FAT32_SYNC_EVERY_WRITE
+    return fat32_sync();
+#else
+    bytes_since_sync += total_written;
+    if (bytes_since_sync >= FAT32_SYNC_BYTES ||
+        (metadata_dirty && time_us_64() - metadata_dirty_since >= FAT32_SYNC_INTERVAL_MS * 1000ull))
+    {
+        return fat32_sync();
+    }
     return FAT32_OK;
+#endif
 }
 
 fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position)
@@ -1672,6 +3477,89 @@ fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position)
     return FAT32_OK;
 }
 
+fat32_error_t fat32_reserve(fat32_file_t *file, uint32_t bytes)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->attributes & FAT32_ATTR_DIRECTORY)
+    {
+        return FAT32_ERROR_NOT_A_FILE;
+    }
+
+    if (!fat32_is_ready())
+    {
+        return mount_status;
+    }
+
+    // The clusters join the file's chain, its size stays as it is
+    return file_grow(file, (bytes + bytes_per_cluster - 1) / bytes_per_cluster);
+}
+
+fat32_error_t fat32_truncate(fat32_file_t *file, uint32_t size)
+{
+    if (!file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    if (file->attributes & FAT32_ATTR_DIRECTORY)
+    {
+        return FAT32_ERROR_NOT_A_FILE;
+    }
+
+    if (!fat32_is_ready())
+    {
+        return mount_status;
+    }
+
+    if (size > file->file_size)
+    {
+        return FAT32_ERROR_INVALID_POSITION;
+    }
+
+    // Whatever the handle has buffered may be in clusters about to go
+    if (file->buffer)
+    {
+        RETURN_ON_ERROR(file_buffer_write_back(file));
+        file->buffer_count = 0;
+    }
+
+    // Keep the clusters size needs, and always the first one which the
+    // directory entry points to, and release the rest including any reserved
+    if (file->start_cluster >= 2)
+    {
+        uint32_t keep = size > 0 ? (size + bytes_per_cluster - 1) / bytes_per_cluster : 1;
+        uint32_t last;
+        uint32_t next;
+        RETURN_ON_ERROR(file_cluster(file, keep - 1, &last));
+        RETURN_ON_ERROR(read_cluster_fat_entry(last, &next));
+        if (next >= 2 && next < FAT32_FAT_ENTRY_EOC)
+        {
+            RETURN_ON_ERROR(write_cluster_fat_entry(last, FAT32_FAT_ENTRY_EOC));
+            RETURN_ON_ERROR(release_cluster_chain(next));
+        }
+        file_forget_chain(file);
+    }
+
+    if (size != file->file_size)
+    {
+        file->file_size = size;
+        if (file->dir_entry_sector && file->dir_entry_offset < FAT32_SECTOR_SIZE)
+        {
+            RETURN_ON_ERROR(pending_entry_set(file->dir_entry_sector, file->dir_entry_offset, size));
+            path_cache_update_size(file->dir_entry_sector, file->dir_entry_offset, size);
+        }
+    }
+    if (file->position > size)
+    {
+        file->position = size;
+    }
+    return FAT32_OK;
+}
+
 inline uint32_t fat32_tell(fat32_file_t *file)
 {
     return file ? file->position : 0;
@@ -1697,7 +3585,8 @@ fat32_error_t fat32_delete(const char *path)
     {
         return mount_status;
     }
-    return delete_entry(path);
+    RETURN_ON_ERROR(delete_entry(path));
+    return fat32_sync();
 }
 
 fat32_error_t fat32_rename(const char *old_path, const char *new_path)
@@ -1728,10 +3617,16 @@ fat32_error_t fat32_rename(const char *old_path, const char *new_path)
     }
 
     // Rename by deleting the old entry and creating a new one with the same start cluster
-    RETURN_ON_ERROR(unlink_entry(&entry));
-    RETURN_ON_ERROR(link_entry(&entry, new_path));
+    result = unlink_entry(&entry);
+    if (result == FAT32_OK)
+    {
+        result = link_entry(&entry, new_path);
+    }
+    path_cache_invalidate();
+    dir_index_invalidate();
+    dir_alloc_invalidate();
 
-    return FAT32_OK;
+    return result;
 }
 
 //
@@ -1960,11 +3855,11 @@ fat32_error_t fat32_dir_read(fat32_file_t *dir, fat32_entry_t *dir_entry)
             }
             dir_entry->attr = entry->attr;
             dir_entry->start_cluster = (entry->fst_clus_hi << 16) | entry->fst_clus_lo;
-            dir_entry->size = entry->file_size;
             dir_entry->date = entry->wrt_date;
             dir_entry->time = entry->wrt_time;
             dir_entry->sector = sector;
             dir_entry->offset = dir->position % FAT32_SECTOR_SIZE;
+            dir_entry->size = pending_entry_size(sector, dir_entry->offset, entry->file_size);
         }
 
         dir->position += 32; // Move to next entry (32 bytes per entry)
@@ -2062,7 +3957,9 @@ fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path)
     }
     dotdot_entry.file_size = 0;
 
-    // Write both entries to the first sector of the directory
+    // Write both entries to the first sector of the directory, once the
+    // card's FAT has its cluster
+    RETURN_ON_ERROR(fat_cache_flush());
     RETURN_ON_ERROR(read_sector(cluster_to_sector(dir->start_cluster), sector_buffer));
 
     memcpy(sector_buffer, &dot_entry, sizeof(fat32_dir_entry_t));
@@ -2119,6 +4016,8 @@ const char *fat32_error_string(fat32_error_t error)
         return "Invalid FAT size";
     case FAT32_ERROR_INVALID_RESERVED_SECTORS:
         return "Invalid reserved sectors";
+    case FAT32_ERROR_OUT_OF_MEMORY:
+        return "Out of memory";
     default:
         return "Unknown error";
     }
@@ -2127,16 +4026,15 @@ const char *fat32_error_string(fat32_error_t error)
 // Timer callback to check SD card presence and unmount if removed
 static bool on_sd_card_detect(repeating_timer_t *rt)
 {
-    // All we need to do is check if the SD card is not present and
-    // if we have a mounted FAT32 file system, we will unmount it.
+    // All we need to do is note if the SD card is not present, the
+    // file system is unmounted the next time it is used.
     //
     // This will cover the case if the SD card is changed as we mount
     // the file system when it is needed.
 
-    if (!sd_card_present() && fat32_is_mounted())
+    if (!sd_card_present())
     {
-        fat32_unmount();                    // Unmount if card is not present
-        mount_status = FAT32_ERROR_NO_CARD; // Update status
+        sd_card_removed = true;
     }
 
     return true;
@@ -6,6 +6,63 @@
 #define FAT32_MAX_PATH_LEN (260)
 #define MAX_LFN_PART (20) // Maximum number of LFN parts (13 UTF-16 chars each)
 
+// Number of FAT sectors kept in the write-back FAT cache
+#ifndef FAT32_FAT_CACHE_SECTORS
+#define FAT32_FAT_CACHE_SECTORS (8)
+#endif
+
+// RAM for the free cluster map built at mount, a bitmap if the card's
+// clusters fit, otherwise a count of free clusters per group of FAT sectors
+#ifndef FAT32_FREE_MAP_BYTES
+#define FAT32_FREE_MAP_BYTES (8192)
+#endif
+
+// FAT sectors read with one multi-block command while building the free map
+#ifndef FAT32_FREE_MAP_READ_SECTORS
+#define FAT32_FREE_MAP_READ_SECTORS (8)
+#endif
+
+// File sizes and the free cluster count are written back on close, fat32_sync()
+// or once this many bytes have been written or this long has passed
+#ifndef FAT32_SYNC_BYTES
+#define FAT32_SYNC_BYTES (32768)
+#endif
+#ifndef FAT32_SYNC_INTERVAL_MS
+#define FAT32_SYNC_INTERVAL_MS (2000)
+#endif
+
+// Set to 1 to write everything back at the end of every fat32_write
+#ifndef FAT32_SYNC_EVERY_WRITE
+#define FAT32_SYNC_EVERY_WRITE (0)
+#endif
+
+// Directory entries whose new size can be held back at once
+#ifndef FAT32_PENDING_ENTRIES
+#define FAT32_PENDING_ENTRIES (4)
+#endif
+
+// Paths remembered by the path lookup cache
+#ifndef FAT32_PATH_CACHE_ENTRIES
+#define FAT32_PATH_CACHE_ENTRIES (16)
+#endif
+
+// Slots in the index of the one directory indexed for fast lookups, which
+// holds up to three quarters as many names, 0 for no index
+#ifndef FAT32_DIR_INDEX_ENTRIES
+#define FAT32_DIR_INDEX_ENTRIES (1024)
+#endif
+
+// Bits in the filter of short names taken in the directory last created
+// in, which aliases for new long names are checked against
+#ifndef FAT32_SHORT_NAME_FILTER_BITS
+#define FAT32_SHORT_NAME_FILTER_BITS (8192)
+#endif
+
+// Runs of contiguous clusters remembered per open file
+#ifndef FAT32_FILE_EXTENTS
+#define FAT32_FILE_EXTENTS (8)
+#endif
+
 // File attributes
 #define FAT32_ATTR_READ_ONLY (0x01)
 #define FAT32_ATTR_HIDDEN (0x02)
@@ -49,8 +106,26 @@ typedef enum
     FAT32_ERROR_INVALID_CLUSTER_SIZE,
     FAT32_ERROR_INVALID_FATS,
     FAT32_ERROR_INVALID_RESERVED_SECTORS,
+    FAT32_ERROR_OUT_OF_MEMORY, // Not from the file system, for its callers
 } fat32_error_t;
 
+// A run of contiguous clusters in a file's cluster chain
+typedef struct
+{
+    uint32_t file_cluster; // Index of the run's first cluster within the file
+    uint32_t cluster;      // First cluster of the run
+    uint32_t count;        // Clusters in the run
+} fat32_extent_t;
+
+// Statistics for a handle's own buffer, see fat32_set_buffer()
+typedef struct
+{
+    uint32_t hits;        // Sector accesses served from the buffer
+    uint32_t misses;      // Sector accesses that refilled it
+    uint32_t read_ahead;  // Sectors read ahead of the one wanted
+    uint32_t write_backs; // Times its changed sectors were written out
+} fat32_file_stats_t;
+
 // File handle structure
 typedef struct
 {
@@ -63,8 +138,56 @@ typedef struct
     uint32_t position;
     uint32_t dir_entry_sector; // Sector containing the directory entry
     uint32_t dir_entry_offset; // Byte offset within the sector
+
+    // What is known of the cluster chain, filled in as the file is used
+    uint32_t current_index;                      // Index of current_cluster within the file
+    uint32_t tail_cluster;                       // Last cluster of the chain
+    uint32_t cluster_total;                      // Clusters in the chain, 0 if not known yet
+    uint32_t mapped_clusters;                    // Clusters from the start covered by extents
+    uint8_t extent_count;
+    fat32_extent_t extents[FAT32_FILE_EXTENTS];
+
+    // The handle's own sector buffer, if it has been given one
+    uint8_t *buffer;
+    uint32_t buffer_sectors;     // Sectors it can hold
+    uint32_t buffer_count;       // Sectors it holds, 0 if none
+    uint32_t buffer_offset;      // File offset of the first sector held
+    uint32_t buffer_sector;      // Where that sector is on the card
+    uint32_t buffer_dirty_start; // Sectors held that have changed, none if start == end
+    uint32_t buffer_dirty_end;
+    uint32_t next_position;      // Where a read carrying on from the last would start
+    fat32_file_stats_t stats;
 } fat32_file_t;
 
+// FAT cache statistics
+typedef struct
+{
+    uint32_t hits;        // FAT sector found in the cache
+    uint32_t misses;      // FAT sector read from the card
+    uint32_t write_backs; // Dirty FAT sectors written to the card
+    uint32_t path_hits;   // Paths found in the path lookup cache
+    uint32_t path_misses; // Paths looked up in their directories
+    uint32_t dir_sectors; // Directory sectors read by lookups
+} fat32_cache_stats_t;
+
+// Free cluster map statistics
+typedef enum
+{
+    FAT32_FREE_MAP_NONE,    // Not built, the FAT is searched directly
+    FAT32_FREE_MAP_BITMAP,  // One bit per cluster
+    FAT32_FREE_MAP_SUMMARY, // Free clusters per group of FAT sectors
+} fat32_free_map_mode_t;
+
+typedef struct
+{
+    fat32_free_map_mode_t mode;
+    uint32_t free_clusters;  // Free clusters according to the map
+    uint32_t build_us;       // Time taken to build the map at mount
+    uint32_t build_sectors;  // FAT sectors read to build it
+    uint32_t searches;       // Free cluster searches since mount
+    uint32_t search_us;      // Total time spent in them
+} fat32_free_map_stats_t;
+
 // Directory entry structure
 typedef struct
 {
@@ -183,11 +306,17 @@ fat32_error_t fat32_close(fat32_file_t *file);
 fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
 fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
 fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position);
+fat32_error_t fat32_reserve(fat32_file_t *file, uint32_t bytes);
+fat32_error_t fat32_truncate(fat32_file_t *file, uint32_t size);
+fat32_error_t fat32_set_buffer(fat32_file_t *file, void *buffer, size_t size);
+fat32_error_t fat32_flush(fat32_file_t *file);
+void fat32_get_file_stats(fat32_file_t *file, fat32_file_stats_t *stats);
 uint32_t fat32_tell(fat32_file_t *file);
 uint32_t fat32_size(fat32_file_t *file);
 bool fat32_eof(fat32_file_t *file);
 fat32_error_t fat32_delete(const char *path);
 fat32_error_t fat32_rename(const char *old_path, const char *new_path);
+fat32_error_t fat32_sync(void);
 
 // Directory operations
 fat32_error_t fat32_set_current_dir(const char *path);
@@ -198,5 +327,8 @@ fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path);
 
 // Utility functions
 const char *fat32_error_string(fat32_error_t error);
+void fat32_get_cache_stats(fat32_cache_stats_t *stats);
+void fat32_reset_cache_stats(void);
+void fat32_get_free_map_stats(fat32_free_map_stats_t *stats);
 
 void fat32_init(void);
@@ -0,0 +1,66 @@
+//
+// Erasing and programming the QSPI flash, see flash_hw.h.
+//
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "flash_hw.h"
+
+typedef struct
+{
+    uint32_t offset; // From the start of flash
+    const uint8_t *page;
+} flash_op_t;
+
+static void erase_sector(void *param)
+{
+    flash_op_t *op = param;
+    flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+}
+
+static void program_page(void *param)
+{
+    flash_op_t *op = param;
+    flash_range_program(op->offset, op->page, FLASH_PAGE_SIZE);
+}
+
+uint32_t flash_hw_offset(const void *address)
+{
+    return (uint32_t)((uintptr_t)address - XIP_BASE);
+}
+
+bool flash_hw_erase(uint32_t offset)
+{
+    flash_op_t op = {offset, NULL};
+    return flash_safe_execute(erase_sector, &op, UINT32_MAX) == PICO_OK;
+}
+
+// The data goes through RAM a page at a time, flash cannot be read while
+// it is being programmed
+bool flash_hw_program(uint32_t offset, const void *data, size_t size)
+{
+    static uint8_t page[FLASH_PAGE_SIZE];
+    const uint8_t *bytes = data;
+
+    while (size > 0)
+    {
+        uint32_t start = offset % FLASH_PAGE_SIZE;
+        size_t part = FLASH_PAGE_SIZE - start < size ? FLASH_PAGE_SIZE - start : size;
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page + start, bytes, part);
+
+        flash_op_t op = {offset - start, page};
+        if (flash_safe_execute(program_page, &op, UINT32_MAX) != PICO_OK)
+        {
+            return false;
+        }
+        offset += part;
+        bytes += part;
+        size -= part;
+    }
+    return true;
+}
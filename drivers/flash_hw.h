@@ -0,0 +1,24 @@
+#pragma once
+
+//
+//  Erasing and programming the QSPI flash the firmware runs from
+//
+//  While flash is erased or programmed nothing can be fetched from it, so
+//  both cores are kept off it with flash_safe_execute(): the other core
+//  must have called flash_safe_execute_core_init().  Offsets are from the
+//  start of flash, flash_hw_offset() gives the one for an XIP address.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Offset into flash of an address in the XIP window
+uint32_t flash_hw_offset(const void *address);
+
+// Erase the 4 KB sector at offset
+bool flash_hw_erase(uint32_t offset);
+
+// Program bytes anywhere, whole pages are programmed with 1s (which leave
+// flash as it is) around them.  The data may itself be in flash.
+bool flash_hw_program(uint32_t offset, const void *data, size_t size);
@@ -0,0 +1,846 @@
+//
+// Log-structured store in on-board flash, see flash_log.h.
+//
+// The host build (FLASH_LOG_HOST) leaves out the RP2040 flash access at
+// the end, bench/nor_flash_sim.c provides it instead.
+//
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "flash_log.h"
+#ifndef FLASH_LOG_HOST
+#include "flash_hw.h"
+#endif
+
+#define SECTOR_MAGIC (0x474F4C54) // "TLOG"
+#define NOT_WRITTEN (0xFFFFFFFF)
+
+// Each step of a record clears one of these
+#define RECORD_COMMITTED (0x01) // Cleared once all of the data is there
+#define RECORD_MIRRORED (0x02)  // Cleared once the data is on the card
+#define RECORD_CONTINUED (0x04) // Cleared with COMMITTED when the next record holds the rest of the append
+#define RECORD_ABANDONED (0x08) // Cleared at mount when that next record never was committed
+
+// Least an append is split down to so as to fill a sector
+#define SPLIT_MIN (64)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;    // Order the sector was taken for writing in, NOT_WRITTEN until then
+    uint32_t erase_count;
+    uint32_t retiring;    // Cleared once what it holds has been copied out, it is erased next
+} sector_header_t;
+
+typedef struct
+{
+    uint16_t length;   // 0xFFFF where no record has been written yet
+    uint8_t flags;
+    uint8_t check;     // Over length and position, a torn header will not match
+    uint32_t position;
+} record_header_t;
+
+_Static_assert(sizeof(sector_header_t) == 16 && sizeof(record_header_t) == 8, "flash_log.h assumes these sizes");
+
+typedef enum
+{
+    SECTOR_FREE,   // Erased, waiting to be written
+    SECTOR_IN_USE,
+} sector_state_t;
+
+static struct
+{
+    uint32_t sequence;
+    uint32_t erase_count;
+    uint16_t end;        // Bytes from the start of the sector holding records
+    uint16_t used;       // and written or spoilt, a torn header ends the records
+    uint8_t state;       // sector_state_t
+} sectors[FLASH_LOG_MAX_SECTORS];
+
+// A place in the log, order[index] is the sector
+typedef struct
+{
+    uint32_t index;
+    uint32_t offset;
+} cursor_t;
+
+static bool mounted = false;
+static const uint8_t *contents;
+static uint32_t sector_count;
+static uint32_t order[FLASH_LOG_MAX_SECTORS]; // Sectors in use, oldest first
+static uint32_t order_count;
+static int head = -1;                       // Sector being written
+static uint32_t next_sequence;
+static uint32_t log_end;                    // Furthest tape position a record reaches
+static uint32_t unmirrored;                 // Bytes in records not yet on the card
+static cursor_t mirror_cursor;              // No unmirrored records before here
+static flash_log_stats_t stats;
+
+#define RETURN_ON_ERROR(expr)            \
+    {                                    \
+        flash_log_error_t _res = (expr); \
+        if (_res != FLASH_LOG_OK)        \
+        {                                \
+            return _res;                 \
+        }                                \
+    }
+
+//
+// Flash layout
+//
+
+static inline uint32_t record_size(uint16_t length)
+{
+    return (sizeof(record_header_t) + length + 3) & ~3u;
+}
+
+static uint8_t record_check(uint16_t length, uint32_t position)
+{
+    return ~(length ^ (length >> 8) ^ position ^ (position >> 8) ^ (position >> 16) ^ (position >> 24));
+}
+
+static inline const sector_header_t *sector_header(uint32_t sector)
+{
+    return (const sector_header_t *)(contents + sector * FLASH_LOG_SECTOR_SIZE);
+}
+
+static inline const record_header_t *record_at(uint32_t offset)
+{
+    return (const record_header_t *)(contents + offset);
+}
+
+static inline bool record_committed(const record_header_t *record)
+{
+    return !(record->flags & RECORD_COMMITTED) && (record->flags & RECORD_ABANDONED);
+}
+
+// Not yet on the card, so still needed
+static inline bool record_live(const record_header_t *record)
+{
+    return record_committed(record) && (record->flags & RECORD_MIRRORED);
+}
+
+static bool program(uint32_t offset, const void *data, size_t size)
+{
+    uint64_t start = time_us_64();
+    bool ok = flash_log_hw_program(offset, data, size);
+    stats.busy_us += time_us_64() - start;
+    stats.programs += (offset + size - 1) / FLASH_LOG_PAGE_SIZE - offset / FLASH_LOG_PAGE_SIZE + 1;
+    return ok;
+}
+
+// Erase a sector and put its header back, counting the erase
+static flash_log_error_t erase(uint32_t sector)
+{
+    uint64_t start = time_us_64();
+    bool ok = flash_log_hw_erase(sector * FLASH_LOG_SECTOR_SIZE);
+    stats.busy_us += time_us_64() - start;
+    stats.erases++;
+
+    sectors[sector].state = SECTOR_FREE;
+    sectors[sector].erase_count++;
+    sectors[sector].end = 0;
+    sectors[sector].used = 0;
+
+    sector_header_t header = {SECTOR_MAGIC, NOT_WRITTEN, sectors[sector].erase_count, NOT_WRITTEN};
+    if (!ok || !program(sector * FLASH_LOG_SECTOR_SIZE, &header, sizeof(header)))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    return FLASH_LOG_OK;
+}
+
+// Find where the records in a sector end.  A header that does not add up
+// means power failed while it was written, nothing more goes in after it.
+static void sector_scan(uint32_t sector)
+{
+    uint32_t base = sector * FLASH_LOG_SECTOR_SIZE;
+    uint32_t offset = sizeof(sector_header_t);
+
+    sectors[sector].used = FLASH_LOG_SECTOR_SIZE;
+    while (offset + sizeof(record_header_t) <= FLASH_LOG_SECTOR_SIZE)
+    {
+        const record_header_t *record = record_at(base + offset);
+        if (record->length == 0xFFFF && record->flags == 0xFF && record->check == 0xFF && record->position == NOT_WRITTEN)
+        {
+            sectors[sector].used = offset; // Never written
+            break;
+        }
+        if (record->check != record_check(record->length, record->position) ||
+            record->length > FLASH_LOG_SECTOR_SIZE - offset - sizeof(record_header_t))
+        {
+            break;
+        }
+        offset += record_size(record->length);
+    }
+    sectors[sector].end = offset < FLASH_LOG_SECTOR_SIZE ? offset : FLASH_LOG_SECTOR_SIZE;
+}
+
+static bool sector_blank(uint32_t sector)
+{
+    const uint32_t *words = (const uint32_t *)sector_header(sector);
+    for (uint32_t i = 0; i < FLASH_LOG_SECTOR_SIZE / sizeof(uint32_t); i++)
+    {
+        if (words[i] != NOT_WRITTEN)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Walking the log
+//
+
+// The next record in the log, oldest first
+static bool record_next(cursor_t *cursor, uint32_t *offset)
+{
+    while (cursor->index < order_count)
+    {
+        uint32_t sector = order[cursor->index];
+        if (cursor->offset == 0)
+        {
+            cursor->offset = sizeof(sector_header_t);
+        }
+        if (cursor->offset + sizeof(record_header_t) <= sectors[sector].end)
+        {
+            *offset = sector * FLASH_LOG_SECTOR_SIZE + cursor->offset;
+            cursor->offset += record_size(record_at(*offset)->length);
+            return true;
+        }
+        cursor->index++;
+        cursor->offset = 0;
+    }
+    return false;
+}
+
+static void order_remove(uint32_t sector)
+{
+    uint32_t i = 0;
+    while (i < order_count && order[i] != sector)
+    {
+        i++;
+    }
+    if (i < order_count)
+    {
+        memmove(&order[i], &order[i + 1], (order_count - i - 1) * sizeof(order[0]));
+        order_count--;
+    }
+    mirror_cursor.index = 0; // The sectors have moved along
+    mirror_cursor.offset = 0;
+}
+
+//
+// Writing
+//
+
+static uint32_t free_sectors(void)
+{
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        count += sectors[s].state == SECTOR_FREE;
+    }
+    return count;
+}
+
+// Start writing the erased sector that has been erased least
+static flash_log_error_t take_sector(void)
+{
+    int best = -1;
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        if (sectors[s].state == SECTOR_FREE &&
+            (best < 0 || sectors[s].erase_count < sectors[best].erase_count))
+        {
+            best = s;
+        }
+    }
+    if (best < 0)
+    {
+        return FLASH_LOG_FULL;
+    }
+
+    // A sector erased before it had a header gets one now, the bits that
+    // are already there are programmed again to what they are
+    sector_header_t header = {SECTOR_MAGIC, next_sequence++, sectors[best].erase_count, NOT_WRITTEN};
+    sectors[best].state = SECTOR_IN_USE;
+    sectors[best].sequence = header.sequence;
+    sectors[best].end = sectors[best].used = sizeof(sector_header_t);
+    order[order_count++] = best;
+    head = best;
+    if (!program(best * FLASH_LOG_SECTOR_SIZE, &header, sizeof(header)))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    return FLASH_LOG_OK;
+}
+
+static flash_log_error_t reclaim(void);
+
+// Make room in the head sector.  One erased sector is kept back for
+// compaction to copy into, and only compaction may take it.
+static flash_log_error_t ensure_room(uint32_t size, bool copying)
+{
+    for (uint32_t tries = 0;; tries++)
+    {
+        if (head >= 0 && FLASH_LOG_SECTOR_SIZE - sectors[head].used >= (int)size)
+        {
+            return FLASH_LOG_OK;
+        }
+        if (free_sectors() > (copying ? 0 : 1))
+        {
+            RETURN_ON_ERROR(take_sector());
+            continue;
+        }
+        if (copying || tries > sector_count)
+        {
+            return FLASH_LOG_FULL; // Everything is still needed
+        }
+        RETURN_ON_ERROR(reclaim());
+    }
+}
+
+static flash_log_error_t put_record(uint32_t position, const uint8_t *data, uint16_t length, bool copying, bool continued)
+{
+    uint32_t size = record_size(length);
+    RETURN_ON_ERROR(ensure_room(size, copying));
+
+    // The space is spent even if programming fails part way
+    uint32_t offset = head * FLASH_LOG_SECTOR_SIZE + sectors[head].used;
+    sectors[head].used += size;
+    sectors[head].end = sectors[head].used;
+
+    record_header_t record = {length, 0xFF, record_check(length, position), position};
+    if (!program(offset, &record, sizeof(record)) ||
+        !program(offset + sizeof(record), data, length))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    uint8_t flags = 0xFF & ~RECORD_COMMITTED & ~(continued ? RECORD_CONTINUED : 0);
+    if (!program(offset + offsetof(record_header_t, flags), &flags, 1))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+
+    if (copying)
+    {
+        stats.copies++;
+    }
+    if (position + length > log_end)
+    {
+        log_end = position + length;
+    }
+    unmirrored += length;
+    return FLASH_LOG_OK;
+}
+
+// Copy the parts of a record that no later record has written over
+static flash_log_error_t copy_uncovered(uint32_t offset, cursor_t after)
+{
+    const record_header_t *record = record_at(offset);
+    const uint8_t *data = contents + offset + sizeof(record_header_t);
+    uint32_t end = record->position + record->length;
+    uint32_t x = record->position;
+
+    while (x < end)
+    {
+        uint32_t covered_to = x;
+        uint32_t next_start = end;
+        cursor_t cursor = after;
+        uint32_t later;
+        while (record_next(&cursor, &later))
+        {
+            const record_header_t *r = record_at(later);
+            if (!record_committed(r))
+            {
+                continue;
+            }
+            uint32_t r_end = r->position + r->length;
+            if (r->position <= x && r_end > covered_to)
+            {
+                covered_to = r_end;
+            }
+            else if (r->position > x && r->position < next_start)
+            {
+                next_start = r->position;
+            }
+        }
+
+        if (covered_to > x)
+        {
+            x = covered_to;
+        }
+        else
+        {
+            RETURN_ON_ERROR(put_record(x, data + (x - record->position), next_start - x, true, false));
+            x = next_start;
+        }
+    }
+    return FLASH_LOG_OK;
+}
+
+// Empty the oldest sector other than the one being written and erase it
+static flash_log_error_t reclaim(void)
+{
+    if (order_count == 0 || (int)order[0] == head)
+    {
+        return FLASH_LOG_FULL;
+    }
+    uint32_t sector = order[0];
+
+    // After each record, every record written later: the rest of the
+    // sector and the sectors after it
+    cursor_t cursor = {0, 0};
+    uint32_t offset;
+    bool copied = false;
+    while (cursor.index == 0 && record_next(&cursor, &offset))
+    {
+        const record_header_t *record = record_at(offset);
+        if (record_live(record))
+        {
+            uint32_t copies = stats.copies;
+            RETURN_ON_ERROR(copy_uncovered(offset, cursor));
+            copied |= stats.copies != copies;
+            unmirrored -= record->length;
+        }
+    }
+
+    // Power failing from here on leaves the copies, the sector is erased
+    // at the next mount
+    uint32_t retiring = 0;
+    if (!program(sector * FLASH_LOG_SECTOR_SIZE + offsetof(sector_header_t, retiring), &retiring, sizeof(retiring)))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    order_remove(sector);
+    if (copied)
+    {
+        stats.compactions++;
+    }
+    return erase(sector);
+}
+
+// Write an append of up to FLASH_LOG_MAX_RECORD bytes.  Rather than leave
+// the end of the head sector empty it is split across two sectors, the
+// first part counting only once the second is there.  That needs the
+// second sector to be taken without compacting in between.
+static flash_log_error_t put_append(uint32_t position, const uint8_t *data, uint16_t length)
+{
+    for (uint32_t tries = 0;; tries++)
+    {
+        uint32_t room = head >= 0 ? FLASH_LOG_SECTOR_SIZE - sectors[head].used : 0;
+        if (record_size(length) <= room || room < record_size(SPLIT_MIN) || tries > sector_count)
+        {
+            return put_record(position, data, length, false, false);
+        }
+        if (free_sectors() > 1)
+        {
+            uint16_t first = room - sizeof(record_header_t);
+            RETURN_ON_ERROR(put_record(position, data, first, false, true));
+            return put_record(position + first, data + first, length - first, false, false);
+        }
+
+        flash_log_error_t status = reclaim();
+        if (status == FLASH_LOG_FULL)
+        {
+            return put_record(position, data, length, false, false);
+        }
+        RETURN_ON_ERROR(status);
+    }
+}
+
+// Mark the first part of an append cut short so it no longer counts
+static flash_log_error_t abandon(uint32_t offset)
+{
+    uint8_t flags = record_at(offset)->flags & ~RECORD_ABANDONED;
+    if (!program(offset + offsetof(record_header_t, flags), &flags, 1))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    return FLASH_LOG_OK;
+}
+
+//
+// Store
+//
+
+flash_log_error_t flash_log_mount(void)
+{
+    mounted = false;
+    contents = flash_log_hw_contents();
+    sector_count = flash_log_hw_size() / FLASH_LOG_SECTOR_SIZE;
+    if (sector_count > FLASH_LOG_MAX_SECTORS)
+    {
+        sector_count = FLASH_LOG_MAX_SECTORS;
+    }
+    if (sector_count < 3)
+    {
+        return FLASH_LOG_NOT_MOUNTED; // One to write, one kept back and one to reclaim
+    }
+
+    order_count = 0;
+    head = -1;
+    next_sequence = 0;
+    log_end = 0;
+    unmirrored = 0;
+    mirror_cursor.index = mirror_cursor.offset = 0;
+
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        const sector_header_t *header = sector_header(s);
+        sectors[s].state = SECTOR_FREE;
+        sectors[s].end = sectors[s].used = 0;
+        sectors[s].erase_count = 0;
+
+        if (header->magic != SECTOR_MAGIC)
+        {
+            // Never used, or an erase was cut short
+            if (!sector_blank(s))
+            {
+                RETURN_ON_ERROR(erase(s));
+            }
+            continue;
+        }
+
+        sectors[s].erase_count = header->erase_count;
+        if (header->retiring != NOT_WRITTEN)
+        {
+            RETURN_ON_ERROR(erase(s)); // Its records were copied out already
+        }
+        else if (header->sequence != NOT_WRITTEN)
+        {
+            sector_scan(s);
+            if (sectors[s].used == sizeof(sector_header_t))
+            {
+                // Taken but never written to, the sequence may not have
+                // been programmed whole
+                RETURN_ON_ERROR(erase(s));
+                continue;
+            }
+
+            sectors[s].state = SECTOR_IN_USE;
+            sectors[s].sequence = header->sequence;
+            if (header->sequence >= next_sequence)
+            {
+                next_sequence = header->sequence + 1;
+            }
+
+            // Keep the sectors in the order they were written
+            uint32_t i = order_count++;
+            while (i > 0 && sectors[order[i - 1]].sequence > header->sequence)
+            {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = s;
+        }
+    }
+    head = order_count > 0 ? (int)order[order_count - 1] : -1;
+
+    // Only the last append can have been cut short between its two parts
+    cursor_t cursor = {0, 0};
+    uint32_t offset;
+    uint32_t continued = NOT_WRITTEN;
+    while (record_next(&cursor, &offset))
+    {
+        const record_header_t *record = record_at(offset);
+        if (continued != NOT_WRITTEN && !record_committed(record))
+        {
+            RETURN_ON_ERROR(abandon(continued));
+        }
+        continued = record_committed(record) && !(record->flags & RECORD_CONTINUED) ? offset : NOT_WRITTEN;
+    }
+    if (continued != NOT_WRITTEN)
+    {
+        RETURN_ON_ERROR(abandon(continued));
+    }
+
+    cursor.index = cursor.offset = 0;
+    while (record_next(&cursor, &offset))
+    {
+        const record_header_t *record = record_at(offset);
+        if (record_committed(record) && record->position + record->length > log_end)
+        {
+            log_end = record->position + record->length;
+        }
+        if (record_live(record))
+        {
+            unmirrored += record->length;
+        }
+    }
+
+    mounted = true;
+    return FLASH_LOG_OK;
+}
+
+bool flash_log_mounted(void)
+{
+    return mounted;
+}
+
+// Erase everything, the erase counts carry on
+void flash_log_format(void)
+{
+    uint32_t retiring = 0;
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        if (sectors[s].state == SECTOR_IN_USE)
+        {
+            program(s * FLASH_LOG_SECTOR_SIZE + offsetof(sector_header_t, retiring), &retiring, sizeof(retiring));
+            erase(s);
+        }
+    }
+    order_count = 0;
+    head = -1;
+    log_end = 0;
+    unmirrored = 0;
+    mirror_cursor.index = mirror_cursor.offset = 0;
+}
+
+flash_log_error_t flash_log_append(uint32_t position, const void *data, size_t size)
+{
+    if (!mounted)
+    {
+        return FLASH_LOG_NOT_MOUNTED;
+    }
+
+    const uint8_t *bytes = data;
+    while (size > 0)
+    {
+        uint16_t length = size > FLASH_LOG_MAX_RECORD ? FLASH_LOG_MAX_RECORD : size;
+        RETURN_ON_ERROR(put_append(position, bytes, length));
+        stats.appends++;
+        stats.bytes += length;
+        position += length;
+        bytes += length;
+        size -= length;
+    }
+    return FLASH_LOG_OK;
+}
+
+// Lay the bytes the log holds for position onwards over buffer, later
+// records over earlier ones.  Returns how far into buffer they reach.
+uint32_t flash_log_read(uint32_t position, uint8_t *buffer, size_t size)
+{
+    uint32_t reach = 0;
+    if (!mounted)
+    {
+        return 0;
+    }
+
+    cursor_t cursor = {0, 0};
+    uint32_t offset;
+    while (record_next(&cursor, &offset))
+    {
+        const record_header_t *record = record_at(offset);
+        uint32_t start = record->position;
+        uint32_t end = start + record->length;
+        if (!record_live(record) || end <= position || start >= position + size)
+        {
+            continue;
+        }
+
+        if (start < position)
+        {
+            start = position;
+        }
+        if (end > position + size)
+        {
+            end = position + size;
+        }
+        memcpy(buffer + (start - position), contents + offset + sizeof(record_header_t) + (start - record->position), end - start);
+        if (end - position > reach)
+        {
+            reach = end - position;
+        }
+    }
+    return reach;
+}
+
+// How many bytes from position on come before the part of the range the
+// log holds, unbroken to its end, in records not yet on the card.  Those
+// already copied may have been erased, so without the card those bytes
+// cannot be read.
+uint32_t flash_log_unheld(uint32_t position, size_t size)
+{
+    uint32_t unheld = size;
+    bool grew = mounted;
+    while (grew && unheld > 0)
+    {
+        grew = false;
+        cursor_t cursor = {0, 0};
+        uint32_t offset;
+        while (record_next(&cursor, &offset))
+        {
+            const record_header_t *record = record_at(offset);
+            uint32_t end = record->position + record->length;
+            if (record_live(record) && record->position < position + unheld && end >= position + unheld)
+            {
+                unheld = record->position > position ? record->position - position : 0;
+                grew = true;
+            }
+        }
+    }
+    return unheld;
+}
+
+uint32_t flash_log_end(void)
+{
+    return log_end;
+}
+
+uint32_t flash_log_unmirrored(void)
+{
+    return unmirrored;
+}
+
+//
+// Copying to the card
+//
+
+// The oldest record not yet on the card when record->data is NULL, else
+// the one after record
+bool flash_log_next_unmirrored(flash_log_record_t *record)
+{
+    if (!mounted || unmirrored == 0)
+    {
+        return false;
+    }
+
+    cursor_t cursor = mirror_cursor;
+    bool from_start = record->data == NULL;
+    if (!from_start)
+    {
+        // Carry on after the record given
+        uint32_t sector = record->offset / FLASH_LOG_SECTOR_SIZE;
+        cursor.index = 0;
+        while (cursor.index < order_count && order[cursor.index] != sector)
+        {
+            cursor.index++;
+        }
+        cursor.offset = record->offset % FLASH_LOG_SECTOR_SIZE + record_size(record->length);
+    }
+
+    uint32_t offset;
+    while (record_next(&cursor, &offset))
+    {
+        const record_header_t *header = record_at(offset);
+        if (record_live(header))
+        {
+            record->position = header->position;
+            record->length = header->length;
+            record->data = contents + offset + sizeof(record_header_t);
+            record->offset = offset;
+            return true;
+        }
+        if (from_start)
+        {
+            mirror_cursor = cursor;
+        }
+    }
+    return false;
+}
+
+flash_log_error_t flash_log_mark_mirrored(const flash_log_record_t *record)
+{
+    const record_header_t *header = record_at(record->offset);
+    if (!record_live(header))
+    {
+        return FLASH_LOG_OK;
+    }
+
+    uint8_t flags = header->flags & ~RECORD_MIRRORED;
+    if (!program(record->offset + offsetof(record_header_t, flags), &flags, 1))
+    {
+        return FLASH_LOG_FLASH_FAILED;
+    }
+    unmirrored -= record->length;
+    return FLASH_LOG_OK;
+}
+
+// Erase the oldest sector if all it holds is on the card, so the time it
+// takes is spent while nothing is waiting rather than in an append
+flash_log_error_t flash_log_tidy(void)
+{
+    if (!mounted || order_count < 2)
+    {
+        return FLASH_LOG_OK;
+    }
+
+    cursor_t cursor = {0, 0};
+    uint32_t offset;
+    while (cursor.index == 0 && record_next(&cursor, &offset))
+    {
+        if (record_live(record_at(offset)))
+        {
+            return FLASH_LOG_OK;
+        }
+    }
+    return reclaim();
+}
+
+//
+// Statistics
+//
+
+void flash_log_get_stats(flash_log_stats_t *out)
+{
+    *out = stats;
+    out->min_erases = UINT32_MAX;
+    out->max_erases = 0;
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        if (sectors[s].erase_count < out->min_erases)
+        {
+            out->min_erases = sectors[s].erase_count;
+        }
+        if (sectors[s].erase_count > out->max_erases)
+        {
+            out->max_erases = sectors[s].erase_count;
+        }
+    }
+    if (sector_count == 0)
+    {
+        out->min_erases = 0;
+    }
+}
+
+void flash_log_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+//
+// RP2040 flash access
+//
+
+#ifndef FLASH_LOG_HOST
+
+// Set aside in memmap_default_rp2040.ld
+extern uint8_t __flash_log_start[];
+extern uint8_t __flash_log_end[];
+
+uint32_t flash_log_hw_size(void)
+{
+    return __flash_log_end - __flash_log_start;
+}
+
+const uint8_t *flash_log_hw_contents(void)
+{
+    return __flash_log_start;
+}
+
+bool flash_log_hw_erase(uint32_t offset)
+{
+    return flash_hw_erase(flash_hw_offset(__flash_log_start) + offset);
+}
+
+bool flash_log_hw_program(uint32_t offset, const void *data, size_t size)
+{
+    return flash_hw_program(flash_hw_offset(__flash_log_start) + offset, data, size);
+}
+
+#endif
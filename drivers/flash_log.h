@@ -0,0 +1,97 @@
+#pragma once
+
+//
+//  Log-structured store in on-board flash
+//
+//  Keeps tape bytes in a region of the QSPI flash set aside past the
+//  firmware (FLASH_LOG in memmap_default_rp2040.ld), so a save does not
+//  need the SD card.  Each record holds a run of bytes for a position on
+//  the tape and is only ever appended; a later record covering the same
+//  bytes wins.  Records are copied to the card when there is one and then
+//  marked mirrored, after which they only take up space until their
+//  erase block is erased.
+//
+//  NOR flash can only turn 1 bits into 0 bits, and only a whole 4 KB
+//  sector can be turned back to 1s.  Every step of a record (written,
+//  committed, mirrored) clears a flag bit, so nothing is rewritten in
+//  place and a power failure part way through an append of up to
+//  FLASH_LOG_MAX_RECORD bytes leaves either all of it or none.  When the
+//  sector being written is full the erased sector that has been erased
+//  least is taken next; when none is left the oldest sector is compacted,
+//  copying out whatever it holds that is neither mirrored nor written
+//  over since, and erased.
+//
+//  Flash is reached through the flash_log_hw_* calls, implemented in
+//  flash_log.c for the RP2040 and by bench/nor_flash_sim.c on the host.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FLASH_LOG_SECTOR_SIZE (4096) // Erase block
+#define FLASH_LOG_PAGE_SIZE (256)    // Most one program operation writes
+
+// Most sectors the region may have, the 256 KB set aside
+#ifndef FLASH_LOG_MAX_SECTORS
+#define FLASH_LOG_MAX_SECTORS (64)
+#endif
+
+// Largest record, a sector less its header and the record's own
+#define FLASH_LOG_MAX_RECORD (FLASH_LOG_SECTOR_SIZE - 16 - 8)
+
+typedef enum
+{
+    FLASH_LOG_OK = 0,
+    FLASH_LOG_NOT_MOUNTED,
+    FLASH_LOG_FULL,        // Every sector holds bytes that are not on the card
+    FLASH_LOG_FLASH_FAILED // Programming or erasing did not take
+} flash_log_error_t;
+
+// A record as it sits in flash, data points into the flash itself
+typedef struct
+{
+    uint32_t position;
+    uint16_t length;
+    const uint8_t *data;
+    uint32_t offset; // Where the record is in the region
+} flash_log_record_t;
+
+typedef struct
+{
+    uint32_t appends;      // Records written for callers
+    uint32_t bytes;        // and the bytes in them
+    uint32_t copies;       // Records written by compaction
+    uint32_t programs;     // Program operations, one per page touched
+    uint32_t erases;       // Sectors erased
+    uint32_t compactions;  // Erases that had to copy records out first
+    uint32_t min_erases;   // Fewest and most times any sector has been erased
+    uint32_t max_erases;
+    uint64_t busy_us;      // Time spent programming and erasing
+} flash_log_stats_t;
+
+// Store
+flash_log_error_t flash_log_mount(void);
+bool flash_log_mounted(void);
+void flash_log_format(void);
+flash_log_error_t flash_log_append(uint32_t position, const void *data, size_t size);
+uint32_t flash_log_read(uint32_t position, uint8_t *buffer, size_t size);
+uint32_t flash_log_unheld(uint32_t position, size_t size);
+uint32_t flash_log_end(void);
+uint32_t flash_log_unmirrored(void);
+
+// Copying to the card, oldest record first.  Start with record.data NULL,
+// and mark records mirrored only once the card has them.
+bool flash_log_next_unmirrored(flash_log_record_t *record);
+flash_log_error_t flash_log_mark_mirrored(const flash_log_record_t *record);
+flash_log_error_t flash_log_tidy(void);
+
+// Statistics
+void flash_log_get_stats(flash_log_stats_t *stats);
+void flash_log_reset_stats(void);
+
+// Flash access, offsets are from the start of the region
+uint32_t flash_log_hw_size(void);
+const uint8_t *flash_log_hw_contents(void);
+bool flash_log_hw_erase(uint32_t offset);
+bool flash_log_hw_program(uint32_t offset, const void *data, size_t size);
@@ -0,0 +1,703 @@
+//
+// I/O service for the PicoCalc
+//
+// Carries out SD card and FAT32 requests on the second core, see io_service.h.
+//
+// The host build (IO_SERVICE_PTHREAD) runs the service on a pthread instead,
+// so the ordering of requests and what is on the card after a crash can be
+// checked on the development machine, see bench/io_check.c.
+//
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#ifdef IO_SERVICE_PTHREAD
+#include <pthread.h>
+#else
+#include "pico/multicore.h"
+#include "pico/flash.h"
+#include "hardware/sync.h"
+#endif
+
+#include "sdcard.h"
+#include "io_service.h"
+
+#define IO_QUEUE_MASK (IO_QUEUE_SIZE - 1)
+#define IO_WRITE_BUFFER_MASK (IO_WRITE_BUFFER_SIZE - 1)
+
+_Static_assert((IO_QUEUE_SIZE & IO_QUEUE_MASK) == 0, "IO_QUEUE_SIZE must be a power of two");
+_Static_assert((IO_WRITE_BUFFER_SIZE & IO_WRITE_BUFFER_MASK) == 0, "IO_WRITE_BUFFER_SIZE must be a power of two");
+
+typedef enum
+{
+    IO_OPEN,
+    IO_CLOSE,
+    IO_READ,
+    IO_WRITE,
+    IO_RESERVE,
+    IO_SYNC,
+    IO_CLAIM,
+    IO_STOP,
+} io_op_t;
+
+typedef struct
+{
+    io_ticket_t ticket;
+    uint8_t op;        // io_op_t
+    bool create;       // IO_OPEN: create the file if it is not there
+    int16_t handle;
+    const char *path;  // IO_OPEN
+    uint32_t position; // IO_READ, IO_WRITE
+    uint32_t size;     // IO_READ, IO_WRITE, bytes for IO_RESERVE
+    void *buffer;      // IO_READ: where the bytes go, IO_WRITE: where they are
+    uint32_t data_end; // IO_WRITE: write-back buffer consumed once written
+} io_request_t;
+
+typedef struct
+{
+    io_ticket_t ticket;
+    fat32_error_t status;
+    uint32_t size;     // Bytes read, or the size of a file opened
+    int16_t handle;    // File opened
+} io_completion_t;
+
+// What the submitting core keeps of a request until it is collected
+typedef struct
+{
+    uint8_t op;
+    fat32_error_t status;
+    uint32_t size;
+    int16_t handle;
+    io_read_result_t *owner; // Copied here too when the request completes
+} io_result_t;
+
+//
+//  Rings
+//
+//  Each index is written by one core only and read by the other with
+//  acquire/release ordering, so a slot is filled in before the index that
+//  hands it over moves on.  Loads and stores of aligned words are atomic on
+//  the Cortex-M0+, which has no read-modify-write atomics to need.
+//
+
+static io_request_t requests[IO_QUEUE_SIZE];
+static volatile uint32_t request_head = 0; // Written by the submitting core
+static io_completion_t completions[IO_QUEUE_SIZE];
+static volatile uint32_t completion_head = 0; // Written by the service
+
+static uint8_t write_data[IO_WRITE_BUFFER_SIZE] __attribute__((aligned(4)));
+static volatile uint32_t write_tail = 0;  // Written by the service, bytes consumed
+static volatile uint32_t claim_released = 0; // Written by the submitting core, the claim over
+
+static inline uint32_t load_acquire(const volatile uint32_t *index)
+{
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(volatile uint32_t *index, uint32_t value)
+{
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+// Submitting core
+static bool running = false;
+static io_ticket_t next_ticket = 1;
+static io_ticket_t reaped = 0;          // Every ticket up to this one has completed
+static uint32_t completion_tail = 0;
+static uint32_t write_head = 0;         // Bytes put in the write-back buffer
+static fat32_error_t write_error = FAT32_OK;
+static int claim_depth = 0;
+static io_ticket_t claim_ticket = 0;
+static io_result_t results[IO_QUEUE_SIZE];
+static io_stats_t stats;
+
+// Service core
+static uint32_t request_tail = 0;
+static fat32_file_t files[IO_MAX_FILES];
+static io_file_stats_t file_stats[IO_MAX_FILES];
+static uint64_t busy_us = 0;
+static io_ticket_t parked_ticket = 0;   // The claim the service is parked for
+
+//
+//  Waking the other side
+//
+//  On the RP2040 a core that runs out of work waits for an event, and the
+//  other core sends one after moving an index.  The host build does the
+//  same with a condition variable.
+//
+
+#ifdef IO_SERVICE_PTHREAD
+static pthread_t service_thread;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+static void io_signal(void)
+{
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_broadcast(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+static void io_sleep_until(bool (*ready)(void))
+{
+    pthread_mutex_lock(&wake_lock);
+    while (!ready())
+    {
+        pthread_cond_wait(&wake_cond, &wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+}
+#else
+static uint32_t service_stack[IO_SERVICE_STACK_SIZE / sizeof(uint32_t)];
+
+static void io_signal(void)
+{
+    __sev();
+}
+
+static void io_sleep_until(bool (*ready)(void))
+{
+    while (!ready())
+    {
+        __wfe();
+    }
+}
+#endif
+
+static bool request_waiting(void)
+{
+    return load_acquire(&request_head) != request_tail;
+}
+
+static bool completion_waiting(void)
+{
+    return load_acquire(&completion_head) != completion_tail;
+}
+
+// Released claims are told apart by their tickets, so the service cannot
+// miss a release followed straight away by another claim
+static bool claim_over(void)
+{
+    return load_acquire(&claim_released) == parked_ticket;
+}
+
+static uint32_t write_room_wanted;
+
+static bool write_room(void)
+{
+    return write_head + write_room_wanted - load_acquire(&write_tail) <= IO_WRITE_BUFFER_SIZE;
+}
+
+//
+//  Carrying out requests
+//
+
+static fat32_file_t *service_file(int handle)
+{
+    if (handle < 0 || handle >= IO_MAX_FILES || !files[handle].is_open)
+    {
+        return NULL;
+    }
+    return &files[handle];
+}
+
+static void io_execute(const io_request_t *request, io_completion_t *completion)
+{
+    fat32_file_t *file = service_file(request->handle);
+    fat32_error_t status = FAT32_OK;
+    size_t bytes = 0;
+    sd_stats_t before;
+
+    completion->ticket = request->ticket;
+    completion->size = 0;
+    completion->handle = request->handle;
+
+    sd_get_stats(&before);
+    switch (request->op)
+    {
+    case IO_OPEN:
+        completion->handle = -1;
+        for (int i = 0; i < IO_MAX_FILES; i++)
+        {
+            if (!files[i].is_open)
+            {
+                status = fat32_open(&files[i], request->path);
+                if (status == FAT32_ERROR_FILE_NOT_FOUND && request->create)
+                {
+                    status = fat32_create(&files[i], request->path);
+                }
+                if (status == FAT32_OK)
+                {
+                    memset(&file_stats[i], 0, sizeof(file_stats[i]));
+                    completion->handle = i;
+                    completion->size = fat32_size(&files[i]);
+                }
+                break;
+            }
+        }
+        if (completion->handle < 0 && status == FAT32_OK)
+        {
+            status = FAT32_ERROR_INVALID_PARAMETER; // No free handle
+        }
+        file = NULL; // Counted against the file once it is open
+        break;
+
+    case IO_CLOSE:
+        status = file ? fat32_close(file) : FAT32_ERROR_INVALID_PARAMETER;
+        break;
+
+    case IO_READ:
+        status = file ? fat32_seek(file, request->position) : FAT32_ERROR_INVALID_PARAMETER;
+        if (status == FAT32_OK)
+        {
+            status = fat32_read(file, request->buffer, request->size, &bytes);
+        }
+        completion->size = bytes;
+        break;
+
+    case IO_WRITE:
+        status = file ? fat32_seek(file, request->position) : FAT32_ERROR_INVALID_PARAMETER;
+        if (status == FAT32_OK)
+        {
+            status = fat32_write(file, request->buffer, request->size, &bytes);
+        }
+        if (status == FAT32_OK && bytes != request->size)
+        {
+            status = FAT32_ERROR_WRITE_FAILED;
+        }
+        completion->size = bytes;
+        break;
+
+    case IO_RESERVE:
+        status = file ? fat32_reserve(file, request->size) : FAT32_ERROR_INVALID_PARAMETER;
+        break;
+
+    case IO_SYNC:
+        status = fat32_sync();
+        break;
+
+    default: // IO_CLAIM and IO_STOP only need to be reached
+        break;
+    }
+
+    if (file != NULL)
+    {
+        sd_stats_t after;
+        sd_get_stats(&after);
+        file_stats[request->handle].sd_reads += after.read_commands - before.read_commands;
+        file_stats[request->handle].sd_writes += after.write_commands - before.write_commands;
+    }
+    completion->status = status;
+}
+
+static void io_service_main(void)
+{
+    for (;;)
+    {
+        io_sleep_until(request_waiting);
+
+        const io_request_t *request = &requests[request_tail & IO_QUEUE_MASK];
+        io_op_t op = request->op;
+        parked_ticket = request->ticket;
+        io_completion_t completion;
+
+        uint64_t started = time_us_64();
+        io_execute(request, &completion);
+        busy_us += time_us_64() - started;
+
+        // The request's slot and data may be reused once it has completed
+        if (op == IO_WRITE)
+        {
+            store_release(&write_tail, request->data_end);
+        }
+        request_tail++;
+
+        completions[completion_head & IO_QUEUE_MASK] = completion;
+        store_release(&completion_head, completion_head + 1);
+        io_signal();
+
+        if (op == IO_CLAIM)
+        {
+            io_sleep_until(claim_over);
+        }
+        else if (op == IO_STOP)
+        {
+            return;
+        }
+    }
+}
+
+#ifdef IO_SERVICE_PTHREAD
+static void *io_service_thread(void *arg)
+{
+    (void)arg;
+    io_service_main();
+    return NULL;
+}
+#else
+// The service runs from flash as well, so it agrees to be parked while
+// core 0 programs the tape's flash log (flash_safe_execute)
+static void io_service_core1(void)
+{
+    flash_safe_execute_core_init();
+    io_service_main();
+}
+#endif
+
+//
+//  Submitting requests
+//
+
+static void complete_owner(io_result_t *result)
+{
+    if (result->owner != NULL)
+    {
+        result->owner->status = result->status;
+        result->owner->size = result->size;
+        result->owner->done = true;
+        result->owner = NULL;
+    }
+}
+
+// Collect whatever the service has completed
+static void io_reap(void)
+{
+    uint32_t head = load_acquire(&completion_head);
+    while (completion_tail != head)
+    {
+        const io_completion_t *completion = &completions[completion_tail & IO_QUEUE_MASK];
+        io_result_t *result = &results[completion->ticket & IO_QUEUE_MASK];
+
+        result->status = completion->status;
+        result->size = completion->size;
+        result->handle = completion->handle;
+        if (result->op == IO_WRITE && result->status != FAT32_OK && write_error == FAT32_OK)
+        {
+            write_error = result->status; // Handed back by the next io_write or io_sync
+        }
+        complete_owner(result);
+        reaped = completion->ticket;
+        completion_tail++;
+    }
+}
+
+static fat32_error_t take_write_error(void)
+{
+    fat32_error_t status = write_error;
+    write_error = FAT32_OK;
+    return status;
+}
+
+static io_ticket_t io_submit_to(io_request_t *request, io_read_result_t *owner)
+{
+    stats.requests++;
+
+    if (!running || claim_depth > 0)
+    {
+        // This core owns the file system, so do it here and now
+        io_completion_t completion;
+        request->ticket = next_ticket++;
+        results[request->ticket & IO_QUEUE_MASK].op = request->op;
+        results[request->ticket & IO_QUEUE_MASK].owner = owner;
+        io_execute(request, &completion);
+        stats.inline_requests++;
+
+        io_result_t *result = &results[request->ticket & IO_QUEUE_MASK];
+        result->status = completion.status;
+        result->size = completion.size;
+        result->handle = completion.handle;
+        if (request->op == IO_WRITE && completion.status != FAT32_OK && write_error == FAT32_OK)
+        {
+            write_error = completion.status;
+        }
+        complete_owner(result);
+        reaped = request->ticket;
+        return request->ticket;
+    }
+
+    io_reap();
+    if (next_ticket - 1 - reaped >= IO_QUEUE_SIZE)
+    {
+        stats.write_stalls += request->op == IO_WRITE;
+        do
+        {
+            io_sleep_until(completion_waiting);
+            io_reap();
+        } while (next_ticket - 1 - reaped >= IO_QUEUE_SIZE);
+    }
+
+    request->ticket = next_ticket++;
+    results[request->ticket & IO_QUEUE_MASK].op = request->op;
+    results[request->ticket & IO_QUEUE_MASK].owner = owner;
+    requests[request_head & IO_QUEUE_MASK] = *request;
+    store_release(&request_head, request_head + 1);
+    io_signal();
+    return request->ticket;
+}
+
+static io_ticket_t io_submit(io_request_t *request)
+{
+    return io_submit_to(request, NULL);
+}
+
+bool io_done(io_ticket_t ticket)
+{
+    io_reap();
+    return (int32_t)(reaped - ticket) >= 0;
+}
+
+// Wait for a request to complete, its result can be collected until
+// IO_QUEUE_SIZE more requests have been submitted
+fat32_error_t io_wait(io_ticket_t ticket, size_t *bytes)
+{
+    if (!io_done(ticket))
+    {
+        stats.read_waits++;
+        do
+        {
+            io_sleep_until(completion_waiting);
+        } while (!io_done(ticket));
+    }
+
+    const io_result_t *result = &results[ticket & IO_QUEUE_MASK];
+    if (bytes)
+    {
+        *bytes = result->size;
+    }
+    return result->op == IO_WRITE ? FAT32_OK : result->status;
+}
+
+// Wait for a read started with io_read_to(), which can be any time later
+fat32_error_t io_wait_result(io_read_result_t *result, size_t *bytes)
+{
+    io_reap();
+    if (!result->done)
+    {
+        stats.read_waits++;
+        do
+        {
+            io_sleep_until(completion_waiting);
+            io_reap();
+        } while (!result->done);
+    }
+
+    if (bytes)
+    {
+        *bytes = result->size;
+    }
+    return result->status;
+}
+
+//
+//  Service control
+//
+
+void io_service_start(void)
+{
+    if (running)
+    {
+        return;
+    }
+
+    // The service takes over from here, with nothing queued
+    request_head = request_tail = 0;
+    completion_head = completion_tail = 0;
+    write_head = write_tail = 0;
+    claim_released = 0;
+    claim_depth = 0;
+    running = true;
+
+#ifdef IO_SERVICE_PTHREAD
+    pthread_create(&service_thread, NULL, io_service_thread, NULL);
+#else
+    multicore_launch_core1_with_stack(io_service_core1, service_stack, sizeof(service_stack));
+    while (!multicore_lockout_victim_is_initialized(1))
+    {
+        tight_loop_contents(); // Flash can be programmed once it is
+    }
+#endif
+}
+
+// Let the service finish what is queued and hand the file system back
+void io_service_stop(void)
+{
+    if (!running || claim_depth > 0)
+    {
+        return;
+    }
+
+    io_request_t request = {.op = IO_STOP};
+    io_wait(io_submit(&request), NULL);
+    running = false;
+
+#ifdef IO_SERVICE_PTHREAD
+    pthread_join(service_thread, NULL);
+#endif
+}
+
+bool io_service_running(void)
+{
+    return running;
+}
+
+// Take the file system for this core until io_release(), calls nest
+void io_claim(void)
+{
+    if (running && claim_depth == 0)
+    {
+        io_request_t request = {.op = IO_CLAIM};
+        claim_ticket = io_submit(&request);
+        io_wait(claim_ticket, NULL);
+    }
+    claim_depth++;
+}
+
+void io_release(void)
+{
+    if (claim_depth > 0 && --claim_depth == 0 && running)
+    {
+        store_release(&claim_released, claim_ticket);
+        io_signal();
+    }
+}
+
+//
+//  File operations
+//
+
+fat32_error_t io_open(const char *path, bool create, io_handle_t *handle, uint32_t *size)
+{
+    io_request_t request = {.op = IO_OPEN, .create = create, .handle = -1, .path = path};
+    io_ticket_t ticket = io_submit(&request);
+    size_t bytes = 0;
+    fat32_error_t status = io_wait(ticket, &bytes);
+
+    *handle = results[ticket & IO_QUEUE_MASK].handle;
+    if (size)
+    {
+        *size = bytes;
+    }
+    return status;
+}
+
+// Close a file, waiting for its writes to reach the card
+fat32_error_t io_close(io_handle_t handle)
+{
+    io_request_t request = {.op = IO_CLOSE, .handle = handle};
+    fat32_error_t status = io_wait(io_submit(&request), NULL);
+    fat32_error_t pending = take_write_error();
+    return pending != FAT32_OK ? pending : status;
+}
+
+// Start reading size bytes at position into buffer, which must stay put
+// until io_wait() says how many bytes were read
+io_ticket_t io_read(io_handle_t handle, uint32_t position, void *buffer, size_t size)
+{
+    io_request_t request = {.op = IO_READ, .handle = handle, .position = position,
+                            .size = size, .buffer = buffer};
+    return io_submit(&request);
+}
+
+// The same as io_read(), with the result put in *result when it completes
+void io_read_to(io_handle_t handle, uint32_t position, void *buffer, size_t size,
+                io_read_result_t *result)
+{
+    io_request_t request = {.op = IO_READ, .handle = handle, .position = position,
+                            .size = size, .buffer = buffer};
+    result->done = false;
+    result->ticket = io_submit_to(&request, result);
+}
+
+// Write size bytes at position, the data is copied so the caller can
+// reuse it straight away.  Returns an error from an earlier write if one
+// has been found since the last io_write or io_sync.
+fat32_error_t io_write(io_handle_t handle, uint32_t position, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    while (size > 0)
+    {
+        io_request_t request = {.op = IO_WRITE, .handle = handle, .position = position};
+        uint32_t chunk = size < IO_WRITE_BUFFER_SIZE / 2 ? size : IO_WRITE_BUFFER_SIZE / 2;
+
+        if (!running || claim_depth > 0)
+        {
+            chunk = size; // Written straight from the caller's data
+            request.buffer = (void *)bytes;
+        }
+        else
+        {
+            // Each write's data is kept in one piece, skip what is left
+            // at the end of the buffer if it does not fit there
+            uint32_t offset = write_head & IO_WRITE_BUFFER_MASK;
+            write_room_wanted = chunk + (offset + chunk > IO_WRITE_BUFFER_SIZE ? IO_WRITE_BUFFER_SIZE - offset : 0);
+            if (!write_room())
+            {
+                stats.write_stalls++;
+                io_sleep_until(write_room);
+            }
+            if (offset + chunk > IO_WRITE_BUFFER_SIZE)
+            {
+                write_head += IO_WRITE_BUFFER_SIZE - offset;
+                offset = 0;
+            }
+
+            memcpy(&write_data[offset], bytes, chunk);
+            write_head += chunk;
+            request.buffer = &write_data[offset];
+            request.data_end = write_head;
+        }
+
+        request.size = chunk;
+        io_submit(&request);
+        stats.bytes_written += chunk;
+        bytes += chunk;
+        position += chunk;
+        size -= chunk;
+    }
+
+    return take_write_error();
+}
+
+// Give a file clusters for this many bytes ahead of it being written,
+// failing (the card is full, say) is not an error worth reporting
+void io_reserve(io_handle_t handle, uint32_t bytes)
+{
+    io_request_t request = {.op = IO_RESERVE, .handle = handle, .size = bytes};
+    io_submit(&request);
+}
+
+// Wait for everything submitted so far to reach the card
+fat32_error_t io_sync(void)
+{
+    io_request_t request = {.op = IO_SYNC};
+    fat32_error_t status = io_wait(io_submit(&request), NULL);
+    fat32_error_t pending = take_write_error();
+    return pending != FAT32_OK ? pending : status;
+}
+
+//
+//  Statistics
+//
+
+void io_get_stats(io_stats_t *out)
+{
+    *out = stats;
+    out->busy_us = busy_us;
+}
+
+void io_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    busy_us = 0;
+}
+
+void io_get_file_stats(io_handle_t handle, io_file_stats_t *out)
+{
+    if (handle < 0 || handle >= IO_MAX_FILES)
+    {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    *out = file_stats[handle];
+}
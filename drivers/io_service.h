@@ -0,0 +1,108 @@
+#pragma once
+
+//
+//  I/O service
+//
+//  Runs the SD card and FAT32 file system on the second core, so a sector
+//  write that keeps the card busy for milliseconds does not stop the
+//  emulator.  Requests go to the service through a submission ring and
+//  their results come back through a completion ring; both are single
+//  producer, single consumer and need no locks.
+//
+//  Once io_service_start() has been called the service core owns the file
+//  system: fat32_* (and with it sector_buffer, fsinfo, current_dir_cluster
+//  and the caches) may only be used from it.  Code on the first core either
+//  goes through the io_* calls below or claims the file system with
+//  io_claim() for a while, which lets the service finish what is queued and
+//  then park until io_release().  While the file system is claimed, or the
+//  service is not running, io_* calls are carried out straight away by the
+//  caller.
+//
+//  Writes are copied into a write-back buffer and acknowledged at once, an
+//  error writing them is handed back by a later io_write() or io_sync().
+//  Requests are carried out in the order they were submitted, so a read
+//  always sees the writes submitted before it.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fat32.h"
+
+// Requests that can be in flight at once, a power of two
+#ifndef IO_QUEUE_SIZE
+#define IO_QUEUE_SIZE (16)
+#endif
+
+// Bytes of written data the service can be holding, a power of two
+#ifndef IO_WRITE_BUFFER_SIZE
+#define IO_WRITE_BUFFER_SIZE (8192)
+#endif
+
+// Files the service can have open at once
+#ifndef IO_MAX_FILES
+#define IO_MAX_FILES (4)
+#endif
+
+// Stack for the service core, the file system nests a few path buffers deep
+#ifndef IO_SERVICE_STACK_SIZE
+#define IO_SERVICE_STACK_SIZE (8192)
+#endif
+
+typedef uint32_t io_ticket_t; // Names a submitted request until it has completed
+typedef int io_handle_t;      // A file opened by the service
+
+typedef struct
+{
+    uint32_t requests;        // Requests submitted
+    uint32_t inline_requests; // Requests carried out by the caller instead
+    uint32_t bytes_written;   // Bytes taken into the write-back buffer
+    uint32_t write_stalls;    // Writes that had to wait for room in the queue or buffer
+    uint32_t read_waits;      // io_wait() calls that found the request still in progress
+    uint64_t busy_us;         // Time the service spent carrying out requests
+} io_stats_t;
+
+// SD traffic the service has caused on behalf of one file
+typedef struct
+{
+    uint32_t sd_reads;  // Read commands issued to the card
+    uint32_t sd_writes; // Write commands issued to the card
+} io_file_stats_t;
+
+// Where the result of a read started with io_read_to() goes, unlike one
+// started with io_read() it can be collected however long after
+typedef struct
+{
+    io_ticket_t ticket;
+    bool done;
+    fat32_error_t status;
+    uint32_t size;
+} io_read_result_t;
+
+// Service control
+void io_service_start(void);
+void io_service_stop(void);
+bool io_service_running(void);
+void io_claim(void);
+void io_release(void);
+
+// File operations
+fat32_error_t io_open(const char *path, bool create, io_handle_t *handle, uint32_t *size);
+fat32_error_t io_close(io_handle_t handle);
+io_ticket_t io_read(io_handle_t handle, uint32_t position, void *buffer, size_t size);
+void io_read_to(io_handle_t handle, uint32_t position, void *buffer, size_t size,
+                io_read_result_t *result);
+fat32_error_t io_write(io_handle_t handle, uint32_t position, const void *data, size_t size);
+void io_reserve(io_handle_t handle, uint32_t bytes);
+fat32_error_t io_sync(void);
+
+// Completion
+bool io_done(io_ticket_t ticket);
+fat32_error_t io_wait(io_ticket_t ticket, size_t *bytes);
+fat32_error_t io_wait_result(io_read_result_t *result, size_t *bytes);
+
+// Statistics
+void io_get_stats(io_stats_t *stats);
+void io_reset_stats(void);
+void io_get_file_stats(io_handle_t handle, io_file_stats_t *stats);
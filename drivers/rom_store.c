@@ -0,0 +1,261 @@
+//
+// BASIC images kept in flash, see rom_store.h.
+//
+
+#include <stddef.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#include "flash_hw.h"
+#include "io_service.h"
+#include "rom_store.h"
+
+#define CATALOG_MAGIC (0x534D4F52) // "ROMS"
+#define CATALOG_VERSION (2)
+#define CATALOG_COPIES (2)
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t sequence; // The copy with the higher one is the catalog
+    rom_store_entry_t entries[ROM_STORE_SLOTS];
+    uint32_t check;    // FNV-1a of everything before it
+} catalog_t;
+
+_Static_assert(sizeof(catalog_t) <= FLASH_SECTOR_SIZE, "a catalog copy takes one sector");
+
+// Set aside in memmap_default_rp2040.ld, the catalog copies and then the slots
+extern uint8_t __flash_rom_start[];
+extern uint8_t __flash_rom_end[];
+
+static uint8_t chunk[FLASH_SECTOR_SIZE]; // A sector of an image on its way in
+
+#define RETURN_ON_ERROR(expr)        \
+    {                                \
+        fat32_error_t _res = (expr); \
+        if (_res != FAT32_OK)        \
+        {                            \
+            return _res;             \
+        }                            \
+    }
+
+static bool region_usable(void)
+{
+    return (size_t)(__flash_rom_end - __flash_rom_start) >=
+           CATALOG_COPIES * FLASH_SECTOR_SIZE + ROM_STORE_SLOTS * ROM_STORE_SLOT_SIZE;
+}
+
+static const catalog_t *catalog_copy(int copy)
+{
+    return (const catalog_t *)(__flash_rom_start + copy * FLASH_SECTOR_SIZE);
+}
+
+static uint32_t catalog_check(const catalog_t *c)
+{
+    return fnv1a(FNV1A_INIT, (const uint8_t *)c, offsetof(catalog_t, check));
+}
+
+// The newest copy written whole, NULL if neither was
+static const catalog_t *catalog(void)
+{
+    const catalog_t *newest = NULL;
+    for (int copy = 0; region_usable() && copy < CATALOG_COPIES; copy++)
+    {
+        const catalog_t *c = catalog_copy(copy);
+        if (c->magic == CATALOG_MAGIC && c->version == CATALOG_VERSION && c->check == catalog_check(c) &&
+            (newest == NULL || c->sequence > newest->sequence))
+        {
+            newest = c;
+        }
+    }
+    return newest;
+}
+
+static uint8_t *slot_start(int slot)
+{
+    return __flash_rom_start + CATALOG_COPIES * FLASH_SECTOR_SIZE + slot * ROM_STORE_SLOT_SIZE;
+}
+
+//
+// Catalog
+//
+
+const rom_store_entry_t *rom_store_entry(int slot)
+{
+    const catalog_t *c = catalog();
+    if (c == NULL || slot < 0 || slot >= ROM_STORE_SLOTS || c->entries[slot].name[0] == '\0')
+    {
+        return NULL;
+    }
+    return &c->entries[slot];
+}
+
+const rom_store_entry_t *rom_store_find(const char *name)
+{
+    for (int slot = 0; slot < ROM_STORE_SLOTS; slot++)
+    {
+        const rom_store_entry_t *entry = rom_store_entry(slot);
+        if (entry != NULL && strncmp(entry->name, name, ROM_STORE_NAME_LEN) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *rom_store_image(const rom_store_entry_t *entry)
+{
+    return slot_start(entry - catalog()->entries);
+}
+
+bool rom_store_load(const char *name, uint8_t *memory, size_t size, uint32_t *loaded)
+{
+    const rom_store_entry_t *entry = rom_store_find(name);
+    if (entry == NULL || entry->size > size || entry->size > ROM_STORE_SLOT_SIZE)
+    {
+        return false;
+    }
+
+    memcpy(memory, rom_store_image(entry), entry->size);
+    if (fnv1a(FNV1A_INIT, memory, entry->size) != entry->hash)
+    {
+        return false; // Its store was cut short
+    }
+    *loaded = entry->size;
+    return true;
+}
+
+//
+// Storing
+//
+
+static fat32_error_t read_chunk(io_handle_t file, uint32_t position, uint32_t size)
+{
+    size_t bytes_read = 0;
+    uint32_t want = size - position < sizeof(chunk) ? size - position : sizeof(chunk);
+    RETURN_ON_ERROR(io_wait(io_read(file, position, chunk, want), &bytes_read));
+    return bytes_read == want ? FAT32_OK : FAT32_ERROR_READ_FAILED;
+}
+
+static fat32_error_t hash_file(io_handle_t file, uint32_t size, uint32_t *hash)
+{
+    *hash = FNV1A_INIT;
+    for (uint32_t position = 0; position < size; position += sizeof(chunk))
+    {
+        RETURN_ON_ERROR(read_chunk(file, position, size));
+        uint32_t part = size - position < sizeof(chunk) ? size - position : sizeof(chunk);
+        *hash = fnv1a(*hash, chunk, part);
+    }
+    return FAT32_OK;
+}
+
+// Program the file into a slot, checking it is the file that was hashed
+static fat32_error_t program_file(io_handle_t file, uint32_t size, int slot, uint32_t hash)
+{
+    uint32_t offset = flash_hw_offset(slot_start(slot));
+    uint32_t check = FNV1A_INIT;
+
+    for (uint32_t position = 0; position < size; position += sizeof(chunk))
+    {
+        RETURN_ON_ERROR(read_chunk(file, position, size));
+        uint32_t part = size - position < sizeof(chunk) ? size - position : sizeof(chunk);
+        if (!flash_hw_erase(offset + position) || !flash_hw_program(offset + position, chunk, part))
+        {
+            return FAT32_ERROR_WRITE_FAILED;
+        }
+        check = fnv1a(check, chunk, part);
+    }
+    return check == hash ? FAT32_OK : FAT32_ERROR_READ_FAILED;
+}
+
+static fat32_error_t store(io_handle_t file, const char *path, uint32_t size, bool *stored)
+{
+    uint32_t hash;
+    RETURN_ON_ERROR(hash_file(file, size, &hash));
+
+    const rom_store_entry_t *entry = rom_store_find(path);
+    if (entry != NULL && entry->size == size && entry->hash == hash &&
+        fnv1a(FNV1A_INIT, rom_store_image(entry), size) == hash)
+    {
+        return FAT32_OK; // Already there
+    }
+
+    static catalog_t updated;
+    const catalog_t *current = catalog();
+    if (current != NULL)
+    {
+        updated = *current;
+    }
+    else
+    {
+        memset(&updated, 0, sizeof(updated));
+        updated.magic = CATALOG_MAGIC;
+        updated.version = CATALOG_VERSION;
+    }
+
+    // An empty slot, so the copy there now stays whole until the new
+    // catalog is written, or failing that its own slot again
+    int old_slot = entry != NULL ? entry - current->entries : -1;
+    int slot = -1;
+    for (int s = 0; slot < 0 && s < ROM_STORE_SLOTS; s++)
+    {
+        if (updated.entries[s].name[0] == '\0')
+        {
+            slot = s;
+        }
+    }
+    if (slot < 0)
+    {
+        slot = old_slot;
+    }
+    if (slot < 0)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    RETURN_ON_ERROR(program_file(file, size, slot, hash));
+
+    if (old_slot >= 0)
+    {
+        memset(&updated.entries[old_slot], 0, sizeof(updated.entries[old_slot]));
+    }
+    rom_store_entry_t *e = &updated.entries[slot];
+    memset(e, 0, sizeof(*e));
+    strncpy(e->name, path, sizeof(e->name) - 1);
+    e->size = size;
+    e->hash = hash;
+
+    // Over the older copy, the current one is used until this is whole
+    int copy = current == catalog_copy(0) ? 1 : 0;
+    updated.sequence = current != NULL ? current->sequence + 1 : 1;
+    updated.check = catalog_check(&updated);
+    uint32_t offset = flash_hw_offset(catalog_copy(copy));
+    if (!flash_hw_erase(offset) || !flash_hw_program(offset, &updated, sizeof(updated)))
+    {
+        return FAT32_ERROR_WRITE_FAILED;
+    }
+    *stored = true;
+    return FAT32_OK;
+}
+
+fat32_error_t rom_store_save(const char *path, bool *stored)
+{
+    *stored = false;
+    if (!region_usable() || strlen(path) >= ROM_STORE_NAME_LEN)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    io_handle_t file;
+    uint32_t size = 0;
+    RETURN_ON_ERROR(io_open(path, false, &file, &size));
+    fat32_error_t status = size > 0 && size <= ROM_STORE_SLOT_SIZE
+                               ? store(file, path, size, stored)
+                               : FAT32_ERROR_INVALID_PARAMETER;
+    io_close(file);
+    return status;
+}
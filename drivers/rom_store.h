@@ -0,0 +1,52 @@
+#pragma once
+
+//
+//  BASIC images kept in flash
+//
+//  Images such as /Altair/basicload.bin are copied from the SD card into
+//  a region of the QSPI flash set aside past the firmware (FLASH_ROM in
+//  memmap_default_rp2040.ld), so BASIC can be started with a memcpy from
+//  XIP flash instead of a read from the card, or with no card at all.
+//  The region starts with two catalog sectors naming each image by the
+//  path it was stored from, with its size and FNV-1a hash (the hash
+//  basic.c fingerprints images with), followed by a fixed size slot per
+//  image.
+//
+//  Storing an image reads the file once to hash it and, only if that
+//  differs from the copy in flash, again to program it, into a free slot
+//  when there is one.  The catalog is written last, over the older of
+//  the two copies, and carries a sequence number and its own hash, so
+//  power lost while it is written leaves the previous catalog in use.  An
+//  image is only loaded if it still hashes as the catalog says, so a
+//  store cut short leaves BASIC to be read from the card as before.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fat32.h"
+#include "crc.h"
+
+#define ROM_STORE_SLOTS (4)
+#define ROM_STORE_SLOT_SIZE (32 * 1024) // Largest image
+#define ROM_STORE_NAME_LEN (48)
+
+typedef struct
+{
+    char name[ROM_STORE_NAME_LEN]; // Path the image was stored from, "" for an empty slot
+    uint32_t size;
+    uint32_t hash;
+} rom_store_entry_t;
+
+// Catalog
+const rom_store_entry_t *rom_store_entry(int slot);
+const rom_store_entry_t *rom_store_find(const char *name);
+const uint8_t *rom_store_image(const rom_store_entry_t *entry);
+
+// Copy an image into memory, false if it is not in flash whole
+bool rom_store_load(const char *name, uint8_t *memory, size_t size, uint32_t *loaded);
+
+// Copy a file from the card into flash unless it is there already.  Uses
+// the I/O service, and parks the other core while flash is programmed.
+fat32_error_t rom_store_save(const char *path, bool *stored);
@@ -18,11 +18,14 @@
 #include "hardware/spi.h"
 
 #include "sdcard.h"
+#include "crc.h"
 
 // Global state
 static bool sd_initialised = false;
 static bool is_sdhc = false;                                                      // Set this in sd_card_init()
+static bool crc_enabled = false;                                                  // The card checks CRCs, set by CMD59
 static uint8_t dummy_bytes[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}; // Dummy bytes for SPI read/write
+static sd_stats_t sd_stats = {0};                                                 // Block-level I/O counters
 
 //
 // Low-level SD card SPI functions
@@ -62,13 +65,14 @@ static void sd_spi_read_buf(uint8_t *dst, size_t len)
 
 static bool sd_wait_ready(void)
 {
+    // The card holds MISO low while it is busy programming, which can take
+    // far longer than any command response
     uint8_t response;
-    uint32_t timeout = 10000; // Add timeout to prevent infinite loop
+    uint32_t start = time_us_32();
     do
     {
         response = sd_spi_write_read(0xFF);
-        timeout--;
-        if (timeout == 0)
+        if (time_us_32() - start > SD_BUSY_TIMEOUT_US)
         {
             return false; // Timeout occurred
         }
@@ -76,6 +80,18 @@ static bool sd_wait_ready(void)
     return true; // Success
 }
 
+static bool sd_wait_data_token(void)
+{
+    uint8_t response;
+    uint32_t timeout = 100000;
+    do
+    {
+        response = sd_spi_write_read(0xFF);
+        timeout--;
+    } while (response != SD_DATA_START_BLOCK && timeout > 0);
+    return response == SD_DATA_START_BLOCK;
+}
+
 static uint8_t sd_send_command(uint8_t cmd, uint32_t arg)
 {
     uint8_t response;
@@ -89,17 +105,7 @@ static uint8_t sd_send_command(uint8_t cmd, uint32_t arg)
     packet[3] = (arg >> 8) & 0xFF;
     packet[4] = arg & 0xFF;
 
-    // Calculate CRC for specific commands
-    uint8_t crc = 0xFF;
-    if (cmd == SD_CMD0)
-    {
-        crc = 0x95;
-    }
-    if (cmd == SD_CMD8)
-    {
-        crc = 0x87;
-    }
-    packet[5] = crc;
+    packet[5] = crc7(packet, 5);
 
     // Send command
     sd_cs_select();
@@ -135,100 +141,267 @@ bool sd_is_sdhc(void)
 // Block-level read/write operations
 //
 
-sd_error_t sd_read_block(uint32_t block, uint8_t *buffer)
+// Take in a block after waiting for its data token, false if the token
+// never came.  *intact is false if the card is sending CRCs and the one
+// after the block does not match it.
+static bool sd_receive_block(uint8_t *buffer, bool *intact)
 {
-    int32_t addr = is_sdhc ? block : block * SD_BLOCK_SIZE;
-    uint8_t response = sd_send_command(SD_CMD17, addr);
-    if (response != 0)
+    if (!sd_wait_data_token())
     {
-        sd_cs_deselect();
-        return SD_ERROR_READ_FAILED;
+        return false;
     }
 
-    // Wait for data token
-    uint32_t timeout = 100000;
-    do
-    {
-        response = sd_spi_write_read(0xFF);
-        timeout--;
-    } while (response != SD_DATA_START_BLOCK && timeout > 0);
+    sd_spi_read_buf(buffer, SD_BLOCK_SIZE);
 
-    if (timeout == 0)
+    uint16_t crc = sd_spi_write_read(0xFF) << 8;
+    crc |= sd_spi_write_read(0xFF);
+    *intact = !crc_enabled || crc == crc16(buffer, SD_BLOCK_SIZE);
+    if (!*intact)
     {
-        sd_cs_deselect();
-        return SD_ERROR_READ_FAILED;
+        sd_stats.crc_errors++;
     }
+    return true;
+}
 
-    // Read data
-    sd_spi_read_buf(buffer, SD_BLOCK_SIZE);
+// Send a block and its CRC after its data token, returns the data response
+static uint8_t sd_send_block(uint8_t token, const uint8_t *buffer)
+{
+    uint16_t crc = crc_enabled ? crc16(buffer, SD_BLOCK_SIZE) : 0xFFFF;
 
-    // Read CRC (ignore it)
-    sd_spi_write_read(0xFF);
-    sd_spi_write_read(0xFF);
+    sd_spi_write_read(token);
+    sd_spi_write_buf(buffer, SD_BLOCK_SIZE);
+    sd_spi_write_read(crc >> 8);
+    sd_spi_write_read(crc & 0xFF);
 
-    sd_cs_deselect();
-    return SD_OK;
+    uint8_t response = sd_spi_write_read(0xFF) & 0x1F;
+    if (response == SD_DATA_CRC_ERROR)
+    {
+        sd_stats.crc_errors++;
+    }
+    return response;
+}
+
+sd_error_t sd_read_block(uint32_t block, uint8_t *buffer)
+{
+    int32_t addr = is_sdhc ? block : block * SD_BLOCK_SIZE;
+    for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++)
+    {
+        sd_stats.read_commands++;
+        uint8_t response = sd_send_command(SD_CMD17, addr);
+        bool intact = false;
+        if (response != 0 || !sd_receive_block(buffer, &intact))
+        {
+            sd_cs_deselect();
+            return SD_ERROR_READ_FAILED;
+        }
+        sd_cs_deselect();
+
+        if (intact)
+        {
+            sd_stats.blocks_read++;
+            return SD_OK;
+        }
+    }
+    return SD_ERROR_READ_FAILED;
 }
 
 sd_error_t sd_write_block(uint32_t block, const uint8_t *buffer)
 {
     uint32_t addr = is_sdhc ? block : block * SD_BLOCK_SIZE;
-    uint8_t response = sd_send_command(SD_CMD24, addr);
-    if (response != 0)
+    for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++)
     {
+        sd_stats.write_commands++;
+        uint8_t response = sd_send_command(SD_CMD24, addr);
+        if (response != 0)
+        {
+            sd_cs_deselect();
+            return SD_ERROR_WRITE_FAILED;
+        }
+
+        response = sd_send_block(SD_DATA_START_BLOCK, buffer);
         sd_cs_deselect();
-        return SD_ERROR_WRITE_FAILED;
+
+        if (response == SD_DATA_CRC_ERROR)
+        {
+            continue; // Garbled on the way, the card has not touched the block
+        }
+        if (response != SD_DATA_ACCEPTED)
+        {
+            return SD_ERROR_WRITE_FAILED;
+        }
+
+        // Wait for programming to finish
+        sd_cs_select();
+        sd_wait_ready();
+        sd_cs_deselect();
+
+        sd_stats.blocks_written++;
+        return SD_OK;
     }
+    return SD_ERROR_WRITE_FAILED;
+}
 
-    // Send data token
-    sd_spi_write_read(SD_DATA_START_BLOCK);
+// End a multiple block read, the card may still be sending data while CMD12 goes out
+static bool sd_stop_transmission(void)
+{
+    uint8_t packet[6] = {0x40 | SD_CMD12, 0, 0, 0, 0, 0};
+    packet[5] = crc7(packet, 5);
+    sd_spi_write_buf(packet, 6);
+    sd_spi_write_read(0xFF); // Stuff byte
 
-    // Send data
-    sd_spi_write_buf(buffer, SD_BLOCK_SIZE);
+    uint8_t response;
+    uint8_t retry = 0;
+    do
+    {
+        response = sd_spi_write_read(0xFF);
+        retry++;
+    } while ((response & 0x80) && (retry < 64));
 
-    // Send dummy CRC
-    sd_spi_write_read(0xFF);
-    sd_spi_write_read(0xFF);
+    return response == 0 && sd_wait_ready();
+}
 
-    // Check data response
-    response = sd_spi_write_read(0xFF) & 0x1F;
-    sd_cs_deselect();
+// One CMD18 streams the blocks back to back, each behind its own data token.
+// Stops early at a block that fails its CRC, *received says how many came.
+static sd_error_t sd_read_stream(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer, uint32_t *received)
+{
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    sd_stats.read_commands++;
+    uint8_t response = sd_send_command(SD_CMD18, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_READ_FAILED;
+    }
 
-    if (response != 0x05)
+    sd_error_t result = SD_OK;
+    *received = 0;
+    while (*received < num_blocks)
     {
-        return SD_ERROR_WRITE_FAILED;
+        bool intact = false;
+        if (!sd_receive_block(buffer + (*received * SD_BLOCK_SIZE), &intact))
+        {
+            result = SD_ERROR_READ_FAILED;
+            break;
+        }
+        if (!intact)
+        {
+            break;
+        }
+        (*received)++;
+        sd_stats.blocks_read++;
     }
 
-    // Wait for programming to finish
-    sd_cs_select();
-    sd_wait_ready();
+    if (!sd_stop_transmission() && result == SD_OK)
+    {
+        result = SD_ERROR_READ_FAILED;
+    }
     sd_cs_deselect();
-
-    return SD_OK;
+    return result;
 }
 
 sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer)
 {
-    for (uint32_t i = 0; i < num_blocks; i++)
+    if (num_blocks <= 1)
+    {
+        return num_blocks ? sd_read_block(start_block, buffer) : SD_OK;
+    }
+
+    // After a block fails its CRC, start again from it
+    uint32_t done = 0;
+    int retries = 0;
+    while (done < num_blocks)
     {
-        sd_error_t result = sd_read_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
+        uint32_t received = 0;
+        sd_error_t result = sd_read_stream(start_block + done, num_blocks - done, buffer + (done * SD_BLOCK_SIZE), &received);
         if (result != SD_OK)
         {
             return result;
         }
+        done += received;
+        if (done < num_blocks && ++retries > SD_CRC_RETRIES)
+        {
+            return SD_ERROR_READ_FAILED;
+        }
     }
     return SD_OK;
 }
 
+// One CMD25 for the blocks, stopping early at one the card takes to have
+// failed its CRC, *accepted says how many were written
+static sd_error_t sd_write_stream(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer, uint32_t *accepted)
+{
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    sd_stats.write_commands++;
+    uint8_t response = sd_send_command(SD_CMD25, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_WRITE_FAILED;
+    }
+
+    sd_error_t result = SD_OK;
+    *accepted = 0;
+    while (*accepted < num_blocks)
+    {
+        // Check data response, then wait while the block is programmed
+        response = sd_send_block(SD_DATA_START_BLOCK_MULT, buffer + (*accepted * SD_BLOCK_SIZE));
+        if (response == SD_DATA_CRC_ERROR)
+        {
+            break;
+        }
+        if (response != SD_DATA_ACCEPTED || !sd_wait_ready())
+        {
+            result = SD_ERROR_WRITE_FAILED;
+            break;
+        }
+        (*accepted)++;
+        sd_stats.blocks_written++;
+    }
+
+    // Stop token, the card is busy again until everything has been programmed
+    sd_spi_write_read(SD_DATA_STOP_MULT);
+    sd_spi_write_read(0xFF);
+    if (!sd_wait_ready() && result == SD_OK)
+    {
+        result = SD_ERROR_WRITE_FAILED;
+    }
+    sd_cs_deselect();
+    return result;
+}
+
 sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer)
 {
-    for (uint32_t i = 0; i < num_blocks; i++)
+    if (num_blocks <= 1)
     {
-        sd_error_t result = sd_write_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
+        return num_blocks ? sd_write_block(start_block, buffer) : SD_OK;
+    }
+
+    // Tell the card how many blocks are coming so it can erase them up front,
+    // this is only a hint so a card that does not take it is not an error
+    uint8_t response = sd_send_command(SD_CMD55, 0);
+    sd_cs_deselect();
+    if (response == 0)
+    {
+        sd_send_command(SD_ACMD23, num_blocks);
+        sd_cs_deselect();
+    }
+
+    // After a block fails its CRC, start again from it
+    uint32_t done = 0;
+    int retries = 0;
+    while (done < num_blocks)
+    {
+        uint32_t accepted = 0;
+        sd_error_t result = sd_write_stream(start_block + done, num_blocks - done, buffer + (done * SD_BLOCK_SIZE), &accepted);
         if (result != SD_OK)
         {
             return result;
         }
+        done += accepted;
+        if (done < num_blocks && ++retries > SD_CRC_RETRIES)
+        {
+            return SD_ERROR_WRITE_FAILED;
+        }
     }
     return SD_OK;
 }
@@ -256,12 +429,30 @@ const char *sd_error_string(sd_error_t error)
     }
 }
 
+void sd_get_stats(sd_stats_t *stats)
+{
+    if (stats)
+    {
+        *stats = sd_stats;
+    }
+}
+
+void sd_reset_stats(void)
+{
+    memset(&sd_stats, 0, sizeof(sd_stats));
+}
+
 //
 // Initialisation functions
 //
 
 sd_error_t sd_card_init(void)
 {
+    // Every command goes with its CRC7, the card checks CMD0 and CMD8's
+    // even before CMD59 turns checking on for the rest
+    crc_init();
+    crc_enabled = false;
+
     // Start with lower SPI speed for initialization (400kHz)
     spi_init(SD_SPI, SD_INIT_BAUDRATE);
 
@@ -373,6 +564,12 @@ sd_error_t sd_card_init(void)
         }
     }
 
+    // Have the card check the CRCs of commands and data and send its own,
+    // so a block garbled on the shared SPI lines is sent again
+    response = sd_send_command(SD_CMD59, 1);
+    sd_cs_deselect();
+    crc_enabled = response == 0;
+
     // Switch to higher speed for normal operation
     spi_set_baudrate(SD_SPI, SD_BAUDRATE);
 
@@ -16,6 +16,8 @@
 // SD card interface definitions
 #define SD_INIT_BAUDRATE (400000) // 400 KHz SPI clock speed for initialization
 #define SD_BAUDRATE (25000000) // 25 MHz SPI clock speed (SD spec max for SPI mode)
+#define SD_BUSY_TIMEOUT_US (500000) // Longest a card may stay busy programming a block
+#define SD_CRC_RETRIES (3) // Times a block that fails its CRC is sent again
 
 // SD card commands
 #define SD_CMD0 (0)    // GO_IDLE_STATE
@@ -32,6 +34,7 @@
 #define SD_CMD25 (25)  // WRITE_MULTIPLE_BLOCK
 #define SD_CMD55 (55)  // APP_CMD
 #define SD_CMD58 (58)  // READ_OCR
+#define SD_CMD59 (59)  // CRC_ON_OFF
 #define SD_ACMD23 (23) // SET_WR_BLK_ERASE_COUNT
 #define SD_ACMD41 (41) // SD_SEND_OP_COND
 
@@ -49,6 +52,10 @@
 #define SD_DATA_START_BLOCK_MULT (0xFC)
 #define SD_DATA_STOP_MULT (0xFD)
 
+// Data response tokens, masked with 0x1F
+#define SD_DATA_ACCEPTED (0x05)
+#define SD_DATA_CRC_ERROR (0x0B)
+
 #define SD_BLOCK_SIZE (512)
 
 typedef enum
@@ -60,6 +67,16 @@ typedef enum
     SD_ERROR_WRITE_FAILED,
 } sd_error_t;
 
+// Block-level I/O counters, used to measure the SD traffic of a workload
+typedef struct
+{
+    uint32_t read_commands;  // Read commands issued to the card
+    uint32_t write_commands; // Write commands issued to the card
+    uint32_t blocks_read;    // 512-byte blocks transferred from the card
+    uint32_t blocks_written; // 512-byte blocks transferred to the card
+    uint32_t crc_errors;     // Blocks either way that failed their CRC and were sent again
+} sd_stats_t;
+
 
 // Function prototypes
 
@@ -77,3 +94,5 @@ sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint
 
 // Utility functions
 const char *sd_error_string(sd_error_t error);
+void sd_get_stats(sd_stats_t *stats);
+void sd_reset_stats(void);
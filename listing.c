@@ -0,0 +1,165 @@
+//
+//  Writing BASIC programs out to the SD card as text
+//
+//  The program in memory, or any program saved on the tape, is listed
+//  with basic.c and written a few sectors at a time, so a listing can be
+//  edited on a desktop and brought back with ctrl-i or ctrl-l.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+#include "basic.h"
+#include "tape.h"
+#include "drivers/io_service.h"
+
+#define RETURN_ON_ERROR(expr)      \
+  {                                \
+    fat32_error_t _res = (expr);   \
+    if (_res != FAT32_OK)          \
+    {                              \
+      return _res;                 \
+    }                              \
+  }
+
+typedef struct
+{
+  fat32_file_t file;
+  size_t used;
+  fat32_error_t status;
+  uint8_t buffer[LISTING_BUFFER_SIZE];
+} writer_t;
+
+static writer_t writer;
+
+static void writer_flush(writer_t* w)
+{
+  if (w->status == FAT32_OK && w->used > 0)
+  {
+    size_t bytes_written = 0;
+    w->status = fat32_write(&w->file, w->buffer, w->used, &bytes_written);
+    if (w->status == FAT32_OK && bytes_written != w->used)
+    {
+      w->status = FAT32_ERROR_WRITE_FAILED;
+    }
+  }
+  w->used = 0;
+}
+
+static bool writer_write(const char* text, size_t len, void* context)
+{
+  writer_t* w = (writer_t*) context;
+  while (len > 0 && w->status == FAT32_OK)
+  {
+    size_t n = sizeof(w->buffer) - w->used;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(&w->buffer[w->used], text, n);
+    w->used += n;
+    text += n;
+    len -= n;
+    if (w->used == sizeof(w->buffer))
+    {
+      writer_flush(w);
+    }
+  }
+  return w->status == FAT32_OK;
+}
+
+// List program text to path, replacing whatever was there
+static fat32_error_t list_to_file(const char* path, const uint8_t* text, size_t len, int* lines)
+{
+  *lines = 0;
+  fat32_error_t status = fat32_delete(path);
+  if (status != FAT32_OK && status != FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    return status;
+  }
+  RETURN_ON_ERROR(fat32_create(&writer.file, path));
+
+  writer.used = 0;
+  writer.status = FAT32_OK;
+  int listed = basic_list_program(text, len, writer_write, &writer);
+  writer_flush(&writer);
+  fat32_close(&writer.file);
+
+  if (listed > 0)
+  {
+    *lines = listed;
+  }
+  return writer.status;
+}
+
+// Write the program in memory to path as text
+fat32_error_t listing_save(const char* path, int* lines)
+{
+  size_t len;
+  const uint8_t* text = basic_program(&len);
+  io_claim(); // the file system belongs to the I/O service otherwise
+  fat32_error_t status = list_to_file(path, text, len, lines);
+  io_release();
+  return status;
+}
+
+static fat32_error_t extract_tape(const char* dir, int* files)
+{
+  *files = 0;
+  RETURN_ON_ERROR(tape_catalog_update());
+
+  fat32_file_t d;
+  fat32_error_t status = fat32_open(&d, dir);
+  if (status == FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    status = fat32_dir_create(&d, dir);
+  }
+  RETURN_ON_ERROR(status);
+  fat32_close(&d);
+
+  for (int i = 0; i < tape_catalog_count(); i++)
+  {
+    const tape_program_t* p = tape_catalog_entry(i);
+    if (p->type != TAPE_SYNC_PROGRAM)
+    {
+      continue;
+    }
+
+    uint8_t* text = malloc(p->length);
+    if (text == NULL)
+    {
+      printf("Program %d is too big to list\n", i + 1);
+      continue;
+    }
+    size_t len;
+    status = tape_read_program(i, text, p->length, &len);
+    if (status == FAT32_OK)
+    {
+      char path[FAT32_MAX_PATH_LEN];
+      char name = (p->name >= '0' && p->name <= '9') ||
+                  (p->name >= 'A' && p->name <= 'Z') ||
+                  (p->name >= 'a' && p->name <= 'z') ? p->name : '_';
+      snprintf(path, sizeof(path), "%s/%03d-%c.bas", dir, i + 1, name);
+
+      int lines;
+      status = list_to_file(path, text, len, &lines);
+      printf("%s, %d lines\n", path, lines);
+    }
+    free(text);
+    RETURN_ON_ERROR(status);
+    (*files)++;
+  }
+  return FAT32_OK;
+}
+
+// Write every program on the tape to dir as NNN-name.bas, NNN being its
+// number in the tape catalog.  Saved arrays are left out.
+fat32_error_t listing_extract_tape(const char* dir, int* files)
+{
+  io_claim();
+  fat32_error_t status = extract_tape(dir, files);
+  io_release();
+  return status;
+}
@@ -0,0 +1,18 @@
+#ifndef LISTING_H_
+#define LISTING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "drivers/fat32.h"
+
+// Listings are written to the SD card in pieces this big
+#ifndef LISTING_BUFFER_SIZE
+#define LISTING_BUFFER_SIZE (4 * 512)
+#endif
+
+fat32_error_t listing_save(const char* path, int* lines);
+fat32_error_t listing_extract_tape(const char* dir, int* files);
+
+#endif // LISTING_H_
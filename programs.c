@@ -0,0 +1,230 @@
+//
+//  Program images
+//
+//  SAVE and LOAD without the tape: BASIC's program text is written
+//  as it sits in memory to its own file under /Altair/programs, with a
+//  small header, and read back in one go.  Images record which BASIC
+//  they came from since its tokens mean nothing to another one.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "programs.h"
+#include "basic.h"
+#include "drivers/io_service.h"
+
+#define RETURN_ON_ERROR(expr)      \
+  {                                \
+    fat32_error_t _res = (expr);   \
+    if (_res != FAT32_OK)          \
+    {                              \
+      return _res;                 \
+    }                              \
+  }
+
+#define IMAGE_MAGIC (0x47495042) // "BPIG", BASIC program image
+#define IMAGE_VERSION (1)
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t txttab;   // where the program was in memory
+  uint32_t rom_hash; // the BASIC it was saved from
+  uint16_t length;   // bytes of program text that follow
+  uint16_t reserved;
+} image_header_t;
+
+static char port_name[16];
+static size_t port_name_len = 0;
+static uint8_t port_status = 0;
+static bool load_pending = false;
+
+static void image_path(char* path, size_t len, const char* name)
+{
+  snprintf(path, len, "%s/%s.img", PROGRAMS_DIR, name);
+}
+
+static fat32_error_t save_image(const char* name)
+{
+  if (!basic_program_known())
+  {
+    return FAT32_ERROR_INVALID_PARAMETER; // BASIC's program not found yet
+  }
+
+  fat32_file_t file;
+  fat32_error_t status = fat32_open(&file, PROGRAMS_DIR);
+  if (status == FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    status = fat32_dir_create(&file, PROGRAMS_DIR);
+  }
+  RETURN_ON_ERROR(status);
+  fat32_close(&file);
+
+  char path[FAT32_MAX_PATH_LEN];
+  image_path(path, sizeof(path), name);
+  status = fat32_delete(path);
+  if (status != FAT32_OK && status != FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    return status;
+  }
+  RETURN_ON_ERROR(fat32_create(&file, path));
+
+  size_t len;
+  const uint8_t* text = basic_program(&len);
+  image_header_t header = {
+      .magic = IMAGE_MAGIC,
+      .version = IMAGE_VERSION,
+      .txttab = basic_layout()->txttab,
+      .rom_hash = basic_layout()->rom_hash,
+      .length = len,
+  };
+
+  size_t bytes_written = 0;
+  status = fat32_write(&file, &header, sizeof(header), &bytes_written);
+  if (status == FAT32_OK && bytes_written == sizeof(header))
+  {
+    status = fat32_write(&file, text, len, &bytes_written);
+  }
+  if (status == FAT32_OK && bytes_written != len)
+  {
+    status = FAT32_ERROR_WRITE_FAILED;
+  }
+  fat32_close(&file);
+  return status;
+}
+
+static fat32_error_t load_image(const char* name, uint16_t limit)
+{
+  if (!basic_program_known())
+  {
+    return FAT32_ERROR_INVALID_PARAMETER; // BASIC's program not found yet
+  }
+
+  char path[FAT32_MAX_PATH_LEN];
+  image_path(path, sizeof(path), name);
+  fat32_file_t file;
+  RETURN_ON_ERROR(fat32_open(&file, path));
+
+  image_header_t header;
+  size_t bytes_read = 0;
+  fat32_error_t status = fat32_read(&file, &header, sizeof(header), &bytes_read);
+  if (status == FAT32_OK &&
+      (bytes_read != sizeof(header) || header.magic != IMAGE_MAGIC ||
+       header.version != IMAGE_VERSION || header.rom_hash != basic_layout()->rom_hash))
+  {
+    status = FAT32_ERROR_INVALID_FORMAT;
+  }
+  if (status == FAT32_OK && basic_layout()->txttab + header.length + 2u > limit)
+  {
+    status = FAT32_ERROR_OUT_OF_MEMORY; // more than BASIC has room for
+  }
+
+  // the image is read straight into place, the old program is gone from
+  // here on so make sure something sane is left whatever happens
+  uint8_t* text = (uint8_t*) basic_program(&bytes_read);
+  if (status == FAT32_OK)
+  {
+    status = fat32_read(&file, text, header.length, &bytes_read);
+    if (status == FAT32_OK && !basic_set_program(text, bytes_read, limit))
+    {
+      status = FAT32_ERROR_INVALID_FORMAT;
+    }
+    if (status != FAT32_OK)
+    {
+      text[0] = text[1] = 0;
+      basic_set_program(text, 2, limit);
+    }
+  }
+  fat32_close(&file);
+  return status;
+}
+
+fat32_error_t programs_save(const char* name)
+{
+  io_claim(); // the file system belongs to the I/O service otherwise
+  fat32_error_t status = save_image(name);
+  io_release();
+  return status;
+}
+
+// Replace the program in memory with a saved image, BASIC must be at its
+// OK prompt.  limit is the first address the program must not reach.
+fat32_error_t programs_load(const char* name, uint16_t limit)
+{
+  io_claim();
+  fat32_error_t status = load_image(name, limit);
+  io_release();
+  return status;
+}
+
+//
+// Save and load from BASIC through OUT
+//
+
+void programs_port_out(uint8_t port, uint8_t value)
+{
+  if (port == PROGRAMS_PORT_NAME)
+  {
+    if (value == 0)
+    {
+      port_name_len = 0;
+    }
+    else if (port_name_len + 1 < sizeof(port_name))
+    {
+      port_name[port_name_len++] = tolower(value);
+    }
+    port_name[port_name_len] = '\0';
+  }
+  else if (port == PROGRAMS_PORT_COMMAND)
+  {
+    if (value == PROGRAMS_COMMAND_SAVE)
+    {
+      port_status = programs_save(port_name);
+    }
+    else if (value == PROGRAMS_COMMAND_LOAD)
+    {
+      // the running program cannot be swapped from under BASIC
+      load_pending = true;
+      port_status = 0;
+    }
+  }
+}
+
+uint8_t programs_port_in(uint8_t port)
+{
+  return port == PROGRAMS_PORT_COMMAND ? port_status : 0xff;
+}
+
+// Called regularly from the emulator loop to carry out a load asked for
+// through OUT once the program has stopped
+void programs_poll(uint16_t limit)
+{
+  if (load_pending && basic_at_prompt())
+  {
+    load_pending = false;
+    port_status = programs_load(port_name, limit);
+    if (port_status != FAT32_OK)
+    {
+      printf("Error loading %s: %s\n", port_name, fat32_error_string(port_status));
+    }
+  }
+}
+
+void programs_get_state(programs_state_t* state)
+{
+  memcpy(state->name, port_name, sizeof(state->name));
+  state->status = port_status;
+  state->load_pending = load_pending;
+}
+
+void programs_set_state(const programs_state_t* state)
+{
+  memcpy(port_name, state->name, sizeof(port_name));
+  port_name[sizeof(port_name) - 1] = '\0';
+  port_name_len = strlen(port_name);
+  port_status = state->status;
+  load_pending = state->load_pending;
+}
@@ -0,0 +1,37 @@
+#ifndef PROGRAMS_H_
+#define PROGRAMS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "drivers/fat32.h"
+
+// Where saved program images live
+#define PROGRAMS_DIR "/Altair/programs"
+
+// OUT ports BASIC itself can use to save and load, e.g.
+//   OUT 8,0: OUT 8,ASC("S"): OUT 8,ASC("T"): OUT 9,1
+// saves the program as ST.  IN 9 gives the result, 0 for success.
+#define PROGRAMS_PORT_NAME (0x08)    // a character of the name, 0 clears it
+#define PROGRAMS_PORT_COMMAND (0x09) // one of the commands below
+#define PROGRAMS_COMMAND_SAVE (1)
+#define PROGRAMS_COMMAND_LOAD (2)    // happens when BASIC is next at OK
+
+// What OUT has set up, kept with snapshots of the machine
+typedef struct
+{
+  char name[16];
+  uint8_t status;
+  bool load_pending;
+} programs_state_t;
+
+fat32_error_t programs_save(const char* name);
+fat32_error_t programs_load(const char* name, uint16_t limit);
+
+void programs_port_out(uint8_t port, uint8_t value);
+uint8_t programs_port_in(uint8_t port);
+void programs_poll(uint16_t limit);
+void programs_get_state(programs_state_t* state);
+void programs_set_state(const programs_state_t* state);
+
+#endif // PROGRAMS_H_
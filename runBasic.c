@@ -11,16 +11,23 @@
 #include "drivers/keyboard.h"
 #include "drivers/onboard_led.h"
 #include "drivers/fat32.h"
+#include "drivers/io_service.h"
+#include "drivers/rom_store.h"
 
 #include "i8080.h"
+#include "tape.h"
+#include "basic.h"
+#include "listing.h"
+#include "programs.h"
+#include "snapshot.h"
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <fcntl.h>
 
-fat32_file_t fullTapeFP;
 const char *fullTapePath = "/Altair/tapes/fulltape.dat";
+const char *basicPath = "/Altair/basicload.bin";
 
 // memory callbacks
 #define MEMORY_SIZE 0x10000
@@ -37,24 +44,193 @@ static void wb(void* userdata, uint16_t addr, uint8_t val) {
   memory[addr] = val;
 }
 
+// Read a line typed at the keyboard, echoing it as it goes.  As with
+// BASIC itself '_' rubs out the last character.
+static void read_line(char* buf, size_t len)
+{
+  size_t n = 0;
+  char chr;
+  while ((chr = getchar()) != 0x0d && chr != 0x0a)
+  {
+    if (chr == '_')
+    {
+      if (n > 0)
+        n--;
+    }
+    else if (n + 1 < len)
+    {
+      buf[n++] = chr;
+    }
+    else
+    {
+      continue;
+    }
+    printf("%c", chr);
+  }
+  buf[n] = 0;
+  printf("\n");
+}
+
+// invert the sense of the shift key for alphas
+// basic keywords are all caps...
+static char invert_shift(char chr)
+{
+  if (chr >= 'A' && chr <= 'Z')
+  {
+    chr = tolower(chr);
+  }
+  else if (chr >= 'a' && chr <= 'z')
+  {
+    chr = toupper(chr);
+  }
+  return chr;
+}
+
+// Put a BASIC listing straight into the program text instead of typing it
+// in.  Only safe while BASIC sits at its OK prompt.
+static void fast_load(i8080* const c, const char* path)
+{
+  if (!basic_at_prompt() || !basic_program_known())
+  {
+    printf("Fast load needs BASIC at its OK prompt\n");
+    return;
+  }
+
+  // the file system belongs to the I/O service otherwise
+  io_claim();
+  fat32_file_t file;
+  fat32_error_t status = fat32_open(&file, path);
+  if (status != FAT32_OK)
+  {
+    io_release();
+    fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+    return;
+  }
+
+  static char chunk[4096];
+  char line[BASIC_MAX_LINE];
+  size_t line_len = 0;
+  size_t bytes_read;
+  bool fits = true;
+  basic_load_stats_t stats = {0, 0};
+  uint32_t shown = 0;
+  uint32_t started = to_ms_since_boot(get_absolute_time());
+
+  // leave BASIC some stack below where it sits at the prompt
+  basic_load_begin(c->sp - 128);
+  do
+  {
+    status = fat32_read(&file, chunk, sizeof(chunk), &bytes_read);
+    for (size_t i = 0; fits && i < bytes_read; i++)
+    {
+      if (chunk[i] != 0x0d && chunk[i] != 0x0a)
+      {
+        if (line_len + 1 < sizeof(line))
+          line[line_len++] = chunk[i];
+        continue;
+      }
+      line[line_len] = 0;
+      line_len = 0;
+      fits = basic_load_line(line, &stats);
+      if (stats.lines >= shown + 100)
+      {
+        shown = stats.lines;
+        printf("\r%lu lines", (unsigned long) shown);
+      }
+    }
+  } while (fits && status == FAT32_OK && bytes_read == sizeof(chunk));
+  if (fits && line_len > 0)
+  {
+    line[line_len] = 0;
+    fits = basic_load_line(line, &stats);
+  }
+  basic_load_end();
+  fat32_close(&file);
+  io_release();
+
+  if (status != FAT32_OK)
+    fprintf(stderr, "\nError: %s\n", fat32_error_string(status));
+  if (!fits)
+    printf("\nOut of memory, program loaded up to the last line that fit\n");
+  printf("\r%lu lines loaded in %lu ms", (unsigned long) stats.lines,
+         (unsigned long) (to_ms_since_boot(get_absolute_time()) - started));
+  if (stats.skipped > 0)
+    printf(", %lu lines without a line number skipped", (unsigned long) stats.skipped);
+  printf("\n");
+}
+
 static bool resetRequested = false;
 static bool sourceInProgress = false;
-static fat32_file_t sFile;
+static io_handle_t sFile = -1;
+static uint8_t sFileBuffer[2048]; // 4 sectors, sourcing reads a byte at a time
+static uint32_t sBufferStart = 0;
+static uint32_t sBufferLen = 0;
+static uint32_t sPosition = 0;    // the next byte to type
+static char sPath[50];
+static char snapshotName[13];
+static char snapshotRequested = 0; // ctrl key asking, acted on between instructions
+static bool coldStartRequested = false;
+static bool warmImagePending = false; // capture one at BASIC's first OK
+
+// Sourcing goes through the I/O service a buffer at a time, so nothing
+// is held up between the characters BASIC reads
+static fat32_error_t source_open(const char* path, uint32_t position)
+{
+  fat32_error_t status = io_open(path, false, &sFile, NULL);
+  if (status != FAT32_OK)
+    return status;
+  strcpy(sPath, path);
+  sPosition = position;
+  sBufferStart = sBufferLen = 0;
+  sourceInProgress = true;
+  return FAT32_OK;
+}
+
+static void source_close(void)
+{
+  if (sourceInProgress)
+  {
+    io_close(sFile);
+    sFile = -1;
+    sourceInProgress = false;
+  }
+}
+
+// The next character of the listing, false at its end
+static bool source_next(char* chr)
+{
+  if (sPosition < sBufferStart || sPosition >= sBufferStart + sBufferLen)
+  {
+    size_t bytes_read = 0;
+    if (io_wait(io_read(sFile, sPosition, sFileBuffer, sizeof(sFileBuffer)), &bytes_read) != FAT32_OK)
+      bytes_read = 0;
+    sBufferStart = sPosition;
+    sBufferLen = bytes_read;
+    if (bytes_read == 0)
+      return false;
+  }
+  *chr = sFileBuffer[sPosition++ - sBufferStart];
+  return true;
+}
+
 static uint8_t port_in(void* userdata, uint8_t port) {
   if (port == 0x01 || port == 0x11)
   {
 
+    // something the emulator types for BASIC goes first
+    if (basic_typing())
+    {
+      return basic_typed();
+    }
+
     // but is sourcing in progress?
     if (sourceInProgress)
     {
-      size_t bytes_read;
       char sChr;
-      fat32_read(&sFile, &sChr, 1, &bytes_read);
-      if (bytes_read != 1)
+      if (!source_next(&sChr))
       {
         sChr = 0x0d;
-        sourceInProgress = false;
-        fat32_close(&sFile);
+        source_close();
         printf("\nDone sourcing\n");
       }
       return sChr;
@@ -89,50 +265,188 @@ static uint8_t port_in(void* userdata, uint8_t port) {
       *nextChr = 0;
 
       printf("Opening %s\n",path);
-      fat32_error_t status =fat32_open(&sFile, path);
+      source_close();
+      fat32_error_t status = source_open(path, 0);
       if (status != FAT32_OK)
+      {
         fprintf(stderr, "Error: %s\n", fat32_error_string(status));
-      sourceInProgress = true;
-      size_t bytes_read;
-      fat32_read(&sFile, &chr, 1, &bytes_read);
+        return 0;
+      }
+      if (!source_next(&chr))
+      {
+        source_close();
+        return 0;
+      }
       return chr;
     }
+    else if (chr == 12)
+    {
+      // ctrl l loads a listing straight into BASIC's program text, the
+      // fast way to do what ctrl i does for a file of numbered lines
+      printf("Enter file name to load: /Altair/");
+      char path[50] = "/Altair/";
+      read_line(&path[8], sizeof(path) - 8);
+      fast_load((i8080*) userdata, path);
+      return 0;
+    }
+    else if (chr == 23)
+    {
+      // ctrl w writes the program in memory out as a text listing
+      if (!basic_program_known())
+      {
+        printf("BASIC's program is not known yet\n");
+        return 0;
+      }
+      printf("Enter name to write listing to: /Altair/");
+      char path[50] = "/Altair/";
+      read_line(&path[8], sizeof(path) - 12);
+      if (strchr(&path[8], '.') == NULL)
+        strcat(path, ".bas");
+
+      int lines;
+      fat32_error_t status = listing_save(path, &lines);
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+      else
+        printf("%d lines written to %s\n", lines, path);
+      return 0;
+    }
+    else if (chr == 24)
+    {
+      // ctrl x lists every program on the tape to its own file
+      int files;
+      fat32_error_t status = listing_extract_tape("/Altair/fromtape", &files);
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+      printf("%d programs extracted from tape\n", files);
+      return 0;
+    }
+    else if (chr == 19 || chr == 7)
+    {
+      // ctrl s saves the program as an image, ctrl g gets one back
+      printf("Enter name of program to %s: %s/", chr == 19 ? "save" : "load", PROGRAMS_DIR);
+      char name[13];
+      read_line(name, sizeof(name));
+      if (name[0] == 0)
+        return 0;
+
+      fat32_error_t status;
+      if (chr == 19)
+        status = programs_save(name);
+      else if (!basic_at_prompt())
+        status = FAT32_ERROR_INVALID_PARAMETER; // only with BASIC at OK
+      else
+        status = programs_load(name, ((i8080*) userdata)->sp - 128);
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+      else
+        printf("%s %s\n", chr == 19 ? "Saved" : "Loaded", name);
+      return 0;
+    }
     else if (chr == 18)
     {
       // ctrl r means rewind full tape file
-      fat32_seek(&fullTapeFP,0);
+      tape_rewind();
       printf("Tape rewound\n");
       return 0;
     }
     else if (chr == 5)
     {
       // ctrl e means skipt to end of full tape file
-      fat32_seek(&fullTapeFP, fat32_size(&fullTapeFP));
+      tape_seek_end();
       printf("Moved to end of tape.\n");
       return 0;
     }
-    else if (chr == 6)
+    else if (chr == 11)
     {
-      resetRequested = true; // force a reset on ctrl-f
+      // ctrl k lists the programs on the tape
+      fat32_error_t status = tape_catalog_update();
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+      tape_print_catalog();
       return 0;
     }
+    else if (chr == 16)
+    {
+      // ctrl p positions the tape head at a program, picked either by
+      // its number in the catalog or by name (the last one saved wins)
+      printf("Position tape at program (#number or name): ");
+      char answer[8];
+      read_line(answer, sizeof(answer));
+
+      fat32_error_t status = tape_catalog_update();
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
 
+      int index = -1;
+      if (answer[0] == '#')
+        index = atoi(&answer[1]) - 1;
+      else if (answer[0] != 0)
+        index = tape_catalog_find(invert_shift(answer[0]));
 
-    // invert the sense of the shift key for alphas 
-    // basic keywords are all caps...
-    if (chr >= 'A' && chr <= 'Z')
+      if (tape_seek_program(index) == FAT32_OK)
+        printf("Tape at program %d\n", index + 1);
+      else
+        printf("No such program on tape\n");
+      return 0;
+    }
+    else if (chr == 20)
     {
-      chr = tolower(chr);
+      // ctrl t shows where the tape is and what it has cost so far
+      tape_print_stats();
+      return 0;
     }
-    else if (chr >= 'a' && chr <= 'z')
+    else if (chr == 2)
     {
-      chr = toupper(chr);
+      // ctrl b stores a BASIC image in flash, so it starts without the card
+      printf("Enter ROM file to store in flash (empty for basicload.bin): /Altair/");
+      char path[ROM_STORE_NAME_LEN] = "/Altair/";
+      read_line(&path[8], sizeof(path) - 8);
+      if (path[8] == 0)
+        strcpy(path, basicPath);
+
+      bool stored;
+      fat32_error_t status = rom_store_save(path, &stored);
+      if (status != FAT32_OK)
+        fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+      else
+        printf("%s %s\n", path, stored ? "stored in flash" : "already in flash");
+      for (int slot = 0; slot < ROM_STORE_SLOTS; slot++)
+      {
+        const rom_store_entry_t *entry = rom_store_entry(slot);
+        if (entry != NULL)
+          printf("  %-40s %5lu bytes  %08lx\n", entry->name,
+                 (unsigned long)entry->size, (unsigned long)entry->hash);
+      }
+      return 0;
+    }
+    else if (chr == 26 || chr == 25)
+    {
+      // ctrl z parks the whole machine in a snapshot, ctrl y resumes one
+      printf("Enter name of snapshot to %s: %s/", chr == 26 ? "save" : "restore", SNAPSHOTS_DIR);
+      read_line(snapshotName, sizeof(snapshotName));
+      if (snapshotName[0] != 0)
+        snapshotRequested = chr;
+      return 0;
     }
-    return chr;
+    else if (chr == 1)
+    {
+      // ctrl a starts BASIC afresh, asking its startup questions again
+      coldStartRequested = true;
+      return 0;
+    }
+    else if (chr == 6)
+    {
+      resetRequested = true; // force a reset on ctrl-f
+      return 0;
+    }
+
+
+    return invert_shift(chr);
   }
   else if (port == 0)
   {
-    if (keyboard_key_available()||sourceInProgress)
+    if (keyboard_key_available()||sourceInProgress||basic_typing())
     {
       return 0x00;
     }
@@ -143,7 +457,7 @@ static uint8_t port_in(void* userdata, uint8_t port) {
   }
   else if (port == 0x10)
   {
-    if (keyboard_key_available()||sourceInProgress)
+    if (keyboard_key_available()||sourceInProgress||basic_typing())
     {
       return 0x7f;
     }
@@ -153,15 +467,19 @@ static uint8_t port_in(void* userdata, uint8_t port) {
     }
 
   }
+  else if (port == PROGRAMS_PORT_COMMAND)
+  {
+    return programs_port_in(port);
+  }
   else if (port == 6)
   {
     return 0x00; // tape always ready 
   }
   else if (port == 7)
   {
-    char tchar;
+    uint8_t tchar;
     size_t bytes_read;
-    if (fat32_read(&fullTapeFP, &tchar, 1, &bytes_read) != FAT32_OK)
+    if (tape_read(&tchar, &bytes_read) != FAT32_OK)
     {
       fprintf(stderr, "Error reading bytes from tape file\n");
       return 0;
@@ -185,26 +503,37 @@ static uint8_t port_in(void* userdata, uint8_t port) {
   return 0x00;
 }
 
+// Let basic.c see what BASIC reads from the console
+static uint8_t port_in_watched(void* userdata, uint8_t port) {
+  uint8_t value = port_in(userdata, port);
+  if (port == 0x01 || port == 0x11)
+  {
+    basic_input(value);
+  }
+  return value;
+}
+
 static void port_out(void* userdata, uint8_t port, uint8_t value) {
   i8080* const c = (i8080*) userdata;
 
   if (port == 0x18 || port == 0x01 || port == 0x11)
   {
     putchar(c->a & 0x7f);
+    basic_output(c->a);
     return;
   }
   else if (port == 7)
   {
-    // just write the char  to the file at cur position
-    size_t bytes_written;
-    if (fat32_write(&fullTapeFP, &c->a, 1, &bytes_written) != FAT32_OK)
+    // just write the char to the tape at cur position
+    if (tape_write(c->a) != FAT32_OK)
     {
       fprintf(stderr, "Error writing byte to tape file.\n");
     }
-    else if (bytes_written != 1)
-    {
-      fprintf(stderr, "Error writing byte to tape, bytes read = %d rather than the expected 1\n", bytes_written);
-    }
+    return;
+  }
+  else if (port == PROGRAMS_PORT_NAME || port == PROGRAMS_PORT_COMMAND)
+  {
+    programs_port_out(port, c->a);
     return;
   }
 
@@ -213,6 +542,45 @@ static void port_out(void* userdata, uint8_t port, uint8_t value) {
   //printf("Out to port: %02x = %02x\n", port, value);
 }
 
+static void save_snapshot(i8080* const c)
+{
+  snapshot_source_t source = {
+      .active = sourceInProgress,
+      .position = sourceInProgress ? sPosition : 0,
+  };
+  strcpy(source.path, sPath);
+
+  fat32_error_t status = snapshot_save(snapshotName, c, memory, &source);
+  if (status != FAT32_OK)
+    fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+  else
+    printf("Saved snapshot %s\n", snapshotName);
+}
+
+static void restore_snapshot(i8080* const c)
+{
+  snapshot_source_t source;
+  fat32_error_t status = snapshot_restore(snapshotName, c, memory, &source);
+  if (status != FAT32_OK)
+  {
+    fprintf(stderr, "Error: %s\n", fat32_error_string(status));
+    return;
+  }
+
+  warmImagePending = false; // this is no longer BASIC fresh from its questions
+
+  // carry on sourcing where the snapshot was
+  source_close();
+  if (source.active)
+  {
+    source.path[sizeof(source.path) - 1] = 0;
+    status = source_open(source.path, source.position);
+    if (status != FAT32_OK)
+      fprintf(stderr, "Error: %s, not sourcing %s\n", fat32_error_string(status), source.path);
+  }
+  printf("Restored snapshot %s\n", snapshotName);
+}
+
 static inline int load_file(const char* filename, uint16_t addr) {
   //printf("Loading %s\n", filename);
   fat32_file_t f;
@@ -253,16 +621,48 @@ static inline int load_file(const char* filename, uint16_t addr) {
   }
 
   fat32_close(&f);
+  basic_init(memory, addr + bytes_read);
   return 0;
 }
 
-static inline void run_test(
-    i8080* const c, const char* filename, unsigned long cyc_expected) {
+// The machine as BASIC left it at its first OK, skipping MEMORY SIZE? and
+// the other startup questions along with the memory probe behind them.
+// One is kept for each BASIC image, with the answers last given to it.
+static void warm_image_name(char* name, size_t len)
+{
+  snprintf(name, len, "warm-%08lx", (unsigned long) basic_layout()->rom_hash);
+}
+
+static bool restore_warm_image(i8080* const c)
+{
+  char name[16];
+  warm_image_name(name, sizeof(name));
+  snapshot_source_t source;
+  uint32_t head = tape_position();
+  if (snapshot_restore(name, c, memory, &source) != FAT32_OK)
+    return false;
+
+  tape_seek(head); // the tape has moved on since
+  printf("Warm start (answered %s), ctrl-a to start cold\n\nOK\n", basic_answers());
+  return true;
+}
+
+// Not worth a message if it cannot be kept, the next boot starts cold
+static void save_warm_image(i8080* const c)
+{
+  char name[16];
+  warm_image_name(name, sizeof(name));
+  snapshot_source_t source = {0};
+  snapshot_save(name, c, memory, &source);
+}
+
+static bool start_basic(i8080* const c, const char* filename, bool warm)
+{
   i8080_init(c);
   c->userdata = c;
   c->read_byte = rb;
   c->write_byte = wb;
-  c->port_in = port_in;
+  c->port_in = port_in_watched;
   c->port_out = port_out;
   memset(memory, 0, MEMORY_SIZE);
 
@@ -271,18 +671,67 @@ static inline void run_test(
   // rom for it's memory sizing
   memory[MEMORY_SIZE-1] = 0xff; // always read as ff
 
-  if (load_file(filename, 0) != 0) {
-    return;
+  // from flash if it has been stored there with ctrl-b, no card needed
+  uint32_t rom_size;
+  if (rom_store_load(filename, memory, MEMORY_SIZE - 1, &rom_size)) {
+    basic_init(memory, rom_size);
+  }
+  else {
+    io_claim(); // the file system belongs to the I/O service otherwise
+    int loaded = load_file(filename, 0);
+    io_release();
+    if (loaded != 0) {
+      return false;
+    }
   }
 
   c->pc = 0x00;
+  warmImagePending = !(warm && restore_warm_image(c));
+  return true;
+}
+
+static inline void run_test(
+    i8080* const c, const char* filename, unsigned long cyc_expected) {
+  if (!start_basic(c, filename, true)) {
+    return;
+  }
+
+  uint32_t steps = 0;
   while (1) {
     if (resetRequested)
     {
+      tape_flush();
       c->pc = 0x00;
       resetRequested = false;
     }
+    if (coldStartRequested)
+    {
+      coldStartRequested = false;
+      tape_flush();
+      if (!start_basic(c, filename, false))
+        return;
+    }
+    if (snapshotRequested != 0)
+    {
+      if (snapshotRequested == 26)
+        save_snapshot(c);
+      else
+        restore_snapshot(c);
+      snapshotRequested = 0;
+    }
+    if (warmImagePending && basic_at_prompt() && basic_program_known())
+    {
+      warmImagePending = false;
+      save_warm_image(c);
+    }
     i8080_step(c);
+
+    // let an idle tape write back what BASIC has saved
+    if ((++steps & 0xfff) == 0)
+    {
+      tape_poll();
+      programs_poll(c->sp - 128);
+    }
   }
 
 }
@@ -301,13 +750,16 @@ int main(void) {
     return 1;
   }
 
+  // the SD card and file system run on the other core from here on
+  io_service_start();
+
   // create a emulated tape file if not already there
-  fat32_error_t status = fat32_open(&fullTapeFP, fullTapePath);
+  fat32_error_t status = tape_open(fullTapePath);
   if (status != FAT32_OK)
-    fat32_create(&fullTapeFP, fullTapePath);
+    fprintf(stderr, "Error: %s\n", fat32_error_string(status));
 
   i8080 cpu;
-  run_test(&cpu, "/Altair/basicload.bin", 0);
+  run_test(&cpu, basicPath, 0);
 
   free(memory);
 
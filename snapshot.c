@@ -0,0 +1,403 @@
+//
+//  Snapshots of the whole machine
+//
+//  Parks a BASIC session so it can be picked up again after a power
+//  cycle: the 8080's registers, all of memory, the tape head, a listing
+//  being sourced with ctrl-i and what basic.c and programs.c have
+//  learned or been told, in a file under /Altair/snapshots.
+//
+//  Most of memory is zeros, so it is run-length encoded (PackBits style,
+//  a count byte followed by either that many bytes as they are or one
+//  byte to repeat) with a CRC over the result.  The file is put together
+//  in RAM and given contiguous space first, so saving it is one write to
+//  the card and restoring it one read.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "tape.h"
+#include "basic.h"
+#include "programs.h"
+#include "drivers/crc.h"
+#include "drivers/io_service.h"
+
+#define RETURN_ON_ERROR(expr)      \
+  {                                \
+    fat32_error_t _res = (expr);   \
+    if (_res != FAT32_OK)          \
+    {                              \
+      return _res;                 \
+    }                              \
+  }
+
+#define SNAPSHOT_MAGIC (0x504e5341) // "ASNP", Altair snapshot
+#define SNAPSHOT_VERSION (2)
+
+// Run-length encoding, a count byte below 128 is followed by count + 1
+// bytes to copy, one of 128 or more by a byte to repeat count - 125 times
+#define LITERAL_MAX (128)
+#define RUN_MIN (3)
+#define RUN_MAX (127 + RUN_MIN)
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t crc;        // CRC16 of the packed bytes that follow
+  uint32_t packed;     // bytes that follow
+  uint32_t unpacked;   // the state and memory they unpack to
+} snapshot_header_t;
+
+#define CPU_IFF (0x01)
+#define CPU_HALTED (0x02)
+#define CPU_INTERRUPT_PENDING (0x04)
+
+// Everything but memory
+typedef struct
+{
+  uint32_t cycles;
+  uint16_t pc, sp;
+  uint8_t a, b, c, d, e, h, l;
+  uint8_t flags;     // as PUSH PSW lays them out
+  uint8_t cpu;       // CPU_ bits
+  uint8_t interrupt_vector;
+  uint8_t interrupt_delay;
+  uint32_t tape_position;
+  basic_state_t basic;
+  programs_state_t programs;
+  snapshot_source_t source;
+} machine_state_t;
+
+// Encode len bytes, out needs room for SNAPSHOT_SNAPSHOT_PACKED_MAX(len)
+size_t snapshot_pack(const uint8_t* in, size_t len, uint8_t* out)
+{
+  size_t i = 0;
+  size_t o = 0;
+  while (i < len)
+  {
+    size_t run = 1;
+    while (i + run < len && run < RUN_MAX && in[i + run] == in[i])
+    {
+      run++;
+    }
+    if (run >= RUN_MIN)
+    {
+      out[o++] = 128 + run - RUN_MIN;
+      out[o++] = in[i];
+      i += run;
+      continue;
+    }
+
+    // bytes as they are, up to where the next run starts
+    size_t start = i;
+    while (i < len && i - start < LITERAL_MAX &&
+           !(i + 2 < len && in[i] == in[i + 1] && in[i] == in[i + 2]))
+    {
+      i++;
+    }
+    out[o++] = i - start - 1;
+    memcpy(&out[o], &in[start], i - start);
+    o += i - start;
+  }
+  return o;
+}
+
+// Fills out exactly, false if in does not hold that much.  With out NULL
+// in is only checked, nothing is written
+bool snapshot_unpack(const uint8_t* in, size_t len, size_t* used, uint8_t* out, size_t out_len)
+{
+  size_t i = *used;
+  size_t o = 0;
+  while (o < out_len)
+  {
+    if (i >= len)
+    {
+      return false;
+    }
+    uint8_t count = in[i++];
+    if (count < 128)
+    {
+      size_t n = count + 1;
+      if (i + n > len || o + n > out_len)
+      {
+        return false;
+      }
+      if (out != NULL)
+      {
+        memcpy(&out[o], &in[i], n);
+      }
+      i += n;
+      o += n;
+    }
+    else
+    {
+      size_t n = count - 128 + RUN_MIN;
+      if (i >= len || o + n > out_len)
+      {
+        return false;
+      }
+      if (out != NULL)
+      {
+        memset(&out[o], in[i], n);
+      }
+      i++;
+      o += n;
+    }
+  }
+  *used = i;
+  return true;
+}
+
+static void snapshot_path(char* path, size_t len, const char* name, const char* extension)
+{
+  snprintf(path, len, "%s/%s.%s", SNAPSHOTS_DIR, name, extension);
+}
+
+static void get_state(machine_state_t* state, const i8080* cpu, const snapshot_source_t* source)
+{
+  memset(state, 0, sizeof(*state));
+  state->cycles = cpu->cyc;
+  state->pc = cpu->pc;
+  state->sp = cpu->sp;
+  state->a = cpu->a;
+  state->b = cpu->b;
+  state->c = cpu->c;
+  state->d = cpu->d;
+  state->e = cpu->e;
+  state->h = cpu->h;
+  state->l = cpu->l;
+  state->flags = cpu->sf << 7 | cpu->zf << 6 | cpu->hf << 4 | cpu->pf << 2 | 1 << 1 | cpu->cf;
+  state->cpu = (cpu->iff ? CPU_IFF : 0) | (cpu->halted ? CPU_HALTED : 0) |
+               (cpu->interrupt_pending ? CPU_INTERRUPT_PENDING : 0);
+  state->interrupt_vector = cpu->interrupt_vector;
+  state->interrupt_delay = cpu->interrupt_delay;
+  state->tape_position = tape_position();
+  basic_get_state(&state->basic);
+  programs_get_state(&state->programs);
+  state->source = *source;
+}
+
+static void set_cpu(i8080* cpu, const machine_state_t* state)
+{
+  cpu->cyc = state->cycles;
+  cpu->pc = state->pc;
+  cpu->sp = state->sp;
+  cpu->a = state->a;
+  cpu->b = state->b;
+  cpu->c = state->c;
+  cpu->d = state->d;
+  cpu->e = state->e;
+  cpu->h = state->h;
+  cpu->l = state->l;
+  cpu->sf = (state->flags >> 7) & 1;
+  cpu->zf = (state->flags >> 6) & 1;
+  cpu->hf = (state->flags >> 4) & 1;
+  cpu->pf = (state->flags >> 2) & 1;
+  cpu->cf = state->flags & 1;
+  cpu->iff = (state->cpu & CPU_IFF) != 0;
+  cpu->halted = (state->cpu & CPU_HALTED) != 0;
+  cpu->interrupt_pending = (state->cpu & CPU_INTERRUPT_PENDING) != 0;
+  cpu->interrupt_vector = state->interrupt_vector;
+  cpu->interrupt_delay = state->interrupt_delay;
+}
+
+static fat32_error_t write_file(const char* name, const uint8_t* data, size_t size)
+{
+  fat32_file_t file;
+  fat32_error_t status = fat32_open(&file, SNAPSHOTS_DIR);
+  if (status == FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    status = fat32_dir_create(&file, SNAPSHOTS_DIR);
+  }
+  RETURN_ON_ERROR(status);
+  fat32_close(&file);
+
+  // written in full under another name first, so a failed save leaves
+  // the last snapshot of that name as it was
+  char path[FAT32_MAX_PATH_LEN];
+  char new_path[FAT32_MAX_PATH_LEN];
+  snapshot_path(path, sizeof(path), name, "snp");
+  snapshot_path(new_path, sizeof(new_path), name, "new");
+
+  // a save cut off between the delete and the rename below left only the
+  // new file, make that the snapshot before it can be written over
+  status = fat32_open(&file, path);
+  if (status == FAT32_OK)
+  {
+    fat32_close(&file);
+  }
+  else if (status == FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    status = fat32_rename(new_path, path);
+    if (status != FAT32_OK && status != FAT32_ERROR_FILE_NOT_FOUND)
+    {
+      return status;
+    }
+  }
+  else
+  {
+    return status;
+  }
+
+  status = fat32_delete(new_path);
+  if (status != FAT32_OK && status != FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    return status;
+  }
+  RETURN_ON_ERROR(fat32_create(&file, new_path));
+
+  // contiguous, so the card is sent it as one multi-block write
+  size_t bytes_written = 0;
+  status = fat32_reserve(&file, size);
+  if (status == FAT32_OK)
+  {
+    status = fat32_write(&file, data, size, &bytes_written);
+  }
+  if (status == FAT32_OK && bytes_written != size)
+  {
+    status = FAT32_ERROR_WRITE_FAILED;
+  }
+  fat32_error_t closed = fat32_close(&file);
+  RETURN_ON_ERROR(status);
+  RETURN_ON_ERROR(closed);
+
+  status = fat32_delete(path);
+  if (status != FAT32_OK && status != FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    return status;
+  }
+  return fat32_rename(new_path, path);
+}
+
+static fat32_error_t read_file(const char* name, uint8_t** data, size_t* size)
+{
+  char path[FAT32_MAX_PATH_LEN];
+  snapshot_path(path, sizeof(path), name, "snp");
+  fat32_file_t file;
+  fat32_error_t status = fat32_open(&file, path);
+  if (status == FAT32_ERROR_FILE_NOT_FOUND)
+  {
+    // the save was cut off after the new file was written in full and
+    // the old one deleted, but before it was renamed
+    snapshot_path(path, sizeof(path), name, "new");
+    status = fat32_open(&file, path);
+  }
+  RETURN_ON_ERROR(status);
+
+  *size = fat32_size(&file);
+  if (*size < sizeof(snapshot_header_t) ||
+      *size > sizeof(snapshot_header_t) + SNAPSHOT_PACKED_MAX(sizeof(machine_state_t)) +
+                  SNAPSHOT_PACKED_MAX(SNAPSHOT_MEMORY_SIZE))
+  {
+    status = FAT32_ERROR_INVALID_FORMAT;
+  }
+  else if ((*data = malloc(*size)) == NULL)
+  {
+    status = FAT32_ERROR_OUT_OF_MEMORY;
+  }
+  else
+  {
+    size_t bytes_read = 0;
+    status = fat32_read(&file, *data, *size, &bytes_read);
+    if (status == FAT32_OK && bytes_read != *size)
+    {
+      status = FAT32_ERROR_READ_FAILED;
+    }
+    if (status != FAT32_OK)
+    {
+      free(*data);
+    }
+  }
+  fat32_close(&file);
+  return status;
+}
+
+// Save the machine as it is between two instructions
+fat32_error_t snapshot_save(const char* name, const i8080* cpu, const uint8_t* memory,
+                            const snapshot_source_t* source)
+{
+  RETURN_ON_ERROR(tape_flush());
+
+  machine_state_t state;
+  get_state(&state, cpu, source);
+
+  size_t most = sizeof(snapshot_header_t) + SNAPSHOT_PACKED_MAX(sizeof(state)) +
+                SNAPSHOT_PACKED_MAX(SNAPSHOT_MEMORY_SIZE);
+  uint8_t* data = malloc(most);
+  if (data == NULL)
+  {
+    return FAT32_ERROR_OUT_OF_MEMORY;
+  }
+
+  uint8_t* packed = data + sizeof(snapshot_header_t);
+  size_t len = snapshot_pack((const uint8_t*) &state, sizeof(state), packed);
+  len += snapshot_pack(memory, SNAPSHOT_MEMORY_SIZE, packed + len);
+  snapshot_header_t header = {
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .crc = crc16(packed, len),
+      .packed = len,
+      .unpacked = sizeof(state) + SNAPSHOT_MEMORY_SIZE,
+  };
+  memcpy(data, &header, sizeof(header));
+
+  io_claim(); // the file system belongs to the I/O service otherwise
+  fat32_error_t status = write_file(name, data, sizeof(header) + len);
+  io_release();
+  free(data);
+  return status;
+}
+
+// Put the machine back as a snapshot left it.  Memory is only written
+// once the whole file has been read, its CRC checked and a dry run of
+// unpacking it has gone through.
+fat32_error_t snapshot_restore(const char* name, i8080* cpu, uint8_t* memory,
+                               snapshot_source_t* source)
+{
+  uint8_t* data;
+  size_t size;
+  io_claim();
+  fat32_error_t status = read_file(name, &data, &size);
+  io_release();
+  RETURN_ON_ERROR(status);
+
+  snapshot_header_t header;
+  memcpy(&header, data, sizeof(header));
+  const uint8_t* packed = data + sizeof(header);
+  machine_state_t state;
+  size_t used = 0;
+  if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+      header.packed != size - sizeof(header) ||
+      header.unpacked != sizeof(state) + SNAPSHOT_MEMORY_SIZE ||
+      crc16(packed, header.packed) != header.crc ||
+      !snapshot_unpack(packed, header.packed, &used, (uint8_t*) &state, sizeof(state)))
+  {
+    free(data);
+    return FAT32_ERROR_INVALID_FORMAT;
+  }
+  size_t memory_used = used;
+  if (!snapshot_unpack(packed, header.packed, &memory_used, NULL, SNAPSHOT_MEMORY_SIZE) ||
+      memory_used != header.packed)
+  {
+    free(data);
+    return FAT32_ERROR_INVALID_FORMAT;
+  }
+  snapshot_unpack(packed, header.packed, &used, memory, SNAPSHOT_MEMORY_SIZE);
+  free(data);
+
+  set_cpu(cpu, &state);
+  basic_set_state(memory, &state.basic);
+  programs_set_state(&state.programs);
+  *source = state.source;
+  // the machine is restored either way, only the tape is out of place
+  status = tape_seek(state.tape_position);
+  if (status != FAT32_OK)
+  {
+    fprintf(stderr, "Error putting the tape head back at %lu: %s\n",
+            (unsigned long) state.tape_position, fat32_error_string(status));
+  }
+  return FAT32_OK;
+}
@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "drivers/fat32.h"
+#include "i8080.h"
+
+// Where snapshots of the machine live
+#define SNAPSHOTS_DIR "/Altair/snapshots"
+
+// The emulated machine's memory, all of which is kept
+#define SNAPSHOT_MEMORY_SIZE (0x10000)
+
+// Most a stream of len bytes can take up once packed
+#define SNAPSHOT_PACKED_MAX(len) ((len) + ((len) + 127) / 128)
+
+// A listing being typed in to BASIC with ctrl-i
+typedef struct
+{
+  bool active;
+  char path[50];
+  uint32_t position; // the next byte to type
+} snapshot_source_t;
+
+size_t snapshot_pack(const uint8_t* in, size_t len, uint8_t* out);
+bool snapshot_unpack(const uint8_t* in, size_t len, size_t* used, uint8_t* out, size_t out_len);
+
+fat32_error_t snapshot_save(const char* name, const i8080* cpu, const uint8_t* memory,
+                            const snapshot_source_t* source);
+fat32_error_t snapshot_restore(const char* name, i8080* cpu, uint8_t* memory,
+                               snapshot_source_t* source);
+
+#endif // SNAPSHOT_H_
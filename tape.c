@@ -0,0 +1,972 @@
+//
+//  Emulated cassette tape behind the Altair ACR ports
+//
+//  BASIC moves the tape one byte per IN/OUT on port 7.  Handing each of
+//  those bytes straight to fat32_read/fat32_write costs a cluster chain
+//  walk and a full sector transfer (plus a directory entry rewrite for
+//  writes) per byte, so the tape is kept behind a sector-aligned window:
+//  reads fill the window ahead of the head, writes collect in it and go
+//  out as one fat32_write when the window fills, the tape changes
+//  direction or is repositioned, or the tape has been idle for
+//  TAPE_IDLE_FLUSH_MS.
+//
+//  The file system belongs to the I/O service on the other core, so a
+//  flushed window is handed to it as a write and the emulator carries on
+//  without waiting for the card.  While the tape is being read the window
+//  after the one in use is read ahead into a second buffer.
+//
+//  Alongside the tape sits a catalog of the programs on it, kept in a
+//  sidecar .idx file next to the tape.  It is grown from the bytes BASIC
+//  writes (or reads) at the end of what has been indexed so far, so a
+//  CSAVE at the end of the tape never costs an extra pass over the file,
+//  and lets the head be put straight onto a program for CLOAD.
+//
+//  With TAPE_FLASH_LOG a flushed window goes to the log-structured store
+//  in the Pico's own flash rather than to the card, and what is read is
+//  the card's file with the store's records laid over it.  Once the tape
+//  has been idle a while the records are copied to the file and marked
+//  mirrored.  The tape works without a card, from what the store holds,
+//  and the file is opened when a card turns up.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "pico/stdlib.h"
+
+#include "drivers/io_service.h"
+#include "tape.h"
+#if TAPE_FLASH_LOG
+#include "drivers/flash_log.h"
+#endif
+
+#define RETURN_ON_ERROR(expr)      \
+  {                                \
+    fat32_error_t _res = (expr);   \
+    if (_res != FAT32_OK)          \
+    {                              \
+      return _res;                 \
+    }                              \
+  }
+
+typedef enum
+{
+  TAPE_IDLE,
+  TAPE_READING,
+  TAPE_WRITING,
+} tape_mode_t;
+
+// Flash log records copied to the card between syncs
+#define MIRROR_BATCH (16)
+
+// How often to look for a card while there is none
+#define CARD_RETRY_MS (1000)
+
+static io_handle_t tape_fp = -1;  // -1 while there is no card
+static char tape_path[FAT32_MAX_PATH_LEN];
+#if TAPE_FLASH_LOG
+static uint64_t card_tried_us = 0;
+#endif
+static uint32_t tape_size = 0;    // file length once the writes handed over land
+static tape_mode_t mode = TAPE_IDLE;
+static uint32_t head = 0; // tape head position
+
+static uint8_t buffers[2][TAPE_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint8_t* window = buffers[0];
+static uint32_t window_start = 0; // tape position of window[0]
+static uint32_t window_len = 0;   // bytes in the window valid for reading
+static uint32_t window_unheld = 0; // those at its start, with no card, not held
+static uint32_t dirty_start = 0;  // tape range held in the window for writing
+static uint32_t dirty_end = 0;
+
+static uint8_t* ahead = buffers[1]; // the next window, being read ahead
+static uint32_t ahead_start = 0;
+static io_read_result_t ahead_result; // its own, it may be collected long after
+static bool ahead_busy = false;    // the service may still be filling it
+static bool ahead_valid = false;   // and what it reads can be used
+
+static uint32_t reserved = 0;     // tape length the file has clusters for
+static uint64_t last_activity_us = 0;
+
+static tape_stats_t stats;
+static io_file_stats_t sd_base;   // SD traffic before the stats were reset
+static io_file_stats_t sd_carried; // and on the files of a tape since put away
+
+// Sidecar catalog file layout: header followed by the catalog entries
+#define CATALOG_MAGIC (0x58444954) // "TIDX"
+#define CATALOG_VERSION (2)
+
+// What the end of the indexed part is in the middle of
+#define CATALOG_LEADER (0)  // between programs, looking for sync bytes
+#define CATALOG_PROGRAM (1) // a program's lines
+#define CATALOG_ARRAY (2)   // a CSAVE* array, its size is not on the tape
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t indexed;  // tape bytes the catalog accounts for
+  uint32_t run_len;  // sync bytes seen at the end of the indexed part
+  uint8_t run_byte;
+  uint8_t scan;      // CATALOG_ state
+  uint8_t field;     // byte of the program line: 0-1 link, 2-3 number, 4 text
+  uint8_t link_low;
+} catalog_header_t;
+
+static io_handle_t catalog_fp = -1;
+static char catalog_path[FAT32_MAX_PATH_LEN];
+static bool catalog_dirty = false;
+static catalog_header_t catalog;
+static tape_program_t programs[TAPE_CATALOG_SIZE];
+
+// SD traffic the service has caused for the tape and its catalog
+static void sd_count(io_file_stats_t* out)
+{
+  io_file_stats_t catalog_stats;
+  io_get_file_stats(tape_fp, out);
+  io_get_file_stats(catalog_fp, &catalog_stats);
+  out->sd_reads += catalog_stats.sd_reads + sd_carried.sd_reads;
+  out->sd_writes += catalog_stats.sd_writes + sd_carried.sd_writes;
+}
+
+// Read part of the tape file and wait for it
+static fat32_error_t read_now(uint32_t position, void* buffer, size_t size, size_t* bytes_read)
+{
+  return io_wait(io_read(tape_fp, position, buffer, size), bytes_read);
+}
+
+//
+// Flash log
+//
+
+// Lay the flash log over bytes read from the file, *len of them.  The
+// tape may go on past the end of the file, with nothing between.  With
+// no card only what the log holds can be read, returns how many bytes at
+// the start it does not.
+static uint32_t flash_overlay(uint32_t position, uint8_t* buffer, size_t size, size_t* len)
+{
+#if TAPE_FLASH_LOG
+  if (!flash_log_mounted() || position >= tape_size)
+  {
+    return 0;
+  }
+  memset(buffer + *len, 0, size - *len);
+  flash_log_read(position, buffer, size);
+  *len = tape_size - position < size ? tape_size - position : size;
+  return tape_fp < 0 ? flash_log_unheld(position, *len) : 0;
+#else
+  (void) position;
+  (void) buffer;
+  (void) size;
+  (void) len;
+  return 0;
+#endif
+}
+
+// Tape bytes at position as they are now, waiting for the card
+static fat32_error_t read_tape(uint32_t position, uint8_t* buffer, size_t size, size_t* bytes_read)
+{
+  *bytes_read = 0;
+  if (tape_fp >= 0)
+  {
+    RETURN_ON_ERROR(read_now(position, buffer, size, bytes_read));
+  }
+  return flash_overlay(position, buffer, size, bytes_read) > 0 ? FAT32_ERROR_NO_CARD : FAT32_OK;
+}
+
+static bool flash_append(uint32_t position, const uint8_t* data, size_t size)
+{
+#if TAPE_FLASH_LOG
+  if (flash_log_mounted() && flash_log_append(position, data, size) == FLASH_LOG_OK)
+  {
+    stats.flash_flushes++;
+    return true;
+  }
+#else
+  (void) position;
+  (void) data;
+  (void) size;
+#endif
+  return false;
+}
+
+static void ahead_drop(void);
+
+// Copy flash log records to the tape file, a batch at a time, oldest
+// first.  They are only marked mirrored once the card has them.
+static fat32_error_t flash_mirror(bool all)
+{
+#if TAPE_FLASH_LOG
+  flash_log_record_t batch[MIRROR_BATCH];
+
+  while (tape_fp >= 0 && flash_log_mounted())
+  {
+    int count = 0;
+    batch[0].data = NULL;
+    while (count < MIRROR_BATCH)
+    {
+      if (count > 0)
+      {
+        batch[count] = batch[count - 1];
+      }
+      if (!flash_log_next_unmirrored(&batch[count]))
+      {
+        break;
+      }
+      count++;
+    }
+    if (count == 0)
+    {
+      break;
+    }
+
+    // what is read ahead may no longer be laid over once marked
+    ahead_drop();
+    for (int i = 0; i < count; i++)
+    {
+      uint32_t end = batch[i].position + batch[i].length;
+      if (end > reserved)
+      {
+        reserved = end + TAPE_RESERVE_SIZE;
+        io_reserve(tape_fp, reserved);
+      }
+      RETURN_ON_ERROR(io_write(tape_fp, batch[i].position, batch[i].data, batch[i].length));
+    }
+    RETURN_ON_ERROR(io_sync());
+    for (int i = 0; i < count; i++)
+    {
+      flash_log_mark_mirrored(&batch[i]);
+    }
+
+    if (!all)
+    {
+      break;
+    }
+  }
+#else
+  (void) all;
+#endif
+  return FAT32_OK;
+}
+
+//
+// Catalog
+//
+
+static void catalog_reset(void)
+{
+  memset(&catalog, 0, sizeof(catalog));
+  catalog.magic = CATALOG_MAGIC;
+  catalog.version = CATALOG_VERSION;
+  catalog_dirty = true;
+}
+
+// Account n copies of value to the program currently being indexed,
+// anything ahead of the first program is leader and is not catalogued
+static inline void catalog_commit(uint8_t value, uint32_t n)
+{
+  if (catalog.count > 0)
+  {
+    tape_program_t* p = &programs[catalog.count - 1];
+    p->length += n;
+    p->checksum += value * n;
+  }
+}
+
+// Feed the catalog the tape byte at position catalog.indexed.  A program
+// is walked line by line up to its zero link, so sync bytes in its links,
+// line numbers or text are not taken for the start of another one.
+static void catalog_scan(uint8_t value)
+{
+  if (catalog.scan == CATALOG_PROGRAM)
+  {
+    catalog_commit(value, 1);
+    if (catalog.field == 0)
+    {
+      catalog.link_low = value;
+      catalog.field = 1;
+    }
+    else if (catalog.field == 1 && (catalog.link_low | value) == 0)
+    {
+      catalog.scan = CATALOG_LEADER; // the zero link after the last line
+    }
+    else if (catalog.field < 4)
+    {
+      catalog.field++;
+    }
+    else if (value == 0)
+    {
+      catalog.field = 0; // end of the line
+    }
+  }
+  else if (catalog.run_len > 0 && value == catalog.run_byte)
+  {
+    catalog.run_len++;
+  }
+  else
+  {
+    bool started = false;
+    if (catalog.run_len >= 3 && catalog.count < TAPE_CATALOG_SIZE)
+    {
+      // the sync bytes and this name byte start a new program
+      tape_program_t* p = &programs[catalog.count++];
+      p->start = catalog.indexed - catalog.run_len;
+      p->length = 0;
+      p->checksum = 0;
+      p->type = catalog.run_byte;
+      p->name = value;
+      catalog.scan = catalog.run_byte == TAPE_SYNC_PROGRAM ? CATALOG_PROGRAM : CATALOG_ARRAY;
+      catalog.field = 0;
+      started = true;
+    }
+    catalog_commit(catalog.run_byte, catalog.run_len);
+
+    if (!started && (value == TAPE_SYNC_PROGRAM || value == TAPE_SYNC_ARRAY))
+    {
+      catalog.run_byte = value;
+      catalog.run_len = 1;
+    }
+    else
+    {
+      catalog.run_len = 0;
+      catalog_commit(value, 1);
+    }
+  }
+  catalog.indexed++;
+  catalog_dirty = true;
+}
+
+// The tape is being changed at position, forget the programs from there on
+static void catalog_truncate(uint32_t position)
+{
+  while (catalog.count > 0 && programs[catalog.count - 1].start + programs[catalog.count - 1].length > position)
+  {
+    catalog.count--;
+  }
+  catalog.indexed = catalog.count > 0 ? programs[catalog.count - 1].start + programs[catalog.count - 1].length : 0;
+  catalog.run_len = 0;
+  catalog.scan = CATALOG_LEADER;
+  catalog_dirty = true;
+}
+
+static fat32_error_t catalog_load(void)
+{
+  size_t bytes_read = 0;
+
+  RETURN_ON_ERROR(io_wait(io_read(catalog_fp, 0, &catalog, sizeof(catalog)), &bytes_read));
+  if (bytes_read != sizeof(catalog) ||
+      catalog.magic != CATALOG_MAGIC ||
+      catalog.version != CATALOG_VERSION ||
+      catalog.count > TAPE_CATALOG_SIZE ||
+      catalog.scan > CATALOG_ARRAY ||
+      catalog.indexed > tape_size)
+  {
+    // not ours, or describes some other tape, so index it again
+    catalog_reset();
+    return FAT32_OK;
+  }
+
+  size_t size = catalog.count * sizeof(tape_program_t);
+  RETURN_ON_ERROR(io_wait(io_read(catalog_fp, sizeof(catalog), programs, size), &bytes_read));
+  if (bytes_read != size)
+  {
+    catalog_reset();
+  }
+  catalog_dirty = false;
+  return FAT32_OK;
+}
+
+static fat32_error_t catalog_save(void)
+{
+  if (!catalog_dirty || catalog_fp < 0)
+  {
+    return FAT32_OK;
+  }
+
+  fat32_error_t status = io_write(catalog_fp, 0, &catalog, sizeof(catalog));
+  if (status == FAT32_OK && catalog.count > 0)
+  {
+    status = io_write(catalog_fp, sizeof(catalog), programs, catalog.count * sizeof(tape_program_t));
+  }
+
+  if (status == FAT32_OK)
+  {
+    catalog_dirty = false;
+  }
+  return status;
+}
+
+//
+// Tape device
+//
+
+// Open the tape file and its catalog on the card
+static fat32_error_t open_files(bool load_catalog)
+{
+  uint32_t size = 0;
+  fat32_error_t status = io_open(tape_path, true, &tape_fp, &size);
+  if (status != FAT32_OK)
+  {
+    tape_fp = -1;
+    return status;
+  }
+  if (size > tape_size)
+  {
+    tape_size = size;
+  }
+
+  uint32_t catalog_size = 0;
+  RETURN_ON_ERROR(io_open(catalog_path, true, &catalog_fp, &catalog_size));
+  if (!load_catalog)
+  {
+    catalog_dirty = true; // the one in memory is newer
+    return FAT32_OK;
+  }
+  return catalog_size > 0 ? catalog_load() : FAT32_OK;
+}
+
+fat32_error_t tape_open(const char* path)
+{
+  mode = TAPE_IDLE;
+  head = 0;
+  window_len = 0;
+  dirty_start = dirty_end = 0;
+  reserved = 0;
+  if (ahead_busy)
+  {
+    io_wait_result(&ahead_result, NULL);
+  }
+  ahead_busy = ahead_valid = false;
+
+  // put away a tape opened before, keeping count of what it cost
+  io_file_stats_t sd;
+  sd_count(&sd);
+  sd_carried = sd;
+  if (tape_fp >= 0)
+  {
+    io_close(tape_fp);
+    tape_fp = -1;
+  }
+  if (catalog_fp >= 0)
+  {
+    io_close(catalog_fp);
+    catalog_fp = -1;
+  }
+
+  strncpy(tape_path, path, sizeof(tape_path) - 1);
+  tape_path[sizeof(tape_path) - 1] = '\0';
+
+  // the catalog lives next to the tape, fulltape.dat -> fulltape.idx
+  strncpy(catalog_path, path, sizeof(catalog_path) - 5);
+  catalog_path[sizeof(catalog_path) - 5] = '\0';
+  char* dot = strrchr(catalog_path, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL)
+  {
+    dot = catalog_path + strlen(catalog_path);
+  }
+  strcpy(dot, ".idx");
+
+  catalog_reset();
+  tape_size = 0;
+#if TAPE_FLASH_LOG
+  if (!flash_log_mounted() && flash_log_mount() != FLASH_LOG_OK)
+  {
+    fprintf(stderr, "Flash log unusable, the tape goes straight to the card\n");
+  }
+  if (flash_log_mounted())
+  {
+    tape_size = flash_log_end();
+  }
+#endif
+
+  // create an emulated tape file if not already there
+  fat32_error_t status = open_files(true);
+#if TAPE_FLASH_LOG
+  if (status != FAT32_OK && tape_fp < 0 && flash_log_mounted())
+  {
+    // carry on from flash until a card turns up
+    card_tried_us = time_us_64();
+    return FAT32_OK;
+  }
+#endif
+  return status;
+}
+
+// Drop the window being read ahead, the tape is about to change under it
+static void ahead_drop(void)
+{
+  ahead_valid = false;
+}
+
+// Start reading the window after this one while BASIC reads this one
+static void read_ahead(void)
+{
+  uint32_t next = window_start + TAPE_BUFFER_SIZE;
+  if (next >= tape_size || tape_fp < 0)
+  {
+    return;
+  }
+  if (ahead_busy)
+  {
+    io_wait_result(&ahead_result, NULL); // a dropped one still owns the buffer
+  }
+  ahead_start = next;
+  io_read_to(tape_fp, next, ahead, TAPE_BUFFER_SIZE, &ahead_result);
+  ahead_busy = ahead_valid = true;
+}
+
+static fat32_error_t flush_window(void)
+{
+  fat32_error_t status = FAT32_OK;
+
+  if (mode == TAPE_WRITING && dirty_end > dirty_start)
+  {
+    const uint8_t* data = &window[dirty_start - window_start];
+    uint32_t size = dirty_end - dirty_start;
+
+    if (flash_append(dirty_start, data, size))
+    {
+      // in flash, it goes to the card later
+    }
+    else if (tape_fp < 0)
+    {
+      status = FAT32_ERROR_NO_CARD;
+    }
+    else
+    {
+      // the flash log is full, or not there.  Empty it first so none of
+      // it is laid over what is written now.
+      status = flash_mirror(true);
+
+      // grow the file in big contiguous pieces so the tape reads back as
+      // long runs of sectors, if the card is too full it carries on without
+      if (dirty_end > reserved)
+      {
+        reserved = dirty_end + TAPE_RESERVE_SIZE;
+        io_reserve(tape_fp, reserved);
+      }
+
+      // the service takes a copy, so the window is free again at once
+      if (status == FAT32_OK)
+      {
+        status = io_write(tape_fp, dirty_start, data, size);
+      }
+    }
+    if (status == FAT32_OK && dirty_end > tape_size)
+    {
+      tape_size = dirty_end;
+    }
+    stats.flushes++;
+  }
+
+  mode = TAPE_IDLE;
+  window_len = 0;
+  dirty_start = dirty_end = 0;
+  return status;
+}
+
+fat32_error_t tape_flush(void)
+{
+  fat32_error_t status = flush_window();
+  fat32_error_t catalog_status = catalog_save();
+  fat32_error_t sync_status = io_sync(); // the tape is never closed
+  if (status == FAT32_OK)
+  {
+    status = catalog_status != FAT32_OK ? catalog_status : sync_status;
+  }
+  return status;
+}
+
+fat32_error_t tape_read(uint8_t* value, size_t* bytes_read)
+{
+  *bytes_read = 0;
+  last_activity_us = time_us_64();
+
+  if (mode == TAPE_WRITING)
+  {
+    // direction change, get the pending writes out first
+    fat32_error_t status = flush_window();
+    if (status != FAT32_OK)
+    {
+      return status;
+    }
+  }
+
+  if (mode != TAPE_READING || head < window_start || head >= window_start + window_len)
+  {
+    if (head >= tape_size)
+    {
+      return FAT32_OK; // end of tape
+    }
+
+    size_t len = 0;
+    fat32_error_t status;
+    window_start = head - (head % TAPE_BUFFER_SIZE);
+    if (ahead_valid && ahead_start == window_start)
+    {
+      // usually there already, swap it in for the window
+      uint8_t* filled = ahead;
+      ahead = window;
+      window = filled;
+      ahead_busy = ahead_valid = false;
+      status = io_wait_result(&ahead_result, &len);
+      if (len > TAPE_BUFFER_SIZE)
+      {
+        len = TAPE_BUFFER_SIZE;
+      }
+    }
+    else
+    {
+      status = tape_fp >= 0 ? read_now(window_start, window, TAPE_BUFFER_SIZE, &len) : FAT32_OK;
+    }
+    if (status != FAT32_OK)
+    {
+      mode = TAPE_IDLE;
+      return status;
+    }
+
+    mode = TAPE_READING;
+    window_unheld = flash_overlay(window_start, window, TAPE_BUFFER_SIZE, &len);
+    window_len = len;
+    if (head >= window_start + window_len)
+    {
+      return FAT32_OK; // end of tape
+    }
+    read_ahead();
+  }
+
+  if (head < window_start + window_unheld)
+  {
+    return FAT32_ERROR_NO_CARD; // copied to the card, and it has gone
+  }
+  *value = window[head - window_start];
+  if (head == catalog.indexed)
+  {
+    catalog_scan(*value);
+  }
+  head++;
+  stats.bytes_read++;
+  *bytes_read = 1;
+  return FAT32_OK;
+}
+
+fat32_error_t tape_write(uint8_t value)
+{
+  last_activity_us = time_us_64();
+
+  if (mode == TAPE_READING)
+  {
+    // direction change, nothing is pending so the read-ahead is just dropped
+    mode = TAPE_IDLE;
+    window_len = 0;
+  }
+  else if (mode == TAPE_WRITING &&
+           (head != dirty_end || head >= window_start + TAPE_BUFFER_SIZE))
+  {
+    fat32_error_t status = flush_window();
+    if (status != FAT32_OK)
+    {
+      return status;
+    }
+  }
+
+  if (mode != TAPE_WRITING)
+  {
+    ahead_drop();
+    mode = TAPE_WRITING;
+    window_start = head - (head % TAPE_BUFFER_SIZE);
+    dirty_start = dirty_end = head;
+  }
+
+  if (head < catalog.indexed)
+  {
+    catalog_truncate(head);
+  }
+  if (head == catalog.indexed)
+  {
+    catalog_scan(value);
+  }
+
+  window[head - window_start] = value;
+  head++;
+  dirty_end = head;
+  stats.bytes_written++;
+  return FAT32_OK;
+}
+
+fat32_error_t tape_seek(uint32_t position)
+{
+  fat32_error_t status = tape_flush();
+
+  head = position > tape_size ? tape_size : position;
+  return status;
+}
+
+void tape_rewind(void)
+{
+  if (tape_seek(0) != FAT32_OK)
+  {
+    fprintf(stderr, "Error writing bytes to tape file\n");
+  }
+}
+
+void tape_seek_end(void)
+{
+  fat32_error_t status = tape_flush();
+  head = tape_size;
+  if (status != FAT32_OK)
+  {
+    fprintf(stderr, "Error writing bytes to tape file\n");
+  }
+}
+
+uint32_t tape_position(void)
+{
+  return head;
+}
+
+uint32_t tape_length(void)
+{
+  uint32_t length = tape_size;
+  if (mode == TAPE_WRITING && dirty_end > length)
+  {
+    length = dirty_end;
+  }
+  return length;
+}
+
+// Look for a card while there is none, then copy the flash log to it.
+// A sector of the log that is all on the card is erased while nothing
+// waits for it.
+static void flash_poll(void)
+{
+#if TAPE_FLASH_LOG
+  if (!flash_log_mounted())
+  {
+    return;
+  }
+
+  if (tape_fp < 0)
+  {
+    if (time_us_64() - card_tried_us < CARD_RETRY_MS * 1000ull)
+    {
+      return;
+    }
+    card_tried_us = time_us_64();
+
+    // the catalog kept since is the one to go by if the tape has changed
+    if (open_files(flash_log_unmirrored() == 0) != FAT32_OK)
+    {
+      return;
+    }
+    mode = TAPE_IDLE;
+    window_len = 0;
+    ahead_drop();
+  }
+
+  if (flash_log_unmirrored() > 0)
+  {
+    if (flash_mirror(false) != FAT32_OK)
+    {
+      fprintf(stderr, "Error copying the tape to the card\n");
+    }
+    return;
+  }
+  flash_log_tidy();
+#endif
+}
+
+// Called regularly from the emulator loop to write back an idle tape
+void tape_poll(void)
+{
+  bool idle = time_us_64() - last_activity_us > TAPE_IDLE_FLUSH_MS * 1000ull;
+
+  if (mode == TAPE_WRITING && idle)
+  {
+    if (tape_flush() != FAT32_OK)
+    {
+      fprintf(stderr, "Error writing bytes to tape file\n");
+    }
+  }
+  else if (idle)
+  {
+    flash_poll();
+  }
+}
+
+// Index whatever part of the tape the catalog has not seen yet
+fat32_error_t tape_catalog_update(void)
+{
+  RETURN_ON_ERROR(flush_window());
+
+  while (catalog.indexed < tape_size)
+  {
+    size_t len = 0;
+    RETURN_ON_ERROR(read_tape(catalog.indexed, window, TAPE_BUFFER_SIZE, &len));
+    if (len == 0)
+    {
+      break;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+      catalog_scan(window[i]);
+    }
+  }
+
+  return catalog_save();
+}
+
+int tape_catalog_count(void)
+{
+  return catalog.count;
+}
+
+const tape_program_t* tape_catalog_entry(int index)
+{
+  if (index < 0 || index >= catalog.count)
+  {
+    return NULL;
+  }
+  return &programs[index];
+}
+
+// Most recently saved program with this name, or -1
+int tape_catalog_find(char name)
+{
+  for (int i = catalog.count - 1; i >= 0; i--)
+  {
+    if (programs[i].name == name)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+fat32_error_t tape_seek_program(int index)
+{
+  if (index < 0 || index >= catalog.count)
+  {
+    return FAT32_ERROR_INVALID_POSITION;
+  }
+  return tape_seek(programs[index].start);
+}
+
+// Read what BASIC saved for a program, the bytes after its sync bytes
+// and name, without moving the tape head
+fat32_error_t tape_read_program(int index, uint8_t* buffer, size_t size, size_t* bytes_read)
+{
+  *bytes_read = 0;
+  if (index < 0 || index >= catalog.count)
+  {
+    return FAT32_ERROR_INVALID_POSITION;
+  }
+  RETURN_ON_ERROR(flush_window());
+
+  const tape_program_t* p = &programs[index];
+  size_t len = 0;
+  RETURN_ON_ERROR(read_tape(p->start, buffer, p->length < size ? p->length : size, &len));
+
+  size_t header = 0;
+  while (header < len && buffer[header] == p->type)
+  {
+    header++;
+  }
+  header = header < len ? header + 1 : len; // and the name
+  memmove(buffer, &buffer[header], len - header);
+  *bytes_read = len - header;
+  return FAT32_OK;
+}
+
+void tape_print_catalog(void)
+{
+  printf("%d programs on tape\n", catalog.count);
+  for (int i = 0; i < catalog.count; i++)
+  {
+    const tape_program_t* p = &programs[i];
+    printf("%3d %c%c %7lu %6lu %04x%s\n", i + 1,
+           isprint((unsigned char) p->name) ? p->name : '?',
+           p->type == TAPE_SYNC_ARRAY ? '*' : ' ',
+           (unsigned long) p->start, (unsigned long) p->length, p->checksum,
+           head >= p->start && head < p->start + p->length ? " <" : "");
+  }
+}
+
+void tape_get_stats(tape_stats_t* out)
+{
+  io_file_stats_t sd;
+  sd_count(&sd);
+  *out = stats;
+  out->sd_reads = sd.sd_reads - sd_base.sd_reads;
+  out->sd_writes = sd.sd_writes - sd_base.sd_writes;
+}
+
+void tape_reset_stats(void)
+{
+  memset(&stats, 0, sizeof(stats));
+  sd_count(&sd_base);
+}
+
+void tape_print_stats(void)
+{
+  tape_stats_t now;
+  tape_get_stats(&now);
+  uint32_t bytes = now.bytes_read + now.bytes_written;
+  uint32_t ops = now.sd_reads + now.sd_writes;
+
+  printf("Tape at %lu of %lu bytes\n", (unsigned long) head, (unsigned long) tape_length());
+  printf("  %lu bytes read, %lu written, %lu flushes (%lu to flash)\n",
+         (unsigned long) now.bytes_read, (unsigned long) now.bytes_written,
+         (unsigned long) now.flushes, (unsigned long) now.flash_flushes);
+  printf("  %lu SD reads, %lu SD writes", (unsigned long) now.sd_reads,
+         (unsigned long) now.sd_writes);
+  if (bytes > 0)
+  {
+    printf(" (%lu.%03lu per tape byte)", (unsigned long) (ops / bytes),
+           (unsigned long) ((uint64_t) (ops % bytes) * 1000 / bytes));
+  }
+  printf("\n");
+
+#if TAPE_FLASH_LOG
+  if (flash_log_mounted())
+  {
+    flash_log_stats_t flash;
+    flash_log_get_stats(&flash);
+    printf("  Flash log %lu bytes not on the card, %lu records copied, %lu erases"
+           " (sectors %lu to %lu times), %lu ms busy\n",
+           (unsigned long) flash_log_unmirrored(), (unsigned long) flash.copies,
+           (unsigned long) flash.erases, (unsigned long) flash.min_erases,
+           (unsigned long) flash.max_erases, (unsigned long) (flash.busy_us / 1000));
+  }
+#endif
+
+  io_stats_t io;
+  io_get_stats(&io);
+  printf("  I/O service %lu requests, %lu ms busy, %lu write stalls, %lu read waits\n",
+         (unsigned long) io.requests, (unsigned long) (io.busy_us / 1000),
+         (unsigned long) io.write_stalls, (unsigned long) io.read_waits);
+
+  // the rest belongs to the file system, so look while the service is parked
+  io_claim();
+  fat32_cache_stats_t cache;
+  fat32_get_cache_stats(&cache);
+  printf("  FAT cache %lu hits, %lu misses, %lu write backs\n",
+         (unsigned long) cache.hits, (unsigned long) cache.misses,
+         (unsigned long) cache.write_backs);
+  printf("  Path cache %lu hits, %lu misses, %lu directory sectors read\n",
+         (unsigned long) cache.path_hits, (unsigned long) cache.path_misses,
+         (unsigned long) cache.dir_sectors);
+
+  fat32_free_map_stats_t free_map;
+  fat32_get_free_map_stats(&free_map);
+  io_release();
+  if (free_map.mode != FAT32_FREE_MAP_NONE)
+  {
+    printf("  Free %s built in %lu ms from %lu FAT sectors, %lu us per allocation\n",
+           free_map.mode == FAT32_FREE_MAP_BITMAP ? "bitmap" : "summary",
+           (unsigned long) (free_map.build_us / 1000), (unsigned long) free_map.build_sectors,
+           (unsigned long) (free_map.searches ? free_map.search_us / free_map.searches : 0));
+  }
+}
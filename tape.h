@@ -0,0 +1,84 @@
+#ifndef TAPE_H_
+#define TAPE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "drivers/fat32.h"
+
+// Size of the tape's read-ahead/write-back window, a multiple of the sector size
+#ifndef TAPE_BUFFER_SIZE
+#define TAPE_BUFFER_SIZE (4 * 512)
+#endif
+
+// The tape file is given contiguous space this much at a time as it grows
+#ifndef TAPE_RESERVE_SIZE
+#define TAPE_RESERVE_SIZE (256 * 1024)
+#endif
+
+// Pending writes are flushed once the tape has been idle this long
+#ifndef TAPE_IDLE_FLUSH_MS
+#define TAPE_IDLE_FLUSH_MS (500)
+#endif
+
+// Keep what is saved in the flash log (drivers/flash_log.c) and copy it
+// to the card while the tape is idle, 0 to write the card directly.  Off
+// unless asked for, as each save then wears the Pico's flash as well.
+#ifndef TAPE_FLASH_LOG
+#define TAPE_FLASH_LOG (0)
+#endif
+
+// Most programs the tape catalog keeps track of
+#ifndef TAPE_CATALOG_SIZE
+#define TAPE_CATALOG_SIZE (512)
+#endif
+
+// BASIC starts each CSAVE with three sync bytes followed by the name
+#define TAPE_SYNC_PROGRAM (0xd3) // CSAVE
+#define TAPE_SYNC_ARRAY (0xd2)   // CSAVE*
+
+// One program (or array) found on the tape
+typedef struct
+{
+  uint32_t start;    // tape position of the first sync byte
+  uint32_t length;   // bytes up to the next program or the end of tape
+  uint16_t checksum; // sum of those bytes
+  uint8_t type;      // TAPE_SYNC_PROGRAM or TAPE_SYNC_ARRAY
+  char name;         // the file name character BASIC matches on
+} tape_program_t;
+
+typedef struct
+{
+  uint32_t bytes_read;     // bytes handed to the emulated machine
+  uint32_t bytes_written;  // bytes received from the emulated machine
+  uint32_t sd_reads;       // SD read commands issued on behalf of the tape
+  uint32_t sd_writes;      // SD write commands issued on behalf of the tape
+  uint32_t flushes;        // write-back buffer flushes
+  uint32_t flash_flushes;  // of which went to the flash log
+} tape_stats_t;
+
+fat32_error_t tape_open(const char* path);
+fat32_error_t tape_read(uint8_t* value, size_t* bytes_read);
+fat32_error_t tape_write(uint8_t value);
+fat32_error_t tape_flush(void);
+fat32_error_t tape_seek(uint32_t position);
+void tape_rewind(void);
+void tape_seek_end(void);
+uint32_t tape_position(void);
+uint32_t tape_length(void);
+void tape_poll(void);
+
+fat32_error_t tape_catalog_update(void);
+int tape_catalog_count(void);
+const tape_program_t* tape_catalog_entry(int index);
+int tape_catalog_find(char name);
+fat32_error_t tape_seek_program(int index);
+fat32_error_t tape_read_program(int index, uint8_t* buffer, size_t size, size_t* bytes_read);
+void tape_print_catalog(void);
+
+void tape_get_stats(tape_stats_t* stats);
+void tape_reset_stats(void);
+void tape_print_stats(void);
+
+#endif // TAPE_H_